@@ -52,6 +52,13 @@ public:
   static void initClass(void);
 
   void useIndexedFaceSet(const SbBool onoff);
+  void setWeldTolerance(const float tolerance);
+  float getWeldTolerance(void) const;
+  void setOptimizeVertexCache(const SbBool onoff);
+  SbBool getOptimizeVertexCache(void) const;
+  void setVertexCacheSize(const int size);
+  int getVertexCacheSize(void) const;
+  void getACMR(float & before, float & after) const;
 
   virtual void apply(SoNode * node);
   virtual void apply(SoPath * path);
@@ -60,6 +67,7 @@ public:
 protected:
   virtual void beginTraversal(SoNode * node);
 private:
+  void convert(SoPath * path);
   SmToVertexArrayShapeActionP * pimpl;
 };
 
@@ -50,8 +50,9 @@
 #include <Inventor/lists/SbList.h>
 #include <Inventor/SbViewportRegion.h>
 #include <SmallChange/nodes/SmVertexArrayShape.h>
+#include <Inventor/actions/SoGetPrimitiveCountAction.h>
 #include <cstring>
-#include "../misc/SbHash.h"
+#include <cmath>
 
 SO_ACTION_SOURCE(SmToVertexArrayShapeAction);
 
@@ -71,30 +72,282 @@ public:
   SbVec3f n;
   SbVec2f tc;
   uint32_t col;
+};
+
+// A welding key is the vertex with every float reinterpreted as its
+// bit pattern, except that the coordinates are rounded to a multiple
+// of the weld tolerance when one is set. Normals and texture
+// coordinates are always compared exactly, since a tolerance given in
+// object space units means nothing for them. Two vertices are welded
+// if their keys are equal.
+#define SM_WELD_KEYSIZE 9
+
+static uint64_t
+sm_weld_quantize(float val, const double invtolerance)
+{
+  if (invtolerance == 0.0) {
+    if (val == 0.0f) val = 0.0f; // so that -0 and +0 are welded
+    uint32_t bits;
+    memcpy(&bits, &val, sizeof(uint32_t));
+    return bits;
+  }
+  return (uint64_t) (int64_t) floor(double(val) * invtolerance + 0.5);
+}
+
+static void
+sm_weld_key(const sm_vavertex & v, const double invtolerance, uint64_t * key)
+{
+  for (int i = 0; i < 3; i++) {
+    key[i] = sm_weld_quantize(v.v[i], invtolerance);
+    key[i+3] = sm_weld_quantize(v.n[i], 0.0);
+  }
+  key[6] = sm_weld_quantize(v.tc[0], 0.0);
+  key[7] = sm_weld_quantize(v.tc[1], 0.0);
+  key[8] = v.col;
+}
+
+static uint32_t
+sm_weld_hash(const uint64_t * key)
+{
+  // multiply/xorshift mixing of every key lane, with the murmur3
+  // 64 bit finalizer at the end
+  uint64_t h = 0;
+  for (int i = 0; i < SM_WELD_KEYSIZE; i++) {
+    h ^= key[i];
+    h *= 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return (uint32_t) h;
+}
+
+// Open addressing (linear probing) table of vertex indices. The
+// vertices themselves live in the action's attribute lists, so a
+// slot only holds the index and the hash value.
+class sm_vaweldtable {
+public:
+  struct slot {
+    uint32_t hash;
+    int32_t index; // -1 for an empty slot
+  };
+
+  sm_vaweldtable(void) : slots(NULL), mask(0), num(0) { }
+  ~sm_vaweldtable() { delete [] this->slots; }
+
+  void init(const int expected) {
+    uint32_t size = 1024;
+    // keep the load factor below 0.7
+    while (size < 0x40000000U && (uint64_t) size * 7 < (uint64_t) expected * 10) size <<= 1;
+    if (size - 1 != this->mask) {
+      delete [] this->slots;
+      this->slots = new slot[size];
+      this->mask = size - 1;
+    }
+    for (uint32_t i = 0; i <= this->mask; i++) this->slots[i].index = -1;
+    this->num = 0;
+  }
 
-  // needed for SbHash
-  operator unsigned long(void) const;
-  int operator==(const sm_vavertex & ov) const;
+  // returns the first slot which is either empty or matches hash
+  // and the vertex key, as reported by the match callback
+  template <class Match>
+  slot * find(const uint32_t hash, Match & match) {
+    uint32_t i = hash & this->mask;
+    for (;;) {
+      slot * s = &this->slots[i];
+      if (s->index < 0) return s;
+      if (s->hash == hash && match(s->index)) return s;
+      i = (i + 1) & this->mask;
+    }
+  }
+
+  void insert(slot * s, const uint32_t hash, const int32_t index) {
+    s->hash = hash;
+    s->index = index;
+    if ((uint64_t) ++this->num * 10 > (uint64_t) (this->mask + 1) * 7) this->grow();
+  }
+
+private:
+  void grow(void) {
+    slot * old = this->slots;
+    const uint32_t oldsize = this->mask + 1;
+    this->slots = new slot[oldsize * 2];
+    this->mask = oldsize * 2 - 1;
+    uint32_t i;
+    for (i = 0; i <= this->mask; i++) this->slots[i].index = -1;
+    for (i = 0; i < oldsize; i++) {
+      if (old[i].index < 0) continue;
+      uint32_t j = old[i].hash & this->mask;
+      while (this->slots[j].index >= 0) j = (j + 1) & this->mask;
+      this->slots[j] = old[i];
+    }
+    delete [] old;
+  }
+
+  slot * slots;
+  uint32_t mask;
+  uint32_t num;
 };
 
-sm_vavertex::operator unsigned long(void) const
+// Vertex cache optimization, after Tom Forsyth's "Linear-Speed Vertex
+// Cache Optimisation". Triangles are emitted greedily, always picking
+// the triangle with the highest sum of vertex scores. A vertex scores
+// high if it is near the front of a simulated LRU cache, and if it has
+// few triangles left, so that lone triangles are not left behind.
+#define SM_VCACHE_MAXSIZE 64
+
+static float
+sm_vcache_score(const int cachepos, const int valence, const int cachesize)
 {
-  int size = sizeof(*this);
-  unsigned long key = 0;
-  const unsigned char * ptr = (const unsigned char *) this;
-  for (int i = 0; i < size; i++) {
-    int shift = (i%4) * 8;
-    key ^= (ptr[i]<<shift);
+  if (valence == 0) return -1.0f; // no triangles left to add
+  float score = 0.0f;
+  if (cachepos >= 0) {
+    // the vertices of the last triangle get a fixed score, so that
+    // the order they were added in doesn't matter
+    if (cachepos < 3) score = 0.75f;
+    else score = powf(1.0f - float(cachepos - 3) / float(cachesize - 3), 1.5f);
   }
-  return key;
+  return score + 2.0f * powf(float(valence), -0.5f);
 }
 
-int
-sm_vavertex::operator==(const sm_vavertex & ov) const
+static void
+sm_vcache_optimize(int32_t * indices, const int numtri,
+                   const int numvertices, int cachesize)
 {
-  return memcmp(this, &ov, sizeof(sm_vavertex)) == 0;
+  if (numtri < 2) return;
+  cachesize = SbClamp(cachesize, 4, SM_VCACHE_MAXSIZE);
+  const int numidx = numtri * 3;
+  int i, j;
+
+  // triangles using each vertex. The first valence[v] entries of a
+  // vertex are the triangles not added yet.
+  int * valence = new int[numvertices];
+  int * adjstart = new int[numvertices + 1];
+  int * adj = new int[numidx];
+  for (i = 0; i < numvertices; i++) valence[i] = 0;
+  for (i = 0; i < numidx; i++) valence[indices[i]]++;
+  adjstart[0] = 0;
+  for (i = 0; i < numvertices; i++) {
+    adjstart[i+1] = adjstart[i] + valence[i];
+    valence[i] = 0;
+  }
+  for (i = 0; i < numidx; i++) {
+    const int v = indices[i];
+    adj[adjstart[v] + valence[v]++] = i / 3;
+  }
+
+  int * cachepos = new int[numvertices];
+  float * vscore = new float[numvertices];
+  for (i = 0; i < numvertices; i++) {
+    cachepos[i] = -1;
+    vscore[i] = sm_vcache_score(-1, valence[i], cachesize);
+  }
+  float * tscore = new float[numtri];
+  unsigned char * added = new unsigned char[numtri];
+  int besttri = 0;
+  for (i = 0; i < numtri; i++) {
+    tscore[i] = vscore[indices[i*3]] + vscore[indices[i*3+1]] + vscore[indices[i*3+2]];
+    added[i] = 0;
+    if (tscore[i] > tscore[besttri]) besttri = i;
+  }
+
+  int32_t * result = new int32_t[numidx];
+  int cache[SM_VCACHE_MAXSIZE + 3];
+  int newcache[SM_VCACHE_MAXSIZE + 3];
+  int cachelen = 0;
+  int cursor = 0;
+
+  for (int n = 0; n < numtri; n++) {
+    if (besttri < 0) {
+      // nothing in the cache has triangles left, continue with the
+      // next triangle in the original order
+      while (added[cursor]) cursor++;
+      besttri = cursor;
+    }
+    const int32_t * tri = indices + besttri * 3;
+    added[besttri] = 1;
+    int newlen = 0;
+    for (i = 0; i < 3; i++) {
+      const int v = tri[i];
+      result[n*3 + i] = v;
+      // remove the triangle from the vertex' remaining triangles
+      int * list = adj + adjstart[v];
+      for (j = 0; list[j] != besttri; j++) { }
+      list[j] = list[--valence[v]];
+      list[valence[v]] = besttri;
+
+      for (j = 0; j < newlen && newcache[j] != v; j++) { }
+      if (j == newlen) newcache[newlen++] = v;
+    }
+    for (i = 0; i < cachelen; i++) {
+      const int v = cache[i];
+      if (v != tri[0] && v != tri[1] && v != tri[2]) newcache[newlen++] = v;
+    }
+
+    // update the scores of the vertices in the new cache, including
+    // those that just fell out of it
+    for (i = 0; i < newlen; i++) {
+      const int v = newcache[i];
+      cachepos[v] = i < cachesize ? i : -1;
+      vscore[v] = sm_vcache_score(cachepos[v], valence[v], cachesize);
+    }
+    besttri = -1;
+    float bestscore = -1.0f;
+    for (i = 0; i < newlen; i++) {
+      const int v = newcache[i];
+      const int * list = adj + adjstart[v];
+      for (j = 0; j < valence[v]; j++) {
+        const int t = list[j];
+        const int32_t * tv = indices + t * 3;
+        tscore[t] = vscore[tv[0]] + vscore[tv[1]] + vscore[tv[2]];
+        if (i < cachesize && tscore[t] > bestscore) {
+          bestscore = tscore[t];
+          besttri = t;
+        }
+      }
+    }
+    cachelen = SbMin(newlen, cachesize);
+    memcpy(cache, newcache, cachelen * sizeof(int));
+  }
+  memcpy(indices, result, numidx * sizeof(int32_t));
+
+  delete [] result;
+  delete [] added;
+  delete [] tscore;
+  delete [] vscore;
+  delete [] cachepos;
+  delete [] adj;
+  delete [] adjstart;
+  delete [] valence;
+}
+
+// Returns the number of misses in a FIFO vertex cache, which is what
+// most hardware has, when rendering the indices. A vertex is in the
+// cache if it was loaded fewer than cachesize misses ago.
+static int
+sm_vcache_misses(const int32_t * indices, const int num,
+                 const int numvertices, const int cachesize)
+{
+  int * loaded = new int[numvertices];
+  int i;
+  for (i = 0; i < numvertices; i++) loaded[i] = -cachesize - 1;
+  int misses = 0;
+  for (i = 0; i < num; i++) {
+    const int v = indices[i];
+    if (misses - loaded[v] > cachesize) {
+      loaded[v] = misses++;
+    }
+  }
+  delete [] loaded;
+  return misses;
 }
 
+// the largest number of vertices that can be addressed with 16 bit indices
+#define SM_VA_MAXCHUNKVERTICES 65536
+
 class SmToVertexArrayShapeActionP {
 public:
   SmToVertexArrayShapeActionP(void)
@@ -102,12 +355,12 @@ public:
       cbaction.addTriangleCallback(SoShape::getClassTypeId(), triangle_cb, this);
       cbaction.addPreCallback(SoVertexShape::getClassTypeId(),
                               pre_shape_cb, this);
-      this->vhash = new SbHash <int32_t, sm_vavertex>;
       this->useifs = TRUE;
+      this->tolerance = 0.0f;
+      this->optimize = FALSE;
+      this->cachesize = 32;
+      this->resetStatistics();
     }
-  ~SmToVertexArrayShapeActionP() {
-    delete this->vhash;
-  }
 
   static SoCallbackAction::Response pre_shape_cb(void * userdata, SoCallbackAction * action, const SoNode * node) {
     SmToVertexArrayShapeActionP * thisp = (SmToVertexArrayShapeActionP*)userdata;
@@ -177,20 +430,48 @@ public:
       if (col != thisp->firstcolor) thisp->colorpervertex = TRUE;
       v.col = col;
 
-      int32_t idx;
-      if (!thisp->vhash->get(v, idx)) {
-        idx = thisp->coordlist.getLength();
-        thisp->coordlist.append(v.v);
-        thisp->normallist.append(v.n);
-        thisp->tcoordlist.append(v.tc);
-        thisp->colorlist.append(v.col);
-        thisp->vhash->put(v, idx);
-      }
-      thisp->indices.append(idx);
+      thisp->indices.append(thisp->weld(v));
     }
   }
 
-  SbHash <int32_t, sm_vavertex> * vhash;
+  // compares the key of a stored vertex with the current key
+  class match {
+  public:
+    match(SmToVertexArrayShapeActionP * thisp, const uint64_t * key)
+      : thisp(thisp), key(key) { }
+    SbBool operator()(const int32_t index) const {
+      sm_vavertex v;
+      v.v = thisp->coordlist[index];
+      v.n = thisp->normallist[index];
+      v.tc = thisp->tcoordlist[index];
+      v.col = thisp->colorlist[index];
+      uint64_t other[SM_WELD_KEYSIZE];
+      sm_weld_key(v, thisp->invtolerance, other);
+      return memcmp(key, other, sizeof(other)) == 0;
+    }
+  private:
+    SmToVertexArrayShapeActionP * thisp;
+    const uint64_t * key;
+  };
+
+  int32_t weld(const sm_vavertex & v) {
+    uint64_t key[SM_WELD_KEYSIZE];
+    sm_weld_key(v, this->invtolerance, key);
+    const uint32_t hash = sm_weld_hash(key);
+    match m(this, key);
+    sm_vaweldtable::slot * s = this->weldtable.find(hash, m);
+    if (s->index >= 0) return s->index;
+
+    const int32_t idx = this->coordlist.getLength();
+    this->coordlist.append(v.v);
+    this->normallist.append(v.n);
+    this->tcoordlist.append(v.tc);
+    this->colorlist.append(v.col);
+    this->weldtable.insert(s, hash, idx);
+    return idx;
+  }
+
+  sm_vaweldtable weldtable;
   SoCallbackAction cbaction;
   SoSearchAction sa;
   SbList <SbVec3f> coordlist;
@@ -199,6 +480,12 @@ public:
   SbList <uint32_t> colorlist;
   SbList <int32_t> indices;
 
+  // the output meshes, see buildChunks()
+  SbList <int32_t> chunkvertices;
+  SbList <int32_t> chunkindices;
+  SbList <int> chunkvstart;
+  SbList <int> chunkistart;
+
   int numdiffuse;
   int numtransp;
   const uint32_t * packedptr;
@@ -208,40 +495,181 @@ public:
   uint32_t firstcolor;
   SbBool hastexture;
   SbBool useifs;
+  float tolerance;
+  double invtolerance;
+  SbBool optimize;
+  int cachesize;
+  double numtriangles;
+  double missesbefore;
+  double missesafter;
+
+  void resetStatistics(void) {
+    this->numtriangles = 0.0;
+    this->missesbefore = 0.0;
+    this->missesafter = 0.0;
+  }
 
-  void init(void) {
+  void init(SoPath * path) {
     coordlist.truncate(0);
     tcoordlist.truncate(0);
     normallist.truncate(0);
     colorlist.truncate(0);
     indices.truncate(0);
-    delete this->vhash;
-    this->vhash = new SbHash<int32_t, sm_vavertex>;
+
+    // size the weld table from the triangle count, so that it
+    // doesn't have to be rehashed for big shapes. Closed meshes have
+    // about half as many vertices as triangles, but seams and hard
+    // edges add more.
+    SoGetPrimitiveCountAction pca;
+    pca.apply(path);
+    this->weldtable.init(pca.getTriangleCount());
+    this->invtolerance = this->tolerance > 0.0f ? 1.0 / this->tolerance : 0.0;
   }
+  // Optimizes the welded triangles for the vertex cache, and splits
+  // them into chunks of at most maxvertices vertices. The vertices of
+  // each chunk are numbered in the order they are first used, for
+  // locality when they are fetched.
+  void buildChunks(const int maxvertices) {
+    this->chunkvertices.truncate(0);
+    this->chunkindices.truncate(0);
+    this->chunkvstart.truncate(0);
+    this->chunkistart.truncate(0);
+
+    const int numv = this->coordlist.getLength();
+    const int numidx = this->indices.getLength();
+    sm_vcache_optimize(this->indices.getArrayPtr(), numidx / 3, numv, this->cachesize);
+
+    int32_t * local = new int32_t[numv];
+    int * owner = new int[numv];
+    int i;
+    for (i = 0; i < numv; i++) owner[i] = -1;
+
+    const int32_t * idx = this->indices.getArrayPtr();
+    int chunk = 0;
+    int vstart = 0;
+    this->chunkvstart.append(0);
+    this->chunkistart.append(0);
+    for (i = 0; i < numidx; i += 3) {
+      int newv = 0;
+      int k;
+      for (k = 0; k < 3; k++) {
+        if (owner[idx[i+k]] != chunk) newv++;
+      }
+      if (this->chunkvertices.getLength() - vstart + newv > maxvertices) {
+        chunk++;
+        vstart = this->chunkvertices.getLength();
+        this->chunkvstart.append(vstart);
+        this->chunkistart.append(this->chunkindices.getLength());
+      }
+      for (k = 0; k < 3; k++) {
+        const int32_t v = idx[i+k];
+        if (owner[v] != chunk) {
+          owner[v] = chunk;
+          local[v] = this->chunkvertices.getLength() - vstart;
+          this->chunkvertices.append(v);
+        }
+        this->chunkindices.append(local[v]);
+      }
+    }
+    this->chunkvstart.append(this->chunkvertices.getLength());
+    this->chunkistart.append(this->chunkindices.getLength());
+
+    delete [] owner;
+    delete [] local;
+  }
+
   void replaceNode(SoFullPath * path) {
-    if (useifs) {
-      this->replaceIfs(path);
+    SoNode * parent = path->getNodeFromTail(1);
+    int idx = path->getIndexFromTail(0);
+    const SbBool isgroup = parent->isOfType(SoGroup::getClassTypeId());
+
+    const int numidx = this->indices.getLength();
+    this->numtriangles += numidx / 3;
+    const double misses = sm_vcache_misses(this->indices.getArrayPtr(), numidx,
+                                           this->coordlist.getLength(),
+                                           this->cachesize);
+    this->missesbefore += misses;
+
+    SoNode * node;
+    if (this->optimize) {
+      // only SmVertexArrayShape benefits from 16 bit indices, and the
+      // chunks can only be put in a group
+      const SbBool split = isgroup && !this->useifs;
+      this->buildChunks(split ? SM_VA_MAXCHUNKVERTICES : 0x7fffffff);
+      const int numchunks = this->chunkvstart.getLength() - 1;
+      SoGroup * group = numchunks > 1 ? new SoGroup : NULL;
+      node = group;
+      for (int i = 0; i < numchunks; i++) {
+        const int vstart = this->chunkvstart[i];
+        const int istart = this->chunkistart[i];
+        const int numchunkidx = this->chunkistart[i+1] - istart;
+        const int numchunkv = this->chunkvstart[i+1] - vstart;
+        const int32_t * chunkidx = this->chunkindices.getArrayPtr() + istart;
+        this->missesafter += sm_vcache_misses(chunkidx, numchunkidx, numchunkv,
+                                              this->cachesize);
+        SoNode * shape = this->createNode(this->chunkvertices.getArrayPtr() + vstart,
+                                          numchunkv, chunkidx, numchunkidx);
+        if (group) group->addChild(shape);
+        else node = shape;
+      }
     }
     else {
-      this->replaceVas(path);
+      this->missesafter += misses;
+      node = this->createNode(NULL, this->coordlist.getLength(),
+                              this->indices.getArrayPtr(), numidx);
+    }
+    node->ref();
+
+    path->pop();
+    if (isgroup) {
+      SoGroup * g = (SoGroup*)parent;
+      g->replaceChild(idx, node);
+    }
+    else if (parent->isOfType(SoVRMLShape::getClassTypeId())) {
+      SoVRMLShape * vs = (SoVRMLShape*) parent;
+      vs->geometry = node;
+    }
+    path->push(idx);
+    node->unrefNoDelete();
+  }
+
+  // Creates a shape from numvertices of the welded vertices, the ones
+  // listed in vertexmap, or the first ones if vertexmap is NULL
+  SoNode * createNode(const int32_t * vertexmap, const int numvertices,
+                      const int32_t * idx, const int numidx) {
+    if (this->useifs) {
+      return this->createIfs(vertexmap, numvertices, idx, numidx);
+    }
+    return this->createVas(vertexmap, numvertices, idx, numidx);
+  }
+
+  template <class Field, class Type>
+  static void setValues(Field & field, const SbList <Type> & list,
+                        const int32_t * vertexmap, const int num) {
+    if (!vertexmap) {
+      field.setValues(0, num, list.getArrayPtr());
+      return;
     }
+    const Type * src = list.getArrayPtr();
+    field.setNum(num);
+    Type * dst = field.startEditing();
+    for (int i = 0; i < num; i++) dst[i] = src[vertexmap[i]];
+    field.finishEditing();
   }
 
-  void replaceIfs(SoFullPath * path) {
+  SoIndexedFaceSet * createIfs(const int32_t * vertexmap, const int numvertices,
+                               const int32_t * idx, const int numidx) {
     SoIndexedFaceSet * ifs = new SoIndexedFaceSet;
     SoVertexProperty * vp = new SoVertexProperty;
     vp->normalBinding = SoVertexProperty::PER_VERTEX_INDEXED;
     vp->materialBinding = SoVertexProperty::OVERALL;
-    ifs->ref();
     ifs->vertexProperty = vp;
 
     if (this->hastexture) {
-      vp->texCoord.setValues(0, this->tcoordlist.getLength(),
-                          this->tcoordlist.getArrayPtr());
+      setValues(vp->texCoord, this->tcoordlist, vertexmap, numvertices);
     }
     if (this->colorpervertex) {
-      vp->orderedRGBA.setValues(0, this->colorlist.getLength(),
-                                this->colorlist.getArrayPtr());
+      setValues(vp->orderedRGBA, this->colorlist, vertexmap, numvertices);
       vp->materialBinding = SoVertexProperty::PER_VERTEX_INDEXED;
     }
     else if (this->colorlist.getLength()) {
@@ -249,68 +677,47 @@ public:
       vp->materialBinding = SoVertexProperty::OVERALL;
       vp->orderedRGBA.setValues(0, 1, &dummy);
     }
-    vp->vertex.setValues(0, this->coordlist.getLength(),
-                         this->coordlist.getArrayPtr());
-
-    vp->normal.setValues(0, this->normallist.getLength(),
-                         this->normallist.getArrayPtr());
+    setValues(vp->vertex, this->coordlist, vertexmap, numvertices);
+    setValues(vp->normal, this->normallist, vertexmap, numvertices);
     
     ifs->normalIndex.setNum(0);
     ifs->materialIndex.setNum(0);
     ifs->textureCoordIndex.setNum(0);
 
-    int numtri = this->indices.getLength() / 3;
+    int numtri = numidx / 3;
     ifs->coordIndex.setNum(numtri * 4);
     int32_t * ptr = ifs->coordIndex.startEditing();
 
     for (int i = 0; i < numtri; i++) {
-      *ptr++ = this->indices[i*3];
-      *ptr++ = this->indices[i*3+1];
-      *ptr++ = this->indices[i*3+2];
+      *ptr++ = idx[i*3];
+      *ptr++ = idx[i*3+1];
+      *ptr++ = idx[i*3+2];
       *ptr++ = -1;
     }
     ifs->coordIndex.finishEditing();
-
-    SoNode * parent = path->getNodeFromTail(1);
-    int idx = path->getIndexFromTail(0);
-    
-    path->pop();
-    if (parent->isOfType(SoGroup::getClassTypeId())) {
-      SoGroup * g = (SoGroup*)parent;
-      g->replaceChild(idx, ifs);
-    }
-    else if (parent->isOfType(SoVRMLShape::getClassTypeId())) {
-      SoVRMLShape * vs = (SoVRMLShape*) parent;
-      vs->geometry = ifs;
-    }
-    path->push(idx);
-    ifs->unrefNoDelete();
+    return ifs;
   }
 
-
-  void replaceVas(SoFullPath * path) {
+  SmVertexArrayShape * createVas(const int32_t * vertexmap, const int numvertices,
+                                 const int32_t * idx, const int numidx) {
     SmVertexArrayShape * vas = new SmVertexArrayShape;
-    vas->ref();
-
     if (this->hastexture) {
       SoTextureCoordinate2 * tc = new SoTextureCoordinate2;
       vas->vertexTexCoord = tc;
-      tc->point.setValues(0, this->tcoordlist.getLength(),
-                          this->tcoordlist.getArrayPtr());
+      setValues(tc->point, this->tcoordlist, vertexmap, numvertices);
     }
     if (this->colorpervertex) {
 #if 1 // packed color
       SoPackedColor * pc = new SoPackedColor;
       vas->vertexColor = pc;
-      pc->orderedRGBA.setValues(0, this->colorlist.getLength(),
-                                this->colorlist.getArrayPtr());
+      setValues(pc->orderedRGBA, this->colorlist, vertexmap, numvertices);
 #else // base color
       SoBaseColor * bc = new SoBaseColor;
-      bc->rgb.setNum(this->colorlist.getLength());
+      bc->rgb.setNum(numvertices);
       SbColor * c = bc->rgb.startEditing();
-      for (int i = 0; i < this->colorlist.getLength(); i++) {
+      for (int i = 0; i < numvertices; i++) {
         float dummy;
-        c[i].setPackedValue(this->colorlist[i], dummy);
+        c[i].setPackedValue(this->colorlist[vertexmap ? vertexmap[i] : i], dummy);
       }
       bc->rgb.finishEditing();
       vas->vertexColor = bc;
@@ -323,34 +730,17 @@ public:
     SoNormal * n = new SoNormal;
     vas->vertexNormal = n;
 
-    c->point.setValues(0, this->coordlist.getLength(),
-                       this->coordlist.getArrayPtr());
-
-    n->vector.setValues(0, this->normallist.getLength(),
-                        this->normallist.getArrayPtr());
+    setValues(c->point, this->coordlist, vertexmap, numvertices);
+    setValues(n->vector, this->normallist, vertexmap, numvertices);
     
-    vas->vertexIndex.setNum(1+this->indices.getLength());
+    vas->vertexIndex.setNum(1+numidx);
     int32_t * ptr = vas->vertexIndex.startEditing();
     *ptr++ = SmVertexArrayShape::TRIANGLES;
-    for (int i = 0; i < this->indices.getLength(); i++) {
-      *ptr++ = this->indices[i];
+    for (int i = 0; i < numidx; i++) {
+      *ptr++ = idx[i];
     }
     vas->vertexIndex.finishEditing();
-
-    SoNode * parent = path->getNodeFromTail(1);
-    int idx = path->getIndexFromTail(0);
-    
-    path->pop();
-    if (parent->isOfType(SoGroup::getClassTypeId())) {
-      SoGroup * g = (SoGroup*)parent;
-      g->replaceChild(idx, vas);
-    }
-    else if (parent->isOfType(SoVRMLShape::getClassTypeId())) {
-      SoVRMLShape * vs = (SoVRMLShape*) parent;
-      vs->geometry = vas;
-    }
-    path->push(idx);
-    vas->unrefNoDelete();
+    return vas;
   }
 };
 
@@ -372,13 +762,14 @@ SmToVertexArrayShapeAction::~SmToVertexArrayShapeAction(void)
 void 
 SmToVertexArrayShapeAction::apply(SoNode * root)
 {
+  PRIVATE(this)->resetStatistics();
   PRIVATE(this)->sa.setType(SoVertexShape::getClassTypeId());
   PRIVATE(this)->sa.setSearchingAll(TRUE);
   PRIVATE(this)->sa.setInterest(SoSearchAction::ALL);
   PRIVATE(this)->sa.apply(root);
   SoPathList & pl = PRIVATE(this)->sa.getPaths();
   for (int i = 0; i < pl.getLength(); i++) {
-    this->apply(pl[i]);
+    this->convert(pl[i]);
   }
   PRIVATE(this)->sa.reset();
 }
@@ -388,20 +779,28 @@ SmToVertexArrayShapeAction::apply(SoNode * root)
 void 
 SmToVertexArrayShapeAction::apply(SoPath * path)
 {
-  PRIVATE(this)->init();
-  PRIVATE(this)->cbaction.apply(path);  
-  PRIVATE(this)->replaceNode((SoFullPath*) path);
+  PRIVATE(this)->resetStatistics();
+  this->convert(path);
 }
 
 // Documented in superclass.
 void 
 SmToVertexArrayShapeAction::apply(const SoPathList & pathlist, SbBool obeysrules)
 {
+  PRIVATE(this)->resetStatistics();
   for (int i = 0; i < pathlist.getLength(); i++) {
-    this->apply(pathlist[i]);
+    this->convert(pathlist[i]);
   }
 }
 
+void
+SmToVertexArrayShapeAction::convert(SoPath * path)
+{
+  PRIVATE(this)->init(path);
+  PRIVATE(this)->cbaction.apply(path);  
+  PRIVATE(this)->replaceNode((SoFullPath*) path);
+}
+
 // Documented in superclass.
 void
 SmToVertexArrayShapeAction::beginTraversal(SoNode * node)
@@ -415,4 +814,101 @@ SmToVertexArrayShapeAction::useIndexedFaceSet(const SbBool onoff)
   PRIVATE(this)->useifs = onoff;
 }
 
+/*!
+  Sets the tolerance used when merging vertices. The default is 0.0,
+  which merges only vertices that are bitwise identical. With a
+  positive tolerance, coordinates are rounded to the nearest multiple
+  of \a tolerance before they are compared. Normals, texture
+  coordinates and colors are always compared exactly.
+
+  Note that two vertices closer than the tolerance might still not be
+  merged if they round to different multiples.
+*/
+void
+SmToVertexArrayShapeAction::setWeldTolerance(const float tolerance)
+{
+  PRIVATE(this)->tolerance = tolerance;
+}
+
+/*!
+  Returns the weld tolerance.
+
+  \sa setWeldTolerance()
+*/
+float
+SmToVertexArrayShapeAction::getWeldTolerance(void) const
+{
+  return PRIVATE(this)->tolerance;
+}
+
+/*!
+  Enables or disables optimizing the output for the post-transform
+  vertex cache. The default is FALSE.
+
+  When enabled, the triangles of each shape are reordered for vertex
+  cache hits, using Tom Forsyth's linear-speed algorithm, and the
+  vertices are then numbered in the order they are first used. When
+  SmVertexArrayShape nodes are created, shapes with more than 65536
+  vertices are split into several shapes, in an SoGroup, so that each
+  of them can be rendered with 16 bit indices. SoIndexedFaceSet
+  output, and shapes that are the geometry of an SoVRMLShape, are
+  never split.
+
+  \sa getACMR(), setVertexCacheSize()
+*/
+void
+SmToVertexArrayShapeAction::setOptimizeVertexCache(const SbBool onoff)
+{
+  PRIVATE(this)->optimize = onoff;
+}
+
+/*!
+  Returns whether the output is optimized for the vertex cache.
+*/
+SbBool
+SmToVertexArrayShapeAction::getOptimizeVertexCache(void) const
+{
+  return PRIVATE(this)->optimize;
+}
+
+/*!
+  Sets the vertex cache size used when optimizing, and when measuring
+  the ACMR. The default is 32 vertices. The optimization is not very
+  sensitive to the exact size, so it is not necessary to match the
+  hardware.
+*/
+void
+SmToVertexArrayShapeAction::setVertexCacheSize(const int size)
+{
+  PRIVATE(this)->cachesize = SbClamp(size, 4, SM_VCACHE_MAXSIZE);
+}
+
+/*!
+  Returns the vertex cache size.
+*/
+int
+SmToVertexArrayShapeAction::getVertexCacheSize(void) const
+{
+  return PRIVATE(this)->cachesize;
+}
+
+/*!
+  Returns the average cache miss ratio (ACMR), the number of vertex
+  cache misses per triangle, for all the shapes converted by the last
+  apply(). \a before is for the triangles in traversal order, and \a
+  after is for the output shapes. They are equal unless
+  setOptimizeVertexCache() is enabled. A FIFO cache of the size set
+  with setVertexCacheSize() is simulated.
+
+  The ACMR is usually between 0.5 and 3.0 for triangle meshes, and lower is
+  better.
+*/
+void
+SmToVertexArrayShapeAction::getACMR(float & before, float & after) const
+{
+  const double numtri = PRIVATE(this)->numtriangles;
+  before = numtri > 0.0 ? float(PRIVATE(this)->missesbefore / numtri) : 0.0f;
+  after = numtri > 0.0 ? float(PRIVATE(this)->missesafter / numtri) : 0.0f;
+}
+
 #undef PRIVATE
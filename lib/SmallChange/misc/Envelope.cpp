@@ -1,3 +1,7 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif // HAVE_CONFIG_H
+
 #include "SmEnvelope.h"
 
 #include <Inventor/SoDB.h>
@@ -40,8 +44,32 @@
 #include <Inventor/VRMLnodes/SoVRMLAppearance.h>
 #include <Inventor/elements/SoTextureEnabledElement.h>
 #include <Inventor/SoInteraction.h>
+#include <Inventor/C/threads/sched.h>
 #include <cassert>
 #include <cstring>
+#include <cmath>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(HAVE_UNISTD_H)
+#include <unistd.h>
+#endif
+
+// number of worker threads used when splitting meshes, unless set
+// with SmEnvelope::setNumThreads()
+static int sm_envelope_num_cpus(void)
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int) info.dwNumberOfProcessors;
+#elif defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+  const long num = sysconf(_SC_NPROCESSORS_ONLN);
+  return num > 0 ? (int) num : 1;
+#else
+  return 1;
+#endif
+}
 
 static void strip_node(SoType type, SoNode * root)
 {
@@ -129,13 +157,16 @@ public:
 
 class sm_mesh {
 public:
-  sm_mesh() : colorpervertex(FALSE) { }
+  sm_mesh() : colorpervertex(FALSE), split(FALSE) { }
 
   sm_mesh(const sm_mesh & org) {
     colorpervertex = org.colorpervertex;
     attrib = org.attrib;
+    split = FALSE;
   }
 
+  enum PointType { COORDS, NORMALS, TCOORDS, COLORS };
+
   sm_meshattrib attrib;
   SbBool colorpervertex;
   
@@ -144,6 +175,11 @@ public:
   SbBSPTree tbsp;
   SbBSPTree cbsp;
 
+  // octree leaf meshes are welded through the source mesh indices,
+  // and store their points here instead of in the BSP trees
+  SbBool split;
+  SbList <SbVec3f> splitpts[4];
+
   SbList <int32_t> vidx;
   SbList <int32_t> nidx;
   SbList <int32_t> tidx; 
@@ -152,12 +188,87 @@ public:
   // for lines
   SbList <int32_t> lidx;
 
-  sm_mesh * split_mesh(const SbBox3f & bbox);
+  const SbVec3f * getPoints(const PointType type, int & num) const;
   SoSeparator * create_iv_mesh(void);
   SoVRMLGroup * create_vrml_mesh(SoVRMLImageTexture * tex);
 
 };
 
+// Maps source mesh point indices to leaf mesh point indices, in the
+// order the points are first used. Open addressing, linear probing.
+class sm_indexmap {
+public:
+  sm_indexmap(void) : keys(NULL), values(NULL), mask(0), num(0) {
+    this->resize(256);
+  }
+  ~sm_indexmap() {
+    delete [] this->keys;
+    delete [] this->values;
+  }
+
+  // returns the leaf index of source point idx, copying the point to
+  // dst if it hasn't been used in the leaf before
+  int32_t map(const int32_t idx, const SbVec3f * src, SbList <SbVec3f> & dst) {
+    uint32_t i = hash(idx) & this->mask;
+    while (this->keys[i] >= 0) {
+      if (this->keys[i] == idx) return this->values[i];
+      i = (i + 1) & this->mask;
+    }
+    const int32_t newidx = dst.getLength();
+    dst.append(src[idx]);
+    this->keys[i] = idx;
+    this->values[i] = newidx;
+    if (++this->num * 2 > this->mask + 1) this->resize((this->mask + 1) * 2);
+    return newidx;
+  }
+
+private:
+  static uint32_t hash(const int32_t idx) {
+    uint32_t h = (uint32_t) idx * 0x9e3779b1U;
+    return h ^ (h >> 16);
+  }
+
+  void resize(const uint32_t size) {
+    int32_t * oldkeys = this->keys;
+    int32_t * oldvalues = this->values;
+    const uint32_t oldsize = oldkeys ? this->mask + 1 : 0;
+    this->keys = new int32_t[size];
+    this->values = new int32_t[size];
+    this->mask = size - 1;
+    uint32_t i;
+    for (i = 0; i < size; i++) this->keys[i] = -1;
+    for (i = 0; i < oldsize; i++) {
+      if (oldkeys[i] < 0) continue;
+      uint32_t j = hash(oldkeys[i]) & this->mask;
+      while (this->keys[j] >= 0) j = (j + 1) & this->mask;
+      this->keys[j] = oldkeys[i];
+      this->values[j] = oldvalues[i];
+    }
+    delete [] oldkeys;
+    delete [] oldvalues;
+  }
+
+  int32_t * keys;
+  int32_t * values;
+  uint32_t mask;
+  uint32_t num;
+};
+
+// the triangles and lines of one source mesh that belong to one
+// octree leaf
+class sm_splitjob {
+public:
+  const sm_mesh * src;
+  const int32_t * tris;
+  int numtris;
+  const int32_t * lines;
+  int numlines;
+  sm_mesh * result;
+
+  static void build_cb(void * closure);
+  void build(void);
+};
+
 class SmEnvelopeP {
 public:
   SmEnvelopeP() {
@@ -170,6 +281,7 @@ public:
     this->packedptr = NULL;
     this->transpptr = NULL;
     this->vrmlifs = NULL;
+    this->numthreads = -1;
   }
   ~SmEnvelopeP() {
     delete this->search;
@@ -194,6 +306,7 @@ public:
   uint32_t firstcolor;
   
   SbList <const char *> alltextures;
+  int numthreads;
   
   void add_texture_filename(const char * name) 
   {
@@ -531,18 +644,27 @@ public:
     return TRUE;
   }
 
+  // the octree cells are computed in one place only, so that the
+  // leaf boxes and the triangle bucketing in sm_leafsplitter agree to
+  // the last bit
+  void getCellSize(const int level, SbVec3f & bmin, SbVec3f & bd) {
+    bmin = this->bbox.getMin();
+    bd = this->bbox.getMax() - bmin;
+    bd *= 1.0001f; // to make sure all points are _inside_ the box
+    
+    int numsplit = 1 << level;
+    bd *= float(1) / float(numsplit);
+  }
+
   SbBox3f * getBBoxes(int & numboxes, int level) {
     
-    SbVec3f bmin = this->bbox.getMin();
-    SbVec3f bd = this->bbox.getMax() - bmin;
-    bd *= 1.0001f; // to make sure all points are _inside_ the box
+    SbVec3f bmin, bd;
+    this->getCellSize(level, bmin, bd);
     
     int numsplit = 1 << level;
     numboxes = numsplit*numsplit*numsplit;
     SbBox3f *bboxes = new SbBox3f[numboxes];
     
-    bd *= float(1) / float(numsplit);
-    
     int cnt = 0;
     for (int z = 0; z < numsplit; z++) {
       float z0 = bmin[2] + bd[2] * float(z);
@@ -561,11 +683,167 @@ public:
     return bboxes;
   }
 
+  // Finds the cells along one axis whose [x0, x1) interval contains
+  // val, computed the same way as in getBBoxes(). Because of
+  // rounding, neighbouring intervals can overlap, and a point can
+  // then belong to two cells.
+  static int getCells(const float val, const float bmin, const float bd,
+                      const int numsplit, int * cells) {
+    const float f = (val - bmin) / bd;
+    if (!(f > -2.0f && f < float(numsplit + 2))) return 0;
+    const int c = (int) floor(f);
+    int num = 0;
+    for (int i = SbMax(c - 1, 0); i <= SbMin(c + 1, numsplit - 1); i++) {
+      const float x0 = bmin + bd * float(i);
+      const float x1 = x0 + bd;
+      if (val >= x0 && val < x1) cells[num++] = i;
+    }
+    return num;
+  }
+
+  // Sorts the primitives of a mesh into octree leaves, by the first
+  // vertex of each primitive. Returns the primitive indices sorted by
+  // leaf, with offsets[leaf] as the start of each leaf.
+  static void bucketPrimitives(const SbVec3f * coords, const SbList <int32_t> & idx,
+                               const int numverts, const SbVec3f & bmin, const SbVec3f & bd,
+                               const int numsplit, SbList <int32_t> & offsets,
+                               SbList <int32_t> & items) {
+    const int numboxes = numsplit * numsplit * numsplit;
+    const int num = idx.getLength() / numverts;
+    SbList <int32_t> leafof(num);
+    SbList <int32_t> primof(num);
+    int i;
+    for (i = 0; i < num; i++) {
+      const SbVec3f & p = coords[idx[i * numverts]];
+      int cells[3][3];
+      int numcells[3];
+      for (int a = 0; a < 3; a++) {
+        numcells[a] = getCells(p[a], bmin[a], bd[a], numsplit, cells[a]);
+      }
+      for (int z = 0; z < numcells[2]; z++) {
+        for (int y = 0; y < numcells[1]; y++) {
+          for (int x = 0; x < numcells[0]; x++) {
+            leafof.append((cells[2][z] * numsplit + cells[1][y]) * numsplit + cells[0][x]);
+            primof.append(i);
+          }
+        }
+      }
+    }
+
+    // counting sort, stable so that each leaf keeps the primitive order
+    offsets.truncate(0);
+    for (i = 0; i <= numboxes; i++) offsets.append(0);
+    for (i = 0; i < leafof.getLength(); i++) offsets[leafof[i] + 1]++;
+    for (i = 0; i < numboxes; i++) offsets[i + 1] += offsets[i];
+    SbList <int32_t> pos(numboxes);
+    for (i = 0; i < numboxes; i++) pos.append(offsets[i]);
+    items.truncate(0);
+    for (i = 0; i < leafof.getLength(); i++) items.append(0);
+    for (i = 0; i < leafof.getLength(); i++) items[pos[leafof[i]]++] = primof[i];
+  }
+
+  // Splits all meshes into the octree leaves of one level. The
+  // primitives are sorted into leaves in one pass when the splitter
+  // is created, and the meshes of one leaf at a time are then built
+  // in a worker pool by buildLeaf(), so that each leaf can be
+  // exported and freed before the next one is built.
+  class sm_leafsplitter {
+  public:
+    sm_leafsplitter(const SbList <sm_mesh*> & meshlist, const SbVec3f & bmin,
+                    const SbVec3f & bd, const int numsplit, const int numthreads)
+      : meshlist(meshlist) {
+      this->nummeshes = meshlist.getLength();
+      this->trioffsets = new SbList<int32_t>[this->nummeshes];
+      this->triitems = new SbList<int32_t>[this->nummeshes];
+      this->lineoffsets = new SbList<int32_t>[this->nummeshes];
+      this->lineitems = new SbList<int32_t>[this->nummeshes];
+      this->jobs = new sm_splitjob[this->nummeshes];
+      this->meshes = new sm_mesh*[this->nummeshes];
+
+      for (int i = 0; i < this->nummeshes; i++) {
+        const sm_mesh * m = meshlist[i];
+        const SbVec3f * coords = m->bsp.getPointsArrayPtr();
+        bucketPrimitives(coords, m->vidx, 3, bmin, bd, numsplit,
+                         this->trioffsets[i], this->triitems[i]);
+        bucketPrimitives(coords, m->lidx, 2, bmin, bd, numsplit,
+                         this->lineoffsets[i], this->lineitems[i]);
+        this->meshes[i] = NULL;
+      }
+      this->sched = numthreads > 0 ? cc_sched_construct(numthreads) : NULL;
+    }
+    ~sm_leafsplitter() {
+      this->freeLeaf();
+      if (this->sched) cc_sched_destruct(this->sched);
+      delete [] this->meshes;
+      delete [] this->jobs;
+      delete [] this->trioffsets;
+      delete [] this->triitems;
+      delete [] this->lineoffsets;
+      delete [] this->lineitems;
+    }
+
+    // Returns the meshes of leaf, indexed like the mesh list, with
+    // NULL for meshes without any primitives. The caller may take
+    // ownership of a mesh by setting its entry to NULL. The other
+    // meshes are deleted on the next call.
+    sm_mesh ** buildLeaf(const int leaf) {
+      this->freeLeaf();
+      int i;
+      for (i = 0; i < this->nummeshes; i++) {
+        const sm_mesh * m = this->meshlist[i];
+        sm_splitjob & job = this->jobs[i];
+        job.src = m;
+        job.result = NULL;
+        if (m->vidx.getLength() == 0 && m->lidx.getLength() == 0) continue;
+
+        job.tris = this->triitems[i].getArrayPtr() + this->trioffsets[i][leaf];
+        job.numtris = this->trioffsets[i][leaf + 1] - this->trioffsets[i][leaf];
+        job.lines = this->lineitems[i].getArrayPtr() + this->lineoffsets[i][leaf];
+        job.numlines = this->lineoffsets[i][leaf + 1] - this->lineoffsets[i][leaf];
+        if (this->sched) cc_sched_schedule(this->sched, sm_splitjob::build_cb, &job, 0.0f);
+        else job.build();
+      }
+      if (this->sched) cc_sched_wait_all(this->sched);
+      for (i = 0; i < this->nummeshes; i++) this->meshes[i] = this->jobs[i].result;
+      return this->meshes;
+    }
+
+    void freeLeaf(void) {
+      for (int i = 0; i < this->nummeshes; i++) {
+        delete this->meshes[i];
+        this->meshes[i] = NULL;
+      }
+    }
+
+  private:
+    const SbList <sm_mesh*> & meshlist;
+    int nummeshes;
+    SbList <int32_t> * trioffsets;
+    SbList <int32_t> * triitems;
+    SbList <int32_t> * lineoffsets;
+    SbList <int32_t> * lineitems;
+    sm_splitjob * jobs;
+    sm_mesh ** meshes;
+    cc_sched * sched;
+  };
+
+  // Returns a splitter for the given octree level, or NULL if there
+  // is only one leaf.
+  sm_leafsplitter * createSplitter(const int level) {
+    if (level <= 0) return NULL;
+    SbVec3f bmin, bd;
+    this->getCellSize(level, bmin, bd);
+    int numthreads = this->numthreads;
+    if (numthreads < 0) numthreads = sm_envelope_num_cpus();
+    return new sm_leafsplitter(this->meshlist, bmin, bd, 1 << level, numthreads);
+  }
+
   SbBool exportGeometry(const char * outfile, const int level, const SbBool vrml2) {
     fprintf(stderr,"About to write envelope(s)\n");
 
     int numboxes;
     SbBox3f * bboxes = this->getBBoxes(numboxes, level);
+    sm_leafsplitter * splitter = numboxes > 1 ? this->createSplitter(level) : NULL;
         
     for (int l = 0; l < numboxes; l++) {
       SbBox3f b = bboxes[l];
@@ -577,6 +855,7 @@ public:
               b.getMax()[1],
               b.getMax()[2]);
       
+      sm_mesh ** leaf = splitter ? splitter->buildLeaf(l) : NULL;
       SoGroup * triroot = vrml2 ? ((SoGroup*)new SoVRMLGroup) : ((SoGroup*)new SoSeparator);
       triroot->ref();
       
@@ -593,11 +872,12 @@ public:
         }
         for (int i = 0; i < meshlist.getLength(); i++) {
           if (meshlist[i]->attrib.texturename == name) {
-            if (numboxes > 1) {
-              sm_mesh * mesh = meshlist[i]->split_mesh(bboxes[l]);
+            if (leaf) {
+              sm_mesh * mesh = leaf[i];
               if (mesh) {
                 triroot->addChild(vrml2 ? ((SoNode*)mesh->create_vrml_mesh(t2)) : ((SoNode*)mesh->create_iv_mesh()));
                 delete mesh;
+                leaf[i] = NULL;
               }
             }
             else {
@@ -618,7 +898,10 @@ public:
       
       if (!out.openFile(filename.getString())) {
         fprintf(stderr,"Unable to open output file: %s\n", outfile);
-        return -1;
+        triroot->unref();
+        delete splitter;
+        delete[] bboxes;
+        return FALSE;
       }
       out.setHeaderString(vrml2 ? "#VRML V2.0 utf8" : "#VRML V1.0 ascii");
 
@@ -626,6 +909,7 @@ public:
       wa.apply(triroot);
       triroot->unref();
     }
+    delete splitter;
     delete[] bboxes;
     return TRUE;
   }
@@ -634,6 +918,7 @@ public:
 
     int numboxes;
     SbBox3f * bboxes = this->getBBoxes(numboxes, level);
+    sm_leafsplitter * splitter = numboxes > 1 ? this->createSplitter(level) : NULL;
 
     SoGroup * root = vrml2 ? ((SoGroup*)new SoVRMLGroup) : ((SoGroup*)new SoSeparator);
 
@@ -647,6 +932,7 @@ public:
               b.getMax()[1],
               b.getMax()[2]);
       
+      sm_mesh ** leaf = splitter ? splitter->buildLeaf(l) : NULL;
       SoGroup * triroot = vrml2 ? ((SoGroup*)new SoVRMLGroup) : ((SoGroup*)new SoSeparator);
       triroot->ref();
       
@@ -663,11 +949,12 @@ public:
         }
         for (int i = 0; i < meshlist.getLength(); i++) {
           if (meshlist[i]->attrib.texturename == name) {
-            if (numboxes > 1) {
-              sm_mesh * mesh = meshlist[i]->split_mesh(bboxes[l]);
+            if (leaf) {
+              sm_mesh * mesh = leaf[i];
               if (mesh) {
                 triroot->addChild(vrml2 ? ((SoNode*)mesh->create_vrml_mesh(t2)) : ((SoNode*)mesh->create_iv_mesh()));
                 delete mesh;
+                leaf[i] = NULL;
               }
             }
             else {
@@ -681,6 +968,7 @@ public:
       root->addChild(triroot);
       triroot->unref();
     }
+    delete splitter;
     delete[] bboxes;
     return root;
   }
@@ -721,9 +1009,10 @@ sm_mesh::create_iv_mesh()
   
   sep->addChild(mat);
 
+  int num;
+  const SbVec3f * pts = this->getPoints(COORDS, num);
   SoCoordinate3 * c = new SoCoordinate3;
-  c->point.setValues(0, this->bsp.numPoints(),
-                     this->bsp.getPointsArrayPtr());
+  c->point.setValues(0, num, pts);
   sep->addChild(c);
   
   if (this->vidx.getLength()) {
@@ -739,23 +1028,22 @@ sm_mesh::create_iv_mesh()
       SoMaterialBinding * mb = new SoMaterialBinding;
       mb->value = SoMaterialBinding::PER_VERTEX_INDEXED;
       sep->addChild(mb);
-      mat->diffuseColor.setNum(this->cbsp.numPoints());
-      mat->diffuseColor.setValues(0, this->cbsp.numPoints(), 
-                                  (SbColor*) this->cbsp.getPointsArrayPtr());
+      pts = this->getPoints(COLORS, num);
+      mat->diffuseColor.setNum(num);
+      mat->diffuseColor.setValues(0, num, (SbColor*) pts);
     }
     
     
+    pts = this->getPoints(NORMALS, num);
     SoNormal * n = new SoNormal;
-    n->vector.setValues(0, this->nbsp.numPoints(), 
-                        this->nbsp.getPointsArrayPtr());
+    n->vector.setValues(0, num, pts);
     sep->addChild(n);
     
     if (this->attrib.texturename != NULL) {
       SoTextureCoordinate2 * tc = new SoTextureCoordinate2;
-      tc->point.setNum(this->tbsp.numPoints());
+      const SbVec3f * src = this->getPoints(TCOORDS, num);
+      tc->point.setNum(num);
       SbVec2f * dst = tc->point.startEditing();
-      const int num = this->tbsp.numPoints();
-      const SbVec3f * src = this->tbsp.getPointsArrayPtr(); 
       for (int i = 0; i < num; i++) {
         dst[i] = SbVec2f(src[i][0], src[i][1]);
       }
@@ -886,9 +1174,10 @@ sm_mesh::create_vrml_mesh(SoVRMLImageTexture * tex)
   
   app->material = mat;
 
+  int num;
+  const SbVec3f * pts = this->getPoints(COORDS, num);
   SoVRMLCoordinate * c = new SoVRMLCoordinate;
-  c->point.setValues(0, this->bsp.numPoints(),
-                     this->bsp.getPointsArrayPtr());
+  c->point.setValues(0, num, pts);
   
   if (this->vidx.getLength()) {
     SoVRMLShape * shape = new SoVRMLShape;
@@ -903,25 +1192,24 @@ sm_mesh::create_vrml_mesh(SoVRMLImageTexture * tex)
       
     ifs->colorPerVertex = this->colorpervertex;
     if (this->colorpervertex) {
+      pts = this->getPoints(COLORS, num);
       SoVRMLColor * color = new SoVRMLColor;
-      color->color.setValues(0, this->cbsp.numPoints(), 
-                             (SbColor*) this->cbsp.getPointsArrayPtr());
+      color->color.setValues(0, num, (SbColor*) pts);
 
       ifs->color = color;
     }
     
+    pts = this->getPoints(NORMALS, num);
     SoVRMLNormal * n = new SoVRMLNormal;
-    n->vector.setValues(0, this->nbsp.numPoints(), 
-                        this->nbsp.getPointsArrayPtr());
+    n->vector.setValues(0, num, pts);
     ifs->normal = n;
     ifs->normalPerVertex = TRUE;
     
     if (this->attrib.texturename != NULL) {
       SoVRMLTextureCoordinate * tc = new SoVRMLTextureCoordinate;
-      tc->point.setNum(this->tbsp.numPoints());
+      const SbVec3f * src = this->getPoints(TCOORDS, num);
+      tc->point.setNum(num);
       SbVec2f * dst = tc->point.startEditing();
-      const int num = this->tbsp.numPoints();
-      const SbVec3f * src = this->tbsp.getPointsArrayPtr(); 
       for (int i = 0; i < num; i++) {
         dst[i] = SbVec2f(src[i][0], src[i][1]);
       }
@@ -1021,61 +1309,74 @@ sm_mesh::create_vrml_mesh(SoVRMLImageTexture * tex)
   return grp;
 }
 
-sm_mesh * 
-sm_mesh::split_mesh(const SbBox3f & bbox)
+const SbVec3f *
+sm_mesh::getPoints(const PointType type, int & num) const
 {
-  if (this->vidx.getLength() == 0) return NULL;
-  
-  sm_mesh * newmesh = new sm_mesh(*this);
-  int numtri = this->vidx.getLength() / 3;
-  
-  const SbVec3f * csrc = this->bsp.getPointsArrayPtr();
-  const SbVec3f * nsrc = this->nbsp.getPointsArrayPtr();
-  const SbVec3f * tsrc = this->tbsp.getPointsArrayPtr();
-  const SbVec3f * colsrc = this->cbsp.getPointsArrayPtr();
+  if (this->split) {
+    num = this->splitpts[type].getLength();
+    return this->splitpts[type].getArrayPtr();
+  }
+  const SbBSPTree * trees[] = { &this->bsp, &this->nbsp, &this->tbsp, &this->cbsp };
+  num = trees[type]->numPoints();
+  return trees[type]->getPointsArrayPtr();
+}
 
-  if (numtri) {
-    for (int i = 0; i < numtri; i++) {
+void
+sm_splitjob::build_cb(void * closure)
+{
+  ((sm_splitjob *) closure)->build();
+}
 
-      SbVec3f tst = csrc[this->vidx[i*3]];
-      if (tst[0] < bbox.getMin()[0] ||
-          tst[0] >= bbox.getMax()[0] ||
-          tst[1] < bbox.getMin()[1] ||
-          tst[1] >= bbox.getMax()[1] ||
-          tst[2] < bbox.getMin()[2] ||
-          tst[2] >= bbox.getMax()[2]) continue;
-
-      newmesh->vidx.append(newmesh->bsp.addPoint(csrc[this->vidx[i*3]]));
-      newmesh->vidx.append(newmesh->bsp.addPoint(csrc[this->vidx[i*3+1]]));
-      newmesh->vidx.append(newmesh->bsp.addPoint(csrc[this->vidx[i*3+2]]));
-      
-      newmesh->nidx.append(newmesh->nbsp.addPoint(nsrc[this->nidx[i*3]]));
-      newmesh->nidx.append(newmesh->nbsp.addPoint(nsrc[this->nidx[i*3+1]]));
-      newmesh->nidx.append(newmesh->nbsp.addPoint(nsrc[this->nidx[i*3+2]]));
-      
-      if (this->colorpervertex) {
-        newmesh->cidx.append(newmesh->cbsp.addPoint(colsrc[this->cidx[i*3]]));
-        newmesh->cidx.append(newmesh->cbsp.addPoint(colsrc[this->cidx[i*3+1]]));
-        newmesh->cidx.append(newmesh->cbsp.addPoint(colsrc[this->cidx[i*3+2]]));
+// Creates the leaf mesh. Points are welded through their source mesh
+// index, which gives the same points, in the same order, as adding
+// them to fresh BSP trees would.
+void
+sm_splitjob::build(void)
+{
+  const sm_mesh * src = this->src;
+  sm_mesh * newmesh = new sm_mesh(*src);
+  newmesh->split = TRUE;
+
+  const SbVec3f * csrc = src->bsp.getPointsArrayPtr();
+  const SbVec3f * nsrc = src->nbsp.getPointsArrayPtr();
+  const SbVec3f * tsrc = src->tbsp.getPointsArrayPtr();
+  const SbVec3f * colsrc = src->cbsp.getPointsArrayPtr();
+
+  sm_indexmap vmap, nmap, tmap, cmap;
+  SbList <SbVec3f> & cdst = newmesh->splitpts[sm_mesh::COORDS];
+  SbList <SbVec3f> & ndst = newmesh->splitpts[sm_mesh::NORMALS];
+  SbList <SbVec3f> & tdst = newmesh->splitpts[sm_mesh::TCOORDS];
+  SbList <SbVec3f> & coldst = newmesh->splitpts[sm_mesh::COLORS];
+
+  int i, j;
+  for (i = 0; i < this->numtris; i++) {
+    const int t = this->tris[i] * 3;
+    for (j = 0; j < 3; j++) {
+      newmesh->vidx.append(vmap.map(src->vidx[t+j], csrc, cdst));
+    }
+    for (j = 0; j < 3; j++) {
+      newmesh->nidx.append(nmap.map(src->nidx[t+j], nsrc, ndst));
+    }
+    if (src->colorpervertex) {
+      for (j = 0; j < 3; j++) {
+        newmesh->cidx.append(cmap.map(src->cidx[t+j], colsrc, coldst));
       }
-      if (this->attrib.texturename) {
-        newmesh->tidx.append(newmesh->tbsp.addPoint(tsrc[this->tidx[i*3]]));
-        newmesh->tidx.append(newmesh->tbsp.addPoint(tsrc[this->tidx[i*3+1]]));
-        newmesh->tidx.append(newmesh->tbsp.addPoint(tsrc[this->tidx[i*3+2]]));
+    }
+    if (src->attrib.texturename) {
+      for (j = 0; j < 3; j++) {
+        newmesh->tidx.append(tmap.map(src->tidx[t+j], tsrc, tdst));
       }
     }
   }
-
-  int numlines = this->lidx.getLength() / 2;
-  if (numlines) {
-    int numlines = this->lidx.getLength() / 2;
-    // FIXME: support lines
-  }  
-  return newmesh;
+  for (i = 0; i < this->numlines; i++) {
+    const int line = this->lines[i] * 2;
+    newmesh->lidx.append(vmap.map(src->lidx[line], csrc, cdst));
+    newmesh->lidx.append(vmap.map(src->lidx[line+1], csrc, cdst));
+  }
+  this->result = newmesh;
 }
 
 
-
 SmEnvelope::SmEnvelope(void)
 {
   this->pimpl = new SmEnvelopeP;
@@ -1113,6 +1414,26 @@ SmEnvelope::getConvertedScene(const int octtreelevels,
   return this->pimpl->getConvertedScene(octtreelevels, vrml2);
 }
 
+/*!
+  Sets the number of worker threads used to build the octree leaves
+  in exportGeometry() and getConvertedScene(). 0 builds them in the
+  calling thread. The default, -1, uses one thread per CPU.
+*/
+void
+SmEnvelope::setNumThreads(const int numthreads)
+{
+  this->pimpl->numthreads = numthreads;
+}
+
+/*!
+  Returns the number of worker threads used to build octree leaves.
+*/
+int
+SmEnvelope::getNumThreads(void) const
+{
+  return this->pimpl->numthreads;
+}
+
 void 
 SmEnvelope::reorganizeScene(SoNode * root, SbBool stripnodes) {
   fprintf(stderr,"Reorganizing\n");
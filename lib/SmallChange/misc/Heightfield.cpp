@@ -0,0 +1,565 @@
+/**************************************************************************\
+ * Copyright (c) Kongsberg Oil & Gas Technologies AS
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+\**************************************************************************/
+
+/*!
+  \class SmHeightfield SmallChange/misc/SmHeightfield.h
+  \brief Memory mapped binary heightfield files for SmScenery.
+
+  The file format is a 64 byte header followed by the elevation grid
+  as 32-bit floats. All values are in the byte order of the host that
+  wrote the file:
+
+  \verbatim
+  offset  type       contents
+  0       char[8]    "SMHFIELD"
+  8       uint32     version (1)
+  12      uint32     offset of the elevation data (64)
+  16      double[2]  origin, the position of the first grid point
+  32      double[2]  spacing - the y spacing is negative if rows
+                     are stored north to south
+  48      int32[2]   number of columns and rows
+  56      int32      tile size
+  60      float      undefined elevation value
+  \endverbatim
+
+  The grid is stored in tile-major order, with tiles of tile size by
+  tile size elevations, rows of tiles from the first to the last row
+  of the grid and each tile in row-major order. Tiles on the right and
+  last edges are padded with the undefined value, so all tiles have
+  the same size.
+
+  Since the grid is memory mapped, even very large files open
+  instantly, and the tiles are paged in as they are used. For the same
+  reason the elevations can't be byte swapped, so files written on a
+  host with the other byte order are rejected when opened.
+
+  \sa SmScenery
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "SmHeightfield.h"
+
+#include <Inventor/errors/SoDebugError.h>
+#include <Inventor/lists/SbList.h>
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef HAVE_WINDOWS_H
+#include <windows.h>
+#else
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#endif
+
+#define HEIGHTFIELD_MAGIC "SMHFIELD"
+#define HEIGHTFIELD_VERSION 1
+#define HEIGHTFIELD_HEADERSIZE 64
+
+struct sm_heightfield_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t dataoffset;
+  double origin[2];
+  double spacing[2];
+  int32_t dimension[2];
+  int32_t tilesize;
+  float undef;
+};
+
+class SmHeightfieldP {
+public:
+  SmHeightfieldP(void)
+    : mapping(NULL), mappingsize(0), data(NULL), tilesx(0), tilesy(0)
+#ifdef HAVE_WINDOWS_H
+    , file(INVALID_HANDLE_VALUE), filemapping(NULL)
+#endif
+  {
+    memset(&this->header, 0, sizeof(this->header));
+  }
+
+  struct sm_heightfield_header header;
+  void * mapping;
+  size_t mappingsize;
+  const float * data;
+  int tilesx, tilesy;
+#ifdef HAVE_WINDOWS_H
+  HANDLE file;
+  HANDLE filemapping;
+#endif
+
+  static SbBool readHeader(const void * buffer, struct sm_heightfield_header & header);
+  static SbBool isForeignHeader(const struct sm_heightfield_header & header);
+  SbBool map(const char * filename);
+  void unmap(void);
+};
+
+#define PRIVATE(obj) ((obj)->pimpl)
+
+// *************************************************************************
+
+SbBool
+SmHeightfieldP::readHeader(const void * buffer, struct sm_heightfield_header & header)
+{
+  const char * ptr = (const char *) buffer;
+  memcpy(header.magic, ptr, 8);
+  memcpy(&header.version, ptr + 8, 4);
+  memcpy(&header.dataoffset, ptr + 12, 4);
+  memcpy(header.origin, ptr + 16, 16);
+  memcpy(header.spacing, ptr + 32, 16);
+  memcpy(header.dimension, ptr + 48, 8);
+  memcpy(&header.tilesize, ptr + 56, 4);
+  memcpy(&header.undef, ptr + 60, 4);
+
+  return
+    (memcmp(header.magic, HEIGHTFIELD_MAGIC, 8) == 0) &&
+    (header.version == HEIGHTFIELD_VERSION) &&
+    (header.dataoffset >= HEIGHTFIELD_HEADERSIZE) &&
+    (header.dimension[0] > 0) && (header.dimension[1] > 0) &&
+    (header.tilesize > 0) &&
+    (header.spacing[0] > 0.0) && (header.spacing[1] != 0.0);
+}
+
+// Returns TRUE if the header was written on a host with the other
+// byte order, detected from the version number.
+SbBool
+SmHeightfieldP::isForeignHeader(const struct sm_heightfield_header & header)
+{
+  const uint32_t v = HEIGHTFIELD_VERSION;
+  const uint32_t swapped =
+    (v << 24) | ((v & 0xff00) << 8) | ((v >> 8) & 0xff00) | (v >> 24);
+  return
+    (memcmp(header.magic, HEIGHTFIELD_MAGIC, 8) == 0) &&
+    (header.version == swapped);
+}
+
+SbBool
+SmHeightfieldP::map(const char * filename)
+{
+#ifdef HAVE_WINDOWS_H
+  this->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                           OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+  if (this->file == INVALID_HANDLE_VALUE) return FALSE;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(this->file, &size) || size.QuadPart < HEIGHTFIELD_HEADERSIZE) {
+    this->unmap();
+    return FALSE;
+  }
+  this->filemapping = CreateFileMappingA(this->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (this->filemapping == NULL) {
+    this->unmap();
+    return FALSE;
+  }
+  this->mapping = MapViewOfFile(this->filemapping, FILE_MAP_READ, 0, 0, 0);
+  this->mappingsize = (size_t) size.QuadPart;
+  if (this->mapping == NULL) {
+    this->unmap();
+    return FALSE;
+  }
+  return TRUE;
+#elif defined(HAVE_SYS_MMAN_H)
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) return FALSE;
+  struct stat buf;
+  if ((fstat(fd, &buf) != 0) || (buf.st_size < HEIGHTFIELD_HEADERSIZE)) {
+    ::close(fd);
+    return FALSE;
+  }
+  void * ptr = mmap(NULL, (size_t) buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd); // the mapping keeps its own reference to the file
+  if (ptr == MAP_FAILED) return FALSE;
+  this->mapping = ptr;
+  this->mappingsize = (size_t) buf.st_size;
+  return TRUE;
+#else
+  SoDebugError::post("SmHeightfield::open", "memory mapped files not supported on this platform");
+  return FALSE;
+#endif
+}
+
+void
+SmHeightfieldP::unmap(void)
+{
+#ifdef HAVE_WINDOWS_H
+  if (this->mapping) UnmapViewOfFile(this->mapping);
+  if (this->filemapping) CloseHandle(this->filemapping);
+  if (this->file != INVALID_HANDLE_VALUE) CloseHandle(this->file);
+  this->filemapping = NULL;
+  this->file = INVALID_HANDLE_VALUE;
+#elif defined(HAVE_SYS_MMAN_H)
+  if (this->mapping) munmap(this->mapping, this->mappingsize);
+#endif
+  this->mapping = NULL;
+  this->mappingsize = 0;
+  this->data = NULL;
+}
+
+// *************************************************************************
+
+SmHeightfield::SmHeightfield(void)
+{
+  PRIVATE(this) = new SmHeightfieldP;
+}
+
+SmHeightfield::~SmHeightfield()
+{
+  this->close();
+  delete PRIVATE(this);
+}
+
+/*!
+  Returns TRUE if \a filename starts with a valid heightfield header.
+  Files with the other byte order are also accepted, so that open()
+  can report them.
+*/
+SbBool
+SmHeightfield::isHeightfieldFile(const char * filename)
+{
+  FILE * fp = fopen(filename, "rb");
+  if (!fp) return FALSE;
+  char buffer[HEIGHTFIELD_HEADERSIZE];
+  const SbBool ok = fread(buffer, 1, HEIGHTFIELD_HEADERSIZE, fp) == HEIGHTFIELD_HEADERSIZE;
+  fclose(fp);
+  struct sm_heightfield_header header;
+  return ok &&
+    (SmHeightfieldP::readHeader(buffer, header) ||
+     SmHeightfieldP::isForeignHeader(header));
+}
+
+/*!
+  Maps \a filename into memory. Returns FALSE if the file could not
+  be opened or is not a valid heightfield file.
+*/
+SbBool
+SmHeightfield::open(const char * filename)
+{
+  this->close();
+  if (!PRIVATE(this)->map(filename)) return FALSE;
+
+  struct sm_heightfield_header & header = PRIVATE(this)->header;
+  if (!SmHeightfieldP::readHeader(PRIVATE(this)->mapping, header)) {
+    if (SmHeightfieldP::isForeignHeader(header)) {
+      SoDebugError::post("SmHeightfield::open",
+                         "'%s' was written on a host with a different byte order",
+                         filename);
+    }
+    else {
+      SoDebugError::post("SmHeightfield::open", "'%s' is not a heightfield file", filename);
+    }
+    this->close();
+    return FALSE;
+  }
+  const int tilesize = header.tilesize;
+  PRIVATE(this)->tilesx = (header.dimension[0] + tilesize - 1) / tilesize;
+  PRIVATE(this)->tilesy = (header.dimension[1] + tilesize - 1) / tilesize;
+
+  const double needed = double(header.dataoffset) +
+    double(PRIVATE(this)->tilesx) * double(PRIVATE(this)->tilesy) *
+    double(tilesize) * double(tilesize) * sizeof(float);
+  if (double(PRIVATE(this)->mappingsize) < needed) {
+    SoDebugError::post("SmHeightfield::open", "'%s' is truncated", filename);
+    this->close();
+    return FALSE;
+  }
+  PRIVATE(this)->data = (const float *)
+    ((const char *) PRIVATE(this)->mapping + header.dataoffset);
+  return TRUE;
+}
+
+/*!
+  Unmaps the file. Pointers returned from getTile() are invalid after
+  this.
+*/
+void
+SmHeightfield::close(void)
+{
+  PRIVATE(this)->unmap();
+  memset(&PRIVATE(this)->header, 0, sizeof(PRIVATE(this)->header));
+  PRIVATE(this)->tilesx = PRIVATE(this)->tilesy = 0;
+}
+
+SbBool
+SmHeightfield::isOpen(void) const
+{
+  return PRIVATE(this)->data != NULL;
+}
+
+void
+SmHeightfield::getOrigin(double * origin) const
+{
+  origin[0] = PRIVATE(this)->header.origin[0];
+  origin[1] = PRIVATE(this)->header.origin[1];
+}
+
+void
+SmHeightfield::getSpacing(double * spacing) const
+{
+  spacing[0] = PRIVATE(this)->header.spacing[0];
+  spacing[1] = PRIVATE(this)->header.spacing[1];
+}
+
+int
+SmHeightfield::getColumns(void) const
+{
+  return PRIVATE(this)->header.dimension[0];
+}
+
+int
+SmHeightfield::getRows(void) const
+{
+  return PRIVATE(this)->header.dimension[1];
+}
+
+float
+SmHeightfield::getUndefValue(void) const
+{
+  return PRIVATE(this)->header.undef;
+}
+
+int
+SmHeightfield::getTileSize(void) const
+{
+  return PRIVATE(this)->header.tilesize;
+}
+
+int
+SmHeightfield::getNumTilesX(void) const
+{
+  return PRIVATE(this)->tilesx;
+}
+
+int
+SmHeightfield::getNumTilesY(void) const
+{
+  return PRIVATE(this)->tilesy;
+}
+
+/*!
+  Returns a pointer into the mapped file, to the tile size by tile
+  size elevations of the given tile, in row-major order.
+*/
+const float *
+SmHeightfield::getTile(const int tilex, const int tiley) const
+{
+  assert(PRIVATE(this)->data);
+  assert(tilex >= 0 && tilex < PRIVATE(this)->tilesx);
+  assert(tiley >= 0 && tiley < PRIVATE(this)->tilesy);
+  const size_t tilesize = PRIVATE(this)->header.tilesize;
+  const size_t tile = size_t(tiley) * PRIVATE(this)->tilesx + tilex;
+  return PRIVATE(this)->data + tile * tilesize * tilesize;
+}
+
+// *************************************************************************
+
+static void
+sm_write_header(FILE * fp, const struct sm_heightfield_header & header)
+{
+  char buffer[HEIGHTFIELD_HEADERSIZE];
+  memset(buffer, 0, HEIGHTFIELD_HEADERSIZE);
+  memcpy(buffer, header.magic, 8);
+  memcpy(buffer + 8, &header.version, 4);
+  memcpy(buffer + 12, &header.dataoffset, 4);
+  memcpy(buffer + 16, header.origin, 16);
+  memcpy(buffer + 32, header.spacing, 16);
+  memcpy(buffer + 48, header.dimension, 8);
+  memcpy(buffer + 56, &header.tilesize, 4);
+  memcpy(buffer + 60, &header.undef, 4);
+  fwrite(buffer, 1, HEIGHTFIELD_HEADERSIZE, fp);
+}
+
+static SbBool
+sm_read_xyz(FILE * fp, char * line, const int linesize, double * xyz)
+{
+  while (fgets(line, linesize, fp)) {
+    char * ptr = line;
+    char * end;
+    int i;
+    for (i = 0; i < 3; i++) {
+      xyz[i] = strtod(ptr, &end);
+      if (end == ptr) break;
+      ptr = end;
+    }
+    if (i == 3) return TRUE;
+    // skip empty lines, stop at anything else
+    while (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n') ptr++;
+    if (*ptr != '\0') return FALSE;
+  }
+  return FALSE;
+}
+
+/*!
+  Converts an ASCII XYZ grid file to the heightfield format.
+
+  The grid points are expected to be given row by row, with x
+  increasing along each row. Rows may be given in either y
+  direction. Missing points become undefined. The input is streamed,
+  and only one row of tiles is kept in memory, so there is no limit
+  on the input file size.
+
+  Returns FALSE on errors.
+*/
+SbBool
+SmHeightfield::convertXYZ(const char * xyzfile, const char * outfile,
+                          const int tilesize, const float undefval)
+{
+  if (tilesize <= 0) return FALSE;
+  FILE * in = fopen(xyzfile, "rb");
+  if (!in) {
+    SoDebugError::post("SmHeightfield::convertXYZ", "unable to open '%s'", xyzfile);
+    return FALSE;
+  }
+
+  char line[1024];
+  double first[3], p[3];
+  if (!sm_read_xyz(in, line, sizeof(line), first) ||
+      !sm_read_xyz(in, line, sizeof(line), p) ||
+      !(p[0] > first[0])) {
+    SoDebugError::post("SmHeightfield::convertXYZ",
+                       "'%s' does not start with a row of increasing x values", xyzfile);
+    fclose(in);
+    return FALSE;
+  }
+  const double dx = p[0] - first[0];
+  const double epsilon = dx * 1.0e-3;
+
+  // the first row decides the number of columns
+  SbList<float> firstrow;
+  firstrow.append((float) first[2]);
+  firstrow.append((float) p[2]);
+  SbBool more;
+  while ((more = sm_read_xyz(in, line, sizeof(line), p)) && (fabs(p[1] - first[1]) <= epsilon)) {
+    const int col = (int) floor((p[0] - first[0]) / dx + 0.5);
+    if (col < firstrow.getLength()) continue; // duplicate or out of order
+    while (firstrow.getLength() < col) firstrow.append(undefval);
+    firstrow.append((float) p[2]);
+  }
+  const int cols = firstrow.getLength();
+  const double dy = more ? (p[1] - first[1]) : dx;
+
+  FILE * out = fopen(outfile, "wb");
+  if (!out) {
+    SoDebugError::post("SmHeightfield::convertXYZ", "unable to write '%s'", outfile);
+    fclose(in);
+    return FALSE;
+  }
+
+  struct sm_heightfield_header header;
+  memcpy(header.magic, HEIGHTFIELD_MAGIC, 8);
+  header.version = HEIGHTFIELD_VERSION;
+  header.dataoffset = HEIGHTFIELD_HEADERSIZE;
+  header.origin[0] = first[0];
+  header.origin[1] = first[1];
+  header.spacing[0] = dx;
+  header.spacing[1] = dy;
+  header.dimension[0] = cols;
+  header.dimension[1] = 0; // updated when done
+  header.tilesize = tilesize;
+  header.undef = undefval;
+  sm_write_header(out, header);
+
+  // one row of tiles, already in file order
+  const int tilesx = (cols + tilesize - 1) / tilesize;
+  const size_t tileelems = size_t(tilesize) * tilesize;
+  const size_t bandelems = tileelems * tilesx;
+  float * band = (float *) malloc(bandelems * sizeof(float));
+  if (!band) {
+    SoDebugError::post("SmHeightfield::convertXYZ", "out of memory");
+    fclose(in);
+    fclose(out);
+    return FALSE;
+  }
+  size_t i;
+  for (i = 0; i < bandelems; i++) band[i] = undefval;
+
+  int bandstart = 0; // first grid row in the band
+  int lastrow = 0;
+  int skipped = 0;
+  SbBool ok = TRUE;
+
+#define SET_ELEVATION(col, row, z) \
+  band[((col) / tilesize) * tileelems + size_t((row) - bandstart) * tilesize + ((col) % tilesize)] = (z)
+
+  for (int c = 0; c < cols; c++) { SET_ELEVATION(c, 0, firstrow[c]); }
+
+  while (more && ok) {
+    const int col = (int) floor((p[0] - first[0]) / dx + 0.5);
+    const int row = (int) floor((p[1] - first[1]) / dy + 0.5);
+    if ((col < 0) || (col >= cols) || (row < bandstart)) {
+      skipped++;
+    }
+    else {
+      while (row >= bandstart + tilesize) {
+        ok = fwrite(band, sizeof(float), bandelems, out) == bandelems;
+        for (i = 0; i < bandelems; i++) band[i] = undefval;
+        bandstart += tilesize;
+      }
+      SET_ELEVATION(col, row, (float) p[2]);
+      if (row > lastrow) lastrow = row;
+    }
+    more = sm_read_xyz(in, line, sizeof(line), p);
+  }
+#undef SET_ELEVATION
+
+  if (ok) ok = fwrite(band, sizeof(float), bandelems, out) == bandelems;
+  free(band);
+  fclose(in);
+
+  header.dimension[1] = lastrow + 1;
+  if (ok) ok = fseek(out, 0, SEEK_SET) == 0;
+  if (ok) sm_write_header(out, header);
+  if (fclose(out) != 0) ok = FALSE;
+
+  if (!ok) {
+    SoDebugError::post("SmHeightfield::convertXYZ", "error while writing '%s'", outfile);
+  }
+  else if (skipped > 0) {
+    SoDebugError::postWarning("SmHeightfield::convertXYZ",
+                              "skipped %d points outside the grid or out of order", skipped);
+  }
+  return ok;
+}
+
+#undef PRIVATE
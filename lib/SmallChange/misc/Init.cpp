@@ -35,6 +35,7 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <SmallChange/misc/Init.h>
+#include <SmallChange/misc/SmSphereMesh.h>
 #include <SmallChange/SmallChange.h>
 #include <SmallChange/elements/GLDepthBufferElement.h>
 #include <SmallChange/nodes/AutoFile.h>
@@ -92,6 +93,7 @@
 #include <SmallChange/nodes/SmHeadlight.h>
 #include <SmallChange/draggers/SmRangeTranslate1Dragger.h>
 #include <SmallChange/nodes/SmMarkerSet.h>
+#include <SmallChange/nodes/SmTrackSet.h>
 #include <SmallChange/nodes/SmCoordinateSystem.h>
 #include <SmallChange/nodes/SmViewpointWrapper.h>
 #include <SmallChange/nodekits/SmPopupMenuKit.h>
@@ -120,6 +122,7 @@ void SmallChange::cleanup(void)
 void
 smallchange_init(void)
 {
+  SmSphereMesh::initClass();
   AutoFile::initClass();
   GLDepthBufferElement::initClass();
   Coinboard::initClass();
@@ -170,6 +173,7 @@ smallchange_init(void)
   SmHeadlight::initClass();
   SmRangeTranslate1Dragger::initClass();
   SmMarkerSet::initClass();
+  SmTrackSet::initClass();
 
   SmVertexArrayShape::initClass();
   SmToVertexArrayShapeAction::initClass();
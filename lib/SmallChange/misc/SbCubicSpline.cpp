@@ -31,6 +31,12 @@
 \**************************************************************************/
 
 #include "SbCubicSpline.h"
+#include <math.h>
+
+// the number of values evaluated per pass in getPoints()
+#define SBCUBICSPLINE_BLOCKSIZE 64
+// the number of intervals in the arc length table for each segment
+#define SBCUBICSPLINE_LUTSIZE 32
 
 SbCubicSpline::SbCubicSpline(const int approxcount)
   : needinit(TRUE),
@@ -122,16 +128,55 @@ SbVec3f
 SbCubicSpline::getPoint(const float t)
 {
   float segt;
-  this->getSegdata(t, segt); 
-  return this->getPoint(this->currmatrix, segt);
+  int seg = this->getSegdata(t, segt); 
+  if (seg < 0) return this->getFirstPoint();
+  return this->getPoint(seg, segt);
 }
 
 SbVec3f 
 SbCubicSpline::getTangent(const float t)
 {
   float segt;
-  this->getSegdata(t, segt); 
-  return this->getTangent(this->currmatrix, segt);
+  int seg = this->getSegdata(t, segt); 
+  if (seg < 0) return SbVec3f(0.0f, 0.0f, 0.0f);
+  return this->getTangent(seg, segt);
+}
+
+// Evaluates the spline for num parameter values. This is the same as
+// calling getPoint() for each value, but the segment lookup and the
+// polynomial evaluation are done in separate passes over blocks of
+// values, so that the evaluation loop can be vectorized.
+void
+SbCubicSpline::getPoints(const float * t, const int num, SbVec3f * points)
+{
+  int i;
+  float segt;
+  if (this->needinit) this->initialize();
+  if (this->seglens.getLength() == 0) {
+    const SbVec3f p = this->getFirstPoint();
+    for (i = 0; i < num; i++) points[i] = p;
+    return;
+  }
+
+  int seg[SBCUBICSPLINE_BLOCKSIZE];
+  double u[SBCUBICSPLINE_BLOCKSIZE];
+  const double * coef = this->coefficients.getArrayPtr();
+
+  for (int start = 0; start < num; start += SBCUBICSPLINE_BLOCKSIZE) {
+    const int cnt = SbMin(num - start, SBCUBICSPLINE_BLOCKSIZE);
+    for (i = 0; i < cnt; i++) {
+      seg[i] = this->getSegdata(t[start + i], segt) * 12;
+      u[i] = (double) segt;
+    }
+    SbVec3f * out = points + start;
+    for (i = 0; i < cnt; i++) {
+      const double * c = coef + seg[i];
+      const double ui = u[i];
+      out[i].setValue((float) (((c[0] * ui + c[3]) * ui + c[6]) * ui + c[9]),
+                      (float) (((c[1] * ui + c[4]) * ui + c[7]) * ui + c[10]),
+                      (float) (((c[2] * ui + c[5]) * ui + c[8]) * ui + c[11]));
+    }
+  }
 }
 
 float 
@@ -140,22 +185,29 @@ SbCubicSpline::getSegmentLength(const int idx)
   return this->seglens[idx];
 }
 
+// Finds the segment and the segment parameter for t. The curve is
+// parameterized by arc length, so t is first mapped to a distance
+// into the segment, and then through the segment's arc length table
+// to the cubic's parameter. Returns -1 if there are no segments.
 int 
 SbCubicSpline::getSegdata(const float t, float & segt)
 {
   if (this->needinit) this->initialize();
-  int seg = this->getSegnum(t);
-  if (seg != this->currsegment) {
-    this->initMatrix(seg, this->currmatrix);
-    this->currsegment = seg;
+  if (this->seglens.getLength() == 0) {
+    segt = 0.0f;
+    return -1;
   }
+  float time;
   if (this->loop) {
-    segt = float(fmod((double)t, 1.0)) - this->segstarttimes[seg];
+    time = float(fmod((double)t, 1.0));
+    if (time < 0.0f) time += 1.0f;
   }
   else {
-    segt = SbClamp(t, 0.0f, 1.0f) - this->segstarttimes[seg];
+    time = SbClamp(t, 0.0f, 1.0f);
   }
-  segt /= this->segdurations[seg];
+  int seg = this->getSegnum(time);
+  this->currsegment = seg;
+  segt = this->getSegmentParameter(seg, time);
   return seg;
 }
 
@@ -163,25 +215,46 @@ void
 SbCubicSpline::initialize(void)
 {
   this->currsegment = -1;
-  int i, n = this->ctrlpts.getLength();
+  int i, j, n = this->ctrlpts.getLength();
 
   if (!this->loop) n--;
-  
-  // calculate an approximation of the length of the curve
+  if (n < 0) n = 0;
+
+  // expand each segment into a cubic polynomial, with the
+  // coefficients for t^3, t^2, t and 1 stored after each other
+  this->coefficients.truncate(0);
+  for (i = 0; i < n; i++) {
+    SbMatrix m;
+    this->initMatrix(i, m);
+    for (j = 0; j < 4; j++) {
+      this->coefficients.append(double(m[j][0]));
+      this->coefficients.append(double(m[j][1]));
+      this->coefficients.append(double(m[j][2]));
+    }
+  }
+
+  // calculate an approximation of the length of the curve, and an
+  // arc length table for each segment with the distance travelled at
+  // SBCUBICSPLINE_LUTSIZE evenly spaced parameter values
   this->seglens.truncate(0);
+  this->arclengths.truncate(0);
   float len;
   float totallen = 0.0;
+  const int lutstep = SbMax((this->approxcount + SBCUBICSPLINE_LUTSIZE - 1) /
+                            SBCUBICSPLINE_LUTSIZE, 1);
+  const int steps = lutstep * SBCUBICSPLINE_LUTSIZE;
 
   for (i = 0; i < n; i++) {
-    SbMatrix m;
-    this->initMatrix(i, m);
-    SbVec3f prev = this->getPoint(m, 0.0f);
+    SbVec3f prev = this->getPoint(i, 0.0f);
     len = 0.0;
-    for (int j = 1; j < this->approxcount; j++) {
-      SbVec3f p = this->getPoint(m, float(j) / float(this->approxcount));
+    this->arclengths.append(0.0f);
+    for (j = 1; j <= steps; j++) {
+      SbVec3f p = this->getPoint(i, float(j) / float(steps));
       len += (float) (p-prev).length();
       prev = p;
+      if (j % lutstep == 0) this->arclengths.append(len);
     }
+    assert(this->arclengths.getLength() == (i + 1) * (SBCUBICSPLINE_LUTSIZE + 1));
     this->seglens.append(len);
     totallen += len;
   }
@@ -194,68 +267,70 @@ SbCubicSpline::initialize(void)
     
   for (i = 0; i < n; i++) {
     len = this->seglens[i];
-    float time = len / totallen;
+    // segments of zero length all get the same share of the curve
+    float time = (totallen > 0.0f) ? len / totallen : 1.0f / float(n);
     this->segdurations.append(time);
     acctime += time;
     this->segstarttimes.append(acctime);
-
   }
   this->needinit = FALSE;
-#if 0
-  myfprintf(stdout,
-          "#Inventor V2.1 ascii\n"
-          "Separator {\n"
-          "Coordinate3 {\n"
-          "point [\n");
-          
-
-  for (int i = 0; i < this->approxcount; i++) {
-            
-    SbVec3f p = this->getPoint(float(i)/float(this->approxcount));
-    myfprintf(stdout, "%g %g %g,\n", p[0], p[1], p[2]); 
-    myfprintf(stderr,"currseg: %d\n", this->currsegment);
-  }
-  myfprintf(stdout,"]\n}\nPointSet { numPoints 400 }\n}\n");
-  fflush(stdout);
-#endif
 }
 
 SbVec3f 
-SbCubicSpline::getPoint(const SbMatrix & m, const float t)
+SbCubicSpline::getFirstPoint(void) const
 {
-#if 0
-  float t2, t3;
-  t2 = t*t; t3 = t2*t;
-  return 
-    SbVec3f(m[0][0] * t3 + m[1][0] * t2 + m[2][0] * t + m[3][0],
-            m[0][1] * t3 + m[1][1] * t2 + m[2][1] * t + m[3][1],
-            m[0][2] * t3 + m[1][2] * t2 + m[2][2] * t + m[3][2]);
+  if (this->ctrlpts.getLength() == 0) return SbVec3f(0.0f, 0.0f, 0.0f);
+  const SbVec4f & p = this->ctrlpts[0];
+  return SbVec3f(p[0], p[1], p[2]);
+}
 
-#else
-  double t1 = (double) t;
-  double t2 = t1*t;
-  double t3 = t2*t;
+SbVec3f 
+SbCubicSpline::getPoint(const int seg, const float t) const
+{
+  const double * c = this->coefficients.getArrayPtr() + seg * 12;
+  const double u = (double) t;
 
   return 
-    SbVec3f((float) (double(m[0][0]) * t3 + double(m[1][0]) * t2 + double(m[2][0]) * t + double(m[3][0])),
-            (float) (double(m[0][1]) * t3 + double(m[1][1]) * t2 + double(m[2][1]) * t + double(m[3][1])),
-            (float) (double(m[0][2]) * t3 + double(m[1][2]) * t2 + double(m[2][2]) * t + double(m[3][2])));
-  
-#endif
+    SbVec3f((float) (((c[0] * u + c[3]) * u + c[6]) * u + c[9]),
+            (float) (((c[1] * u + c[4]) * u + c[7]) * u + c[10]),
+            (float) (((c[2] * u + c[5]) * u + c[8]) * u + c[11]));
 }
 
 SbVec3f
-SbCubicSpline::getTangent(const SbMatrix &m, const float t)
+SbCubicSpline::getTangent(const int seg, const float t) const
 {
-  float t2;
-  t2 = t*t;
-  SbVec3f vec(3.0f * m[0][0] * t2 + 2.0f * m[1][0] * t + m[2][0],
-              3.0f * m[0][1] * t2 + 2.0f * m[1][1] * t + m[2][1],
-              3.0f * m[0][2] * t2 + 2.0f * m[1][2] * t + m[2][2]);
+  const double * c = this->coefficients.getArrayPtr() + seg * 12;
+  const double u = (double) t;
+  SbVec3f vec((float) ((3.0 * c[0] * u + 2.0 * c[3]) * u + c[6]),
+              (float) ((3.0 * c[1] * u + 2.0 * c[4]) * u + c[7]),
+              (float) ((3.0 * c[2] * u + 2.0 * c[5]) * u + c[8]));
   vec.normalize();
   return vec;
 }
 
+// Maps time, which must be within segment seg, to the cubic's
+// parameter, using the arc length table for the segment.
+float
+SbCubicSpline::getSegmentParameter(const int seg, const float time) const
+{
+  const float len = this->seglens[seg];
+  if (len <= 0.0f) return 0.0f;
+  float dist = (time - this->segstarttimes[seg]) / this->segdurations[seg] * len;
+  dist = SbClamp(dist, 0.0f, len);
+
+  // binary search for the last table entry at or before dist
+  const float * lut = this->arclengths.getArrayPtr() + seg * (SBCUBICSPLINE_LUTSIZE + 1);
+  int lo = 0, hi = SBCUBICSPLINE_LUTSIZE - 1;
+  while (lo < hi) {
+    const int mid = (lo + hi + 1) >> 1;
+    if (lut[mid] <= dist) lo = mid;
+    else hi = mid - 1;
+  }
+  const float d = lut[lo + 1] - lut[lo];
+  const float frac = (d > 0.0f) ? (dist - lut[lo]) / d : 0.0f;
+  return (float(lo) + frac) * (1.0f / float(SBCUBICSPLINE_LUTSIZE));
+}
+
 void 
 SbCubicSpline::initMatrix(const int q, SbMatrix & m)
 {
@@ -279,41 +354,27 @@ SbCubicSpline::getSegmentInfo(const float t, float & segt) const
 {
   assert((t >= 0.0f)&&(t <= 1.0f));
   int segnum = this->getSegnum(t);
-  segt = t - this->segstarttimes[segnum];
-  segt /= this->segdurations[segnum];
+  segt = this->getSegmentParameter(segnum, t);
   return segnum;
 }
 
 int 
 SbCubicSpline::getSegnum(const float time) const
 {
+  const int n = this->segdurations.getLength();
   int i = this->currsegment;
-  if (i >= 0 && time >= this->segstarttimes[i] && 
+  if (i >= 0 && i < n && time >= this->segstarttimes[i] && 
       time <= this->segstarttimes[i] + this->segdurations[i])
     return i;
 
-  int n = this->segstarttimes.getLength();
-  if (!this->loop) n--;
-  // do binary search
-  int currlen = n / 2;
-  i = currlen;
-  while (currlen >= 4) {
-    currlen >>= 1;
-    if (this->segstarttimes[i] == time) return i;
-    else if (time < this->segstarttimes[i]) {
-      i -= currlen;
-    }
-    else {
-      i += currlen;
-    }
-    assert(i >= 0 && i < n);
-  }
-  // do linear search for the last bit
-  i -= currlen;
-  for (; i < n; i++) {
-    if (this->segstarttimes[i] > time) return i-1;
+  // binary search for the last segment starting at or before time
+  int lo = 0, hi = n - 1;
+  while (lo < hi) {
+    const int mid = (lo + hi + 1) >> 1;
+    if (this->segstarttimes[mid] <= time) lo = mid;
+    else hi = mid - 1;
   }
-  return n-1;
+  return lo;
 }
 
 int 
@@ -63,14 +63,17 @@ public:
 
   SbVec3f getPoint(const float t);
   SbVec3f getTangent(const float t);
+  void getPoints(const float * t, const int num, SbVec3f * points);
   int getSegmentInfo(const float t, float & segt) const;
   float getSegmentLength(const int idx);
 
 private:
 
   int getSegdata(const float t, float & segt);
-  SbVec3f getPoint(const SbMatrix & m, const float t);
-  SbVec3f getTangent(const SbMatrix & m, const float t);
+  SbVec3f getFirstPoint(void) const;
+  SbVec3f getPoint(const int seg, const float t) const;
+  SbVec3f getTangent(const int seg, const float t) const;
+  float getSegmentParameter(const int seg, const float time) const;
   void initMatrix(const int seg, SbMatrix & m);
   void initialize(void);
   int getSegnum(const float time) const;
@@ -80,12 +83,13 @@ private:
   SbList <float> segstarttimes;
   SbList <float> segdurations;
   SbList <float> seglens;
+  SbList <double> coefficients;
+  SbList <float> arclengths;
 
   SbBool needinit;
   SbBool loop;
   int approxcount;
   int currsegment;
-  SbMatrix currmatrix;
   SbMatrix basismatrix;
 };
 
@@ -25,6 +25,9 @@ public:
 
   void reorganizeScene(SoNode * node, SbBool stripnodes);
 
+  void setNumThreads(const int numthreads);
+  int getNumThreads(void) const;
+
 private:
   SmEnvelopeP * pimpl;
 
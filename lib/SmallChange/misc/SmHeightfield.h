@@ -0,0 +1,71 @@
+#ifndef SM_HEIGHTFIELD_H
+#define SM_HEIGHTFIELD_H
+
+/**************************************************************************\
+ * Copyright (c) Kongsberg Oil & Gas Technologies AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+\**************************************************************************/
+
+class SmHeightfieldP;
+
+#include <Inventor/SbBasic.h>
+#include <SmallChange/basic.h>
+
+class SMALLCHANGE_DLL_API SmHeightfield {
+public:
+  SmHeightfield(void);
+  ~SmHeightfield();
+
+  static SbBool isHeightfieldFile(const char * filename);
+  static SbBool convertXYZ(const char * xyzfile, const char * outfile,
+                           const int tilesize = 256,
+                           const float undefval = 999999.0f);
+
+  SbBool open(const char * filename);
+  void close(void);
+  SbBool isOpen(void) const;
+
+  void getOrigin(double * origin) const;
+  void getSpacing(double * spacing) const;
+  int getColumns(void) const;
+  int getRows(void) const;
+  float getUndefValue(void) const;
+
+  int getTileSize(void) const;
+  int getNumTilesX(void) const;
+  int getNumTilesY(void) const;
+  const float * getTile(const int tilex, const int tiley) const;
+
+private:
+  SmHeightfieldP * pimpl;
+
+};
+
+#endif // SM_HEIGHTFIELD_H
@@ -0,0 +1,82 @@
+#ifndef SMALLCHANGE_SMSPHEREMESH_H
+#define SMALLCHANGE_SMSPHEREMESH_H
+
+/**************************************************************************\
+ * Copyright (c) Kongsberg Oil & Gas Technologies AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+\**************************************************************************/
+
+// This is an internal class used by the SmallChange shapes, and its
+// interface may change without notice.
+
+#include <Inventor/SbBasic.h>
+#include <Inventor/SbVec2f.h>
+#include <Inventor/SbVec3f.h>
+#include <SmallChange/misc/SbList.h>
+
+class SmVBO;
+
+class SmSphereMesh {
+ public:
+  static void initClass(void);
+
+  static SmSphereMesh * ref(const int level);
+  void unref(void);
+
+  int getLevel(void) const;
+  int getNumVertices(void) const;
+  int getNumIndices(void) const;
+  const SbVec3f * getCoords(void) const;
+  const SbVec2f * getTextureCoords(void) const;
+  const int32_t * getIndices(void) const;
+
+  SmVBO * getCoordVBO(void);
+  SmVBO * getTextureCoordVBO(void);
+  SmVBO * getIndexVBO(void);
+
+ private:
+  SmSphereMesh(const int level);
+  ~SmSphereMesh();
+
+  static void cleanup(void);
+  void generate(void);
+  void generateTextureCoords(void);
+
+  int level;
+  int refcount;
+  SbList <SbVec3f> coords;
+  SbList <SbVec2f> texcoords;
+  SbList <int32_t> indices;
+  SmVBO * coordvbo;
+  SmVBO * texcoordvbo;
+  SmVBO * indexvbo;
+};
+
+#endif // SMALLCHANGE_SMSPHEREMESH_H
@@ -0,0 +1,80 @@
+#ifndef SMALLCHANGE_SMVBO_H
+#define SMALLCHANGE_SMVBO_H
+
+/**************************************************************************\
+ * Copyright (c) Kongsberg Oil & Gas Technologies AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+\**************************************************************************/
+
+// This is an internal class used by the SmallChange shapes, and its
+// interface may change without notice.
+
+#include <Inventor/SbBasic.h>
+#include <Inventor/system/gl.h>
+#include <Inventor/C/glue/gl.h>
+#include <SmallChange/misc/SbHash.h>
+
+class SmVBO {
+ public:
+  SmVBO(const GLenum target = GL_ARRAY_BUFFER,
+        const GLenum usage = GL_STATIC_DRAW);
+  ~SmVBO();
+
+  void setBufferData(const GLvoid * data, intptr_t size, uint32_t dataid = 0);  
+  void * allocBufferData(intptr_t size, uint32_t dataid = 0);  
+  uint32_t getBufferDataId(void) const;
+  void getBufferData(const GLvoid *& data, intptr_t & size);
+  void bindBuffer(uint32_t contextid);
+  
+  static void setVertexCountLimits(const int minlimit, const int maxlimit);
+  static int getVertexCountMinLimit(void);
+  static int getVertexCountMaxLimit(void);
+
+  static SbBool shouldCreateVBO(const uint32_t contextid, const int numdata);
+  static GLenum getUsageHint(const uint32_t updatehistory);
+
+ private:
+  static SbBool isVBOFast(const uint32_t contextid);
+  static void context_destruction_cb(uint32_t context, void * userdata);
+  static void vbo_schedule(const uint32_t & key,
+                           const GLuint & value,
+                           void * closure);
+  static void vbo_delete(void * closure, uint32_t contextid);
+  
+  GLenum target;
+  GLenum usage;
+  const GLvoid * data;
+  intptr_t datasize;
+  uint32_t dataid;
+  SbBool didalloc;
+
+  SbHash <GLuint, uint32_t> vbohash;
+};
+#endif // SMALLCHANGE_SMVBO_H
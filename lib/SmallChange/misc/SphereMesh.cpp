@@ -0,0 +1,419 @@
+/**************************************************************************\
+ * Copyright (c) Kongsberg Oil & Gas Technologies AS
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+\**************************************************************************/
+
+/*!
+  \class SmSphereMesh SmallChange/misc/SmSphereMesh.h
+  \brief Unit sphere tessellations shared by the SmallChange shapes.
+
+  The meshes are cached per subdivision level for the whole process
+  and reference counted, so any number of shapes using the same level
+  share one copy of the geometry and one set of buffer objects. The
+  buffer objects are uploaded once for each GL context.
+
+  The tessellation is the same as the one made by HQSphereGenerator:
+  a unit octahedron where each triangle is recursively subdivided
+  into 4 new triangles. Level 1 gives 8 triangles, and each level
+  above that multiplies the number of triangles by 4.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif // HAVE_CONFIG_H
+
+#include <SmallChange/misc/SmSphereMesh.h>
+#include <SmallChange/misc/SmVBO.h>
+#include <SmallChange/misc/SbHash.h>
+
+#include <Inventor/SbBasic.h>
+#include <Inventor/C/tidbits.h>
+#include <Inventor/threads/SbMutex.h>
+
+#include <math.h>
+#include <assert.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif // M_PI
+
+#define SMSPHEREMESH_MAXLEVEL 12
+
+static SmSphereMesh * sphere_meshes[SMSPHEREMESH_MAXLEVEL];
+static SbMutex * sphere_mutex = NULL;
+
+static void
+sphere_lock(void)
+{
+  if (sphere_mutex) sphere_mutex->lock();
+}
+
+static void
+sphere_unlock(void)
+{
+  if (sphere_mutex) sphere_mutex->unlock();
+}
+
+// the key for an edge is its two vertex indices, smallest first
+static uintptr_t
+sphere_edge_hash(const uint64_t & key)
+{
+  return (uintptr_t) ((key >> 32) * 2654435761u) ^ (uintptr_t) (key & 0xffffffff);
+}
+
+// returns the index of the normalized midpoint of the edge between
+// vertex a and b, adding it the first time the edge is seen.
+static int32_t
+sphere_midpoint(SbList <SbVec3f> & coords,
+                SbHash <int32_t, uint64_t> & edges,
+                const int32_t a, const int32_t b)
+{
+  const uint64_t key = (a < b) ?
+    ((uint64_t(a) << 32) | uint64_t(b)) :
+    ((uint64_t(b) << 32) | uint64_t(a));
+
+  int32_t idx;
+  if (edges.get(key, idx)) return idx;
+
+  SbVec3f p = (coords[a] + coords[b]) * 0.5f;
+  float mag = p[0] * p[0] + p[1] * p[1] + p[2] * p[2];
+  if (mag != 0.0f) {
+    mag = (float) (1.0 / sqrt(mag));
+    p[0] *= mag;
+    p[1] *= mag;
+    p[2] *= mag;
+  }
+  idx = coords.getLength();
+  coords.append(p);
+  edges.put(key, idx);
+  return idx;
+}
+
+/*!
+  Initializes the mesh cache. Called by smallchange_init().
+*/
+void
+SmSphereMesh::initClass(void)
+{
+  if (sphere_mutex == NULL) {
+    for (int i = 0; i < SMSPHEREMESH_MAXLEVEL; i++) sphere_meshes[i] = NULL;
+    sphere_mutex = new SbMutex;
+    cc_coin_atexit((coin_atexit_f *) SmSphereMesh::cleanup);
+  }
+}
+
+void
+SmSphereMesh::cleanup(void)
+{
+  // meshes still referenced are freed by their last unref()
+  delete sphere_mutex;
+  sphere_mutex = NULL;
+}
+
+/*!
+  Returns the mesh for \a level, which is clamped to [1, 12], and
+  increments its reference count. The mesh is generated the first
+  time a level is used. Call unref() when the mesh is no longer
+  needed.
+*/
+SmSphereMesh *
+SmSphereMesh::ref(const int level)
+{
+  const int l = SbClamp(level, 1, SMSPHEREMESH_MAXLEVEL);
+  sphere_lock();
+  SmSphereMesh * mesh = sphere_meshes[l-1];
+  if (mesh == NULL) {
+    mesh = new SmSphereMesh(l);
+    sphere_meshes[l-1] = mesh;
+  }
+  mesh->refcount++;
+  sphere_unlock();
+  return mesh;
+}
+
+/*!
+  Decrements the reference count, and deletes the mesh and its
+  buffer objects when it reaches zero.
+*/
+void
+SmSphereMesh::unref(void)
+{
+  sphere_lock();
+  assert(this->refcount > 0);
+  if (--this->refcount == 0) {
+    sphere_meshes[this->level-1] = NULL;
+    delete this;
+  }
+  sphere_unlock();
+}
+
+SmSphereMesh::SmSphereMesh(const int level)
+  : level(level),
+    refcount(0),
+    coordvbo(NULL),
+    texcoordvbo(NULL),
+    indexvbo(NULL)
+{
+  this->generate();
+  this->generateTextureCoords();
+}
+
+SmSphereMesh::~SmSphereMesh()
+{
+  delete this->coordvbo;
+  delete this->texcoordvbo;
+  delete this->indexvbo;
+}
+
+/*!
+  Returns the subdivision level of the mesh.
+*/
+int
+SmSphereMesh::getLevel(void) const
+{
+  return this->level;
+}
+
+/*!
+  Returns the number of vertices in the mesh.
+*/
+int
+SmSphereMesh::getNumVertices(void) const
+{
+  return this->coords.getLength();
+}
+
+/*!
+  Returns the number of triangle indices in the mesh.
+*/
+int
+SmSphereMesh::getNumIndices(void) const
+{
+  return this->indices.getLength();
+}
+
+/*!
+  Returns the vertex coordinates. The sphere has radius 1, so the
+  coordinates can also be used as normals.
+*/
+const SbVec3f *
+SmSphereMesh::getCoords(void) const
+{
+  return this->coords.getArrayPtr();
+}
+
+/*!
+  Returns the texture coordinates, one for each vertex.
+*/
+const SbVec2f *
+SmSphereMesh::getTextureCoords(void) const
+{
+  return this->texcoords.getArrayPtr();
+}
+
+/*!
+  Returns the triangle indices, with counterclockwise ordering seen
+  from outside the sphere.
+*/
+const int32_t *
+SmSphereMesh::getIndices(void) const
+{
+  return this->indices.getArrayPtr();
+}
+
+/*!
+  Returns the buffer object for the vertex coordinates.
+*/
+SmVBO *
+SmSphereMesh::getCoordVBO(void)
+{
+  sphere_lock();
+  if (this->coordvbo == NULL) {
+    this->coordvbo = new SmVBO(GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+    this->coordvbo->setBufferData(this->coords.getArrayPtr(),
+                                  this->coords.getLength() * sizeof(SbVec3f));
+  }
+  sphere_unlock();
+  return this->coordvbo;
+}
+
+/*!
+  Returns the buffer object for the texture coordinates.
+*/
+SmVBO *
+SmSphereMesh::getTextureCoordVBO(void)
+{
+  sphere_lock();
+  if (this->texcoordvbo == NULL) {
+    this->texcoordvbo = new SmVBO(GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+    this->texcoordvbo->setBufferData(this->texcoords.getArrayPtr(),
+                                     this->texcoords.getLength() * sizeof(SbVec2f));
+  }
+  sphere_unlock();
+  return this->texcoordvbo;
+}
+
+/*!
+  Returns the buffer object for the triangle indices.
+*/
+SmVBO *
+SmSphereMesh::getIndexVBO(void)
+{
+  sphere_lock();
+  if (this->indexvbo == NULL) {
+    this->indexvbo = new SmVBO(GL_ELEMENT_ARRAY_BUFFER, GL_STATIC_DRAW);
+    this->indexvbo->setBufferData(this->indices.getArrayPtr(),
+                                  this->indices.getLength() * sizeof(int32_t));
+  }
+  sphere_unlock();
+  return this->indexvbo;
+}
+
+//
+// Subdivides the octahedron directly on indices. The midpoint of
+// each edge is looked up in a hash on the edge's vertex indices, so
+// the vertices come out shared without any point welding.
+//
+void
+SmSphereMesh::generate(void)
+{
+  static const float octahedron[6][3] = {
+    { 1.0f, 0.0f, 0.0f }, { -1.0f, 0.0f, 0.0f },
+    { 0.0f, 1.0f, 0.0f }, { 0.0f, -1.0f, 0.0f },
+    { 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, -1.0f }
+  };
+  static const int32_t octahedron_tris[24] = {
+    0, 4, 2,  2, 4, 1,  1, 4, 3,  3, 4, 0,
+    0, 2, 5,  2, 1, 5,  1, 3, 5,  3, 0, 5
+  };
+
+  const int numtris = 8 << (2 * (this->level - 1));
+  this->coords.truncate(0);
+
+  int i;
+  for (i = 0; i < 6; i++) this->coords.append(SbVec3f(octahedron[i]));
+
+  // the triangles are subdivided back and forth between two lists
+  SbList <int32_t> trilists[2] = { SbList <int32_t>(numtris * 3),
+                                   SbList <int32_t>(numtris * 3) };
+  int curr = 0;
+  for (i = 0; i < 24; i++) trilists[curr].append(octahedron_tris[i]);
+
+  for (int l = 1; l < this->level; l++) {
+    const SbList <int32_t> & tris = trilists[curr];
+    SbList <int32_t> & newtris = trilists[curr ^ 1];
+    const int n = tris.getLength();
+    SbHash <int32_t, uint64_t> edges(n);
+    edges.setHashFunc(sphere_edge_hash);
+    newtris.truncate(0);
+
+    // each triangle [0,1,2] is split into [0,b,a], [b,1,c], [a,b,c]
+    // and [a,c,2], where a = (0+2)/2, b = (0+1)/2 and c = (1+2)/2
+    const int32_t * t = tris.getArrayPtr();
+    for (i = 0; i < n; i += 3) {
+      const int32_t a = sphere_midpoint(this->coords, edges, t[i], t[i+2]);
+      const int32_t b = sphere_midpoint(this->coords, edges, t[i], t[i+1]);
+      const int32_t c = sphere_midpoint(this->coords, edges, t[i+1], t[i+2]);
+
+      newtris.append(t[i]); newtris.append(b); newtris.append(a);
+      newtris.append(b); newtris.append(t[i+1]); newtris.append(c);
+      newtris.append(a); newtris.append(b); newtris.append(c);
+      newtris.append(a); newtris.append(c); newtris.append(t[i+2]);
+    }
+    curr ^= 1;
+  }
+
+  // the subdivision triangles are clockwise, so reverse them
+  const int n = trilists[curr].getLength();
+  const int32_t * t = trilists[curr].getArrayPtr();
+  this->indices.truncate(0);
+  for (i = 0; i < n; i += 3) {
+    this->indices.append(t[i+2]);
+    this->indices.append(t[i+1]);
+    this->indices.append(t[i]);
+  }
+}
+
+void
+SmSphereMesh::generateTextureCoords(void)
+{
+  int i, n;
+  const SbVec3f * pts = this->coords.getArrayPtr();
+  this->texcoords.truncate(0);
+
+  // generate texcoords for all vertices
+  n = this->coords.getLength();
+  for (i = 0; i < n; i++) {
+    SbVec3f pt = pts[i];
+    SbVec2f tc((float) (atan2(pt[0], pt[2]) * (1.0 / (2.0*M_PI)) + 0.5),
+               (float) (atan2(pt[1], sqrt(pt[0]*pt[0] + pt[2]*pt[2])) * (1.0/M_PI) + 0.5));
+
+    tc[0] = SbClamp(tc[0], 0.0f, 1.0f);
+    tc[1] = SbClamp(tc[1], 0.0f, 1.0f);
+    // so that right-side-of-texture can be detected below
+    if (tc[0] >= 0.99999f) tc[0] = 0.0f;
+    this->texcoords.append(tc);
+  }
+
+  // detect triangles that are on the back side of the sphere, on the
+  // right side, with at least one vertex on the right-side-edge of
+  // the texture. Fix texture coordinates for those trianges
+  n = this->indices.getLength();
+  int32_t * iptr = (int32_t*) this->indices.getArrayPtr();
+
+#define FLTCOMPARE(x, y) (fabs((x)-(y)) < 0.000001f)
+
+  SbVec3f p[3];
+  SbVec2f t[3];
+  int j;
+  for (i = 0; i < n; i += 3) {
+    SbBool rightside = FALSE;
+    for (j = 0; j < 3; j++) {
+      p[j] = this->coords[iptr[i+j]];
+      t[j] = this->texcoords[iptr[i+j]];
+      if (p[j][0] > 0.000001f) rightside = TRUE;
+      if (p[j][2] > 0.000001f) break; // not on the back of the sphere
+    }
+    if (rightside && (j == 3) &&
+        (FLTCOMPARE(p[0][0], 0.0f) || FLTCOMPARE(p[1][0], 0.0f) || FLTCOMPARE(p[2][0], 0.0f))) {
+      // just create new vertices for these triangles
+      int len = this->coords.getLength();
+      for (j = 0; j < 3; j++) {
+        iptr[i+j] = len+j;
+        this->coords.append(p[j]);
+        if (t[j][0] <= 0.000001f) t[j][0] = 1.0f;
+        this->texcoords.append(t[j]);
+      }
+    }
+  }
+#undef FLTCOMPARE
+}
+
+#undef SMSPHEREMESH_MAXLEVEL
@@ -0,0 +1,321 @@
+/**************************************************************************\
+ * Copyright (c) Kongsberg Oil & Gas Technologies AS
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+\**************************************************************************/
+
+/*!
+  \class SmVBO SmallChange/misc/SmVBO.h
+  \brief Vertex buffer object wrapper shared by the SmallChange shapes.
+
+  Keeps one GL buffer per context for the same data, and schedules
+  the buffers for deletion when the data changes or the object is
+  destructed.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif // HAVE_CONFIG_H
+
+#include <SmallChange/misc/SmVBO.h>
+
+#include <Inventor/C/glue/gl.h>
+#include <Inventor/C/tidbits.h>
+#include <Inventor/elements/SoGLCacheContextElement.h>
+#include <Inventor/misc/SoContextHandler.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+static int vbo_vertex_count_min_limit = -1;
+static int vbo_vertex_count_max_limit = -1;
+
+/*!
+  Constructor
+*/
+SmVBO::SmVBO(const GLenum target, const GLenum usage)
+  : target(target),
+    usage(usage),
+    data(NULL),
+    datasize(0),
+    dataid(0),
+    didalloc(FALSE),
+    vbohash(5)
+{
+  SoContextHandler::addContextDestructionCallback(context_destruction_cb, this);
+}
+
+
+/*!
+  Destructor
+*/
+SmVBO::~SmVBO()
+{
+  SoContextHandler::removeContextDestructionCallback(context_destruction_cb, this);
+  // schedule delete for all allocated GL resources
+  this->vbohash.apply(vbo_schedule, NULL);
+  if (this->didalloc) {
+    char * ptr = (char*) this->data;
+    delete[] ptr;
+  }
+}
+
+/*!
+  Used to allocate buffer data. The user is responsible for filling in
+  the correct type of data in the buffer before the buffer is used.
+
+  \sa setBufferData()
+*/
+void *
+SmVBO::allocBufferData(intptr_t size, uint32_t dataid)
+{
+  // schedule delete for all allocated GL resources
+  this->vbohash.apply(vbo_schedule, NULL);
+  // clear hash table
+  this->vbohash.clear();
+
+  if (this->didalloc && this->datasize == size) {
+    return (void*)this->data;
+  }
+  if (this->didalloc) {
+    char * ptr = (char*) this->data;
+    delete[] ptr;
+  }
+
+  char * ptr = new char[size];
+  this->didalloc = TRUE;
+  this->data = (const GLvoid*) ptr;
+  this->datasize = size;
+  this->dataid = dataid;
+  return (void*) this->data;
+}
+
+/*!
+  Sets the buffer data. \a dataid is a unique id used to identify 
+  the buffer data. In Coin it's possible to use the node id
+  (SoNode::getNodeId()) to test if a buffer is valid for a node.
+*/
+void 
+SmVBO::setBufferData(const GLvoid * data, intptr_t size, uint32_t dataid)
+{
+  // schedule delete for all allocated GL resources
+  this->vbohash.apply(vbo_schedule, NULL);
+  // clear hash table
+  this->vbohash.clear();
+
+  // clean up old buffer (if any)
+  if (this->didalloc) {
+    char * ptr = (char*) this->data;
+    delete[] ptr;
+  }
+  
+  this->data = data;
+  this->datasize = size;
+  this->dataid = dataid;
+  this->didalloc = FALSE;
+}
+
+/*!
+  Returns the buffer data id. 
+  
+  \sa setBufferData()
+*/
+uint32_t 
+SmVBO::getBufferDataId(void) const
+{
+  return this->dataid;
+}
+
+/*!
+  Returns the data pointer and size.
+*/
+void 
+SmVBO::getBufferData(const GLvoid *& data, intptr_t & size)
+{
+  data = this->data;
+  size = this->datasize;
+}
+
+
+/*!
+  Binds the buffer for the context \a contextid.
+*/
+void 
+SmVBO::bindBuffer(uint32_t contextid)
+{
+  if ((this->data == NULL) ||
+      (this->datasize == 0)) {
+    assert(0 && "no data in buffer");
+    return;
+  }
+
+  const cc_glglue * glue = cc_glglue_instance((int) contextid);
+
+  GLuint buffer;
+  if (!this->vbohash.get(contextid, buffer)) {
+    // need to create a new buffer for this context
+    cc_glglue_glGenBuffers(glue, 1, &buffer);
+    cc_glglue_glBindBuffer(glue, this->target, buffer);
+    cc_glglue_glBufferData(glue, this->target,
+                           this->datasize,
+                           this->data,
+                           this->usage);
+    this->vbohash.put(contextid, buffer);
+  }
+  else {
+    // buffer already exists, bind it
+    cc_glglue_glBindBuffer(glue, this->target, buffer);
+  }
+}
+
+//
+// Callback from SbHash
+//
+void 
+SmVBO::vbo_schedule(const uint32_t & key,
+                    const GLuint & value,
+                    void * closure)
+{
+  void * ptr = (void*) ((uintptr_t) value);
+  SoGLCacheContextElement::scheduleDeleteCallback(key, vbo_delete, ptr);
+}
+
+//
+// Callback from SoGLCacheContextElement
+//
+void 
+SmVBO::vbo_delete(void * closure, uint32_t contextid)
+{
+  const cc_glglue * glue = cc_glglue_instance((int) contextid);
+  GLuint id = (GLuint) ((uintptr_t) closure);
+  cc_glglue_glDeleteBuffers(glue, 1, &id);
+}
+
+//
+// Callback from SoContextHandler
+//
+void 
+SmVBO::context_destruction_cb(uint32_t context, void * userdata)
+{
+  GLuint buffer;
+  SmVBO * thisp = (SmVBO*) userdata;
+
+  if (thisp->vbohash.get(context, buffer)) {
+    const cc_glglue * glue = cc_glglue_instance((int) context);
+    cc_glglue_glDeleteBuffers(glue, 1, &buffer);    
+    thisp->vbohash.remove(context);
+  }
+}
+
+
+/*!
+  Sets the global limits on the number of vertex data in a node before
+  vertex buffer objects are considered to be used for rendering.
+*/
+void 
+SmVBO::setVertexCountLimits(const int minlimit, const int maxlimit)
+{
+  vbo_vertex_count_min_limit = minlimit;
+  vbo_vertex_count_max_limit = maxlimit;
+}
+
+/*!
+  Returns the vertex VBO minimum limit.
+
+  \sa setVertexCountLimits()
+ */
+int 
+SmVBO::getVertexCountMinLimit(void)
+{
+  if (vbo_vertex_count_min_limit < 0) {
+    const char * env = coin_getenv("COIN_VBO_MIN_LIMIT");
+    if (env) {
+      vbo_vertex_count_min_limit = atoi(env);
+    }
+    else {
+      vbo_vertex_count_min_limit = 40;
+    }
+  } 
+  return vbo_vertex_count_min_limit;
+}
+
+/*!
+  Returns the vertex VBO maximum limit.
+
+  \sa setVertexCountLimits()
+ */
+int 
+SmVBO::getVertexCountMaxLimit(void)
+{
+  if (vbo_vertex_count_max_limit < 0) {
+    const char * env = coin_getenv("COIN_VBO_MAX_LIMIT");
+    if (env) {
+      vbo_vertex_count_max_limit = atoi(env);
+    }
+    else {
+      vbo_vertex_count_max_limit = 10000000;
+    }
+  }
+  return vbo_vertex_count_max_limit;
+}
+
+SbBool 
+SmVBO::shouldCreateVBO(const uint32_t contextid, const int numdata)
+{
+  int minv = SmVBO::getVertexCountMinLimit();
+  int maxv = SmVBO::getVertexCountMaxLimit();
+  return (numdata >= minv) && (numdata <= maxv) && SmVBO::isVBOFast(contextid);
+}
+
+/*!
+  Returns a buffer usage hint based on how often the data has been
+  updated. \a updatehistory has one bit per render, with the most
+  recent render in the lowest bit, set if the data changed before
+  that render. The last 8 renders are considered. Data updated for
+  every render is GL_STREAM_DRAW, data updated at most once is
+  GL_STATIC_DRAW, and anything in between is GL_DYNAMIC_DRAW.
+*/
+GLenum
+SmVBO::getUsageHint(const uint32_t updatehistory)
+{
+  int count = 0;
+  for (int i = 0; i < 8; i++) {
+    if (updatehistory & (1 << i)) count++;
+  }
+  if (count == 8) return GL_STREAM_DRAW;
+  if (count > 1) return GL_DYNAMIC_DRAW;
+  return GL_STATIC_DRAW;
+}
+
+SbBool 
+SmVBO::isVBOFast(const uint32_t contextid)
+{
+  return TRUE;
+}
+
@@ -89,48 +89,6 @@
 #include <math.h>
 #include <stdlib.h>
 
-static int vbo_vertex_count_min_limit = -1;
-static int vbo_vertex_count_max_limit = -1;
-
-class SmVBO {
- public:
-  SmVBO(const GLenum target = GL_ARRAY_BUFFER,
-        const GLenum usage = GL_STATIC_DRAW);
-  ~SmVBO();
-
-  static void init(void);
-  
-  void setBufferData(const GLvoid * data, intptr_t size, uint32_t dataid = 0);  
-  void * allocBufferData(intptr_t size, uint32_t dataid = 0);  
-  uint32_t getBufferDataId(void) const;
-  void getBufferData(const GLvoid *& data, intptr_t & size);
-  void bindBuffer(uint32_t contextid);
-  
-  static void setVertexCountLimits(const int minlimit, const int maxlimit);
-  static int getVertexCountMinLimit(void);
-  static int getVertexCountMaxLimit(void);
-
-  static void testGLPerformance(const uint32_t contextid);
-  static SbBool shouldCreateVBO(const uint32_t contextid, const int numdata);
-
- private:
-  static void context_created(const cc_glglue * glue, void * closure);
-  static SbBool isVBOFast(const uint32_t contextid);
-  static void context_destruction_cb(uint32_t context, void * userdata);
-  static void vbo_schedule(const uint32_t & key,
-                           const GLuint & value,
-                           void * closure);
-  static void vbo_delete(void * closure, uint32_t contextid);
-  
-  GLenum target;
-  GLenum usage;
-  const GLvoid * data;
-  intptr_t datasize;
-  uint32_t dataid;
-  SbBool didalloc;
-
-  SbHash <GLuint, uint32_t> vbohash;
-};
 
 class SmOceanKitP {
 public:
@@ -151,7 +109,10 @@ public:
   static void preShaderCB(void * closure, SoAction * action);
   OceanShape(void);
   float getElevation(float x, float y);
+  void getElevations(const SbVec2f * points, const int num,
+                     float * elevations, SbVec3f * normals);
   SbMatrix lastModelMatrix;
+  SbMatrix lastInverseMatrix;
 
   SoSFVec2f size;
   SoSFFloat chop;
@@ -200,8 +161,15 @@ private:
   void createTexScene();
   void updateShader(void);
   void renderGrid(ocean_quadnode * node, const int bitmask);
+  void renderPatches(const cc_glglue * glue, const uint32_t contextid);
+  void allocSlot(ocean_quadnode * node);
+  void clearSlots(void);
+  static void deleteBufferCB(void * closure, uint32_t contextid);
   void renderOutline(ocean_quadnode * node, const int bitmask);
   void wavefunc(const SbVec3f & in, SbVec3f &v, SbVec3f &n);
+  void evaluateWaves(const SbVec3f * in, const int num,
+                     SbVec3f * v, SbVec3f * n);
+  void updateWaveCoefficients(void);
   void updateQuadtree(SoState * state);
   ocean_quadnode * root;
   SbList <ocean_quadnode*> nodelist;
@@ -269,13 +237,28 @@ public:
 
 private:
   SbVec3f * grid;
-  SmVBO * gridvbo;
-  SmVBO * idxvbo[16];
   unsigned short * grididx[16];
   int idxlen[16];
   int minlevel;
   int maxlevel;
 
+  // All patches share one vertex buffer, with GRIDSIZE*GRIDSIZE
+  // vertices for each quadtree node in a slot. The slot of a node is
+  // uploaded once when the node is created, and the visible patches
+  // are drawn with one glDrawElements() call.
+  SbVec3f * poolverts;
+  int poolcapacity; // in slots
+  int poolused;
+  SbList <int> freeslots;
+  SbList <int> dirtyslots;
+  SbList <int> drawkeys;
+  SbList <int> newdrawkeys;
+  SbList <uint32_t> drawindices;
+  uint32_t poolcontext;
+  GLuint poolbuffer;
+  GLuint indexbuffer;
+  int poolbuffercapacity;
+
   typedef struct {
     float chop;
     float gravConst;
@@ -333,6 +316,23 @@ private:
 
   geowave geowaves[4];
 
+  // per-frame constants for evaluating the geometric waves on the
+  // CPU, in structure of arrays form
+  typedef struct {
+    float dirx[NUM_GEO_WAVES];
+    float diry[NUM_GEO_WAVES];
+    float freq[NUM_GEO_WAVES];
+    float phase[NUM_GEO_WAVES];
+    float amp[NUM_GEO_WAVES];
+    float qampx[NUM_GEO_WAVES];    // Q * amp * dir[0]
+    float qampy[NUM_GEO_WAVES];    // Q * amp * dir[1]
+    float freqampx[NUM_GEO_WAVES]; // freq * amp * dir[0]
+    float freqampy[NUM_GEO_WAVES]; // freq * amp * dir[1]
+    float qfreqamp[NUM_GEO_WAVES]; // Q * freq * amp
+  } wavecoef;
+
+  wavecoef wavecoefs;
+
   typedef struct {
     float phase;
     float amp;
@@ -416,7 +416,7 @@ private:
   unsigned char neighbor_rotate_bits;
   unsigned char flags;
 
-  GLuint gridvbo;
+  int slot;
 
 private:
   friend class OceanShape;
@@ -425,7 +425,7 @@ private:
   void setNeighborRotate(const int i, const int rot);
   int getNeighborRotate(const int i) const;
   void unsplit(void);
-  void deleteHiddenChildren(const cc_glglue * glue);
+  void deleteHiddenChildren(SbList <int> & freeslots);
 
 public:
   float debugcolor[3];
@@ -544,6 +544,7 @@ SmOceanKit::SmOceanKit(void)
 //   cube->depth = 500.0;
 
   shape->lastModelMatrix.makeIdentity();
+  shape->lastInverseMatrix.makeIdentity();
 }
 
 /*!
@@ -602,6 +603,11 @@ SmOceanKit::setDefaultOnNonWritingFields(void)
   this->oceanShape.setDefault(TRUE);
 }
 
+/*!
+  Returns the elevation of the ocean surface at (\a x, \a y).
+
+  \sa getElevations()
+*/
 float
 SmOceanKit::getElevation(float x, float y)
 {
@@ -614,6 +620,34 @@ SmOceanKit::getElevation(float x, float y)
     return 0.0;
 }
 
+/*!
+  Returns the elevation of the ocean surface for \a num points in
+  \a elevations. This is much faster than calling getElevation() for
+  each point, and should be used when many objects are placed on the
+  water each frame.
+
+  If \a normals is not NULL, the unit surface normals at the points
+  are returned there too.
+
+  \sa getElevation()
+*/
+void
+SmOceanKit::getElevations(const SbVec2f * points, const int num,
+                          float * elevations, SbVec3f * normals)
+{
+  if (this->enableEffects.getValue()) {
+    OceanShape * shape = (OceanShape*) this->getAnyPart("oceanShape", TRUE);
+    assert(shape);
+    shape->getElevations(points, num, elevations, normals);
+  }
+  else {
+    for (int i = 0; i < num; i++) {
+      elevations[i] = 0.0f;
+      if (normals) normals[i].setValue(0.0f, 0.0f, 1.0f);
+    }
+  }
+}
+
 
 //********************************************************************************************
 
@@ -765,8 +799,6 @@ OceanShape::OceanShape()
                                 0.0f);
     }
   }
-  this->gridvbo = new SmVBO(GL_ARRAY_BUFFER, GL_STATIC_DRAW);
-  this->gridvbo->setBufferData(this->grid, GRIDSIZE*GRIDSIZE*3*sizeof(float));
   int size = (GRIDSIZE/2)*(GRIDSIZE/2)*3*8;
   
   for (i = 0; i < 16; i++) {
@@ -779,9 +811,15 @@ OceanShape::OceanShape()
       }
     }
     this->idxlen[i] = ptr-orgptr;
-    this->idxvbo[i] = new SmVBO(GL_ELEMENT_ARRAY_BUFFER, GL_STATIC_DRAW);
-    this->idxvbo[i]->setBufferData(this->grididx[i], this->idxlen[i]*sizeof(short));    
   }
+
+  this->poolverts = NULL;
+  this->poolcapacity = 0;
+  this->poolused = 0;
+  this->poolcontext = 0;
+  this->poolbuffer = 0;
+  this->indexbuffer = 0;
+  this->poolbuffercapacity = 0;
 }
 
 OceanShape::~OceanShape()
@@ -804,11 +842,16 @@ OceanShape::~OceanShape()
 
   delete this->root;
   delete[] this->grid;
-  delete this->gridvbo;
+  delete[] this->poolverts;
+  if (this->poolbuffer) {
+    SoGLCacheContextElement::scheduleDeleteCallback(this->poolcontext, deleteBufferCB,
+                                                    (void*) ((uintptr_t) this->poolbuffer));
+    SoGLCacheContextElement::scheduleDeleteCallback(this->poolcontext, deleteBufferCB,
+                                                    (void*) ((uintptr_t) this->indexbuffer));
+  }
 
   for (int i = 0; i < 16; i++) {
     delete[] this->grididx[i];
-    delete this->idxvbo[i];
   }
 
   numnodes--;
@@ -887,6 +930,7 @@ OceanShape::tick()
     this->updateWaves((t - this->currtime).getValue());
     this->updateShader();
   }
+  this->updateWaveCoefficients();
   this->currtime = t;
 }
 
@@ -923,20 +967,18 @@ OceanShape::updateQuadtree(SoState * state)
   SbVec2f s = this->size.getValue();
   const SbMatrix & mat = SoModelMatrixElement::get(state);
   this->lastModelMatrix = mat;
+  this->lastInverseMatrix = mat.inverse();
   const SbViewVolume & vv = SoViewVolumeElement::get(state);
 
-  uint32_t contextid = SoGLCacheContextElement::get(state);
-  const cc_glglue * glue = cc_glglue_instance(contextid);
-
   SbVec3f pos = vv.getProjectionPoint();
   // move camera position to object space
-  mat.inverse().multVecMatrix(pos, pos);
+  this->lastInverseMatrix.multVecMatrix(pos, pos);
 
   if (this->root) {
     this->root->clearNeighbors();
     this->root->unsplit();
     this->root->distanceSplit(pos, 1, this->minlevel, this->maxlevel);
-    this->root->deleteHiddenChildren(glue);
+    this->root->deleteHiddenChildren(this->freeslots);
   }
   else {
     this->root = new (node_memalloc) ocean_quadnode(NULL,
@@ -997,51 +1039,7 @@ OceanShape::GLRender(SoGLRenderAction * action)
       cc_glglue_has_arb_fragment_program(glue) &&
       cc_glglue_has_arb_vertex_program(glue)) {
 
-    this->gridvbo->bindBuffer((uint32_t) contextid);
-    cc_glglue_glEnableClientState(glue, GL_VERTEX_ARRAY);
-    cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0, NULL);
-    
-    for (int i = 0; i < nodelist.getLength(); i++) {
-      ocean_quadnode * node = this->nodelist[i];
-      int mask = node->getNodeBitmask();
-      const SbVec3f * corners = node->getCorners();
-      SbVec3f scale = corners[2] - corners[0];
-      if (!node->gridvbo) {
-        SbMatrix m;
-        m.setScale(scale);
-        SbMatrix m2;
-        m2.setTranslate(corners[0]);
-        m.multRight(m2);
-        
-        int i = 0;
-        for (int y = 0; y < GRIDSIZE; y++) {
-          float fy = float(y) / float(GRIDSIZE-1);
-          for (int x = 0; x < GRIDSIZE; x++) {
-            float fx = float(x) / float(GRIDSIZE-1);
-            SbVec3f tmp(fx, fy, 0.0f);
-            m.multVecMatrix(tmp, tmp);
-            this->grid[i++] = tmp;
-          }
-        }
-        cc_glglue_glGenBuffers(glue, 1, &node->gridvbo);
-        cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, node->gridvbo);
-        cc_glglue_glBufferData(glue, GL_ARRAY_BUFFER, i*sizeof(SbVec3f),
-                               this->grid,
-                               GL_STATIC_DRAW); 
-      }
-      else {
-        cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, node->gridvbo);
-      }
-      cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0, NULL);
-      this->idxvbo[mask]->bindBuffer(contextid);
-      cc_glglue_glDrawElements(glue,
-                               GL_TRIANGLES,
-                               this->idxlen[mask],
-                               GL_UNSIGNED_SHORT, NULL);
-    }
-    cc_glglue_glDisableClientState(glue, GL_VERTEX_ARRAY);
-    cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, 0);
-    cc_glglue_glBindBuffer(glue, GL_ELEMENT_ARRAY_BUFFER, 0);
+    this->renderPatches(glue, contextid);
   }
   else {
     for (int i = 0; i < nodelist.getLength(); i++) {
@@ -1055,6 +1053,152 @@ OceanShape::GLRender(SoGLRenderAction * action)
 }
 
 
+//
+// Renders all visible patches from the shared vertex buffer.
+//
+void
+OceanShape::renderPatches(const cc_glglue * glue, const uint32_t contextid)
+{
+  int i;
+  const int num = this->nodelist.getLength();
+  this->newdrawkeys.truncate(0);
+  for (i = 0; i < num; i++) {
+    ocean_quadnode * node = this->nodelist[i];
+    if (node->slot < 0) this->allocSlot(node);
+    this->newdrawkeys.append((node->slot << 4) | node->getNodeBitmask());
+  }
+
+  SbBool newindices = this->newdrawkeys.getLength() != this->drawkeys.getLength();
+  for (i = 0; !newindices && i < num; i++) {
+    if (this->newdrawkeys[i] != this->drawkeys[i]) newindices = TRUE;
+  }
+
+  if (this->poolbuffer && this->poolcontext != contextid) {
+    SoGLCacheContextElement::scheduleDeleteCallback(this->poolcontext, deleteBufferCB,
+                                                    (void*) ((uintptr_t) this->poolbuffer));
+    SoGLCacheContextElement::scheduleDeleteCallback(this->poolcontext, deleteBufferCB,
+                                                    (void*) ((uintptr_t) this->indexbuffer));
+    this->poolbuffer = 0;
+  }
+  if (this->poolbuffer == 0) {
+    cc_glglue_glGenBuffers(glue, 1, &this->poolbuffer);
+    cc_glglue_glGenBuffers(glue, 1, &this->indexbuffer);
+    this->poolcontext = contextid;
+    this->poolbuffercapacity = 0;
+    newindices = TRUE;
+  }
+
+  const int slotsize = GRIDSIZE*GRIDSIZE;
+  cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, this->poolbuffer);
+  if (this->poolbuffercapacity < this->poolcapacity) {
+    // the pool has grown, upload all of it
+    cc_glglue_glBufferData(glue, GL_ARRAY_BUFFER,
+                           this->poolcapacity * slotsize * sizeof(SbVec3f),
+                           this->poolverts, GL_DYNAMIC_DRAW);
+    this->poolbuffercapacity = this->poolcapacity;
+  }
+  else {
+    for (i = 0; i < this->dirtyslots.getLength(); i++) {
+      const int slot = this->dirtyslots[i];
+      cc_glglue_glBufferSubData(glue, GL_ARRAY_BUFFER,
+                                slot * slotsize * sizeof(SbVec3f),
+                                slotsize * sizeof(SbVec3f),
+                                this->poolverts + slot * slotsize);
+    }
+  }
+  this->dirtyslots.truncate(0);
+
+  cc_glglue_glBindBuffer(glue, GL_ELEMENT_ARRAY_BUFFER, this->indexbuffer);
+  if (newindices) {
+    // the set of visible patches has changed, rebuild the indices
+    this->drawindices.truncate(0);
+    for (i = 0; i < num; i++) {
+      const int key = this->newdrawkeys[i];
+      const int mask = key & 0xf;
+      const uint32_t offset = (uint32_t) (key >> 4) * slotsize;
+      const unsigned short * idx = this->grididx[mask];
+      for (int j = 0; j < this->idxlen[mask]; j++) {
+        this->drawindices.append(offset + idx[j]);
+      }
+    }
+    if (this->drawindices.getLength()) {
+      cc_glglue_glBufferData(glue, GL_ELEMENT_ARRAY_BUFFER,
+                             this->drawindices.getLength() * sizeof(uint32_t),
+                             this->drawindices.getArrayPtr(), GL_DYNAMIC_DRAW);
+    }
+    // swap the key lists
+    this->drawkeys.truncate(0);
+    for (i = 0; i < num; i++) this->drawkeys.append(this->newdrawkeys[i]);
+  }
+
+  if (this->drawindices.getLength()) {
+    cc_glglue_glEnableClientState(glue, GL_VERTEX_ARRAY);
+    cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0, NULL);
+    cc_glglue_glDrawElements(glue, GL_TRIANGLES, this->drawindices.getLength(),
+                             GL_UNSIGNED_INT, NULL);
+    cc_glglue_glDisableClientState(glue, GL_VERTEX_ARRAY);
+  }
+  cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, 0);
+  cc_glglue_glBindBuffer(glue, GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+//
+// Gives the node a slot in the vertex pool, and fills in its grid.
+//
+void
+OceanShape::allocSlot(ocean_quadnode * node)
+{
+  const int slotsize = GRIDSIZE*GRIDSIZE;
+  int slot;
+  if (this->freeslots.getLength()) {
+    slot = this->freeslots.pop();
+  }
+  else {
+    if (this->poolused == this->poolcapacity) {
+      const int newcapacity = SbMax(this->poolcapacity * 2, 64);
+      SbVec3f * newverts = new SbVec3f[newcapacity * slotsize];
+      for (int i = 0; i < this->poolused * slotsize; i++) {
+        newverts[i] = this->poolverts[i];
+      }
+      delete[] this->poolverts;
+      this->poolverts = newverts;
+      this->poolcapacity = newcapacity;
+    }
+    slot = this->poolused++;
+  }
+  node->slot = slot;
+
+  const SbVec3f * corners = node->getCorners();
+  const SbVec3f scale = corners[2] - corners[0];
+  SbVec3f * dst = this->poolverts + slot * slotsize;
+  for (int i = 0; i < slotsize; i++) {
+    const SbVec3f & g = this->grid[i];
+    dst[i].setValue(corners[0][0] + g[0] * scale[0],
+                    corners[0][1] + g[1] * scale[1],
+                    corners[0][2]);
+  }
+  // uploaded in renderPatches(), unless the whole pool is uploaded anyway
+  if (this->poolbuffercapacity == this->poolcapacity) this->dirtyslots.append(slot);
+}
+
+// Releases all slots. Called when the quadtree is deleted.
+void
+OceanShape::clearSlots(void)
+{
+  this->poolused = 0;
+  this->freeslots.truncate(0);
+  this->dirtyslots.truncate(0);
+  this->drawkeys.truncate(0);
+}
+
+void
+OceanShape::deleteBufferCB(void * closure, uint32_t contextid)
+{
+  const cc_glglue * glue = cc_glglue_instance((int) contextid);
+  GLuint buffer = (GLuint) ((uintptr_t) closure);
+  cc_glglue_glDeleteBuffers(glue, 1, &buffer);
+}
+
 void
 OceanShape::renderOutline(ocean_quadnode * node, const int bitmask) 
 {
@@ -1111,16 +1255,21 @@ OceanShape::renderGrid(ocean_quadnode * node, const int bitmask)
   unsigned short * iptr = this->grididx[bitmask];
   int len = this->idxlen[bitmask];
 
+  // evaluate the whole grid once, since most vertices are shared
+  // by several triangles
+  SbVec3f in[GRIDSIZE*GRIDSIZE];
+  SbVec3f v[GRIDSIZE*GRIDSIZE];
+  SbVec3f n[GRIDSIZE*GRIDSIZE];
+  for (int i = 0; i < GRIDSIZE*GRIDSIZE; i++) {
+    m.multVecMatrix(this->grid[i], in[i]);
+  }
+  this->evaluateWaves(in, GRIDSIZE*GRIDSIZE, v, n);
+
   glBegin(GL_TRIANGLES);
-  SbVec3f v0,v,n;
   while (len--) {
     int idx = *iptr++;
-    // fprintf(stderr,"idx: %d\n", idx);
-    v0 = this->grid[idx];
-    m.multVecMatrix(v0,v0);
-    this->wavefunc(v0, v, n);
-    glNormal3fv(n.getValue());
-    glVertex3fv(v.getValue());
+    glNormal3fv(n[idx].getValue());
+    glVertex3fv(v[idx].getValue());
   }
   glEnd();
 }
@@ -1194,6 +1343,7 @@ OceanShape::notify(SoNotList * list)
   if (f == &this->size) {
     delete this->root;
     this->root = NULL;
+    this->clearSlots();
   }
   inherited::notify(list);
 }
@@ -1250,7 +1400,7 @@ ocean_quadnode::ocean_quadnode(ocean_quadnode * parent,
       this->debugcolor[i] = val;
     }
   }
-  this->gridvbo = 0;
+  this->slot = -1;
 }
 
 ocean_quadnode::~ocean_quadnode(void)
@@ -1345,14 +1495,12 @@ ocean_quadnode::unsplit(void)
 }
 
 void 
-ocean_quadnode::deleteHiddenChildren(const cc_glglue * glue)
+ocean_quadnode::deleteHiddenChildren(SbList <int> & freeslots)
 {
   if (!this->isSplit() && this->hasChildren()) {
     for (int i = 0; i < 4; i++) {
-      this->child[i]->deleteHiddenChildren(glue);
-      if (this->child[i]->gridvbo) {
-        cc_glglue_glDeleteBuffers(glue, 1, &this->child[i]->gridvbo);
-      }
+      this->child[i]->deleteHiddenChildren(freeslots);
+      if (this->child[i]->slot >= 0) freeslots.append(this->child[i]->slot);
       delete this->child[i];
       this->child[i] = NULL;
     }
@@ -2104,55 +2252,134 @@ OceanShape::updateTextureParameters(SoState * state)
   this->texparam_scalebias->value = scaleBiasVec;
 }
 
-void OceanShape::wavefunc(const SbVec3f & in, SbVec3f & v, SbVec3f & n) 
-{
-  SbVec3f tv(in[0], in[1], 0.0f);
-  SbVec3f tn(0.0f, 0.0f, 1.0f);
-
-  float Q[NUM_GEO_WAVES];
-  int i;
-  for (i = 0; i < NUM_GEO_WAVES; i++) {
-    if (this->geowaves[i].amp > 0.01f) {
-      Q[i] = this->geostate_cache.Q / (this->geowaves[i].freq * this->geowaves[i].amp * float(NUM_GEO_WAVES));
-    }
-    else {
-      Q[i] = 0.0f;
-    }
-    Q[i] = this->geostate_cache.Q / (this->geowaves[i].freq * this->geowaves[i].fullamp * float(NUM_GEO_WAVES));
+//
+// Computes sin() and cos() for num floats. Written without branches,
+// so that the compiler can vectorize the loop. The argument is reduced
+// to [-pi/4, pi/4] in three steps, to keep the error below 1e-7 for the
+// large phase values that occur far from the ocean origin.
+//
+static void
+ocean_sincos(const float * x, float * s, float * c, const int num)
+{
+  for (int i = 0; i < num; i++) {
+    const float xi = x[i];
+    // nearest multiple of pi/2
+    const int j = (int) (xi * 0.63661977236758134f + (xi >= 0.0f ? 0.5f : -0.5f));
+    const float fj = (float) j;
+    const float r = ((xi - fj * 1.5703125f) - fj * 4.837512969970703125e-4f) -
+      fj * 7.549789948768648e-8f;
+    const float r2 = r * r;
+    const float sr = r + r * r2 * (-1.6666654611e-1f + r2 * (8.3321608736e-3f +
+                                                            r2 * -1.9515295891e-4f));
+    const float cr = 1.0f - 0.5f * r2 + r2 * r2 * (4.166664568298827e-2f + r2 *
+                                                   (-1.388731625493765e-3f +
+                                                    r2 * 2.443315711809948e-5f));
+    const int q = j & 3;
+    const float ss = (q & 1) ? cr : sr;
+    const float cc = (q & 1) ? sr : cr;
+    s[i] = (q & 2) ? -ss : ss;
+    c[i] = ((q + 1) & 2) ? -cc : cc;
   }
+}
 
-  for (i = 0; i < NUM_GEO_WAVES; i++) {
+//
+// Updates the wave constants used by evaluateWaves(). Called once per
+// frame from tick(), after the waves have been animated.
+//
+void
+OceanShape::updateWaveCoefficients(void)
+{
+  wavecoef & wc = this->wavecoefs;
+  for (int i = 0; i < NUM_GEO_WAVES; i++) {
+    const geowave & w = this->geowaves[i];
+    // uses the full amplitude, not the faded one, to match the shader
+    // parameters set in updateParameters()
+    const float Q = this->geostate_cache.Q / (w.freq * w.fullamp * float(NUM_GEO_WAVES));
+    wc.dirx[i] = w.dir[0];
+    wc.diry[i] = w.dir[1];
+    wc.freq[i] = w.freq;
+    wc.phase[i] = w.phase;
+    wc.amp[i] = w.amp;
+    wc.qampx[i] = Q * w.amp * w.dir[0];
+    wc.qampy[i] = Q * w.amp * w.dir[1];
+    wc.freqampx[i] = w.freq * w.amp * w.dir[0];
+    wc.freqampy[i] = w.freq * w.amp * w.dir[1];
+    wc.qfreqamp[i] = Q * w.freq * w.amp;
+  }
+}
 
-    float dot = this->geowaves[i].dir[0] * in[0] + this->geowaves[i].dir[1] * in[1];
-    float cossinval = (float) (dot *
-                               this->geowaves[i].freq + 
-                               this->geowaves[i].phase);
-    
-    float cosval = (float) cos(cossinval);
-    float sinval = (float) sin(cossinval);
+#define OCEAN_BLOCKSIZE 64
 
-    tv[0] += Q[i]*this->geowaves[i].amp*this->geowaves[i].dir[0] * cosval;
-    tv[1] += Q[i]*this->geowaves[i].amp*this->geowaves[i].dir[1] * cosval;
-    tv[2] += this->geowaves[i].amp * sinval;
+//
+// Evaluates the Gerstner waves for num points, returning the displaced
+// points in v and the unit normals in n (which may be NULL). The
+// points are processed in blocks, and the sin/cos values for each wave
+// are computed for a whole block at a time. The normals are computed
+// the same way as in the vertex shader, from the undisplaced points.
+//
+void
+OceanShape::evaluateWaves(const SbVec3f * in, const int num,
+                          SbVec3f * v, SbVec3f * n)
+{
+  const wavecoef & wc = this->wavecoefs;
+  float arg[OCEAN_BLOCKSIZE];
+  float sinval[OCEAN_BLOCKSIZE];
+  float cosval[OCEAN_BLOCKSIZE];
+  float px[OCEAN_BLOCKSIZE], py[OCEAN_BLOCKSIZE], pz[OCEAN_BLOCKSIZE];
+  float nx[OCEAN_BLOCKSIZE], ny[OCEAN_BLOCKSIZE], nz[OCEAN_BLOCKSIZE];
+
+  for (int start = 0; start < num; start += OCEAN_BLOCKSIZE) {
+    const int cnt = SbMin(num - start, (int) OCEAN_BLOCKSIZE);
+    const SbVec3f * src = in + start;
+    int k;
+    for (k = 0; k < cnt; k++) {
+      px[k] = src[k][0];
+      py[k] = src[k][1];
+      pz[k] = 0.0f;
+      nx[k] = 0.0f;
+      ny[k] = 0.0f;
+      nz[k] = 1.0f;
+    }
+    for (int i = 0; i < NUM_GEO_WAVES; i++) {
+      const float fx = wc.dirx[i] * wc.freq[i];
+      const float fy = wc.diry[i] * wc.freq[i];
+      const float phase = wc.phase[i];
+      for (k = 0; k < cnt; k++) {
+        arg[k] = src[k][0] * fx + src[k][1] * fy + phase;
+      }
+      ocean_sincos(arg, sinval, cosval, cnt);
+
+      const float qampx = wc.qampx[i];
+      const float qampy = wc.qampy[i];
+      const float amp = wc.amp[i];
+      const float freqampx = wc.freqampx[i];
+      const float freqampy = wc.freqampy[i];
+      const float qfreqamp = wc.qfreqamp[i];
+      for (k = 0; k < cnt; k++) {
+        px[k] += qampx * cosval[k];
+        py[k] += qampy * cosval[k];
+        pz[k] += amp * sinval[k];
+        nx[k] -= freqampx * cosval[k];
+        ny[k] -= freqampy * cosval[k];
+        nz[k] -= qfreqamp * sinval[k];
+      }
+    }
+    for (k = 0; k < cnt; k++) {
+      v[start + k].setValue(px[k], py[k], pz[k]);
+    }
+    if (n) {
+      for (k = 0; k < cnt; k++) {
+        const float len = (float) sqrt(nx[k] * nx[k] + ny[k] * ny[k] + nz[k] * nz[k]);
+        const float inv = len > 0.0f ? 1.0f / len : 0.0f;
+        n[start + k].setValue(nx[k] * inv, ny[k] * inv, nz[k] * inv);
+      }
+    }
   }
-  for (i = 0; i < NUM_GEO_WAVES; i++) {
-    float dot = this->geowaves[i].dir[0] * tv[0] + this->geowaves[i].dir[1] * tv[1];
-    float cossinval = (float) (dot *
-                               this->geowaves[i].freq + 
-                               this->geowaves[i].phase);
-    float cosval = (float) cos(cossinval);
-    float sinval = (float) sin(cossinval);
+}
 
-    tn[0] -= (this->geowaves[i].freq * 
-              this->geowaves[i].amp *
-              cosval);
-    tn[1] -= (this->geowaves[i].freq * 
-              this->geowaves[i].amp *
-              cosval);
-    tn[2] -= Q[i] * this->geowaves[i].freq * this->geowaves[i].amp * sinval;
-  }
-  v = tv;
-  n = tn;
+void OceanShape::wavefunc(const SbVec3f & in, SbVec3f & v, SbVec3f & n) 
+{
+  this->evaluateWaves(&in, 1, &v, &n);
 }
 
 void
@@ -2441,275 +2668,43 @@ float OceanShape::getElevation(float x, float y)
     return 0.0;
   } 
   else {
-    SbVec3f in(x, y, 0.0), v, n;
-    this->lastModelMatrix.inverse().multVecMatrix(in, in);
-    this->wavefunc(in, v, n);
+    SbVec3f in(x, y, 0.0), v;
+    this->lastInverseMatrix.multVecMatrix(in, in);
+    this->evaluateWaves(&in, 1, &v, NULL);
     return v[2];
   }
 }
 
-#undef FLAG_ISSPLIT
-
-
-
-/*!
-  Constructor
-*/
-SmVBO::SmVBO(const GLenum target, const GLenum usage)
-  : target(target),
-    usage(usage),
-    data(NULL),
-    datasize(0),
-    dataid(0),
-    didalloc(FALSE),
-    vbohash(5)
-{
-  SoContextHandler::addContextDestructionCallback(context_destruction_cb, this);
-}
-
-
-/*!
-  Destructor
-*/
-SmVBO::~SmVBO()
-{
-  SoContextHandler::removeContextDestructionCallback(context_destruction_cb, this);
-  // schedule delete for all allocated GL resources
-  this->vbohash.apply(vbo_schedule, NULL);
-  if (this->didalloc) {
-    char * ptr = (char*) this->data;
-    delete[] ptr;
-  }
-}
-
-void 
-SmVBO::init(void)
-{
-  // coin_glglue_add_instance_created_callback(context_created, NULL);
-}
-
-/*!
-  Used to allocate buffer data. The user is responsible for filling in
-  the correct type of data in the buffer before the buffer is used.
-
-  \sa setBufferData()
-*/
-void *
-SmVBO::allocBufferData(intptr_t size, uint32_t dataid)
-{
-  // schedule delete for all allocated GL resources
-  this->vbohash.apply(vbo_schedule, NULL);
-  // clear hash table
-  this->vbohash.clear();
-
-  if (this->didalloc && this->datasize == size) {
-    return (void*)this->data;
-  }
-  if (this->didalloc) {
-    char * ptr = (char*) this->data;
-    delete[] ptr;
-  }
-
-  char * ptr = new char[size];
-  this->didalloc = TRUE;
-  this->data = (const GLvoid*) ptr;
-  this->datasize = size;
-  this->dataid = dataid;
-  return (void*) this->data;
-}
-
-/*!
-  Sets the buffer data. \a dataid is a unique id used to identify 
-  the buffer data. In Coin it's possible to use the node id
-  (SoNode::getNodeId()) to test if a buffer is valid for a node.
-*/
-void 
-SmVBO::setBufferData(const GLvoid * data, intptr_t size, uint32_t dataid)
-{
-  // schedule delete for all allocated GL resources
-  this->vbohash.apply(vbo_schedule, NULL);
-  // clear hash table
-  this->vbohash.clear();
-
-  // clean up old buffer (if any)
-  if (this->didalloc) {
-    char * ptr = (char*) this->data;
-    delete[] ptr;
-  }
-  
-  this->data = data;
-  this->datasize = size;
-  this->dataid = dataid;
-  this->didalloc = FALSE;
-}
-
-/*!
-  Returns the buffer data id. 
-  
-  \sa setBufferData()
-*/
-uint32_t 
-SmVBO::getBufferDataId(void) const
-{
-  return this->dataid;
-}
-
-/*!
-  Returns the data pointer and size.
-*/
-void 
-SmVBO::getBufferData(const GLvoid *& data, intptr_t & size)
-{
-  data = this->data;
-  size = this->datasize;
-}
-
-
-/*!
-  Binds the buffer for the context \a contextid.
-*/
-void 
-SmVBO::bindBuffer(uint32_t contextid)
+void
+OceanShape::getElevations(const SbVec2f * points, const int num,
+                          float * elevations, SbVec3f * normals)
 {
-  if ((this->data == NULL) ||
-      (this->datasize == 0)) {
-    assert(0 && "no data in buffer");
+  int i;
+  if (this->invalidstate) {
+    for (i = 0; i < num; i++) {
+      elevations[i] = 0.0f;
+      if (normals) normals[i].setValue(0.0f, 0.0f, 1.0f);
+    }
     return;
   }
-
-  const cc_glglue * glue = cc_glglue_instance((int) contextid);
-
-  GLuint buffer;
-  if (!this->vbohash.get(contextid, buffer)) {
-    // need to create a new buffer for this context
-    cc_glglue_glGenBuffers(glue, 1, &buffer);
-    cc_glglue_glBindBuffer(glue, this->target, buffer);
-    cc_glglue_glBufferData(glue, this->target,
-                           this->datasize,
-                           this->data,
-                           this->usage);
-    this->vbohash.put(contextid, buffer);
-  }
-  else {
-    // buffer already exists, bind it
-    cc_glglue_glBindBuffer(glue, this->target, buffer);
-  }
-}
-
-//
-// Callback from SbHash
-//
-void 
-SmVBO::vbo_schedule(const uint32_t & key,
-                    const GLuint & value,
-                    void * closure)
-{
-  void * ptr = (void*) ((uintptr_t) value);
-  SoGLCacheContextElement::scheduleDeleteCallback(key, vbo_delete, ptr);
-}
-
-//
-// Callback from SoGLCacheContextElement
-//
-void 
-SmVBO::vbo_delete(void * closure, uint32_t contextid)
-{
-  const cc_glglue * glue = cc_glglue_instance((int) contextid);
-  GLuint id = (GLuint) ((uintptr_t) closure);
-  cc_glglue_glDeleteBuffers(glue, 1, &id);
-}
-
-//
-// Callback from SoContextHandler
-//
-void 
-SmVBO::context_destruction_cb(uint32_t context, void * userdata)
-{
-  GLuint buffer;
-  SmVBO * thisp = (SmVBO*) userdata;
-
-  if (thisp->vbohash.get(context, buffer)) {
-    const cc_glglue * glue = cc_glglue_instance((int) context);
-    cc_glglue_glDeleteBuffers(glue, 1, &buffer);    
-    thisp->vbohash.remove(context);
-  }
-}
-
-
-/*!
-  Sets the global limits on the number of vertex data in a node before
-  vertex buffer objects are considered to be used for rendering.
-*/
-void 
-SmVBO::setVertexCountLimits(const int minlimit, const int maxlimit)
-{
-  vbo_vertex_count_min_limit = minlimit;
-  vbo_vertex_count_max_limit = maxlimit;
-}
-
-/*!
-  Returns the vertex VBO minimum limit.
-
-  \sa setVertexCountLimits()
- */
-int 
-SmVBO::getVertexCountMinLimit(void)
-{
-  if (vbo_vertex_count_min_limit < 0) {
-    const char * env = coin_getenv("COIN_VBO_MIN_LIMIT");
-    if (env) {
-      vbo_vertex_count_min_limit = atoi(env);
-    }
-    else {
-      vbo_vertex_count_min_limit = 40;
-    }
-  } 
-  return vbo_vertex_count_min_limit;
-}
-
-/*!
-  Returns the vertex VBO maximum limit.
-
-  \sa setVertexCountLimits()
- */
-int 
-SmVBO::getVertexCountMaxLimit(void)
-{
-  if (vbo_vertex_count_max_limit < 0) {
-    const char * env = coin_getenv("COIN_VBO_MAX_LIMIT");
-    if (env) {
-      vbo_vertex_count_max_limit = atoi(env);
-    }
-    else {
-      vbo_vertex_count_max_limit = 10000000;
+  SbVec3f in[OCEAN_BLOCKSIZE];
+  SbVec3f v[OCEAN_BLOCKSIZE];
+  for (int start = 0; start < num; start += OCEAN_BLOCKSIZE) {
+    const int cnt = SbMin(num - start, (int) OCEAN_BLOCKSIZE);
+    for (i = 0; i < cnt; i++) {
+      const SbVec2f & p = points[start + i];
+      this->lastInverseMatrix.multVecMatrix(SbVec3f(p[0], p[1], 0.0f), in[i]);
     }
+    this->evaluateWaves(in, cnt, v, normals ? normals + start : NULL);
+    for (i = 0; i < cnt; i++) elevations[start + i] = v[i][2];
   }
-  return vbo_vertex_count_max_limit;
 }
 
-SbBool 
-SmVBO::shouldCreateVBO(const uint32_t contextid, const int numdata)
-{
-  int minv = SmVBO::getVertexCountMinLimit();
-  int maxv = SmVBO::getVertexCountMaxLimit();
-  return (numdata >= minv) && (numdata <= maxv) && SmVBO::isVBOFast(contextid);
-}
+#undef OCEAN_BLOCKSIZE
 
+#undef FLAG_ISSPLIT
 
-SbBool 
-SmVBO::isVBOFast(const uint32_t contextid)
-{
-  return TRUE;
-}
 
-//
-// callback from glglue (when a new glglue instance is created)
-//
-void 
-SmVBO::context_created(const cc_glglue * glue, void * closure)
-{
-  // SmVBO::testGLPerformance(coin_glglue_get_contextid(glue));
-}
 
 #endif // temporary compile fix
 
@@ -216,7 +216,8 @@ SmAnnotationAxis::GLRender(SoGLRenderAction * action)
                                             -1.0,
                                             col,
                                             static_cast<SmTextureText2::Justification>(text->justification.getValue()),
-                                            static_cast<SmTextureText2::VerticalJustification>(text->verticalJustification.getValue()));
+                                            static_cast<SmTextureText2::VerticalJustification>(text->verticalJustification.getValue()),
+                                            0.0f, this, l1[i]);
         
         if (text->string.getNum()) text->string.setNum(0);
       }
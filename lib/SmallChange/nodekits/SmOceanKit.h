@@ -65,6 +65,8 @@ public:
   SmOceanKit(void);
   static void initClass(void);
   float getElevation(float x, float y);
+  void getElevations(const SbVec2f * points, const int num,
+                     float * elevations, SbVec3f * normals = NULL);
 
   SoSFBool enableEffects;
   SoSFVec2f size;
@@ -29,6 +29,7 @@ SmTrackPointKit::SmTrackPointKit(void)
   SO_KIT_ADD_FIELD(lineInterval, (0));
   SO_KIT_ADD_FIELD(tickInterval, (0));
   SO_KIT_ADD_FIELD(tickSize, (1.0f));
+  SO_KIT_ADD_FIELD(ringBuffer, (FALSE));
   SO_KIT_INIT_INSTANCE();
   
   getTrack()->trackLength.connectFrom(&this->trackLength);
@@ -36,6 +37,7 @@ SmTrackPointKit::SmTrackPointKit(void)
   getTrack()->lineInterval.connectFrom(&this->lineInterval);
   getTrack()->tickInterval.connectFrom(&this->tickInterval);
   getTrack()->tickSize.connectFrom(&this->tickSize);
+  getTrack()->ringBuffer.connectFrom(&this->ringBuffer);
   this->set("appearanceKit.drawStyle { pointSize 3 }");
 }
 
@@ -37,6 +37,7 @@
 #include <Inventor/nodekits/SoBaseKit.h>
 #include <Inventor/fields/SoSFFloat.h>
 #include <Inventor/fields/SoSFUShort.h>
+#include <Inventor/fields/SoSFBool.h>
 #include <SmallChange/basic.h>
 
 class SbVec3d;
@@ -59,6 +60,7 @@ public:
   SoSFUShort lineInterval;
   SoSFUShort tickInterval;
   SoSFFloat tickSize;
+  SoSFBool ringBuffer;
 
 public:
   static void initClass(void);
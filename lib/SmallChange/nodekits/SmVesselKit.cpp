@@ -42,7 +42,8 @@
 class SmVesselKitP {
 public:
   SbVec3d heading2SbVec3d(float heading);
-  float getWaveSlope(SoGLRenderAction * action, SmOceanKit * ok, SbVec3d & pos, float heading, float length, float & avgElevation);
+  void getSlopePoints(const SbVec3d & p0, float heading, float length, SbVec2f * points);
+  float getWaveSlope(const float * elevations, float length, float & avgElevation);
   SbVec2f getTranslation(float heading, float speed, float dt);
   SbTime lasttime;
   SoFieldSensor * positionsensor;
@@ -128,9 +129,20 @@ SmVesselKit::GLRender(SoGLRenderAction * action)
   SbVec3d utmpos = this->position.getValue();
   SmOceanKit * ok = (SmOceanKit*)this->oceanKit.getValue();
   if (ok && ok->isOfType(SmOceanKit::getClassTypeId())) {
+    double cx, cy, cz;
+    UTMElement::getReferencePosition(action->getState(), cx, cy, cz);
+    SbVec3d p0 = utmpos - SbVec3d(cx, cy, cz);
+
+    // sample the bow, stern and both sides in one go
+    SbVec2f points[4];
+    float elevations[4];
+    PRIVATE(this)->getSlopePoints(p0, this->heading.getValue(), this->size.getValue()[0], points);
+    PRIVATE(this)->getSlopePoints(p0, this->heading.getValue()+90.0, this->size.getValue()[1], points + 2);
+    ok->getElevations(points, 4, elevations);
+
     float e1, e2;
-    float pitch = PRIVATE(this)->getWaveSlope(action, ok, utmpos, this->heading.getValue(), this->size.getValue()[0], e1);
-    float roll = -1.0 * PRIVATE(this)->getWaveSlope(action, ok, utmpos, this->heading.getValue()+90.0, this->size.getValue()[1], e2);
+    float pitch = PRIVATE(this)->getWaveSlope(elevations, this->size.getValue()[0], e1);
+    float roll = -1.0 * PRIVATE(this)->getWaveSlope(elevations + 2, this->size.getValue()[1], e2);
     elevation = (e1+e2)/2.0;
     this->pitch.enableNotify(FALSE);  // Avoid triggering redraw
     this->pitch.setValue(pitch);
@@ -159,20 +171,22 @@ SmVesselKitP::heading2SbVec3d(float heading)
   return SbVec3d( sin(heading*M_PI/180.0), cos(heading*M_PI/180.0), 0.0);
 }
 
-float 
-SmVesselKitP::getWaveSlope(SoGLRenderAction * action, SmOceanKit * ok, SbVec3d & pos, float heading, float length, float & avgElevation)
+// Returns the two points to sample, length/2 behind and ahead of p0.
+void
+SmVesselKitP::getSlopePoints(const SbVec3d & p0, float heading, float length, SbVec2f * points)
 {
-  double cx, cy, cz;
-  UTMElement::getReferencePosition(action->getState(), cx, cy, cz);
-  SbVec3d campos(cx, cy, cz);
-  SbVec3d p0 = pos - campos;
   SbVec3d v = this->heading2SbVec3d(heading);
-  SbVec3d v1 = v * length / - 2.0;
-  SbVec3d p1 = p0 + v1;
-  float p1e = ok->getElevation(p1[0], p1[1]) / 2.0;  // FIXME: workaround for SmOceanKit bug? preng 2006-03-13
-  SbVec3d v2 = v * length / 2.0;
-  SbVec3d p2 = p0 + v2;
-  float p2e = ok->getElevation(p2[0], p2[1]) / 2.0;  // FIXME: workaround for SmOceanKit bug? preng 2006-03-13
+  SbVec3d p1 = p0 + v * length / - 2.0;
+  SbVec3d p2 = p0 + v * length / 2.0;
+  points[0].setValue((float) p1[0], (float) p1[1]);
+  points[1].setValue((float) p2[0], (float) p2[1]);
+}
+
+float 
+SmVesselKitP::getWaveSlope(const float * elevations, float length, float & avgElevation)
+{
+  float p1e = elevations[0] / 2.0;  // FIXME: workaround for SmOceanKit bug? preng 2006-03-13
+  float p2e = elevations[1] / 2.0;  // FIXME: workaround for SmOceanKit bug? preng 2006-03-13
   float elevdiff = p2e - p1e;
   float slopeangle = atan(elevdiff/length) * 180.0 / M_PI;
   avgElevation = (p1e+p2e)/2.0;
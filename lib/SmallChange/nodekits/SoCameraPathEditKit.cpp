@@ -408,7 +408,7 @@ void SoCameraPathEditKit::pickCallback(void * data, SoEventCallback * eventCallb
 
               // timestamp are specified
               if (thisp->timestamp.getNum() != 0) {
-                float k = (curvedetails->getPartIndex() + 0.5f)/((float)curve->getLinesPerSegment());
+                float k = (curvedetails->getPartIndex() + 0.5f)/((float)curve->getLinesPerSegment(curvedetails->getLineIndex()));
                 SbTime timeA = thisp->timestamp[curvedetails->getLineIndex()];
                 SbTime timeB = thisp->timestamp[curvedetails->getLineIndex() + 1];
                 SbTime delta = timeB - timeA;
@@ -36,11 +36,15 @@
 
   \ingroup nodes
 
-  It works by using a timer sensor that triggers an idle sensor at
-  regular intervals. The idle sensor then checks if the loaded file
-  has been modified, and triggers a new timer sensor that reloads the
-  file after a given delay. A delay is needed to avoid trying to load
-  the file while it is being written by another process.
+  By default it works by using a timer sensor that triggers an
+  idle sensor at regular intervals. The idle sensor then checks if the
+  loaded file has been modified, and triggers a new timer sensor that
+  reloads the file after a given delay. A delay is needed to avoid
+  trying to load the file while it is being written by another
+  process.
+
+  On systems with inotify, the file can be watched from a background
+  thread instead. See the \a asynchronous field.
 */
 
 // *************************************************************************
@@ -71,6 +75,23 @@
   Sets whether autoload is active.
 */
 
+/*!
+  \var SoSFBool AutoFile::asynchronous
+
+  If set to \c TRUE, on systems with inotify, the file is watched
+  instead of polled. All AutoFile nodes share one watcher thread. It
+  waits for the writer to close the file (or for a new file to be
+  renamed into place), reads the new contents in the background, and
+  hands the new subgraph over to the main loop. The \a interval, \a
+  delay and \a priority fields are not used then. If the file can't
+  be watched, or inotify isn't available, the file is polled.
+
+  Note that reading files in a background thread requires a Coin
+  library built with thread safety enabled.
+
+  Default value is \c FALSE.
+*/
+
 /*!
   \var SoSFBool AutoFile::stripTopSeparator
 
@@ -123,6 +144,12 @@
 #ifdef HAVE_IO_H
 #include <io.h>
 #endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <cerrno>
+#endif
 
 #include <cstdlib>
 #include <cstddef>
@@ -134,9 +161,52 @@
 #include <Inventor/misc/SoChildList.h>
 #include <Inventor/errors/SoDebugError.h>
 #include <Inventor/C/tidbits.h>
+#include <Inventor/C/threads/thread.h>
+#include <Inventor/threads/SbMutex.h>
+#include <Inventor/lists/SbList.h>
+#include <Inventor/SoInput.h>
+#include <Inventor/SoDB.h>
 
 // *************************************************************************
 
+// Watches files for all AutoFile nodes with a single inotify
+// descriptor. The parent directory of each file is watched rather
+// than the file itself, so that files replaced through a rename are
+// picked up too.
+class AutoFileWatcher {
+public:
+  static int addWatch(class AutoFileP * owner, const SbString & fullname);
+  static void removeWatch(const int id);
+
+private:
+  struct watch {
+    int id;
+    int wd;
+    SbString basename;
+    SbString fullname;
+    AutoFileP * owner; // only used in the main thread
+  };
+  struct result {
+    int id;
+    SoSeparator * root;
+  };
+
+  static SbBool init(void);
+  static void cleanup(void);
+  static void * thread_cb(void * closure);
+  static void sensor_cb(void * closure, SoSensor * sensor);
+
+  static SbBool initialized;
+  static int fd;
+  static int wakeup[2];
+  static cc_thread * thread;
+  static SbMutex * mutex;
+  static SbList <watch> * watches; // written by the main thread only
+  static SbList <result> * results;
+  static SoTimerSensor * sensor;
+  static int nextid;
+};
+
 class AutoFileP {
 public:
   AutoFileP(AutoFile * master);
@@ -154,6 +224,15 @@ public:
   SoTimerSensor * rescheduler;
   SoIdleSensor * idler;
 
+  SbBool usewatcher;
+  int watchid;
+  SbString watchname;
+
+  void updateMode(void);
+  void updateWatch(void);
+  void setContents(SoSeparator * root);
+  void stripTopSeparator(void);
+
   static void idler_cb(void * data, SoSensor *);
   static void rescheduler_cb(void * data, SoSensor *);
   static void toucher_cb(void * data, SoSensor *);
@@ -179,6 +258,7 @@ AutoFile::AutoFile()
   SO_NODE_CONSTRUCTOR(AutoFile);
 
   SO_NODE_ADD_FIELD(active, (TRUE));
+  SO_NODE_ADD_FIELD(asynchronous, (FALSE));
   SO_NODE_ADD_FIELD(interval, (1.0f));
   SO_NODE_ADD_FIELD(delay, (1.0f));
   SO_NODE_ADD_FIELD(priority, ((int32_t)SoDelayQueueSensor::getDefaultPriority()));
@@ -241,7 +321,15 @@ AutoFile::notify(SoNotList * list)
     }
   }
 
-  if (f == &this->active) {
+  if (f == &this->asynchronous) {
+    PRIVATE(this)->updateMode();
+  }
+  else if (PRIVATE(this)->usewatcher) {
+    // the watch is updated again in readNamedFile(), when the full
+    // name of the file is known
+    if (f == &this->active || f == &this->name) PRIVATE(this)->updateWatch();
+  }
+  else if (f == &this->active) {
     if (this->active.getValue()) {
       if (!PRIVATE(this)->rescheduler->isScheduled() &&
           !PRIVATE(this)->idler->isScheduled()) {
@@ -259,27 +347,14 @@ AutoFile::notify(SoNotList * list)
   inherited::notify(list);
 }
 
-// Overridden to strip off top SoSeparator, if requested.
+// Overridden to strip off top SoSeparator, if requested, and to
+// watch the file that was read.
 SbBool
 AutoFile::readNamedFile(SoInput * in)
 {
   SbBool ret = inherited::readNamedFile(in);
-
-  if (this->stripTopSeparator.getValue()) {
-    SoChildList * children = this->getChildren();
-    SoNode * child = children->getLength() == 1 ?
-      (*children)[0] : NULL;
-    if (child && child->getTypeId() == SoSeparator::getClassTypeId()) {
-      SoSeparator * sep = (SoSeparator*) child;
-      sep->ref();
-      children->truncate(0);
-      for (int i = 0; i < sep->getNumChildren(); i++) {
-        children->append(sep->getChild(i));
-      }
-      sep->removeAllChildren();
-      sep->unref();
-    }
-  }
+  PRIVATE(this)->stripTopSeparator();
+  PRIVATE(this)->updateMode();
   return ret;
 }
 
@@ -303,11 +378,17 @@ AutoFileP::AutoFileP(AutoFile * master)
 
   this->rescheduler = new SoTimerSensor(rescheduler_cb, this);
   this->rescheduler->setInterval(SbTime((double) PUBLIC(this)->interval.getValue()));
+
+  this->watchid = -1;
+  // the watcher is started from updateMode() if the asynchronous
+  // field is set
+  this->usewatcher = FALSE;
   this->rescheduler->schedule(); // go
 }
 
 AutoFileP::~AutoFileP()
 {
+  if (this->watchid >= 0) AutoFileWatcher::removeWatch(this->watchid);
   delete this->idler;
   delete this->rescheduler;
   delete this->toucher;
@@ -441,6 +522,361 @@ AutoFileP::toucher_cb(void * data, SoSensor *)
   thisp->toucher->unschedule();
 }
 
+//
+// Switches between watching and polling, according to the
+// asynchronous field.
+//
+void
+AutoFileP::updateMode(void)
+{
+  SbBool watch = FALSE;
+#ifdef HAVE_SYS_INOTIFY_H
+  watch = PUBLIC(this)->asynchronous.getValue();
+#endif // HAVE_SYS_INOTIFY_H
+
+  if (watch) {
+    if (!this->usewatcher) {
+      if (this->idler->isScheduled()) this->idler->unschedule();
+      if (this->rescheduler->isScheduled()) this->rescheduler->unschedule();
+      if (this->toucher->isScheduled()) this->toucher->unschedule();
+      this->usewatcher = TRUE;
+    }
+    this->updateWatch();
+  }
+  else if (this->usewatcher) {
+    if (this->watchid >= 0) {
+      AutoFileWatcher::removeWatch(this->watchid);
+      this->watchid = -1;
+    }
+    this->watchname.makeEmpty();
+    this->usewatcher = FALSE;
+    if (PUBLIC(this)->active.getValue()) this->rescheduler->schedule();
+  }
+}
+
+//
+// Starts watching the current file, or stops watching if the node
+// isn't active. Falls back to polling if the file can't be watched.
+//
+void
+AutoFileP::updateWatch(void)
+{
+  SbString fullname;
+  if (PUBLIC(this)->active.getValue() && PUBLIC(this)->name.getValue().getLength()) {
+    fullname = PUBLIC(this)->getFullName();
+    if (fullname.getLength() == 0) fullname = PUBLIC(this)->name.getValue();
+  }
+  if (this->watchid >= 0 && fullname == this->watchname) return;
+
+  if (this->watchid >= 0) {
+    AutoFileWatcher::removeWatch(this->watchid);
+    this->watchid = -1;
+  }
+  this->watchname = fullname;
+  if (fullname.getLength() == 0) return;
+
+  this->watchid = AutoFileWatcher::addWatch(this, fullname);
+  if (this->watchid < 0) {
+    if (this->debug) {
+      SoDebugError::postInfo("AutoFileP::updateWatch",
+                             "unable to watch '%s', polling instead",
+                             fullname.getString());
+    }
+    this->usewatcher = FALSE;
+    this->rescheduler->schedule();
+  }
+  else if (this->debug) {
+    SoDebugError::postInfo("AutoFileP::updateWatch", "watching '%s'",
+                           fullname.getString());
+  }
+}
+
+//
+// Replaces the children with the contents of a file read by the
+// watcher thread.
+//
+void
+AutoFileP::setContents(SoSeparator * root)
+{
+  if (this->debug) {
+    SoDebugError::postInfo("AutoFileP::setContents", "reloaded '%s'",
+                           this->watchname.getString());
+  }
+  SoChildList * children = PUBLIC(this)->getChildren();
+  children->truncate(0);
+  for (int i = 0; i < root->getNumChildren(); i++) {
+    children->append(root->getChild(i));
+  }
+  this->stripTopSeparator();
+  PUBLIC(this)->touch();
+}
+
+// Strips off top SoSeparator, if requested.
+void
+AutoFileP::stripTopSeparator(void)
+{
+  if (PUBLIC(this)->stripTopSeparator.getValue()) {
+    SoChildList * children = PUBLIC(this)->getChildren();
+    SoNode * child = children->getLength() == 1 ?
+      (*children)[0] : NULL;
+    if (child && child->getTypeId() == SoSeparator::getClassTypeId()) {
+      SoSeparator * sep = (SoSeparator*) child;
+      sep->ref();
+      children->truncate(0);
+      for (int i = 0; i < sep->getNumChildren(); i++) {
+        children->append(sep->getChild(i));
+      }
+      sep->removeAllChildren();
+      sep->unref();
+    }
+  }
+}
+
+// *************************************************************************
+
+SbBool AutoFileWatcher::initialized = FALSE;
+int AutoFileWatcher::fd = -1;
+int AutoFileWatcher::wakeup[2] = { -1, -1 };
+cc_thread * AutoFileWatcher::thread = NULL;
+SbMutex * AutoFileWatcher::mutex = NULL;
+SbList <AutoFileWatcher::watch> * AutoFileWatcher::watches = NULL;
+SbList <AutoFileWatcher::result> * AutoFileWatcher::results = NULL;
+SoTimerSensor * AutoFileWatcher::sensor = NULL;
+int AutoFileWatcher::nextid = 0;
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define AUTOFILE_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+SbBool
+AutoFileWatcher::init(void)
+{
+  if (AutoFileWatcher::initialized) return AutoFileWatcher::fd >= 0;
+  AutoFileWatcher::initialized = TRUE;
+
+  AutoFileWatcher::fd = inotify_init();
+  if (AutoFileWatcher::fd < 0) return FALSE;
+  if (pipe(AutoFileWatcher::wakeup) != 0) {
+    close(AutoFileWatcher::fd);
+    AutoFileWatcher::fd = -1;
+    return FALSE;
+  }
+  fcntl(AutoFileWatcher::fd, F_SETFL, O_NONBLOCK);
+
+  AutoFileWatcher::mutex = new SbMutex;
+  AutoFileWatcher::watches = new SbList <watch>;
+  AutoFileWatcher::results = new SbList <result>;
+  // results are only checked for, no system calls are made
+  AutoFileWatcher::sensor = new SoTimerSensor(AutoFileWatcher::sensor_cb, NULL);
+  AutoFileWatcher::sensor->setInterval(SbTime(0.1));
+  AutoFileWatcher::thread = cc_thread_construct(AutoFileWatcher::thread_cb, NULL);
+  cc_coin_atexit((coin_atexit_f *) AutoFileWatcher::cleanup);
+  return TRUE;
+}
+
+void
+AutoFileWatcher::cleanup(void)
+{
+  // wake up the watcher thread, which then returns
+  const char c = 0;
+  if (write(AutoFileWatcher::wakeup[1], &c, 1) == 1) {
+    cc_thread_join(AutoFileWatcher::thread, NULL);
+  }
+  cc_thread_destruct(AutoFileWatcher::thread);
+  AutoFileWatcher::thread = NULL;
+
+  close(AutoFileWatcher::fd);
+  close(AutoFileWatcher::wakeup[0]);
+  close(AutoFileWatcher::wakeup[1]);
+  AutoFileWatcher::fd = -1;
+
+  for (int i = 0; i < AutoFileWatcher::results->getLength(); i++) {
+    (*AutoFileWatcher::results)[i].root->unref();
+  }
+  delete AutoFileWatcher::results;
+  delete AutoFileWatcher::watches;
+  delete AutoFileWatcher::mutex;
+  delete AutoFileWatcher::sensor;
+  AutoFileWatcher::results = NULL;
+  AutoFileWatcher::watches = NULL;
+  AutoFileWatcher::mutex = NULL;
+  AutoFileWatcher::sensor = NULL;
+}
+
+int
+AutoFileWatcher::addWatch(AutoFileP * owner, const SbString & fullname)
+{
+  if (!AutoFileWatcher::init()) return -1;
+
+  watch w;
+  int split = fullname.getLength() - 1;
+  while (split >= 0 && fullname[split] != '/') split--;
+  const SbString dirname = split < 0 ? SbString(".") :
+    (split == 0 ? SbString("/") : fullname.getSubString(0, split - 1));
+  w.basename = fullname.getSubString(split + 1);
+  w.fullname = fullname;
+  w.owner = owner;
+  w.wd = inotify_add_watch(AutoFileWatcher::fd, dirname.getString(),
+                           AUTOFILE_WATCH_MASK);
+  if (w.wd < 0) return -1;
+  w.id = AutoFileWatcher::nextid++;
+
+  AutoFileWatcher::mutex->lock();
+  AutoFileWatcher::watches->append(w);
+  AutoFileWatcher::mutex->unlock();
+
+  if (!AutoFileWatcher::sensor->isScheduled()) AutoFileWatcher::sensor->schedule();
+  return w.id;
+}
+
+void
+AutoFileWatcher::removeWatch(const int id)
+{
+  if (AutoFileWatcher::watches == NULL) return; // after cleanup
+
+  AutoFileWatcher::mutex->lock();
+  SbList <watch> & watches = *AutoFileWatcher::watches;
+  int i, wd = -1;
+  for (i = 0; i < watches.getLength(); i++) {
+    if (watches[i].id == id) {
+      wd = watches[i].wd;
+      watches.remove(i);
+      break;
+    }
+  }
+  // the directory may be shared with other watches
+  SbBool dirused = FALSE;
+  for (i = 0; i < watches.getLength(); i++) {
+    if (watches[i].wd == wd) dirused = TRUE;
+  }
+  const int numwatches = watches.getLength();
+  AutoFileWatcher::mutex->unlock();
+
+  if (wd >= 0 && !dirused) inotify_rm_watch(AutoFileWatcher::fd, wd);
+  if (numwatches == 0) AutoFileWatcher::sensor->unschedule();
+}
+
+//
+// The watcher thread. Blocks until files are closed after writing or
+// renamed into place, and reads them.
+//
+void *
+AutoFileWatcher::thread_cb(void * closure)
+{
+  char buf[4096 + sizeof(struct inotify_event) + 256];
+  SbList <int> changed;
+  SbList <SbString> changednames;
+
+  for (;;) {
+    struct pollfd fds[2];
+    fds[0].fd = AutoFileWatcher::fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = AutoFileWatcher::wakeup[0];
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (fds[1].revents) break; // shutting down
+
+    // drain all pending events, so that files written several times
+    // in a row are only read once
+    changed.truncate(0);
+    changednames.truncate(0);
+    ssize_t len;
+    while ((len = read(AutoFileWatcher::fd, buf, sizeof(buf))) > 0) {
+      AutoFileWatcher::mutex->lock();
+      SbList <watch> & watches = *AutoFileWatcher::watches;
+      for (char * ptr = buf; ptr < buf + len; ) {
+        const struct inotify_event * event = (const struct inotify_event *) ptr;
+        ptr += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          // events were dropped, so reload all watched files
+          for (int i = 0; i < watches.getLength(); i++) {
+            if (changed.find(watches[i].id) < 0) {
+              changed.append(watches[i].id);
+              changednames.append(watches[i].fullname);
+            }
+          }
+          continue;
+        }
+        if (event->len == 0) continue;
+        for (int i = 0; i < watches.getLength(); i++) {
+          if (watches[i].wd == event->wd && watches[i].basename == event->name &&
+              changed.find(watches[i].id) < 0) {
+            changed.append(watches[i].id);
+            changednames.append(watches[i].fullname);
+          }
+        }
+      }
+      AutoFileWatcher::mutex->unlock();
+    }
+
+    for (int i = 0; i < changed.getLength(); i++) {
+      SoInput in;
+      if (!in.openFile(changednames[i].getString())) continue;
+      SoSeparator * root = SoDB::readAll(&in);
+      if (root == NULL) continue;
+      root->ref();
+
+      result r;
+      r.id = changed[i];
+      r.root = root;
+      AutoFileWatcher::mutex->lock();
+      AutoFileWatcher::results->append(r);
+      AutoFileWatcher::mutex->unlock();
+    }
+  }
+  return NULL;
+}
+
+//
+// Hands the files read by the watcher thread over to their nodes.
+//
+void
+AutoFileWatcher::sensor_cb(void * closure, SoSensor * sensor)
+{
+  AutoFileWatcher::mutex->lock();
+  const int num = AutoFileWatcher::results->getLength();
+  if (num == 0) {
+    AutoFileWatcher::mutex->unlock();
+    return;
+  }
+  SbList <result> results(num);
+  for (int i = 0; i < num; i++) results.append((*AutoFileWatcher::results)[i]);
+  AutoFileWatcher::results->truncate(0);
+  AutoFileWatcher::mutex->unlock();
+
+  // the watch list is only changed by this thread, no need to lock
+  const SbList <watch> & watches = *AutoFileWatcher::watches;
+  for (int i = 0; i < num; i++) {
+    for (int j = 0; j < watches.getLength(); j++) {
+      if (watches[j].id == results[i].id) {
+        watches[j].owner->setContents(results[i].root);
+        break;
+      }
+    }
+    results[i].root->unref();
+  }
+}
+
+#undef AUTOFILE_WATCH_MASK
+
+#else // !HAVE_SYS_INOTIFY_H
+
+int
+AutoFileWatcher::addWatch(AutoFileP * owner, const SbString & fullname)
+{
+  return -1;
+}
+
+void
+AutoFileWatcher::removeWatch(const int id)
+{
+}
+
+#endif // !HAVE_SYS_INOTIFY_H
+
 // *************************************************************************
 
 #undef PUBLIC
@@ -55,6 +55,7 @@ public:
   SoSFFloat delay;
   SoSFInt32 priority;
   SoSFBool active;
+  SoSFBool asynchronous;
 
   virtual void search(SoSearchAction * action);
   virtual void doAction(SoAction * action);
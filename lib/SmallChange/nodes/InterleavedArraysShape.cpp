@@ -40,7 +40,11 @@
   all vertex data will be interleaved for maximum rendering
   performance. If you change one vertex attribute, for instance the
   normals, the entire cache needs to be rebuilt, and this is why this
-  shape is best suited for relatively static geometry.
+  shape is best suited for relatively static geometry. When only some
+  of the vertices change, call markDirtyRange() before editing the
+  SoVertexProperty node, and only those vertices are updated in the
+  cache. The buffer usage hint is picked from how often the vertex
+  data has been updated recently.
 
   To achieve this caching and reduce overhead, it will only render the
   contents of its SoVertexShape::vertexProperty node, it will not pick
@@ -128,6 +132,7 @@
 #include <Inventor/elements/SoShapeStyleElement.h>
 #include <Inventor/misc/SoContextHandler.h>
 #include <Inventor/elements/SoOverrideElement.h>
+#include <SmallChange/misc/SmVBO.h>
 #include <cstddef>
 #include <cstring>
 #include <map>
@@ -150,6 +155,12 @@ public:
   void setBufferData(const GLvoid * data, 
                      intptr_t size, 
                      uint32_t contextid);
+  void updateBufferData(const GLvoid * data,
+                        intptr_t offset,
+                        intptr_t size,
+                        uint32_t contextid);
+  void clearOtherContexts(uint32_t contextid);
+  GLenum getUsage() const { return this->usage; }
   
   bool hasVBO(uint32_t contextid);
   void bindBuffer(uint32_t contextid);
@@ -188,12 +199,28 @@ public:
   size_t coloroffset;
   size_t texcoordoffset;
   size_t vertexsize;
+  int numvertices;
   SbBool useshorts;
 
+  // vertex range from markDirtyRange()
+  int dirtystart;
+  int dirtyend;
+  // one bit per render, see SmVBO::getUsageHint()
+  uint32_t updatehistory;
+  SbBool datachanged;
+
   enum {
     MAYBE, YES, NO
   };
   int transparency;
+
+  SbBool setupLayout(SoVertexProperty * vp);
+  void fillVertexData(SoVertexProperty * vp, unsigned char * dst,
+                      const int start, const int end) const;
+  void clearDirtyRange() {
+    this->dirtystart = 0x7fffffff;
+    this->dirtyend = 0;
+  }
 };
 
 namespace {
@@ -252,6 +279,14 @@ InterleavedArraysShape::InterleavedArraysShape()
   PRIVATE(this) = new Pimpl;
   PRIVATE(this)->vbo = NULL;
   PRIVATE(this)->indexvbo = NULL;
+  PRIVATE(this)->numvertices = 0;
+  PRIVATE(this)->vertexsize = 0;
+  PRIVATE(this)->normaloffset = 0;
+  PRIVATE(this)->coloroffset = 0;
+  PRIVATE(this)->texcoordoffset = 0;
+  PRIVATE(this)->updatehistory = 0;
+  PRIVATE(this)->datachanged = TRUE;
+  PRIVATE(this)->clearDirtyRange();
   PRIVATE(this)->transparency = Pimpl::MAYBE;
 
   SO_NODE_CONSTRUCTOR(InterleavedArraysShape);
@@ -297,77 +332,183 @@ void
 InterleavedArraysShape::notify(SoNotList * l)
 {
   SoField * f = l->getLastField();
-  if (f == &this->vertexProperty) {
-    PRIVATE(this)->transparency = Pimpl::MAYBE;
-  }
-  if (PRIVATE(this)->vbo) {
-    delete PRIVATE(this)->vbo;
-    PRIVATE(this)->vbo = NULL;
+  if (f == &this->vertexProperty &&
+      PRIVATE(this)->dirtyend > PRIVATE(this)->dirtystart) {
+    // only the range from markDirtyRange() has changed, and the
+    // cache is updated in GLRender()
+    SoVertexProperty * vp = (SoVertexProperty*) this->vertexProperty.getValue();
+    if (PRIVATE(this)->transparency == Pimpl::YES) {
+      PRIVATE(this)->transparency = Pimpl::MAYBE;
+    }
+    else if (PRIVATE(this)->transparency == Pimpl::NO && vp) {
+      const uint32_t * rgba = vp->orderedRGBA.getValues(0);
+      const int end = SbMin(PRIVATE(this)->dirtyend, vp->orderedRGBA.getNum());
+      for (int i = PRIVATE(this)->dirtystart; i < end; i++) {
+        if ((rgba[i] & 0xff) != 0xff) {
+          PRIVATE(this)->transparency = Pimpl::YES;
+          break;
+        }
+      }
+    }
   }
-  if (PRIVATE(this)->indexvbo) {
-    delete PRIVATE(this)->indexvbo;
-    PRIVATE(this)->indexvbo = NULL;
+  else {
+    if (f == &this->vertexProperty) {
+      PRIVATE(this)->transparency = Pimpl::MAYBE;
+    }
+    // the vertex data does not depend on the indices
+    if (PRIVATE(this)->vbo && f != &this->vertexIndex) {
+      delete PRIVATE(this)->vbo;
+      PRIVATE(this)->vbo = NULL;
+      PRIVATE(this)->datachanged = TRUE;
+    }
+    if (PRIVATE(this)->indexvbo) {
+      delete PRIVATE(this)->indexvbo;
+      PRIVATE(this)->indexvbo = NULL;
+    }
   }
   inherited::notify(l);
 }
 
+/*!
+  Tells the node that the next edits of the SoVertexProperty node
+  only change vertices \a start to \a start + \a num - 1. Call this
+  before editing the node, and only those vertices will be updated in
+  the vertex cache, instead of rebuilding it. Ranges marked between
+  two renders are merged.
+
+  The cache is rebuilt anyway if the number of vertices, or the
+  vertex attributes in use, change.
+*/
 void
-InterleavedArraysShape::createVBO(uint32_t contextid)
+InterleavedArraysShape::markDirtyRange(const int start, const int num)
 {
-  if (!PRIVATE(this)->vbo) {
-    PRIVATE(this)->vbo = new VBO();
-  }
-  PRIVATE(this)->normaloffset = 0;
-  PRIVATE(this)->coloroffset = 0;
-  PRIVATE(this)->texcoordoffset = 0;
-  PRIVATE(this)->vertexsize = sizeof(SbVec3f);
+  if (num <= 0) return;
+  PRIVATE(this)->dirtystart = SbMin(PRIVATE(this)->dirtystart, start);
+  PRIVATE(this)->dirtyend = SbMax(PRIVATE(this)->dirtyend, start + num);
+}
 
-  SoVertexProperty * vp = (SoVertexProperty*) this->vertexProperty.getValue();
-  
-  const SbVec3f * vptr = vp->vertex.getValues(0);
-  const SbVec3f * nptr = NULL;
-  const SbVec2f * tcptr = NULL;
-  const uint32_t * cptr = NULL;
+//
+// Finds the interleaved vertex layout for vp. Returns TRUE if it
+// differs from the current layout.
+//
+SbBool
+InterleavedArraysShape::Pimpl::setupLayout(SoVertexProperty * vp)
+{
+  const size_t oldnormaloffset = this->normaloffset;
+  const size_t oldcoloroffset = this->coloroffset;
+  const size_t oldtexcoordoffset = this->texcoordoffset;
+  const size_t oldvertexsize = this->vertexsize;
+  const int oldnumvertices = this->numvertices;
+
+  this->normaloffset = 0;
+  this->coloroffset = 0;
+  this->texcoordoffset = 0;
+  this->vertexsize = sizeof(SbVec3f);
 
   const int n = vp->vertex.getNum();
+  this->numvertices = n;
 
   if (vp->normal.getNum() >= n) {
-    PRIVATE(this)->normaloffset = PRIVATE(this)->vertexsize;
-    PRIVATE(this)->vertexsize += sizeof(SbVec3f);
-    nptr = vp->normal.getValues(0);
+    this->normaloffset = this->vertexsize;
+    this->vertexsize += sizeof(SbVec3f);
   }
   if (vp->orderedRGBA.getNum() >= n) {
-    PRIVATE(this)->coloroffset = PRIVATE(this)->vertexsize;
-    PRIVATE(this)->vertexsize += sizeof(uint32_t);
-    cptr = vp->orderedRGBA.getValues(0);
+    this->coloroffset = this->vertexsize;
+    this->vertexsize += sizeof(uint32_t);
   }
   if (vp->texCoord.getNum() >= n) {
-    PRIVATE(this)->texcoordoffset = PRIVATE(this)->vertexsize;
-    PRIVATE(this)->vertexsize += sizeof(SbVec2f);
-    tcptr = vp->texCoord.getValues(0);
+    this->texcoordoffset = this->vertexsize;
+    this->vertexsize += sizeof(SbVec2f);
   }
-  std::vector<unsigned char> buffer(PRIVATE(this)->vertexsize * n);
-  unsigned char * dst = &buffer[0];
+  return
+    this->normaloffset != oldnormaloffset ||
+    this->coloroffset != oldcoloroffset ||
+    this->texcoordoffset != oldtexcoordoffset ||
+    this->vertexsize != oldvertexsize ||
+    this->numvertices != oldnumvertices;
+}
+
+//
+// Writes interleaved data for vertices start to end (exclusive) to dst
+//
+void
+InterleavedArraysShape::Pimpl::fillVertexData(SoVertexProperty * vp,
+                                              unsigned char * dst,
+                                              const int start,
+                                              const int end) const
+{
+  const SbVec3f * vptr = vp->vertex.getValues(0);
+  const SbVec3f * nptr = this->normaloffset ? vp->normal.getValues(0) : NULL;
+  const uint32_t * cptr = this->coloroffset ? vp->orderedRGBA.getValues(0) : NULL;
+  const SbVec2f * tcptr = this->texcoordoffset ? vp->texCoord.getValues(0) : NULL;
 
   SbBool bigendian = coin_host_get_endianness() == COIN_HOST_IS_BIGENDIAN;
-  for (int i = 0; i < n; i++) {
+  for (int i = start; i < end; i++) {
     memcpy(dst, vptr+i, sizeof(SbVec3f));
-    if (nptr) memcpy(dst + PRIVATE(this)->normaloffset, nptr+i, sizeof(SbVec3f));
+    if (nptr) memcpy(dst + this->normaloffset, nptr+i, sizeof(SbVec3f));
     if (cptr) {
-      memcpy(dst + PRIVATE(this)->coloroffset, cptr+i, sizeof(uint32_t));
+      memcpy(dst + this->coloroffset, cptr+i, sizeof(uint32_t));
       if (!bigendian) {
-        uint32_t * dsti = (uint32_t*) (dst + PRIVATE(this)->coloroffset);
+        uint32_t * dsti = (uint32_t*) (dst + this->coloroffset);
         *dsti = coin_hton_uint32(*dsti);
       }
     }
-    if (tcptr) memcpy(dst + PRIVATE(this)->texcoordoffset, tcptr+i, sizeof(SbVec2f));
-    dst += PRIVATE(this)->vertexsize;
+    if (tcptr) memcpy(dst + this->texcoordoffset, tcptr+i, sizeof(SbVec2f));
+    dst += this->vertexsize;
+  }
+}
+
+void
+InterleavedArraysShape::createVBO(uint32_t contextid)
+{
+  if (!PRIVATE(this)->vbo) {
+    PRIVATE(this)->vbo =
+      new VBO(GL_ARRAY_BUFFER, SmVBO::getUsageHint(PRIVATE(this)->updatehistory));
   }
+  SoVertexProperty * vp = (SoVertexProperty*) this->vertexProperty.getValue();
+  (void) PRIVATE(this)->setupLayout(vp);
+
+  const int n = PRIVATE(this)->numvertices;
+  std::vector<unsigned char> buffer(PRIVATE(this)->vertexsize * n);
+  PRIVATE(this)->fillVertexData(vp, &buffer[0], 0, n);
   PRIVATE(this)->vbo->setBufferData(&buffer[0], 
                                     buffer.size(),
                                     contextid);
 }
 
+//
+// Updates the range from markDirtyRange() in the vertex cache for
+// contextid. The cache is deleted, to be rebuilt, if the layout or the
+// usage hint has changed. Other contexts rebuild their caches.
+//
+void
+InterleavedArraysShape::updateVBO(uint32_t contextid)
+{
+  const int start = PRIVATE(this)->dirtystart;
+  const int dirtyend = PRIVATE(this)->dirtyend;
+  PRIVATE(this)->clearDirtyRange();
+
+  VBO * vbo = PRIVATE(this)->vbo;
+  if (!vbo) return;
+
+  SoVertexProperty * vp = (SoVertexProperty*) this->vertexProperty.getValue();
+  if (PRIVATE(this)->setupLayout(vp) ||
+      vbo->getUsage() != SmVBO::getUsageHint(PRIVATE(this)->updatehistory)) {
+    delete PRIVATE(this)->vbo;
+    PRIVATE(this)->vbo = NULL;
+    return;
+  }
+  vbo->clearOtherContexts(contextid);
+  if (!vbo->hasVBO(contextid)) return;
+
+  const int end = SbMin(dirtyend, PRIVATE(this)->numvertices);
+  if (end <= start) return;
+  const size_t vsize = PRIVATE(this)->vertexsize;
+  std::vector<unsigned char> buffer(vsize * (end - start));
+  PRIVATE(this)->fillVertexData(vp, &buffer[0], start, end);
+  vbo->updateBufferData(&buffer[0], start * vsize, buffer.size(), contextid);
+}
+
 void
 InterleavedArraysShape::createIndexVBO(uint32_t contextid)
 {
@@ -446,6 +587,14 @@ InterleavedArraysShape::GLRender(SoGLRenderAction * action)
 
     if (cc_glglue_has_vertex_array(glue) &&
         cc_glglue_has_vertex_buffer_object(glue)) {
+      const SbBool partial = PRIVATE(this)->dirtyend > PRIVATE(this)->dirtystart;
+      PRIVATE(this)->updatehistory <<= 1;
+      if (partial || PRIVATE(this)->datachanged) {
+        PRIVATE(this)->updatehistory |= 1;
+      }
+      PRIVATE(this)->datachanged = FALSE;
+      if (partial) this->updateVBO(contextid);
+
       if (!PRIVATE(this)->vbo || !PRIVATE(this)->vbo->hasVBO(contextid)) {
         this->createVBO(contextid);
       }
@@ -487,6 +636,13 @@ InterleavedArraysShape::GLRender(SoGLRenderAction * action)
                                                SoGLCacheContextElement::DONT_AUTO_CACHE);
     }
     else {
+      // the cache is not used here, and is rebuilt if it is needed
+      if (PRIVATE(this)->dirtyend > PRIVATE(this)->dirtystart) {
+        delete PRIVATE(this)->vbo;
+        PRIVATE(this)->vbo = NULL;
+        PRIVATE(this)->clearDirtyRange();
+      }
+
       // fall back to immediate mode rendering
       const SbVec3f * vptr = vp->vertex.getValues(0);
       const SbVec3f * nptr = NULL;
@@ -970,6 +1126,36 @@ InterleavedArraysShape::VBO::setBufferData(const GLvoid * data,
   cc_glglue_glBindBuffer(glue, this->target, 0);
 }
 
+void
+InterleavedArraysShape::VBO::updateBufferData(const GLvoid * data,
+                                              intptr_t offset,
+                                              intptr_t size,
+                                              uint32_t contextid)
+{
+  assert(this->hasVBO(contextid));
+  const cc_glglue * glue = cc_glglue_instance((int) contextid);
+  cc_glglue_glBindBuffer(glue, this->target, this->vbomap[contextid]);
+  cc_glglue_glBufferSubData(glue, this->target, offset, size, data);
+  cc_glglue_glBindBuffer(glue, this->target, 0);
+}
+
+void
+InterleavedArraysShape::VBO::clearOtherContexts(uint32_t contextid)
+{
+  std::map<uint32_t, GLuint>::iterator it = this->vbomap.begin();
+  while (it != this->vbomap.end()) {
+    if (it->first != contextid) {
+      uintptr_t id = (uintptr_t) it->second;
+      SoGLCacheContextElement::scheduleDeleteCallback(it->first, vbo_delete,
+                                                      (void*) id);
+      this->vbomap.erase(it++);
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
 bool 
 InterleavedArraysShape::VBO::hasVBO(uint32_t contextid)
 {
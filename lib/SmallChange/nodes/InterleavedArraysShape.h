@@ -71,6 +71,8 @@ class SMALLCHANGE_DLL_API InterleavedArraysShape : public SoVertexShape {
   virtual void getPrimitiveCount(SoGetPrimitiveCountAction * action);
   virtual void rayPick(SoRayPickAction * action);
 
+  void markDirtyRange(const int start, const int num);
+
 protected:
   virtual void notify(SoNotList * nl);
   virtual ~InterleavedArraysShape();
@@ -94,6 +96,7 @@ private:
   void enableArrays(SoGLRenderAction * action, SbBool normals, SbBool colors, SbBool texcoords);
   void disableArrays(SoGLRenderAction * action, SbBool normals, SbBool colors, SbBool texcoords);
   void createVBO(uint32_t contextid);
+  void updateVBO(uint32_t contextid);
   void createIndexVBO(uint32_t contextid);
   class Pimpl;
   Pimpl * pimpl;
@@ -52,6 +52,7 @@
 #include <Inventor/elements/SoViewVolumeElement.h>
 #include <Inventor/elements/SoViewportRegionElement.h>
 #include <Inventor/errors/SoDebugError.h>
+#include <Inventor/lists/SbList.h>
 #include <Inventor/lists/SbStringList.h>
 #include <Inventor/misc/SoGLImage.h>
 #include <Inventor/misc/SoState.h>
@@ -60,6 +61,7 @@
 #include <Inventor/sensors/SoFieldSensor.h>
 
 #include <SmallChange/misc/SceneryGlue.h>
+#include <SmallChange/misc/SmHeightfield.h>
 #include <SmallChange/nodes/SmScenery.h>
 #include <SmallChange/nodes/SceneryGL.h>
 #include <SmallChange/elements/SmColorGradientElement.h>
@@ -90,6 +92,9 @@
 /*!
   \var SmSFString SmScenery::filename
   \brief The filename for a SIM Scenery database.
+
+  The file can also be a binary heightfield file (see SmHeightfield),
+  which is memory mapped and fed into a cross and line system.
 */
 
 /*!
@@ -233,6 +238,7 @@ public:
   void * cbtexclosure;
 
   ss_system * system;
+  SmHeightfield * heightfield;
   int blocksize;
 
   SoPrimitiveVertex * pvertex;
@@ -259,12 +265,31 @@ public:
   int usevertexarrays;
   uint32_t colorgradientid;
 
+  // compiled color map, see updateColorTable()
+  enum ColorTableMode {
+    COLORTABLE_WHITE,
+    COLORTABLE_DENSE,
+    COLORTABLE_DISCRETE_EVEN,
+    COLORTABLE_INTERPOLATED,
+    COLORTABLE_DISCRETE
+  };
+  SbBool colortablevalid;
+  ColorTableMode colortablemode;
+  double colortablerange[2];
+  double colortablescale;
+  SbList<uint32_t> colortable;
+  SbList<float> colortableelev;
+  SbList<float> colortablergba;
+  void updateColorTable(void);
+  uint32_t lookupColor(const float elevation) const;
+
   SceneryP(void);
   void commonConstructor(void);
 
   void colormaptexchange(void);
   void elevationlinestexchange(void);
 
+  static ss_system * openHeightfield(SmHeightfield * heightfield, const char * filename);
   static void filenamesensor_cb(void * closure, SoSensor * sensor);
   static void blocksensor_cb(void * closure, SoSensor * sensor);
   static void loadsensor_cb(void * closure, SoSensor * sensor);
@@ -291,14 +316,17 @@ SceneryP::SceneryP(void)
   elevationtexsensor(NULL), elevationdistsensor(NULL), elevationoffsensor(NULL),
   elevationthicknesssensor(NULL), elevationemphasissensor(NULL),
   cbtexcb(NULL), cbtexclosure(NULL),
-  system(NULL), blocksize(0), pvertex(NULL), colormaptexid(-1), firstGLRender(TRUE),
+  system(NULL), heightfield(NULL), blocksize(0), pvertex(NULL), colormaptexid(-1), firstGLRender(TRUE),
   lastglcontext(UINT_MAX),
   facedetail(NULL), currhotspot(0.0f, 0.0f, 0.0f), curraction(NULL),
   currstate(NULL), viewid(-1), dummyimage(NULL),
   elevationlinesimage(NULL), elevationlinesdata(NULL),
   elevationlinestexturesize(0),
-  usevertexarrays(TRUE), colorgradientid(0)
+  usevertexarrays(TRUE), colorgradientid(0),
+  colortablevalid(FALSE), colortablemode(COLORTABLE_WHITE), colortablescale(0.0)
 {
+  this->colortablerange[0] = 0.0;
+  this->colortablerange[1] = 0.0;
   this->renderstate.bbmin[0] = 0.0;
   this->renderstate.bbmin[1] = 0.0;
   this->renderstate.bbmin[2] = 0.0;
@@ -602,6 +630,8 @@ SmScenery::~SmScenery(void)
     sc_ssglue_system_close(PRIVATE(this)->system);
     PRIVATE(this)->viewid = -1;
   }
+  delete PRIVATE(this)->heightfield;
+  PRIVATE(this)->heightfield = NULL;
   if (PRIVATE(this)->elevationlinesimage) {
     PRIVATE(this)->elevationlinesimage->unref();
     PRIVATE(this)->elevationlinesimage = NULL;
@@ -856,8 +886,11 @@ SmScenery::GLRender(SoGLRenderAction * action)
     PRIVATE(this)->renderstate.etexscale = 0.0f;
   }
   
+  sc_reset_vbo_cache_stats(&PRIVATE(this)->renderstate);
   PRIVATE(this)->renderstate.renderpass = TRUE;
   sc_ssglue_view_render(PRIVATE(this)->system, PRIVATE(this)->viewid);
+  // draws the blocks that were tessellated by worker threads, if any
+  sc_va_flush_deferred(&PRIVATE(this)->renderstate);
   PRIVATE(this)->renderstate.renderpass = FALSE;
 
   PRIVATE(this)->renderstate.numclipplanes = 0;
@@ -1336,6 +1369,91 @@ SmScenery::getVertexArraysRendering(void) const
   return (SbBool) PRIVATE(this)->usevertexarrays;
 }
 
+/*!
+  Sets whether the tessellated blocks should be kept in vertex buffer
+  objects between frames when vertex array rendering is used. Blocks
+  that are rendered with the same level of detail as in an earlier
+  frame are then drawn straight from graphics memory. Default is
+  TRUE. Has no effect if the OpenGL driver lacks vertex buffer object
+  support.
+
+  \sa setVertexArraysRendering(), setVertexBufferCacheBudget()
+*/
+void
+SmScenery::setVertexBufferCaching(const SbBool onoff)
+{
+  sc_set_use_vbo_cache(&PRIVATE(this)->renderstate, (int) onoff);
+}
+
+/*!
+  Returns whether vertex buffer caching is enabled.
+*/
+SbBool
+SmScenery::getVertexBufferCaching(void) const
+{
+  return (SbBool) sc_get_use_vbo_cache(&PRIVATE(this)->renderstate);
+}
+
+/*!
+  Sets the maximum number of bytes of vertex buffer memory used for
+  cached blocks, per OpenGL context. The least recently used blocks are
+  released first when the budget is exceeded. Default is 64MB.
+*/
+void
+SmScenery::setVertexBufferCacheBudget(const unsigned int bytes)
+{
+  sc_set_vbo_cache_budget(&PRIVATE(this)->renderstate, bytes);
+}
+
+/*!
+  Returns the vertex buffer cache budget in bytes.
+*/
+unsigned int
+SmScenery::getVertexBufferCacheBudget(void) const
+{
+  return sc_get_vbo_cache_budget(&PRIVATE(this)->renderstate);
+}
+
+/*!
+  Returns the number of block cache hits and misses for the last
+  rendered frame, and the number of bytes currently held in vertex
+  buffers for the last used OpenGL context.
+*/
+void
+SmScenery::getVertexBufferCacheStats(int & hits, int & misses, unsigned int & bytes) const
+{
+  sc_get_vbo_cache_stats(&PRIVATE(this)->renderstate, &hits, &misses, &bytes);
+}
+
+/*!
+  Sets the number of worker threads used to tessellate blocks that are
+  not found in the vertex buffer cache. The render traversal then only
+  records the triangle fans of each block, the workers expand them to
+  vertex and index buffers in parallel, and the rendering thread
+  uploads and draws the results when the traversal is done. Blocks are
+  still drawn in traversal order, and the block data is copied for the
+  workers.
+
+  Default is 0, which tessellates in the rendering thread. Only used
+  together with vertex array rendering and vertex buffer caching.
+
+  \sa setVertexBufferCaching()
+*/
+void
+SmScenery::setTessellationThreads(const int numthreads)
+{
+  sc_set_tessellation_threads(&PRIVATE(this)->renderstate, numthreads);
+}
+
+/*!
+  Returns the number of tessellation worker threads.
+*/
+int
+SmScenery::getTessellationThreads(void) const
+{
+  return sc_get_tessellation_threads(&PRIVATE(this)->renderstate);
+}
+
 SbVec3f
 SmScenery::getRenderCoordinateOffset(void) const
 {
@@ -1374,6 +1492,7 @@ SmScenery::refreshTextures(const int id)
   if (id >= 0)
     sc_ssglue_system_refresh_runtime_texture2d(PRIVATE(this)->system, id);
   sc_delete_all_textures(&PRIVATE(this)->renderstate);
+  sc_invalidate_vbo_cache(&PRIVATE(this)->renderstate);
 }
 
 // *************************************************************************
@@ -1388,6 +1507,71 @@ SceneryP::renderseqsensor_cb(void * closure, SoSensor * sensor)
   thisp->refreshTextures(-1);
 }
 
+/*
+  Sets up a cross and line system for a binary heightfield file (see
+  SmHeightfield). The tiles are passed straight from the memory
+  mapped file, so there is no parsing or intermediate copy of the
+  grid, except for tiles that need row flipping or undef remapping.
+*/
+ss_system *
+SceneryP::openHeightfield(SmHeightfield * heightfield, const char * filename)
+{
+  if (!heightfield->open(filename)) { return NULL; }
+
+  double origin[2], spacing[2];
+  heightfield->getOrigin(origin);
+  heightfield->getSpacing(spacing);
+  const int cols = heightfield->getColumns();
+  const int rows = heightfield->getRows();
+  // rows stored north to south are fed bottom up
+  const SbBool flip = spacing[1] < 0.0;
+  if (flip) {
+    spacing[1] = -spacing[1];
+    origin[1] -= spacing[1] * (rows - 1);
+  }
+  int elements[2] = { cols, rows };
+  ss_system * system = sc_ssglue_system_create_for_cross_and_line(1, origin, spacing, elements);
+  if (!system) { return NULL; }
+  const int dataset = sc_ssglue_system_add_dataset(system, SS_ELEVATION_TYPE, filename, 0);
+  if (dataset < 0) {
+    sc_ssglue_system_close(system);
+    return NULL;
+  }
+
+  const float fileundef = heightfield->getUndefValue();
+  const float undef = sc_ssglue_system_get_undef_elevation(system);
+  const int tilesize = heightfield->getTileSize();
+  float * line = (float *) malloc(tilesize * sizeof(float));
+
+  for (int ty = 0; ty < heightfield->getNumTilesY(); ty++) {
+    const int numline = SbMin(tilesize, rows - ty * tilesize);
+    for (int tx = 0; tx < heightfield->getNumTilesX(); tx++) {
+      const int numcross = SbMin(tilesize, cols - tx * tilesize);
+      const float * tile = heightfield->getTile(tx, ty);
+      if (!flip && (fileundef == undef) && (numcross == tilesize)) {
+        sc_ssglue_system_set_dataset_cross_and_line_data(system, dataset, 0, 0,
+                                                         tx * tilesize, ty * tilesize,
+                                                         numcross, numline,
+                                                         const_cast<float *>(tile));
+        continue;
+      }
+      for (int y = 0; y < numline; y++) {
+        const float * src = tile + y * tilesize;
+        for (int x = 0; x < numcross; x++) {
+          line[x] = (src[x] == fileundef) ? undef : src[x];
+        }
+        const int row = ty * tilesize + y;
+        sc_ssglue_system_set_dataset_cross_and_line_data(system, dataset, 0, 0,
+                                                         tx * tilesize,
+                                                         flip ? (rows - 1 - row) : row,
+                                                         numcross, 1, line);
+      }
+    }
+  }
+  free(line);
+  return system;
+}
+
 void 
 SceneryP::filenamesensor_cb(void * closure, SoSensor * sensor)
 {
@@ -1406,6 +1590,8 @@ SceneryP::filenamesensor_cb(void * closure, SoSensor * sensor)
   PRIVATE(thisp)->viewid = -1;
   PRIVATE(thisp)->system = NULL;
   PRIVATE(thisp)->colormaptexid = -1;
+  delete PRIVATE(thisp)->heightfield;
+  PRIVATE(thisp)->heightfield = NULL;
 
   const SbStringList & pathlist = SoInput::getDirectories();
   SbString s = thisp->filename.getValue();
@@ -1418,12 +1604,22 @@ SceneryP::filenamesensor_cb(void * closure, SoSensor * sensor)
     if (!PRIVATE(thisp)->system) {
       int i;
       for (i = -1; (PRIVATE(thisp)->system == NULL) && (i < pathlist.getLength()); i++) {
-        if (i == -1) {
-          PRIVATE(thisp)->system = sc_ssglue_system_open(s.getString(), 1);
-        } else {
-          SbString path = *(pathlist[i]);
+        SbString path = s;
+        if (i != -1) {
+          path = *(pathlist[i]);
           path += "/";
           path += s;
+        }
+        if (SmHeightfield::isHeightfieldFile(path.getString())) {
+          PRIVATE(thisp)->heightfield = new SmHeightfield;
+          PRIVATE(thisp)->system =
+            SceneryP::openHeightfield(PRIVATE(thisp)->heightfield, path.getString());
+          if (!PRIVATE(thisp)->system) {
+            delete PRIVATE(thisp)->heightfield;
+            PRIVATE(thisp)->heightfield = NULL;
+          }
+        }
+        else {
           PRIVATE(thisp)->system = sc_ssglue_system_open(path.getString(), 1);
         }
       }
@@ -1520,6 +1716,9 @@ SceneryP::elevationlinessensor_cb(void * closure, SoSensor * sensor)
 void
 SceneryP::colormaptexchange(void)
 {
+  // the color map has changed, so the lookup table must be rebuilt
+  // even if the elevation range is the same
+  this->colortablevalid = FALSE;
   if (this->colormaptexid != -1) {
     PUBLIC(this)->refreshTextures(this->colormaptexid);
   }
@@ -1762,147 +1961,201 @@ SmScenery::ray_culling_post_cb(void * closure)
 /* ********************************************************************** */
 // DYNAMIC TEXTURING
 
-uint32_t
-SmScenery::colortexture_cb(void * closure, double * pos, float elevation, double * spacing)
+static inline uint32_t
+sm_pack_abgr(const float r, const float g, const float b, const float a)
 {
-  assert(closure);
-  SmScenery * thisp = (SmScenery *) closure;
-  assert(thisp->isOfType(SmScenery::getClassTypeId()));
+  int nr = (int) (SbClamp(r, 0.0f, 1.0f) * 255.0);
+  int ng = (int) (SbClamp(g, 0.0f, 1.0f) * 255.0);
+  int nb = (int) (SbClamp(b, 0.0f, 1.0f) * 255.0);
+  int na = (int) (SbClamp(a, 0.0f, 1.0f) * 255.0);
+  return (na << 24) | (nb << 16) | (ng << 8) | nr;
+}
 
-  const RenderState & rs = PRIVATE(thisp)->renderstate;
-  uint32_t abgr = 0xffffffff; // default color to white
-  if (rs.bbmax[2] == rs.bbmin[2]) return abgr;
+// Compiles colorTexturing, colorMap, colorElevation and the elevation
+// range into the table used by lookupColor(). Invalidated by the
+// color texture sensors, and rebuilt when the elevation range has
+// changed.
+void
+SceneryP::updateColorTable(void)
+{
+  const RenderState & rs = this->renderstate;
+  if (this->colortablevalid &&
+      (this->colortablerange[0] == rs.bbmin[2]) &&
+      (this->colortablerange[1] == rs.bbmax[2])) {
+    return;
+  }
+
+  SmScenery * thisp = PUBLIC(this);
+  this->colortablevalid = TRUE;
+  this->colortablerange[0] = rs.bbmin[2];
+  this->colortablerange[1] = rs.bbmax[2];
+  this->colortablemode = COLORTABLE_WHITE;
+  this->colortable.truncate(0);
+  this->colortableelev.truncate(0);
+  this->colortablergba.truncate(0);
+
+  if (rs.bbmax[2] == rs.bbmin[2]) return;
+
+  const float * cmap = thisp->colorMap.getValues(0);
+  const int numcolors = thisp->colorMap.getNum() / 4; // four components
+  const float * celev = thisp->colorElevation.getValues(0);
+  const int max = thisp->colorElevation.getNum();
+  int i;
 
   if (thisp->colorTexturing.getValue() == SmScenery::INTERPOLATED) {
-    if (thisp->colorElevation.getNum() == 0) {
+    if (max == 0) {
       // interpolate color table evenly over elevation range
-      float fac = (float) ((elevation - rs.bbmin[2]) /
-                           (rs.bbmax[2] - rs.bbmin[2]));
-      int steps = ((thisp->colorMap.getNum() / 4) - 1); // four components
-      if (steps == 0) { // only one color given
-        int nr = (int) (SbClamp(thisp->colorMap[0], 0.0f, 1.0f) * 255.0f);
-        int ng = (int) (SbClamp(thisp->colorMap[1], 0.0f, 1.0f) * 255.0f);
-        int nb = (int) (SbClamp(thisp->colorMap[2], 0.0f, 1.0f) * 255.0f);
-        int na = (int) (SbClamp(thisp->colorMap[3], 0.0f, 1.0f) * 255.0f);
-        abgr = (na << 24) | (nb << 16) | (ng << 8) | nr;
-      }
-      else if (steps > 0) { // interpolate color
+      const int steps = numcolors - 1;
+      if (steps < 0) return;
+      // dense table, fine enough to be within one color level of the
+      // exact interpolation
+      const int size = SbMax(1024, steps * 256) + 1;
+      for (i = 0; i < size; i++) {
+        const float fac = float(i) / float(size - 1);
         int startcolidx = (int) floor(float(steps) * fac);
         float rest = (float(steps) * fac) - float(startcolidx);
-        float r = thisp->colorMap[startcolidx * 4 + 0];
-        float g = thisp->colorMap[startcolidx * 4 + 1];
-        float b = thisp->colorMap[startcolidx * 4 + 2];
-        float a = thisp->colorMap[startcolidx * 4 + 3];
+        if (startcolidx >= steps) { startcolidx = steps; rest = 0.0f; }
+        const float * c0 = cmap + startcolidx * 4;
         if (rest > 0.0f) {
-          assert(rest < 1.0f);
-          float end_r = thisp->colorMap[startcolidx * 4 + 4];
-          float end_g = thisp->colorMap[startcolidx * 4 + 5];
-          float end_b = thisp->colorMap[startcolidx * 4 + 6];
-          float end_a = thisp->colorMap[startcolidx * 4 + 7];
-          r = r * (1.0f - rest) + end_r * rest;
-          g = g * (1.0f - rest) + end_g * rest;
-          b = b * (1.0f - rest) + end_b * rest;
-          a = a * (1.0f - rest) + end_a * rest;
+          const float * c1 = c0 + 4;
+          this->colortable.append(sm_pack_abgr(c0[0] * (1.0f - rest) + c1[0] * rest,
+                                               c0[1] * (1.0f - rest) + c1[1] * rest,
+                                               c0[2] * (1.0f - rest) + c1[2] * rest,
+                                               c0[3] * (1.0f - rest) + c1[3] * rest));
+        }
+        else {
+          this->colortable.append(sm_pack_abgr(c0[0], c0[1], c0[2], c0[3]));
         }
-        int nr = (int) (SbClamp(r, 0.0f, 1.0f) * 255.0);
-        int ng = (int) (SbClamp(g, 0.0f, 1.0f) * 255.0);
-        int nb = (int) (SbClamp(b, 0.0f, 1.0f) * 255.0);
-        int na = (int) (SbClamp(a, 0.0f, 1.0f) * 255.0);
-        abgr = (na << 24) | (nb << 16) | (ng << 8) | nr;
       }
-    } else {
-      if ((thisp->colorElevation.getNum() * 4) != thisp->colorMap.getNum()) {
+      this->colortablescale = double(size - 1) / (rs.bbmax[2] - rs.bbmin[2]);
+      this->colortablemode = COLORTABLE_DENSE;
+    }
+    else {
+      if ((max * 4) != thisp->colorMap.getNum()) {
         SoDebugError::post("SmScenery::colortexture_cb", "size of colorElevation does not match size of colorMap");
         thisp->colorTexturing.setValue(SmScenery::DISABLED);
-        return abgr;
+        return;
       }
       // use elevation values to decide colors
-      const int max = thisp->colorElevation.getNum();
-      int i;
-      for (i = 0; (i < max) && (elevation > thisp->colorElevation[i]); i++) { }
-      if (i == 0) {
-        // first color
-        int nr = (int) (SbClamp(thisp->colorMap[0], 0.0f, 1.0f) * 255.0f);
-        int ng = (int) (SbClamp(thisp->colorMap[1], 0.0f, 1.0f) * 255.0f);
-        int nb = (int) (SbClamp(thisp->colorMap[2], 0.0f, 1.0f) * 255.0f);
-        int na = (int) (SbClamp(thisp->colorMap[3], 0.0f, 1.0f) * 255.0f);
-        abgr = (na << 24) | (nb << 16) | (ng << 8) | nr;
-      }
-      else if (i == max) {
-        // last color
-        int nr = (int) (SbClamp(thisp->colorMap[(i-1)*4+0], 0.0f, 1.0f) * 255.0f);
-        int ng = (int) (SbClamp(thisp->colorMap[(i-1)*4+1], 0.0f, 1.0f) * 255.0f);
-        int nb = (int) (SbClamp(thisp->colorMap[(i-1)*4+2], 0.0f, 1.0f) * 255.0f);
-        int na = (int) (SbClamp(thisp->colorMap[(i-1)*4+3], 0.0f, 1.0f) * 255.0f);
-        abgr = (na << 24) | (nb << 16) | (ng << 8) | nr;
-      }
-      else {
-        // interpolated color
-        float fac =
-          (elevation - thisp->colorElevation[i-1]) /
-          (thisp->colorElevation[i] - thisp->colorElevation[i-1]);
-        float r = thisp->colorMap[(i-1) * 4 + 0];
-        float g = thisp->colorMap[(i-1) * 4 + 1];
-        float b = thisp->colorMap[(i-1) * 4 + 2];
-        float a = thisp->colorMap[(i-1) * 4 + 3];
-        float end_r = thisp->colorMap[i * 4 + 0];
-        float end_g = thisp->colorMap[i * 4 + 1];
-        float end_b = thisp->colorMap[i * 4 + 2];
-        float end_a = thisp->colorMap[i * 4 + 3];
-        r = r * (1.0f - fac) + end_r * fac;
-        g = g * (1.0f - fac) + end_g * fac;
-        b = b * (1.0f - fac) + end_b * fac;
-        a = a * (1.0f - fac) + end_a * fac;
-        int nr = (int) (SbClamp(r, 0.0f, 1.0f) * 255.0);
-        int ng = (int) (SbClamp(g, 0.0f, 1.0f) * 255.0);
-        int nb = (int) (SbClamp(b, 0.0f, 1.0f) * 255.0);
-        int na = (int) (SbClamp(a, 0.0f, 1.0f) * 255.0);
-        abgr = (na << 24) | (nb << 16) | (ng << 8) | nr;
+      for (i = 0; i < max; i++) {
+        this->colortableelev.append(celev[i]);
+        this->colortable.append(sm_pack_abgr(cmap[i*4+0], cmap[i*4+1], cmap[i*4+2], cmap[i*4+3]));
+        for (int c = 0; c < 4; c++) { this->colortablergba.append(cmap[i*4+c]); }
       }
+      this->colortablemode = COLORTABLE_INTERPOLATED;
     }
   }
   else if (thisp->colorTexturing.getValue() == SmScenery::DISCRETE) {
-    if (thisp->colorElevation.getNum() == 0) {
+    if (max == 0) {
       // distribute colors evenly
-      int colors = thisp->colorMap.getNum() / 4;
-      int color = (int) floor(((elevation - rs.bbmin[2]) / ((rs.bbmax[2] - rs.bbmin[2]) * 1.00001)) * float(colors));
-      float r = thisp->colorMap[color * 4 + 0];
-      float g = thisp->colorMap[color * 4 + 1];
-      float b = thisp->colorMap[color * 4 + 2];
-      float a = thisp->colorMap[color * 4 + 3];
-      int nr = (int) (SbClamp(r, 0.0f, 1.0f) * 255.0);
-      int ng = (int) (SbClamp(g, 0.0f, 1.0f) * 255.0);
-      int nb = (int) (SbClamp(b, 0.0f, 1.0f) * 255.0);
-      int na = (int) (SbClamp(a, 0.0f, 1.0f) * 255.0);
-      abgr = (na << 24) | (nb << 16) | (ng << 8) | nr;
+      if (numcolors == 0) return;
+      for (i = 0; i < numcolors; i++) {
+        this->colortable.append(sm_pack_abgr(cmap[i*4+0], cmap[i*4+1], cmap[i*4+2], cmap[i*4+3]));
+      }
+      this->colortablescale = double(numcolors) / ((rs.bbmax[2] - rs.bbmin[2]) * 1.00001);
+      this->colortablemode = COLORTABLE_DISCRETE_EVEN;
     }
     else {
       // distribute colors based on elevation value table
-      const int max = thisp->colorElevation.getNum();
       if (((max + 1) * 4) != (thisp->colorMap.getNum())) {
         SoDebugError::post("SmScenery::colortexture_cb", "size of colorElevation does not match size of colorMap");
         thisp->colorTexturing.setValue(SmScenery::DISABLED);
-        return abgr;
+        return;
       }
-      // use elevation values to decide colors
-      int i;
-      for (i = 1; (i <= max) && (elevation > thisp->colorElevation[i-1]); i++) { }
-      i = i - 1;
-      float r = thisp->colorMap[i * 4 + 0];
-      float g = thisp->colorMap[i * 4 + 1];
-      float b = thisp->colorMap[i * 4 + 2];
-      float a = thisp->colorMap[i * 4 + 3];
-      int nr = (int) (SbClamp(r, 0.0f, 1.0f) * 255.0);
-      int ng = (int) (SbClamp(g, 0.0f, 1.0f) * 255.0);
-      int nb = (int) (SbClamp(b, 0.0f, 1.0f) * 255.0);
-      int na = (int) (SbClamp(a, 0.0f, 1.0f) * 255.0);
-      abgr = (na << 24) | (nb << 16) | (ng << 8) | nr;
+      for (i = 0; i < max; i++) {
+        this->colortableelev.append(celev[i]);
+      }
+      for (i = 0; i <= max; i++) {
+        this->colortable.append(sm_pack_abgr(cmap[i*4+0], cmap[i*4+1], cmap[i*4+2], cmap[i*4+3]));
+      }
+      this->colortablemode = COLORTABLE_DISCRETE;
     }
   }
-  else {
-    // disabled?
+}
+
+// index of the first breakpoint not below the elevation (the
+// breakpoints are expected to be sorted in ascending order)
+static inline int
+sm_find_breakpoint(const float * elev, const int num, const float elevation)
+{
+  int lo = 0, hi = num;
+  while (lo < hi) {
+    const int mid = (lo + hi) >> 1;
+    if (elevation > elev[mid]) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+inline uint32_t
+SceneryP::lookupColor(const float elevation) const
+{
+  const uint32_t * table = this->colortable.getArrayPtr();
+  switch (this->colortablemode) {
+  case COLORTABLE_DENSE:
+    {
+      const int last = this->colortable.getLength() - 1;
+      const double pos = (elevation - this->colortablerange[0]) * this->colortablescale;
+      if (pos <= 0.0) return table[0];
+      if (pos >= double(last)) return table[last];
+      return table[(int) (pos + 0.5)];
+    }
+  case COLORTABLE_DISCRETE_EVEN:
+    {
+      const int last = this->colortable.getLength() - 1;
+      const double pos = (elevation - this->colortablerange[0]) * this->colortablescale;
+      if (pos <= 0.0) return table[0];
+      const int idx = (int) floor(pos);
+      return table[(idx > last) ? last : idx];
+    }
+  case COLORTABLE_INTERPOLATED:
+    {
+      const int max = this->colortableelev.getLength();
+      const float * elev = this->colortableelev.getArrayPtr();
+      const int i = sm_find_breakpoint(elev, max, elevation);
+      if (i == 0) return table[0]; // first color
+      if (i == max) return table[max-1]; // last color
+      // interpolated color
+      const float fac = (elevation - elev[i-1]) / (elev[i] - elev[i-1]);
+      const float * c0 = this->colortablergba.getArrayPtr() + (i-1) * 4;
+      const float * c1 = c0 + 4;
+      return sm_pack_abgr(c0[0] * (1.0f - fac) + c1[0] * fac,
+                          c0[1] * (1.0f - fac) + c1[1] * fac,
+                          c0[2] * (1.0f - fac) + c1[2] * fac,
+                          c0[3] * (1.0f - fac) + c1[3] * fac);
+    }
+  case COLORTABLE_DISCRETE:
+    return table[sm_find_breakpoint(this->colortableelev.getArrayPtr(),
+                                    this->colortableelev.getLength(), elevation)];
+  default:
+    return 0xffffffff; // default color to white
+  }
+}
+
+uint32_t
+SmScenery::colortexture_cb(void * closure, double * pos, float elevation, double * spacing)
+{
+  assert(closure);
+  SmScenery * thisp = (SmScenery *) closure;
+  assert(thisp->isOfType(SmScenery::getClassTypeId()));
+
+  PRIVATE(thisp)->updateColorTable();
+  return PRIVATE(thisp)->lookupColor(elevation);
+}
+
+/*!
+  Fills \a abgr with the colors the color texture callback would
+  produce for \a num elevation values, typically a row of texels.
+
+  \sa colorTexturing, colorMap, colorElevation
+*/
+void
+SmScenery::getColorTextureRow(const float * elevations, const int num, uint32_t * abgr)
+{
+  PRIVATE(this)->updateColorTable();
+  for (int i = 0; i < num; i++) {
+    abgr[i] = PRIVATE(this)->lookupColor(elevations[i]);
   }
-  return abgr;
 }
 
 SbBool 
@@ -2005,6 +2258,7 @@ SmScenery::deleteElevationDataset(int datasetid)
 {
   if (!sc_scenery_available()) { return -1; }
   assert(PRIVATE(this)->system);
+  sc_invalidate_vbo_cache(&PRIVATE(this)->renderstate);
   return sc_ssglue_system_delete_dataset(PRIVATE(this)->system, datasetid);
 }
 
@@ -2013,6 +2267,7 @@ SmScenery::setCrossAndLineElevationData(int datasetid, int lodlevel, int startcr
 {
   if (!sc_scenery_available()) { return; }
   assert(PRIVATE(this)->system);
+  sc_invalidate_vbo_cache(&PRIVATE(this)->renderstate);
   sc_ssglue_system_set_dataset_cross_and_line_data(PRIVATE(this)->system, datasetid, lodlevel, 0, startcross, startline, numcross, numline, elevationvalues);
 }
 
@@ -2021,6 +2276,7 @@ SmScenery::changeDatasetProximity(int datasetid, int numdatasets, int * datasets
 {
   if (!sc_scenery_available()) { return; }
   assert(PRIVATE(this)->system);
+  sc_invalidate_vbo_cache(&PRIVATE(this)->renderstate);
   sc_ssglue_system_change_dataset_proximity(PRIVATE(this)->system, datasetid, numdatasets, datasets, epsilon, newval);
 }
 
@@ -2029,6 +2285,7 @@ SmScenery::cullDatasetAbove(int datasetid, int numdatasets, int * datasets, floa
 {
   if (!sc_scenery_available()) { return; }
   assert(PRIVATE(this)->system);
+  sc_invalidate_vbo_cache(&PRIVATE(this)->renderstate);
   sc_ssglue_system_cull_dataset_above(PRIVATE(this)->system, datasetid, numdatasets, datasets, distance);
 }
 
@@ -2037,6 +2294,7 @@ SmScenery::cullDatasetBelow(int datasetid, int numdatasets, int * datasets, floa
 {
   if (!sc_scenery_available()) { return; }
   assert(PRIVATE(this)->system);
+  sc_invalidate_vbo_cache(&PRIVATE(this)->renderstate);
   sc_ssglue_system_cull_dataset_below(PRIVATE(this)->system, datasetid, numdatasets, datasets, distance);
 }
 
@@ -2045,6 +2303,7 @@ SmScenery::oversampleDataset(int datasetid)
 {
   if (!sc_scenery_available()) { return; }
   assert(PRIVATE(this)->system);
+  sc_invalidate_vbo_cache(&PRIVATE(this)->renderstate);
   sc_ssglue_system_oversample_dataset(PRIVATE(this)->system, datasetid);
 }
 
@@ -2053,6 +2312,7 @@ SmScenery::smoothDataset(int datasetid)
 {
   if (!sc_scenery_available()) { return; }
   assert(PRIVATE(this)->system);
+  sc_invalidate_vbo_cache(&PRIVATE(this)->renderstate);
   sc_ssglue_system_smooth_dataset(PRIVATE(this)->system, datasetid);
 }
 
@@ -2061,6 +2321,7 @@ SmScenery::stripVerticals(int datasetid, float dropsize)
 {
   if (!sc_scenery_available()) { return; }
   assert(PRIVATE(this)->system);
+  sc_invalidate_vbo_cache(&PRIVATE(this)->renderstate);
   sc_ssglue_system_strip_verticals(PRIVATE(this)->system, datasetid, dropsize);
 }
 
@@ -2069,6 +2330,7 @@ SmScenery::stripHorizontals(int datasetid, float maxskew)
 {
   if (!sc_scenery_available()) { return; }
   assert(PRIVATE(this)->system);
+  sc_invalidate_vbo_cache(&PRIVATE(this)->renderstate);
   sc_ssglue_system_strip_horizontals(PRIVATE(this)->system, datasetid, maxskew);
 }
 
@@ -34,6 +34,8 @@
 #include <SmallChange/misc/SceneryGlue.h>
 #include <SmallChange/nodes/SceneryGL.h>
 #include <Inventor/errors/SoDebugError.h>
+#include <Inventor/C/threads/sched.h>
+#include <Inventor/elements/SoGLCacheContextElement.h>
 
 #ifdef HAVE_WINDOWS_H
 #include <windows.h>
@@ -45,8 +47,15 @@
 #include <assert.h>
 #include <stdlib.h> // atoi()
 #include <stdio.h>
+#include <stddef.h> // ptrdiff_t
+#include <string.h> // memcmp()
 #include <math.h> // fmod()
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define SC_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
 #ifdef HAVE_DLFCN_H
 #include <dlfcn.h>
 #endif // HAVE_DLFCN_H
@@ -66,6 +75,9 @@
 // the number of frames a texture can be unused before being recycled
 #define MAX_UNUSED_COUNT 200
 
+// default GPU memory budget for the block vertex buffer cache
+#define DEFAULT_VBO_CACHE_BUDGET (64*1024*1024)
+
 #define VA_INTERLEAVED 1
 
 #ifdef SS_SCENERY_H
@@ -101,6 +113,18 @@
 #define GL_OCCLUSION_TEST_RESULT_HP       0x8166
 #endif /* !GL_OCCLUSION_TEST_RESULT_HP */
 
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER                   0x8892
+#endif /* !GL_ARRAY_BUFFER */
+
+#ifndef GL_ELEMENT_ARRAY_BUFFER
+#define GL_ELEMENT_ARRAY_BUFFER           0x8893
+#endif /* !GL_ELEMENT_ARRAY_BUFFER */
+
+#ifndef GL_STATIC_DRAW
+#define GL_STATIC_DRAW                    0x88E4
+#endif /* !GL_STATIC_DRAW */
+
 /* ********************************************************************** */
 /* GL setup */
 
@@ -125,6 +149,11 @@ typedef void (APIENTRY * glDrawArrays_f)(GLenum mode, GLint first, GLsizei count
 typedef void (APIENTRY * glDrawElements_f)(GLenum mode, GLsizei count, GLenum type, const GLvoid * ptr);
 // 1.2
 typedef void (APIENTRY * glDrawRangeElements_f)( GLenum mode, GLuint start, GLuint end, GLsizei count, GLenum type, const GLvoid *indices );
+// 1.5
+typedef void (APIENTRY * glGenBuffers_f)(GLsizei n, GLuint * buffers);
+typedef void (APIENTRY * glBindBuffer_f)(GLenum target, GLuint buffer);
+typedef void (APIENTRY * glBufferData_f)(GLenum target, ptrdiff_t size, const GLvoid * data, GLenum usage);
+typedef void (APIENTRY * glDeleteBuffers_f)(GLsizei n, const GLuint * buffers);
 
 
 // FIXME: there is a lot of duplicated effort in the OpenGL capability
@@ -170,6 +199,12 @@ struct sc_GL {
   glDrawElements_f glDrawElements;
   glDrawRangeElements_f glDrawRangeElements;
 
+  // vertex buffer objects
+  glGenBuffers_f glGenBuffers;
+  glBindBuffer_f glBindBuffer;
+  glBufferData_f glBufferData;
+  glDeleteBuffers_f glDeleteBuffers;
+
   // normalmaps
 
   // occlusion
@@ -186,6 +221,7 @@ struct sc_GL {
   int HAVE_NORMALMAPS;
   int HAVE_OCCLUSIONTEST;
   int USE_OCCLUSIONTEST;
+  int HAVE_VBO;
 };
 
 static SbHash<struct sc_GL *, unsigned int> * glctxhash = NULL;
@@ -224,6 +260,11 @@ GLi(const unsigned int ctxid)
       NULL,     // glDrawElements
       NULL,     // glDrawRangeElements
 
+      NULL,     // glGenBuffers
+      NULL,     // glBindBuffer
+      NULL,     // glBufferData
+      NULL,     // glDeleteBuffers
+
       GL_CLAMP, // clamp_to_edge
       TRUE,     // USE_BYTENORMALS
       TRUE,     // SUGGEST_BYTENORMALS
@@ -233,7 +274,8 @@ GLi(const unsigned int ctxid)
       FALSE,    // SUGGEST_VERTEXARRAYS
       FALSE,    // HAVE_NORMALMAPS
       FALSE,    // HAVE_OCCLUSIONTEST
-      FALSE     // USE_OCCLUSIONTEST
+      FALSE,    // USE_OCCLUSIONTEST
+      FALSE     // HAVE_VBO
     };
 
     // FIXME: there's got to be a more elegant way to alloc and init?
@@ -278,6 +320,12 @@ GL_FUNCTION_SETTER(glDrawArrays)
 GL_FUNCTION_SETTER(glDrawElements)
 GL_FUNCTION_SETTER(glDrawRangeElements)
 
+/* vertex buffer objects */
+GL_FUNCTION_SETTER(glGenBuffers)
+GL_FUNCTION_SETTER(glBindBuffer)
+GL_FUNCTION_SETTER(glBufferData)
+GL_FUNCTION_SETTER(glDeleteBuffers)
+
 #undef GL_FUNCTION_SETTER
 
 void
@@ -345,6 +393,12 @@ sc_suggest_bytenormals(unsigned int ctxid)
   return GLi(ctxid)->SUGGEST_BYTENORMALS;
 }
 
+int
+sc_found_vbo(unsigned int ctxid)
+{
+  return GLi(ctxid)->HAVE_VBO;
+}
+
 /* ********************************************************************** */
 
 #ifdef HAVE_WINDOWS_H
@@ -683,6 +737,35 @@ sc_probe_gl(const unsigned int ctxid, sc_msghandler_fp msghandler)
   // It is currently the preferred rendering loop.
   GL->SUGGEST_VERTEXARRAYS = GL->HAVE_VERTEXARRAYS;
 
+  // Buffer objects are core from OpenGL 1.5, and are used for caching
+  // the tessellated blocks on the GPU between frames.
+  sc_set_glGenBuffers(ctxid, NULL);
+  sc_set_glBindBuffer(ctxid, NULL);
+  sc_set_glBufferData(ctxid, NULL);
+  sc_set_glDeleteBuffers(ctxid, NULL);
+  GL->HAVE_VBO = FALSE;
+  if ( GL->HAVE_VERTEXARRAYS &&
+       ((major > 1) || (minor >= 5) ||
+        (exts && strstr(exts, "GL_ARB_vertex_buffer_object "))) ) {
+    GL_PROC_SEARCH(ptr, glGenBuffers);
+    sc_set_glGenBuffers(ctxid, ptr);
+    GL_PROC_SEARCH(ptr, glBindBuffer);
+    sc_set_glBindBuffer(ctxid, ptr);
+    GL_PROC_SEARCH(ptr, glBufferData);
+    sc_set_glBufferData(ctxid, ptr);
+    GL_PROC_SEARCH(ptr, glDeleteBuffers);
+    sc_set_glDeleteBuffers(ctxid, ptr);
+    if ( GL->glGenBuffers && GL->glBindBuffer &&
+         GL->glBufferData && GL->glDeleteBuffers ) {
+      GL->HAVE_VBO = TRUE;
+    }
+  }
+  if ( msghandler ) {
+    msghandler(GL->HAVE_VBO ?
+               "PROBE: installed vertex buffer object support\n" :
+               "PROBE: vertex buffer objects not supported\n");
+  }
+
   APP_HANDLE_CLOSE(handle);
 
   free(buf);
@@ -699,6 +782,89 @@ sc_probe_gl(const unsigned int ctxid, sc_msghandler_fp msghandler)
 
 /* ********************************************************************** */
 
+// Everything the contents of a tessellated block depend on, except
+// for the tessellation itself (the fan list). Compared with memcmp(),
+// so always memset() before filling in.
+struct sc_vbo_blockkey {
+  const float * elevdata;
+  double voffset[2];
+  double vspacing[2];
+  unsigned int texid;
+  float toffset[2];
+  float tscale[2];
+  float etexscale;
+  float etexoffset;
+  int layout;
+  unsigned int generation;
+};
+
+// vertex layout flags
+#define SC_VBO_NORMALS     0x01
+#define SC_VBO_BYTENORMALS 0x02
+#define SC_VBO_TEXCOORD1   0x04
+#define SC_VBO_TEXCOORD2   0x08
+
+// fan record types
+#define SC_VBO_FAN         0
+#define SC_VBO_UNDEF_FAN   1
+#define SC_VBO_FAN_RECORD  5 /* type, x, y, len, bitmask */
+
+struct sc_vbo_entry {
+  struct sc_vbo_blockkey key;
+  uintptr_t hashkey;
+  SbList<int> fans;
+  GLuint buffers[2]; // vertex data, indices
+  GLenum indextype;
+  int numindices;
+  int normaloffset;
+  int texcoord1offset;
+  int texcoord2offset;
+  unsigned int bytes;
+  struct sc_vbo_entry * prev; // LRU chain, most recently used first
+  struct sc_vbo_entry * next;
+  struct sc_vbo_entry * hashnext; // entries with the same hash key
+};
+
+// a block waiting to be tessellated and uploaded
+struct sc_vbo_tessjob {
+  struct sc_vbo_blockkey key;
+  uintptr_t hashkey;
+  SbList<int> fans;
+  const float * elevdata;
+  const signed char * normaldata;
+  int ownsdata; // elevdata and normaldata are copies
+  int blocksize;
+  float invtsizescale[2];
+
+  // result
+  char * data;
+  int size;
+  int normaloffset;
+  int texcoord1offset;
+  int texcoord2offset;
+  void * indices;
+  GLenum indextype;
+  int indexsize;
+  int numindices;
+};
+
+// a block to be drawn in sc_va_flush_deferred(), either from the
+// cache or from a job that is being tessellated
+struct sc_vbo_drawitem {
+  struct sc_vbo_entry * entry;
+  struct sc_vbo_tessjob * job;
+};
+
+struct sc_vbo_cache {
+  sc_vbo_cache(void) : head(NULL), tail(NULL), bytes(0) { }
+  SbHash<struct sc_vbo_entry *, uintptr_t> entries;
+  struct sc_vbo_entry * head;
+  struct sc_vbo_entry * tail;
+  unsigned int bytes;
+};
+
+/* ********************************************************************** */
+
 struct RenderStateP {
   RenderStateP(void)
   {
@@ -712,6 +878,17 @@ struct RenderStateP {
     this->glcontextidset = FALSE;
 
     this->activetexturecontext = UINT_MAX;
+
+    this->usevbocache = TRUE;
+    this->vbobudget = DEFAULT_VBO_CACHE_BUDGET;
+    this->vbogeneration = 0;
+    this->vborecording = FALSE;
+    this->vbohits = 0;
+    this->vbomisses = 0;
+    this->vbobytes = 0;
+
+    this->tessthreads = 0;
+    this->tesssched = NULL;
   }
 
   ~RenderStateP()
@@ -723,6 +900,7 @@ struct RenderStateP {
 
   SbHash<SbHash<class TexInfo *, unsigned int> *, unsigned int> contexthashes;
   SbList<int> cullstate;
+  float cullplanes[4 * SC_MAX_CULL_PLANES];
 
   unsigned int glcontextid;
   int glcontextidset;
@@ -751,6 +929,23 @@ struct RenderStateP {
   float texture1[10*2];
   float texture2[10*2];
 
+  // vertex buffer object cache
+  SbHash<struct sc_vbo_cache *, unsigned int> vbocaches;
+  int usevbocache;
+  unsigned int vbobudget;
+  unsigned int vbogeneration;
+  int vborecording;
+  int vbohits;
+  int vbomisses;
+  unsigned int vbobytes;
+  struct sc_vbo_blockkey vbokey;
+  SbList<int> fanlist;
+
+  // threaded tessellation
+  int tessthreads;
+  cc_sched * tesssched;
+  SbList<struct sc_vbo_drawitem> drawqueue;
+
   // post-block loop
   SbList<float> vertexarray;
   SbList<signed char> normalarray;
@@ -925,6 +1120,8 @@ void
 sc_renderstate_destruct(RenderState * state)
 {
   sc_delete_all_textures(state);
+  sc_set_tessellation_threads(state, 0);
+  sc_delete_all_vbos(state);
 
   delete PRIVATE(state);
   PRIVATE(state) = NULL;
@@ -1084,6 +1281,713 @@ sc_texture_hash_inc_unused(const unsigned int & key, TexInfo * const & tex, void
   tex->unusedcount++;
 }
 
+/* ********************************************************************** */
+/* vertex buffer object cache */
+
+/*
+ * When vertex arrays are used, the tessellated blocks are kept in
+ * buffer objects on the GPU between frames. The render callbacks
+ * just record the triangle fans the scenery library asks for, and
+ * the post-block callback either finds an identical tessellation of
+ * the block in the cache, or builds and uploads a new one. Stale
+ * entries are dropped in least-recently-used order when the cache
+ * grows beyond its memory budget.
+ */
+
+#define SC_BUFFER_OFFSET(offset) ((const GLvoid *) (((char *) NULL) + (offset)))
+
+void
+sc_set_use_vbo_cache(RenderState * state, int enable)
+{
+  PRIVATE(state)->usevbocache = (enable != FALSE) ? TRUE : FALSE;
+}
+
+int
+sc_get_use_vbo_cache(RenderState * state)
+{
+  return PRIVATE(state)->usevbocache;
+}
+
+void
+sc_set_vbo_cache_budget(RenderState * state, unsigned int bytes)
+{
+  PRIVATE(state)->vbobudget = bytes;
+}
+
+unsigned int
+sc_get_vbo_cache_budget(RenderState * state)
+{
+  return PRIVATE(state)->vbobudget;
+}
+
+void
+sc_invalidate_vbo_cache(RenderState * state)
+{
+  // old entries will never match again, and will be recycled through
+  // the LRU chain
+  PRIVATE(state)->vbogeneration++;
+}
+
+void
+sc_reset_vbo_cache_stats(RenderState * state)
+{
+  PRIVATE(state)->vbohits = 0;
+  PRIVATE(state)->vbomisses = 0;
+}
+
+static struct sc_vbo_cache *
+sc_get_context_vbocache(RenderState * state)
+{
+  assert(PRIVATE(state)->glcontextidset);
+  const unsigned int key = PRIVATE(state)->glcontextid;
+
+  struct sc_vbo_cache * cache = NULL;
+  if (!PRIVATE(state)->vbocaches.get(key, cache)) {
+    cache = new sc_vbo_cache;
+    PRIVATE(state)->vbocaches.put(key, cache);
+  }
+  return cache;
+}
+
+void
+sc_get_vbo_cache_stats(RenderState * state, int * hits, int * misses, unsigned int * bytes)
+{
+  if (hits) *hits = PRIVATE(state)->vbohits;
+  if (misses) *misses = PRIVATE(state)->vbomisses;
+  if (bytes) *bytes = PRIVATE(state)->vbobytes;
+}
+
+static void
+sc_vbo_lru_unlink(struct sc_vbo_cache * cache, struct sc_vbo_entry * entry)
+{
+  if (entry->prev) entry->prev->next = entry->next;
+  else cache->head = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else cache->tail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+static void
+sc_vbo_lru_push_front(struct sc_vbo_cache * cache, struct sc_vbo_entry * entry)
+{
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head) cache->head->prev = entry;
+  cache->head = entry;
+  if (!cache->tail) cache->tail = entry;
+}
+
+// Blocks whose keys hash to the same value are chained from the hash
+// entry, so that they don't evict each other.
+static struct sc_vbo_entry *
+sc_vbo_cache_find(const struct sc_vbo_cache * cache, const uintptr_t hashkey,
+                  const struct sc_vbo_blockkey * key)
+{
+  struct sc_vbo_entry * entry = NULL;
+  cache->entries.get(hashkey, entry);
+  while (entry && (memcmp(&entry->key, key, sizeof(struct sc_vbo_blockkey)) != 0)) {
+    entry = entry->hashnext;
+  }
+  return entry;
+}
+
+static void
+sc_vbo_cache_add(struct sc_vbo_cache * cache, struct sc_vbo_entry * entry)
+{
+  struct sc_vbo_entry * first = NULL;
+  cache->entries.get(entry->hashkey, first);
+  entry->hashnext = first;
+  cache->entries.put(entry->hashkey, entry);
+  cache->bytes += entry->bytes;
+  sc_vbo_lru_push_front(cache, entry);
+}
+
+static void
+sc_vbo_release_entry(const struct sc_GL * GL, struct sc_vbo_cache * cache,
+                     struct sc_vbo_entry * entry)
+{
+  GL->glDeleteBuffers(2, entry->buffers);
+  assert(cache->bytes >= entry->bytes);
+  cache->bytes -= entry->bytes;
+  sc_vbo_lru_unlink(cache, entry);
+
+  struct sc_vbo_entry * first = NULL;
+  cache->entries.get(entry->hashkey, first);
+  assert(first);
+  if (first == entry) {
+    if (entry->hashnext) { cache->entries.put(entry->hashkey, entry->hashnext); }
+    else { cache->entries.remove(entry->hashkey); }
+  }
+  else {
+    while (first->hashnext != entry) { first = first->hashnext; }
+    first->hashnext = entry->hashnext;
+  }
+  delete entry;
+}
+
+static void
+sc_vbo_release_cache(const struct sc_GL * GL, struct sc_vbo_cache * cache)
+{
+  while (cache->head) {
+    sc_vbo_release_entry(GL, cache, cache->head);
+  }
+  delete cache;
+}
+
+// called by Coin when the GL context of the cache is current
+static void
+sc_vbo_release_cache_cb(void * closure, uint32_t contextid)
+{
+  sc_vbo_release_cache(GLi(contextid), (struct sc_vbo_cache *) closure);
+}
+
+void
+sc_delete_all_vbos(RenderState * state)
+{
+  assert(state);
+
+  // the caches of other contexts are released the next time their
+  // context is current
+  SbList<unsigned int> keylist;
+  PRIVATE(state)->vbocaches.makeKeyList(keylist);
+  for (int i = 0; i < keylist.getLength(); i++) {
+    const unsigned int ctxid = keylist[i];
+    struct sc_vbo_cache * cache = NULL;
+    PRIVATE(state)->vbocaches.get(ctxid, cache);
+    assert(cache);
+    if (PRIVATE(state)->glcontextidset && (ctxid == PRIVATE(state)->glcontextid)) {
+      sc_vbo_release_cache(GLi(ctxid), cache);
+    }
+    else {
+      SoGLCacheContextElement::scheduleDeleteCallback(ctxid, sc_vbo_release_cache_cb,
+                                                      cache);
+    }
+  }
+  PRIVATE(state)->vbocaches.clear();
+  PRIVATE(state)->vbobytes = 0;
+}
+
+static uintptr_t
+sc_vbo_hash_key(const struct sc_vbo_blockkey * key)
+{
+  // FNV-1a over the key bytes
+  const unsigned char * ptr = (const unsigned char *) key;
+  unsigned int hash = 2166136261U;
+  for (unsigned int i = 0; i < sizeof(struct sc_vbo_blockkey); i++) {
+    hash ^= ptr[i];
+    hash *= 16777619U;
+  }
+  return (uintptr_t) hash;
+}
+
+static void
+sc_vbo_setup_key(RenderState * state, const struct sc_GL * GL)
+{
+  struct sc_vbo_blockkey * key = &PRIVATE(state)->vbokey;
+  memset(key, 0, sizeof(struct sc_vbo_blockkey));
+
+  int layout = 0;
+  if (state->normaldata) {
+    layout |= SC_VBO_NORMALS;
+    if (GL->USE_BYTENORMALS) layout |= SC_VBO_BYTENORMALS;
+  }
+  if (!state->normaldata || PRIVATE(state)->scenerytexid != 0) {
+    layout |= SC_VBO_TEXCOORD1;
+    if ((state->etexscale != 0.0f) && (GL->glClientActiveTexture != NULL)) {
+      layout |= SC_VBO_TEXCOORD2;
+    }
+  }
+
+  key->elevdata = state->elevdata;
+  key->voffset[0] = state->voffset[0];
+  key->voffset[1] = state->voffset[1];
+  key->vspacing[0] = state->vspacing[0];
+  key->vspacing[1] = state->vspacing[1];
+  key->layout = layout;
+  key->generation = PRIVATE(state)->vbogeneration;
+  if (layout & SC_VBO_TEXCOORD1) {
+    key->texid = PRIVATE(state)->scenerytexid;
+    key->toffset[0] = PRIVATE(state)->toffset[0];
+    key->toffset[1] = PRIVATE(state)->toffset[1];
+    key->tscale[0] = PRIVATE(state)->tscale[0];
+    key->tscale[1] = PRIVATE(state)->tscale[1];
+  }
+  if (layout & SC_VBO_TEXCOORD2) {
+    key->etexscale = state->etexscale;
+    key->etexoffset = state->etexoffset;
+  }
+}
+
+static void
+sc_vbo_record_fan(RenderState * state, const int type, const int x, const int y,
+                  const int len, const unsigned int bitmask)
+{
+  SbList<int> & fans = PRIVATE(state)->fanlist;
+  fans.append(type);
+  fans.append(x);
+  fans.append(y);
+  fans.append(len);
+  fans.append((int) bitmask);
+}
+
+static struct sc_vbo_tessjob *
+sc_vbo_create_job(RenderState * state, const uintptr_t hashkey)
+{
+  struct RenderStateP * P = PRIVATE(state);
+  struct sc_vbo_tessjob * job = new sc_vbo_tessjob;
+  job->key = P->vbokey;
+  job->hashkey = hashkey;
+  job->fans = P->fanlist;
+  job->elevdata = state->elevdata;
+  job->normaldata = state->normaldata;
+  job->ownsdata = FALSE;
+  job->blocksize = (int) state->blocksize;
+  job->invtsizescale[0] = P->invtsizescale[0];
+  job->invtsizescale[1] = P->invtsizescale[1];
+  job->data = NULL;
+  job->size = 0;
+  job->normaloffset = -1;
+  job->texcoord1offset = -1;
+  job->texcoord2offset = -1;
+  job->indices = NULL;
+  job->indextype = GL_UNSIGNED_SHORT;
+  job->indexsize = 0;
+  job->numindices = 0;
+  return job;
+}
+
+static void
+sc_vbo_free_job(struct sc_vbo_tessjob * job)
+{
+  if (job->ownsdata) {
+    free((void *) job->elevdata);
+    free((void *) job->normaldata);
+  }
+  free(job->data);
+  free(job->indices);
+  delete job;
+}
+
+// Copies the block elevation and normal data into the job. The
+// scenery library only guarantees that the data is valid during the
+// block render callbacks, and worker threads read it later.
+static void
+sc_vbo_copy_job_data(struct sc_vbo_tessjob * job)
+{
+  const int W = job->blocksize + 1;
+  float * elevdata = (float *) malloc(W * W * sizeof(float));
+  assert(elevdata);
+  memcpy(elevdata, job->elevdata, W * W * sizeof(float));
+  job->elevdata = elevdata;
+  if (job->normaldata) {
+    signed char * normaldata = (signed char *) malloc(W * W * 3);
+    assert(normaldata);
+    memcpy(normaldata, job->normaldata, W * W * 3);
+    job->normaldata = normaldata;
+  }
+  job->ownsdata = TRUE;
+}
+
+// per-job scratch lists, so that jobs can be expanded in parallel
+struct sc_vbo_tessarrays {
+  SbList<float> vertices;
+  SbList<signed char> bnormals;
+  SbList<float> fnormals;
+  SbList<float> texcoord1;
+  SbList<float> texcoord2;
+  SbList<unsigned int> indices;
+};
+
+static void
+sc_vbo_add_vertex(const struct sc_vbo_tessjob * job, struct sc_vbo_tessarrays * arrays,
+                  const int x, const int y)
+{
+  const struct sc_vbo_blockkey * key = &job->key;
+  const int layout = key->layout;
+  const int W = job->blocksize + 1;
+  const int idx = y*W + x;
+  const float elev = job->elevdata[idx];
+
+  arrays->vertices.append((float) (x*key->vspacing[0] + key->voffset[0]));
+  arrays->vertices.append((float) (y*key->vspacing[1] + key->voffset[1]));
+  arrays->vertices.append(elev);
+
+  if (layout & SC_VBO_NORMALS) {
+    const signed char * n = job->normaldata + 3*idx;
+    if (layout & SC_VBO_BYTENORMALS) {
+      arrays->bnormals.append(n[0]);
+      arrays->bnormals.append(n[1]);
+      arrays->bnormals.append(n[2]);
+    } else {
+      static const float factor = 1.0f / 127.0f;
+      arrays->fnormals.append(float(n[0]) * factor);
+      arrays->fnormals.append(float(n[1]) * factor);
+      arrays->fnormals.append(float(n[2]) * factor);
+    }
+  }
+  if (layout & SC_VBO_TEXCOORD1) {
+    arrays->texcoord1.append(key->toffset[0] + float(x) * job->invtsizescale[0]);
+    arrays->texcoord1.append(key->toffset[1] + float(y) * job->invtsizescale[1]);
+  }
+  if (layout & SC_VBO_TEXCOORD2) {
+    arrays->texcoord2.append(0.0f);
+    arrays->texcoord2.append((key->etexscale * elev) + key->etexoffset);
+  }
+}
+
+// converts the fan started at vertex index 'start' into triangles
+static void
+sc_vbo_end_fan(struct sc_vbo_tessarrays * arrays, const int start)
+{
+  const int end = arrays->vertices.getLength() / 3;
+  for (int i = start + 1; i < end - 1; i++) {
+    arrays->indices.append(start);
+    arrays->indices.append(i);
+    arrays->indices.append(i+1);
+  }
+}
+
+// Expands the recorded fans of a job into packed vertex and index
+// data. Does not touch the render state or OpenGL, and may be run in
+// any thread.
+static void
+sc_vbo_tessellate(struct sc_vbo_tessjob * job)
+{
+  struct sc_vbo_tessarrays arrays;
+
+  const int * fans = job->fans.getArrayPtr();
+  const int numfans = job->fans.getLength() / SC_VBO_FAN_RECORD;
+  for (int f = 0; f < numfans; f++, fans += SC_VBO_FAN_RECORD) {
+    const int x = fans[1];
+    const int y = fans[2];
+    const int len = fans[3];
+    const unsigned int bitmask = (unsigned int) fans[4];
+    int start = arrays.vertices.getLength() / 3;
+
+    if (fans[0] == SC_VBO_FAN) {
+      // same vertex sequence as sc_va_render_cb()
+      sc_vbo_add_vertex(job, &arrays, x, y);
+      sc_vbo_add_vertex(job, &arrays, x-len, y-len);
+      if (!(bitmask & SS_RENDER_BIT_SOUTH)) {
+        sc_vbo_add_vertex(job, &arrays, x, y-len);
+      }
+      sc_vbo_add_vertex(job, &arrays, x+len, y-len);
+      if (!(bitmask & SS_RENDER_BIT_EAST)) {
+        sc_vbo_add_vertex(job, &arrays, x+len, y);
+      }
+      sc_vbo_add_vertex(job, &arrays, x+len, y+len);
+      if (!(bitmask & SS_RENDER_BIT_NORTH)) {
+        sc_vbo_add_vertex(job, &arrays, x, y+len);
+      }
+      sc_vbo_add_vertex(job, &arrays, x-len, y+len);
+      if (!(bitmask & SS_RENDER_BIT_WEST)) {
+        sc_vbo_add_vertex(job, &arrays, x-len, y);
+      }
+      sc_vbo_add_vertex(job, &arrays, x-len, y-len);
+      sc_vbo_end_fan(&arrays, start);
+    }
+    else {
+      // same vertex sequence as sc_va_undefrender_cb()
+      const signed char * ptr = ss_render_get_undef_array(bitmask);
+      int numv = *ptr++;
+      while (numv) {
+        start = arrays.vertices.getLength() / 3;
+        while (numv) {
+          const int tx = x + *ptr++ * len;
+          const int ty = y + *ptr++ * len;
+          sc_vbo_add_vertex(job, &arrays, tx, ty);
+          numv--;
+        }
+        sc_vbo_end_fan(&arrays, start);
+        numv = *ptr++;
+      }
+    }
+  }
+
+  const int layout = job->key.layout;
+  const int numvertices = arrays.vertices.getLength() / 3;
+  job->numindices = arrays.indices.getLength();
+  if (job->numindices == 0) { return; }
+
+  // non-interleaved layout: positions, normals, texcoords
+  int size = numvertices * 3 * sizeof(float);
+  if (layout & SC_VBO_NORMALS) {
+    job->normaloffset = size;
+    size += numvertices * 3 * ((layout & SC_VBO_BYTENORMALS) ? sizeof(signed char) : sizeof(float));
+    size = (size + 3) & ~3; // keep the float arrays aligned
+  }
+  if (layout & SC_VBO_TEXCOORD1) {
+    job->texcoord1offset = size;
+    size += numvertices * 2 * sizeof(float);
+  }
+  if (layout & SC_VBO_TEXCOORD2) {
+    job->texcoord2offset = size;
+    size += numvertices * 2 * sizeof(float);
+  }
+
+  char * data = (char *) malloc(size);
+  assert(data);
+  memcpy(data, arrays.vertices.getArrayPtr(), numvertices * 3 * sizeof(float));
+  if (layout & SC_VBO_BYTENORMALS) {
+    memcpy(data + job->normaloffset, arrays.bnormals.getArrayPtr(),
+           numvertices * 3 * sizeof(signed char));
+  }
+  else if (layout & SC_VBO_NORMALS) {
+    memcpy(data + job->normaloffset, arrays.fnormals.getArrayPtr(),
+           numvertices * 3 * sizeof(float));
+  }
+  if (layout & SC_VBO_TEXCOORD1) {
+    memcpy(data + job->texcoord1offset, arrays.texcoord1.getArrayPtr(),
+           numvertices * 2 * sizeof(float));
+  }
+  if (layout & SC_VBO_TEXCOORD2) {
+    memcpy(data + job->texcoord2offset, arrays.texcoord2.getArrayPtr(),
+           numvertices * 2 * sizeof(float));
+  }
+  job->data = data;
+  job->size = size;
+
+  const unsigned int * src = arrays.indices.getArrayPtr();
+  if (numvertices <= 65536) {
+    // blocks are small, so 16-bit indices will almost always do
+    unsigned short * indices = (unsigned short *) malloc(job->numindices * sizeof(unsigned short));
+    assert(indices);
+    for (int i = 0; i < job->numindices; i++) { indices[i] = (unsigned short) src[i]; }
+    job->indices = indices;
+    job->indexsize = job->numindices * sizeof(unsigned short);
+    job->indextype = GL_UNSIGNED_SHORT;
+  }
+  else {
+    job->indexsize = job->numindices * sizeof(unsigned int);
+    job->indices = malloc(job->indexsize);
+    assert(job->indices);
+    memcpy(job->indices, src, job->indexsize);
+    job->indextype = GL_UNSIGNED_INT;
+  }
+}
+
+static void
+sc_vbo_tessellate_cb(void * closure)
+{
+  sc_vbo_tessellate((struct sc_vbo_tessjob *) closure);
+}
+
+static struct sc_vbo_entry *
+sc_vbo_upload_job(const struct sc_GL * GL, const struct sc_vbo_tessjob * job)
+{
+  if (job->numindices == 0) { return NULL; }
+
+  struct sc_vbo_entry * entry = new sc_vbo_entry;
+  entry->key = job->key;
+  entry->hashkey = job->hashkey;
+  entry->fans = job->fans;
+  entry->numindices = job->numindices;
+  entry->indextype = job->indextype;
+  entry->normaloffset = job->normaloffset;
+  entry->texcoord1offset = job->texcoord1offset;
+  entry->texcoord2offset = job->texcoord2offset;
+  entry->bytes = job->size + job->indexsize;
+  entry->prev = entry->next = entry->hashnext = NULL;
+
+  GL->glGenBuffers(2, entry->buffers);
+  GL->glBindBuffer(GL_ARRAY_BUFFER, entry->buffers[0]);
+  GL->glBufferData(GL_ARRAY_BUFFER, job->size, job->data, GL_STATIC_DRAW);
+  GL->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, entry->buffers[1]);
+  GL->glBufferData(GL_ELEMENT_ARRAY_BUFFER, job->indexsize, job->indices, GL_STATIC_DRAW);
+  GL->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  GL->glBindBuffer(GL_ARRAY_BUFFER, 0);
+  return entry;
+}
+
+static void
+sc_vbo_draw_entry(RenderState * state, const struct sc_GL * GL,
+                  const struct sc_vbo_entry * entry)
+{
+  const int layout = entry->key.layout;
+
+  GL->glBindBuffer(GL_ARRAY_BUFFER, entry->buffers[0]);
+  GL->glVertexPointer(3, GL_FLOAT, 0, SC_BUFFER_OFFSET(0));
+  GL->glEnableClientState(GL_VERTEX_ARRAY);
+  if (layout & SC_VBO_NORMALS) {
+    GL->glNormalPointer((layout & SC_VBO_BYTENORMALS) ? GL_BYTE : GL_FLOAT, 0,
+                        SC_BUFFER_OFFSET(entry->normaloffset));
+    GL->glEnableClientState(GL_NORMAL_ARRAY);
+  }
+  if (layout & SC_VBO_TEXCOORD2) {
+    GL->glClientActiveTexture(GL_TEXTURE1);
+    GL->glTexCoordPointer(2, GL_FLOAT, 0, SC_BUFFER_OFFSET(entry->texcoord2offset));
+    GL->glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    GL->glClientActiveTexture(GL_TEXTURE0);
+  }
+  if (layout & SC_VBO_TEXCOORD1) {
+    GL->glTexCoordPointer(2, GL_FLOAT, 0, SC_BUFFER_OFFSET(entry->texcoord1offset));
+    GL->glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  }
+
+  GL->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, entry->buffers[1]);
+  GL->glDrawElements(GL_TRIANGLES, entry->numindices, entry->indextype, SC_BUFFER_OFFSET(0));
+  GL->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  GL->glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  GL->glDisableClientState(GL_VERTEX_ARRAY);
+  if (layout & SC_VBO_NORMALS) {
+    GL->glDisableClientState(GL_NORMAL_ARRAY);
+  }
+  if (layout & SC_VBO_TEXCOORD2) {
+    GL->glClientActiveTexture(GL_TEXTURE1);
+    GL->glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    GL->glClientActiveTexture(GL_TEXTURE0);
+  }
+  if (layout & SC_VBO_TEXCOORD1) {
+    GL->glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  }
+}
+
+static void
+sc_vbo_insert_entry(RenderState * state, const struct sc_GL * GL,
+                    struct sc_vbo_cache * cache, struct sc_vbo_entry * entry)
+{
+  sc_vbo_cache_add(cache, entry);
+
+  // keep within budget, but never evict the block we just made
+  while ((cache->bytes > PRIVATE(state)->vbobudget) && (cache->tail != entry)) {
+    sc_vbo_release_entry(GL, cache, cache->tail);
+  }
+  PRIVATE(state)->vbobytes = cache->bytes;
+}
+
+static void
+sc_vbo_render_block(RenderState * state, const struct sc_GL * GL)
+{
+  struct RenderStateP * P = PRIVATE(state);
+  if (P->fanlist.getLength() == 0) { return; }
+
+  struct sc_vbo_cache * cache = sc_get_context_vbocache(state);
+  const uintptr_t hashkey = sc_vbo_hash_key(&P->vbokey);
+
+  struct sc_vbo_entry * entry = sc_vbo_cache_find(cache, hashkey, &P->vbokey);
+  if (entry) {
+    const int numfanints = P->fanlist.getLength();
+    if ((entry->fans.getLength() == numfanints) &&
+        (memcmp(entry->fans.getArrayPtr(), P->fanlist.getArrayPtr(),
+                numfanints * sizeof(int)) == 0)) {
+      P->vbohits++;
+      sc_vbo_lru_unlink(cache, entry);
+      sc_vbo_lru_push_front(cache, entry);
+      P->vbobytes = cache->bytes;
+      if (P->drawqueue.getLength()) {
+        // keep the block order when blocks before this one are
+        // still being tessellated
+        struct sc_vbo_drawitem item = { entry, NULL };
+        P->drawqueue.append(item);
+        return;
+      }
+      sc_vbo_draw_entry(state, GL, entry);
+      return;
+    }
+    // block was re-tessellated
+    sc_vbo_release_entry(GL, cache, entry);
+  }
+
+  P->vbomisses++;
+  struct sc_vbo_tessjob * job = sc_vbo_create_job(state, hashkey);
+
+  if (P->tesssched) {
+    // expand in the worker pool, upload and draw in
+    // sc_va_flush_deferred(). All blocks after this one are queued
+    // too, so that they are drawn in the same order.
+    sc_vbo_copy_job_data(job);
+    struct sc_vbo_drawitem item = { NULL, job };
+    P->drawqueue.append(item);
+    cc_sched_schedule(P->tesssched, sc_vbo_tessellate_cb, job, 0.0f);
+    return;
+  }
+
+  sc_vbo_tessellate(job);
+  entry = sc_vbo_upload_job(GL, job);
+  sc_vbo_free_job(job);
+  if (entry == NULL) { return; }
+
+  sc_vbo_insert_entry(state, GL, cache, entry);
+  sc_vbo_draw_entry(state, GL, entry);
+}
+
+void
+sc_va_flush_deferred(RenderState * state)
+{
+  struct RenderStateP * P = PRIVATE(state);
+  const int numitems = P->drawqueue.getLength();
+  if (numitems == 0) { return; }
+
+  assert(P->tesssched);
+  cc_sched_wait_all(P->tesssched);
+
+  const struct sc_GL * GL = GLi(P->glcontextid);
+  struct sc_vbo_cache * cache = sc_get_context_vbocache(state);
+
+  for (int i = 0; i < numitems; i++) {
+    struct sc_vbo_entry * entry = P->drawqueue[i].entry;
+    struct sc_vbo_tessjob * job = P->drawqueue[i].job;
+    if (job) {
+      entry = sc_vbo_upload_job(GL, job);
+      sc_vbo_free_job(job);
+      if (entry == NULL) { continue; }
+      // the budget is applied after the loop, since the entries of
+      // blocks later in the queue must stay alive
+      sc_vbo_cache_add(cache, entry);
+    }
+
+    // the block texture was set up in sc_render_pre_cb(), but another
+    // block may have been activated since
+    const unsigned int texid = entry->key.texid;
+    TexInfo * texinfo = NULL;
+    if (state->dotex && texid) { texinfo = sc_find_texture(state, texid); }
+    if (texinfo) {
+      if (texid != state->activescenerytexid) {
+        texture_activate(state, texinfo->clienttexdata);
+        state->activescenerytexid = texid;
+      }
+      glEnable(GL_TEXTURE_2D);
+    }
+    else {
+      glDisable(GL_TEXTURE_2D);
+    }
+    sc_vbo_draw_entry(state, GL, entry);
+  }
+  P->drawqueue.truncate(0);
+
+  while ((cache->bytes > P->vbobudget) && (cache->tail != cache->head)) {
+    sc_vbo_release_entry(GL, cache, cache->tail);
+  }
+  P->vbobytes = cache->bytes;
+}
+
+void
+sc_set_tessellation_threads(RenderState * state, int numthreads)
+{
+  struct RenderStateP * P = PRIVATE(state);
+  if (numthreads < 0) { numthreads = 0; }
+  if (numthreads == P->tessthreads) { return; }
+
+  assert(P->drawqueue.getLength() == 0 && "changed during rendering");
+  if (P->tesssched) {
+    cc_sched_destruct(P->tesssched);
+    P->tesssched = NULL;
+  }
+  P->tessthreads = numthreads;
+  if (numthreads > 0) {
+    P->tesssched = cc_sched_construct(numthreads);
+  }
+}
+
+int
+sc_get_tessellation_threads(RenderState * state)
+{
+  return PRIVATE(state)->tessthreads;
+}
+
+#undef SC_BUFFER_OFFSET
+
 /* ********************************************************************** */
 
 void
@@ -1235,6 +2139,146 @@ sc_display_debug_info(RenderState * state, float * campos, short * vpsize)
 /* ********************************************************************** */
 /* culling callbacks */
 
+/*
+ * Box versus clip plane tests. Both functions return TRUE if the box
+ * is completely outside one of the planes, and otherwise set
+ * 'insidebits' to the planes the box is completely inside of. Planes
+ * set in 'mask' are skipped.
+ *
+ * sc_cull_box_corners() is the original test, which classifies the
+ * eight box corners against each plane. sc_cull_box() does the same
+ * with the centre/extent formulation, testing the distance of the
+ * nearest and farthest corner (the n- and p-vertex) to four planes
+ * at a time, and needs the planes prepared with
+ * sc_prepare_cull_planes().
+ */
+
+int
+sc_cull_box_corners(const float * planes, const int numplanes,
+                    const double * bmin, const double * bmax,
+                    const int mask, int * insidebits)
+{
+  SbVec3<float> point[8];
+  int i, j;
+  for ( i = 0; i < 8; i++ ) {
+    point[i].setValue((float) ((i & 1) ? bmin[0] : bmax[0]),
+                      (float) ((i & 2) ? bmin[1] : bmax[1]),
+                      (float) ((i & 4) ? bmin[2] : bmax[2]));
+  }
+  int bits = 0;
+  for ( i = 0; i < numplanes; i++ ) { // foreach plane
+    if ( (mask & (1 << i)) != 0 ) {
+      continue; // uncullable plane - all corners will be inside
+    }
+    SbVec3<float> normal(planes[i*4+0], planes[i*4+1], planes[i*4+2]);
+    float distance = planes[i*4+3];
+    SbPlane<float> plane(normal, distance);
+    int outside = 0, inside = 0;
+    for ( j = 0; j < 8; j++ ) { // foreach bbox corner point
+      if ( !plane.isInHalfSpace(point[j]) ) { outside++; }
+      else { inside++; }
+    }
+    if ( inside == 8 ) { // mark this plane as uncullable
+      bits = bits | (1 << i);
+    }
+    if ( outside == 8 ) {
+      return TRUE; // culled
+    }
+  }
+  *insidebits = bits;
+  return FALSE;
+}
+
+void
+sc_prepare_cull_planes(const float * planes, const int numplanes, float * soaplanes)
+{
+  assert(numplanes <= SC_MAX_CULL_PLANES);
+  const int stride = SC_CULL_PLANES_STRIDE(numplanes);
+  for ( int i = 0; i < stride; i++ ) {
+    if ( i < numplanes ) {
+      // normalized like SbPlane does it
+      SbVec3<float> normal(planes[i*4+0], planes[i*4+1], planes[i*4+2]);
+      normal.normalize();
+      soaplanes[i] = normal[0];
+      soaplanes[stride+i] = normal[1];
+      soaplanes[2*stride+i] = normal[2];
+      soaplanes[3*stride+i] = planes[i*4+3];
+    }
+    else {
+      // padding - a plane every box is inside of
+      soaplanes[i] = 0.0f;
+      soaplanes[stride+i] = 0.0f;
+      soaplanes[2*stride+i] = 0.0f;
+      soaplanes[3*stride+i] = -1.0f;
+    }
+  }
+}
+
+int
+sc_cull_box(const float * soaplanes, const int numplanes,
+            const double * bmin, const double * bmax,
+            const int mask, int * insidebits)
+{
+  const int stride = SC_CULL_PLANES_STRIDE(numplanes);
+  const float * nx = soaplanes;
+  const float * ny = soaplanes + stride;
+  const float * nz = soaplanes + 2*stride;
+  const float * nd = soaplanes + 3*stride;
+
+  const float c[3] = {
+    (float) ((bmin[0] + bmax[0]) * 0.5),
+    (float) ((bmin[1] + bmax[1]) * 0.5),
+    (float) ((bmin[2] + bmax[2]) * 0.5)
+  };
+  const float e[3] = {
+    (float) ((bmax[0] - bmin[0]) * 0.5),
+    (float) ((bmax[1] - bmin[1]) * 0.5),
+    (float) ((bmax[2] - bmin[2]) * 0.5)
+  };
+
+  int outside = 0, inside = 0;
+  int i;
+#ifdef SC_HAVE_SSE2
+  const __m128 cx = _mm_set1_ps(c[0]);
+  const __m128 cy = _mm_set1_ps(c[1]);
+  const __m128 cz = _mm_set1_ps(c[2]);
+  const __m128 ex = _mm_set1_ps(e[0]);
+  const __m128 ey = _mm_set1_ps(e[1]);
+  const __m128 ez = _mm_set1_ps(e[2]);
+  const __m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  const __m128 zero = _mm_setzero_ps();
+  for ( i = 0; i < stride; i += 4 ) {
+    const __m128 px = _mm_loadu_ps(nx + i);
+    const __m128 py = _mm_loadu_ps(ny + i);
+    const __m128 pz = _mm_loadu_ps(nz + i);
+    // signed distance from the box centre
+    __m128 s = _mm_mul_ps(px, cx);
+    s = _mm_add_ps(s, _mm_mul_ps(py, cy));
+    s = _mm_add_ps(s, _mm_mul_ps(pz, cz));
+    s = _mm_sub_ps(s, _mm_loadu_ps(nd + i));
+    // projected box radius
+    __m128 r = _mm_mul_ps(_mm_and_ps(px, absmask), ex);
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_and_ps(py, absmask), ey));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_and_ps(pz, absmask), ez));
+
+    outside |= _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(s, r), zero)) << i;
+    inside |= _mm_movemask_ps(_mm_cmpge_ps(_mm_sub_ps(s, r), zero)) << i;
+  }
+#else // !SC_HAVE_SSE2
+  for ( i = 0; i < numplanes; i++ ) {
+    const float s = nx[i]*c[0] + ny[i]*c[1] + nz[i]*c[2] - nd[i];
+    const float r = (float) (fabs(nx[i])*e[0] + fabs(ny[i])*e[1] + fabs(nz[i])*e[2]);
+    if ( (s + r) < 0.0f ) { outside |= (1 << i); }
+    if ( (s - r) >= 0.0f ) { inside |= (1 << i); }
+  }
+#endif // !SC_HAVE_SSE2
+
+  const int valid = (1 << numplanes) - 1;
+  if ( (outside & valid & ~mask) != 0 ) { return TRUE; } // culled
+  *insidebits = inside & valid & ~mask;
+  return FALSE;
+}
+
 int
 sc_plane_culling_pre_cb(void * closure, const double * bmin, const double * bmax)
 {
@@ -1255,44 +2299,23 @@ sc_plane_culling_pre_cb(void * closure, const double * bmin, const double * bmax
     // front to back, this will have to be disabled.
     mask = PRIVATE(state)->cullstate.getLast();
   }
-
-  // set up bbox corner points
-  SbVec3<float> point[8];
-  int i;
-  for ( i = 0; i < 8; i++ ) {
-    point[i].setValue((float) ((i & 1) ? bmin[0] : bmax[0]),
-                      (float) ((i & 2) ? bmin[1] : bmax[1]),
-                      (float) ((i & 4) ? bmin[2] : bmax[2]));
+  else if ( state->numclipplanes > 0 ) {
+    // root of the quadtree - set up the planes for this traversal
+    assert(state->clipplanes);
+    sc_prepare_cull_planes(state->clipplanes, state->numclipplanes,
+                           PRIVATE(state)->cullplanes);
   }
-  int j, bits = 0;
-  int total_inside = 0, total_outside = 0;
+
+  int bits = 0;
   if ( state->numclipplanes > 0 ) {
-    assert(state->clipplanes);
-    for ( i = 0; i < state->numclipplanes; i++ ) { // foreach plane
-      if ( (mask & (1 << i)) != 0 ) {
-        total_inside += 8;
-        continue; // uncullable plane - all corners will be inside
-      }
-      SbVec3<float> normal(state->clipplanes[i*4+0], state->clipplanes[i*4+1], state->clipplanes[i*4+2]);
-      float distance = state->clipplanes[i*4+3];
-      SbPlane<float> plane(normal, distance);
-      int outside = 0, inside = 0;
-      for ( j = 0; j < 8; j++ ) { // foreach bbox corner point
-        if ( !plane.isInHalfSpace(point[j]) ) { outside++; }
-        else { inside++; }
-      }
-      total_inside += inside;
-      total_outside += outside;
-      if ( inside == 8 ) { // mark this plane as uncullable
-        bits = bits | (1 << i);
-      }
-      if ( outside == 8 ) {
-        PRIVATE(state)->cullstate.push(0); // push state since post_cb pops it
-        return FALSE; // culled
-      }
+    if ( sc_cull_box(PRIVATE(state)->cullplanes, state->numclipplanes,
+                     bmin, bmax, mask, &bits) ) {
+      PRIVATE(state)->cullstate.push(0); // push state since post_cb pops it
+      return FALSE; // culled
     }
   }
   PRIVATE(state)->cullstate.push(mask | bits); // push culling state for next iteration
+  const int allplanes = (1 << state->numclipplanes) - 1;
 
   // Use the GL_HP_occlusion_test extension to check if bounding box will
   // be totally occluded.
@@ -1313,7 +2336,7 @@ sc_plane_culling_pre_cb(void * closure, const double * bmin, const double * bmax
   const struct sc_GL * GL = GLi(ctxid);
 
   if ( state->renderpass && GL->USE_OCCLUSIONTEST ) {
-    if ( (state->numclipplanes > 0) && (total_inside == (state->numclipplanes * 8)) ) {
+    if ( (state->numclipplanes > 0) && (((mask | bits) & allplanes) == allplanes) ) {
       // save GL state
       glPushAttrib(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT|GL_ENABLE_BIT);
       // disable backface culling
@@ -1907,6 +2930,10 @@ sc_va_render_cb(void * closure, const int x, const int y,
                 const int len, const unsigned int bitmask)
 {
   RenderState * renderstate = (RenderState *) closure;
+  if (PRIVATE(renderstate)->vborecording) {
+    sc_vbo_record_fan(renderstate, SC_VBO_FAN, x, y, len, bitmask);
+    return;
+  }
   const struct sc_GL * GL = GLi(PRIVATE(renderstate)->glcontextid);
 
   const signed char * normals = renderstate->normaldata;  
@@ -2067,6 +3094,10 @@ sc_va_undefrender_cb(void * closure, const int x, const int y, const int len,
                      const unsigned int bitmask_org)
 {
   RenderState * renderstate = (RenderState *) closure;
+  if (PRIVATE(renderstate)->vborecording) {
+    sc_vbo_record_fan(renderstate, SC_VBO_UNDEF_FAN, x, y, len, bitmask_org);
+    return;
+  }
   const struct sc_GL * GL = GLi(PRIVATE(renderstate)->glcontextid);
 
   const signed char * normals = renderstate->normaldata;
@@ -2154,6 +3185,15 @@ sc_va_render_pre_cb(void * closure, ss_render_block_cb_info * info)
   assert(GL->glDrawElements != NULL);
   assert(GL->glDrawArrays != NULL);
 
+  if ( PRIVATE(renderstate)->usevbocache && GL->HAVE_VBO ) {
+    // just record the fans - the block is drawn from a cached buffer
+    // object in sc_va_render_post_cb()
+    sc_vbo_setup_key(renderstate, GL);
+    PRIVATE(renderstate)->fanlist.truncate(0);
+    PRIVATE(renderstate)->vborecording = TRUE;
+    return;
+  }
+
   const signed char * normals = renderstate->normaldata; // used as a flag below
   // elevation data is common for all modes
   GL->glEnableClientState(GL_VERTEX_ARRAY);
@@ -2219,6 +3259,13 @@ sc_va_render_post_cb(void * closure, ss_render_block_cb_info * info)
   RenderState * state = (RenderState *) closure;
   const struct sc_GL * GL = GLi(PRIVATE(state)->glcontextid);
 
+  if ( PRIVATE(state)->vborecording ) {
+    sc_vbo_render_block(state, GL);
+    PRIVATE(state)->vborecording = FALSE;
+    sc_render_post_cb(closure, info);
+    return;
+  }
+
   sc_render_post_cb(closure, info);
 
   const signed char * normals = state->normaldata; // used as a flag below
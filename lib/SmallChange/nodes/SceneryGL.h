@@ -85,6 +85,7 @@ int sc_get_use_occlusion_test(unsigned int ctxid);
 /* ask about features */
 int sc_found_multitexturing(unsigned int ctxid);
 int sc_found_vertexarrays(unsigned int ctxid);
+int sc_found_vbo(unsigned int ctxid);
 int sc_suggest_vertexarrays(unsigned int ctxid);
 int sc_suggest_bytenormals(unsigned int ctxid);
 
@@ -100,6 +101,24 @@ void sc_mark_unused_textures(RenderState * state);
 void sc_delete_unused_textures(RenderState * state);
 void sc_delete_all_textures(RenderState * state);
 
+/* ********************************************************************** */
+/* vertex buffer object cache for vertex array rendering */
+
+void sc_set_use_vbo_cache(RenderState * state, int enable);
+int sc_get_use_vbo_cache(RenderState * state);
+void sc_set_vbo_cache_budget(RenderState * state, unsigned int bytes);
+unsigned int sc_get_vbo_cache_budget(RenderState * state);
+void sc_invalidate_vbo_cache(RenderState * state); /* after dataset changes */
+void sc_delete_all_vbos(RenderState * state);
+void sc_reset_vbo_cache_stats(RenderState * state);
+void sc_get_vbo_cache_stats(RenderState * state, int * hits, int * misses,
+                            unsigned int * bytes);
+
+/* expand blocks that miss the cache in a worker pool (0 = off) */
+void sc_set_tessellation_threads(RenderState * state, int numthreads);
+int sc_get_tessellation_threads(RenderState * state);
+void sc_va_flush_deferred(RenderState * state); /* after view render */
+
 /* ********************************************************************** */
 /* rendering callbacks */
 
@@ -142,6 +161,18 @@ void sc_undefraypick_cb(void * closure, const int x, const int y, const int len,
 int sc_plane_culling_pre_cb(void * closure, const double * bmin, const double * bmax);
 void sc_plane_culling_post_cb(void * closure);
 
+/* box versus clip planes, return TRUE if culled (see SceneryGL.cpp) */
+#define SC_MAX_CULL_PLANES 16
+#define SC_CULL_PLANES_STRIDE(numplanes) (((numplanes) + 3) & ~3)
+int sc_cull_box_corners(const float * planes, const int numplanes,
+                        const double * bmin, const double * bmax,
+                        const int mask, int * insidebits);
+void sc_prepare_cull_planes(const float * planes, const int numplanes,
+                            float * soaplanes); /* 4 * SC_CULL_PLANES_STRIDE(numplanes) floats */
+int sc_cull_box(const float * soaplanes, const int numplanes,
+                const double * bmin, const double * bmax,
+                const int mask, int * insidebits);
+
 #if 0 /* FIXME: These used to be public, but it doesn't seem like they
          have to be? I've marked them as "static" inside
          SceneryGL.cpp. 20040602 mortene. */
@@ -52,19 +52,22 @@
 #include <Inventor/SbBasic.h> // COIN_MAJOR_VERSION, COIN_MINOR_VERSION
 
 #include "../misc/SbList.h"
+#include <SmallChange/misc/SmSphereMesh.h>
+#include <SmallChange/misc/SmVBO.h>
 
 
 
 class SmHQSphereP {
 public:
-  SbBSPTree bsp;
-  SbList <int32_t> idx;
-  SbList <SbVec3f> coord;
-  SbList <SbVec2f> texcoord;
-  HQSphereGenerator generator;
-  int currlevel;
-
-  void genGeom(const int level);
+  SmHQSphereP(void) : mesh(NULL) { }
+  ~SmHQSphereP() {
+    if (this->mesh) this->mesh->unref();
+  }
+
+  // shared with all other spheres of the same level
+  SmSphereMesh * mesh;
+
+  SmSphereMesh * getMesh(const int level);
 };
 
 #define PRIVATE(obj) obj->pimpl
@@ -105,7 +108,6 @@ SmHQSphere::SmHQSphere()
   SO_NODE_ADD_FIELD(level, (5));
 
   PRIVATE(this) = new SmHQSphereP;
-  PRIVATE(this)->currlevel = -1;
 }
 
 /*!
@@ -148,16 +150,11 @@ SmHQSphere::GLRender(SoGLRenderAction * action)
   SbBool sendNormals = !mb.isColorOnly() ||
     (SoTextureCoordinateElement::getType(state) == SoTextureCoordinateElement::FUNCTION);
 
-  int l = this->level.getValue();
-  if (l != PRIVATE(this)->currlevel) {
-    PRIVATE(this)->genGeom(l);
-    PRIVATE(this)->currlevel = l;
-  }
-
-  int n = PRIVATE(this)->idx.getLength();
-  const int32_t * idx = PRIVATE(this)->idx.getArrayPtr();
-  const SbVec3f * pts = PRIVATE(this)->coord.getArrayPtr();
-  const SbVec2f * tc = PRIVATE(this)->texcoord.getArrayPtr();
+  SmSphereMesh * mesh = PRIVATE(this)->getMesh(this->level.getValue());
+  int n = mesh->getNumIndices();
+  const int32_t * idx = mesh->getIndices();
+  const SbVec3f * pts = mesh->getCoords();
+  const SbVec2f * tc = mesh->getTextureCoords();
 
   float r = this->radius.getValue();
 
@@ -173,6 +170,15 @@ SmHQSphere::GLRender(SoGLRenderAction * action)
 #endif // Coin version >= 2.2
   if (varray) {
 #if (COIN_MAJOR_VERSION > 2) || ((COIN_MAJOR_VERSION==2) && (COIN_MINOR_VERSION > 1))
+    // the mesh is uploaded once per context, and shared by all
+    // spheres with the same level
+    const uint32_t contextid = SoGLCacheContextElement::get(state);
+    const SbBool usevbo = cc_glglue_has_vertex_buffer_object(glue) &&
+      SmVBO::shouldCreateVBO(contextid, mesh->getNumVertices());
+    if (usevbo) {
+      mesh->getCoordVBO()->bindBuffer(contextid);
+      pts = NULL;
+    }
     cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0,
                               (GLvoid*) pts);
     cc_glglue_glEnableClientState(glue, GL_VERTEX_ARRAY);
@@ -183,15 +189,27 @@ SmHQSphere::GLRender(SoGLRenderAction * action)
       cc_glglue_glEnableClientState(glue, GL_NORMAL_ARRAY);
     }
     if (doTextures) {
+      if (usevbo) {
+        mesh->getTextureCoordVBO()->bindBuffer(contextid);
+        tc = NULL;
+      }
       cc_glglue_glTexCoordPointer(glue, 2, GL_FLOAT, 0,
                                   (GLvoid*) tc);
       cc_glglue_glEnableClientState(glue, GL_TEXTURE_COORD_ARRAY);
     }
+    if (usevbo) {
+      mesh->getIndexVBO()->bindBuffer(contextid);
+      idx = NULL;
+    }
     cc_glglue_glDrawElements(glue, GL_TRIANGLES, n, GL_UNSIGNED_INT, idx);
 
     cc_glglue_glDisableClientState(glue, GL_VERTEX_ARRAY);
     if (sendNormals) cc_glglue_glDisableClientState(glue, GL_NORMAL_ARRAY);
     if (doTextures) cc_glglue_glDisableClientState(glue, GL_TEXTURE_COORD_ARRAY);
+    if (usevbo) {
+      cc_glglue_glBindBuffer(glue, GL_ELEMENT_ARRAY_BUFFER, 0);
+      cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, 0);
+    }
     SoGLCacheContextElement::shouldAutoCache(state, SoGLCacheContextElement::DONT_AUTO_CACHE);
 #endif // Coin version >= 2.2
   }
@@ -232,12 +250,8 @@ SmHQSphere::getPrimitiveCount(SoGetPrimitiveCountAction * action)
 {
   if (!this->shouldPrimitiveCount(action)) return;
 
-  int l = this->level.getValue();
-  if (l != PRIVATE(this)->currlevel) {
-    PRIVATE(this)->genGeom(l);
-    PRIVATE(this)->currlevel = l;
-  }
-  action->addNumTriangles(PRIVATE(this)->idx.getLength()/3);
+  SmSphereMesh * mesh = PRIVATE(this)->getMesh(this->level.getValue());
+  action->addNumTriangles(mesh->getNumIndices()/3);
 }
 
 // internal method used to add a sphere intersection to the ray pick
@@ -277,16 +291,11 @@ SmHQSphere::rayPick(SoRayPickAction * action)
 void
 SmHQSphere::generatePrimitives(SoAction * action)
 {
-  int l = this->level.getValue();
-  if (l != PRIVATE(this)->currlevel) {
-    PRIVATE(this)->genGeom(l);
-    PRIVATE(this)->currlevel = l;
-  }
-
-  int n = PRIVATE(this)->idx.getLength();
-  const int32_t * idx = PRIVATE(this)->idx.getArrayPtr();
-  const SbVec3f * pts = PRIVATE(this)->coord.getArrayPtr();
-  const SbVec2f * tc = PRIVATE(this)->texcoord.getArrayPtr();
+  SmSphereMesh * mesh = PRIVATE(this)->getMesh(this->level.getValue());
+  int n = mesh->getNumIndices();
+  const int32_t * idx = mesh->getIndices();
+  const SbVec3f * pts = mesh->getCoords();
+  const SbVec2f * tc = mesh->getTextureCoords();
 
   float r = this->radius.getValue();
 
@@ -318,68 +327,15 @@ SmHQSphere::computeBBox(SoAction * action, SbBox3f & box, SbVec3f & center)
 
 #undef PRIVATE
 
-void
-SmHQSphereP::genGeom(const int level)
+SmSphereMesh *
+SmHQSphereP::getMesh(const int level)
 {
-  int i, n;
-  this->generator.generate(SbClamp(level, 1, 12), this->bsp, this->idx);
-  const SbVec3f * pts = this->bsp.getPointsArrayPtr();
-  this->texcoord.truncate(0, TRUE);
-  this->coord.truncate(0, TRUE);
-
-  n = this->bsp.numPoints();
-  for (i = 0; i < n; i++) {
-    this->coord.append(pts[i]);
-  }
-  this->bsp.clear();
-  pts = this->coord.getArrayPtr();
-
-  // generate texcoords for all vertices
-  for (i = 0; i < n; i++) {
-    SbVec3f pt = pts[i];
-    SbVec2f tc((float) (atan2(pt[0], pt[2]) * (1.0 / (2.0*M_PI)) + 0.5),
-               (float) (atan2(pt[1], sqrt(pt[0]*pt[0] + pt[2]*pt[2])) * (1.0/M_PI) + 0.5));
-
-    tc[0] = SbClamp(tc[0], 0.0f, 1.0f);
-    tc[1] = SbClamp(tc[1], 0.0f, 1.0f);
-    // so that right-side-of-texture can be detected below
-    if (tc[0] >= 0.99999f) tc[0] = 0.0f;
-    this->texcoord.append(tc);
-  }
-
-  // detect triangles that are on the back side of the sphere, on the
-  // right side, with at least one vertex on the right-side-edge of
-  // the texture. Fix texture coordinates for those trianges
-  n = this->idx.getLength();
-  int32_t * iptr = (int32_t*) this->idx.getArrayPtr();
-
-#define FLTCOMPARE(x, y) (fabs((x)-(y)) < 0.000001f)
-
-  SbVec3f p[3];
-  SbVec2f t[3];
-  int cnt = 0;
-  int j;
-  for (i = 0; i < n; i += 3) {
-    SbBool rightside = FALSE;
-    for (j = 0; j < 3; j++) {
-      p[j] = pts[iptr[i+j]];
-      t[j] = this->texcoord[iptr[i+j]];
-      if (p[j][0] > 0.000001f) rightside = TRUE;
-      if (p[j][2] > 0.000001f) break; // not on the back of the sphere
-    }
-    if (rightside && (j == 3) &&
-        (FLTCOMPARE(p[0][0], 0.0f) || FLTCOMPARE(p[1][0], 0.0f) || FLTCOMPARE(p[2][0], 0.0f))) {
-      // just create new vertices for these triangles
-      int len = this->coord.getLength();
-      for (j = 0; j < 3; j++) {
-        iptr[i+j] = len+j;
-        this->coord.append(p[j]);
-        if (t[j][0] <= 0.000001f) t[j][0] = 1.0f;
-        this->texcoord.append(t[j]);
-      }
-    }
+  const int l = SbClamp(level, 1, 12);
+  if (this->mesh == NULL || this->mesh->getLevel() != l) {
+    if (this->mesh) this->mesh->unref();
+    this->mesh = SmSphereMesh::ref(l);
   }
-#undef FLTCOMPARE
+  return this->mesh;
 }
 
 void
@@ -1,20 +1,124 @@
+/*!
+  \class SmLazyFile SmLazyFile.h SmallChange/nodes/SmLazyFile.h
+  \brief The SmLazyFile class is an SoFile which is read the first time it is rendered.
+
+  \ingroup nodes
+
+  By default the file is read in the rendering thread, the first time
+  the node is rendered. Set \a asynchronous to TRUE to read it in a
+  background thread instead. The node then renders its proxy bounding
+  box until the file has been read, and the new subgraph is inserted
+  between two frames.
+
+  All asynchronous loads share one global queue. The nodes closest to
+  the camera are loaded first, and at most getMaxConcurrentLoads()
+  files are read at the same time.
+
+  Note that reading files in a background thread requires a Coin
+  library built with thread safety enabled.
+*/
 
 #include <SmallChange/nodes/SmLazyFile.h>
 #include <Inventor/SoInput.h>
+#include <Inventor/SoDB.h>
 #include <Inventor/actions/SoAction.h>
 #include <Inventor/actions/SoGLRenderAction.h>
 #include <Inventor/actions/SoGetBoundingBoxAction.h>
+#include <Inventor/bundles/SoMaterialBundle.h>
+#include <Inventor/elements/SoLazyElement.h>
+#include <Inventor/elements/SoGLTextureEnabledElement.h>
+#include <Inventor/elements/SoModelMatrixElement.h>
+#include <Inventor/elements/SoViewVolumeElement.h>
+#include <Inventor/misc/SoChildList.h>
+#include <Inventor/misc/SoState.h>
+#include <Inventor/nodes/SoSeparator.h>
+#include <Inventor/sensors/SoTimerSensor.h>
+#include <Inventor/threads/SbMutex.h>
+#include <Inventor/lists/SbList.h>
+#include <Inventor/C/threads/sched.h>
+#include <Inventor/C/tidbits.h>
+#include <Inventor/SbString.h>
+#include <Inventor/system/gl.h>
+#include <cassert>
+
+/*!
+  \var SoSFBool SmLazyFile::asynchronous
+
+  Set to TRUE to read the file in a background thread. Default is FALSE.
+*/
+
+/*!
+  \var SoSFVec3f SmLazyFile::bboxCenter
+
+  Center of the proxy bounding box. Default is (0, 0, 0).
+*/
+
+/*!
+  \var SoSFVec3f SmLazyFile::bboxSize
+
+  Size of the proxy bounding box. Until the file is read, the box is
+  used for bounding box calculations and is rendered as a wireframe,
+  and its center is used to prioritize asynchronous loads. Default is
+  (-1, -1, -1), which means that no proxy box is rendered and a unit
+  box is used for bounding box calculations.
+*/
 
 #define PRIVATE(obj) (obj)->pimpl
 #define PUBLIC(obj) (obj)->master
 
+// A file being read asynchronously. Owned by the loader queue.
+class SmLazyFileLoad {
+public:
+  SmLazyFileLoad(SmLazyFile * node, const SbString & filename)
+    : node(node), filename(filename), distance(0.0f), root(NULL), done(FALSE) { }
+
+  SmLazyFile * node; // NULL if the node was destructed during the load
+  SbString filename;
+  float distance;
+
+  SbMutex mutex;
+  SoSeparator * root;
+  SbBool done;
+
+  static void load_cb(void * closure);
+};
+
 class SmLazyFileP {
 public:
+  SmLazyFileP(SmLazyFile * master) : master(master) { }
+
+  SmLazyFile * master;
   SbBool loaded;
   SbBool isloading;
   SoInput * input;
+
+  SmLazyFileLoad * load;
+  SbString failedname;
+
+  void queueLoad(const SbString & filename, const float distance);
+  void cancelLoad(void);
+  void finishLoad(SmLazyFileLoad * load);
+  float cameraDistance(SoState * state) const;
+  SbBool hasProxyBox(void) const;
+  void renderProxyBox(SoGLRenderAction * action);
+
+  static SbList <SmLazyFileLoad *> * pending;
+  static SbList <SmLazyFileLoad *> * running;
+  static int maxloads;
+  static cc_sched * sched;
+  static SoTimerSensor * sensor;
+
+  static void dispatch(void);
+  static void sensor_cb(void * closure, SoSensor * sensor);
+  static void loader_cleanup(void);
 };
 
+SbList <SmLazyFileLoad *> * SmLazyFileP::pending = NULL;
+SbList <SmLazyFileLoad *> * SmLazyFileP::running = NULL;
+int SmLazyFileP::maxloads = 2;
+cc_sched * SmLazyFileP::sched = NULL;
+SoTimerSensor * SmLazyFileP::sensor = NULL;
+
 SO_NODE_SOURCE(SmLazyFile);
 
 void
@@ -26,24 +130,59 @@ SmLazyFile::initClass(void)
 SmLazyFile::SmLazyFile(void)
 {
   SO_NODE_CONSTRUCTOR(SmLazyFile);
-  PRIVATE(this) = new SmLazyFileP;
+  SO_NODE_ADD_FIELD(asynchronous, (FALSE));
+  SO_NODE_ADD_FIELD(bboxCenter, (0.0f, 0.0f, 0.0f));
+  SO_NODE_ADD_FIELD(bboxSize, (-1.0f, -1.0f, -1.0f));
+
+  PRIVATE(this) = new SmLazyFileP(this);
   PRIVATE(this)->loaded = FALSE;
   PRIVATE(this)->isloading = FALSE;
   PRIVATE(this)->input = NULL;
+  PRIVATE(this)->load = NULL;
 }
 
 SmLazyFile::~SmLazyFile()
 {
+  PRIVATE(this)->cancelLoad();
   delete PRIVATE(this);
 }
 
+/*!
+  Sets the maximum number of files read at the same time by
+  asynchronous SmLazyFile nodes. Default is 2.
+*/
+void
+SmLazyFile::setMaxConcurrentLoads(const int num)
+{
+  SmLazyFileP::maxloads = SbMax(num, 1);
+  if (SmLazyFileP::sched) {
+    cc_sched_set_num_threads(SmLazyFileP::sched, SmLazyFileP::maxloads);
+  }
+  SmLazyFileP::dispatch();
+}
+
+/*!
+  Returns the maximum number of files read at the same time.
+*/
+int
+SmLazyFile::getMaxConcurrentLoads(void)
+{
+  return SmLazyFileP::maxloads;
+}
+
 // Doc from superclass.
 void
 SmLazyFile::getBoundingBox(SoGetBoundingBoxAction * action)
 {
   if (!PRIVATE(this)->loaded) {
     SbBox3f bbox(0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f);
-    action->setCenter(SbVec3f(0.0f, 0.0f, 0.0f), FALSE);
+    SbVec3f center(0.0f, 0.0f, 0.0f);
+    if (PRIVATE(this)->hasProxyBox()) {
+      center = this->bboxCenter.getValue();
+      const SbVec3f half = this->bboxSize.getValue() * 0.5f;
+      bbox.setBounds(center - half, center + half);
+    }
+    action->setCenter(center, FALSE);
     action->extendBy(bbox);
   } else {
     inherited::getBoundingBox(action);
@@ -53,7 +192,27 @@ SmLazyFile::getBoundingBox(SoGetBoundingBoxAction * action)
 void
 SmLazyFile::GLRender(SoGLRenderAction * action)
 {
+  if (!PRIVATE(this)->loaded && this->asynchronous.getValue()) {
+    const SbString filename = this->name.getValue();
+    SoState * state = action->getState();
+    if (PRIVATE(this)->load && PRIVATE(this)->load->filename != filename) {
+      PRIVATE(this)->cancelLoad();
+    }
+    if (PRIVATE(this)->load) {
+      // keep the priority up to date while waiting in the queue
+      PRIVATE(this)->load->distance = PRIVATE(this)->cameraDistance(state);
+    }
+    else if (filename.getLength() && filename != PRIVATE(this)->failedname) {
+      PRIVATE(this)->queueLoad(filename, PRIVATE(this)->cameraDistance(state));
+    }
+    if (PRIVATE(this)->hasProxyBox()) {
+      PRIVATE(this)->renderProxyBox(action);
+    }
+    return;
+  }
+
   if (!PRIVATE(this)->loaded && !PRIVATE(this)->isloading) {
+    PRIVATE(this)->cancelLoad();
     PRIVATE(this)->isloading = TRUE;
     SoInput in;
     PRIVATE(this)->loaded = inherited::readNamedFile(&in);
@@ -75,5 +234,217 @@ SmLazyFile::readNamedFile(SoInput * in)
   return TRUE;
 }
 
+// *************************************************************************
+
+void
+SmLazyFileLoad::load_cb(void * closure)
+{
+  SmLazyFileLoad * load = (SmLazyFileLoad *) closure;
+
+  // the file is read into a detached subgraph, which is inserted
+  // below the node by SmLazyFileP::finishLoad()
+  SoSeparator * root = NULL;
+  SoInput in;
+  if (in.openFile(load->filename.getString())) {
+    root = SoDB::readAll(&in);
+    if (root) root->ref();
+  }
+
+  load->mutex.lock();
+  load->root = root;
+  load->done = TRUE;
+  load->mutex.unlock();
+}
+
+void
+SmLazyFileP::queueLoad(const SbString & filename, const float distance)
+{
+  this->load = new SmLazyFileLoad(PUBLIC(this), filename);
+  this->load->distance = distance;
+
+  if (SmLazyFileP::pending == NULL) {
+    SmLazyFileP::pending = new SbList <SmLazyFileLoad *>;
+    SmLazyFileP::running = new SbList <SmLazyFileLoad *>;
+    cc_coin_atexit((coin_atexit_f *) SmLazyFileP::loader_cleanup);
+  }
+  SmLazyFileP::pending->append(this->load);
+  SmLazyFileP::dispatch();
+}
+
+void
+SmLazyFileP::cancelLoad(void)
+{
+  if (this->load == NULL) return;
+
+  const int idx = SmLazyFileP::pending->find(this->load);
+  if (idx >= 0) {
+    SmLazyFileP::pending->removeFast(idx);
+    delete this->load;
+  }
+  else {
+    // already being read, the loader will discard the result
+    this->load->node = NULL;
+  }
+  this->load = NULL;
+}
+
+//
+// Inserts the children of the file just read. Called from the sensor
+// callback, i.e. never in the middle of a traversal.
+//
+void
+SmLazyFileP::finishLoad(SmLazyFileLoad * load)
+{
+  assert(this->load == load);
+  this->load = NULL;
+
+  if (load->root == NULL) {
+    // don't retry until the name changes
+    this->failedname = load->filename;
+    return;
+  }
+
+  SoChildList * children = PUBLIC(this)->getChildren();
+  children->truncate(0);
+  for (int i = 0; i < load->root->getNumChildren(); i++) {
+    children->append(load->root->getChild(i));
+  }
+  this->loaded = TRUE;
+  PUBLIC(this)->touch();
+}
+
+float
+SmLazyFileP::cameraDistance(SoState * state) const
+{
+  SbVec3f center(0.5f, 0.5f, 0.5f);
+  if (this->hasProxyBox()) center = PUBLIC(this)->bboxCenter.getValue();
+  SoModelMatrixElement::get(state).multVecMatrix(center, center);
+  return (center - SoViewVolumeElement::get(state).getProjectionPoint()).length();
+}
+
+SbBool
+SmLazyFileP::hasProxyBox(void) const
+{
+  const SbVec3f & size = PUBLIC(this)->bboxSize.getValue();
+  return size[0] >= 0.0f && size[1] >= 0.0f && size[2] >= 0.0f;
+}
+
+void
+SmLazyFileP::renderProxyBox(SoGLRenderAction * action)
+{
+  SoState * state = action->getState();
+  state->push();
+  SoLazyElement::setLightModel(state, SoLazyElement::BASE_COLOR);
+  SoGLTextureEnabledElement::set(state, PUBLIC(this), FALSE);
+  SoMaterialBundle mb(action);
+  mb.sendFirst();
+
+  const SbVec3f center = PUBLIC(this)->bboxCenter.getValue();
+  const SbVec3f half = PUBLIC(this)->bboxSize.getValue() * 0.5f;
+  SbVec3f corners[8];
+  for (int i = 0; i < 8; i++) {
+    corners[i].setValue(center[0] + ((i & 1) ? half[0] : -half[0]),
+                        center[1] + ((i & 2) ? half[1] : -half[1]),
+                        center[2] + ((i & 4) ? half[2] : -half[2]));
+  }
+  static const int edges[12][2] = {
+    { 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 },
+    { 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 },
+    { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 }
+  };
+  glBegin(GL_LINES);
+  for (int e = 0; e < 12; e++) {
+    glVertex3fv(corners[edges[e][0]].getValue());
+    glVertex3fv(corners[edges[e][1]].getValue());
+  }
+  glEnd();
+  state->pop();
+}
+
+//
+// Starts reading the pending files closest to the camera, as long as
+// fewer than maxloads files are being read.
+//
+void
+SmLazyFileP::dispatch(void)
+{
+  if (SmLazyFileP::pending == NULL) return;
+
+  while (SmLazyFileP::pending->getLength() &&
+         SmLazyFileP::running->getLength() < SmLazyFileP::maxloads) {
+    int best = 0;
+    for (int i = 1; i < SmLazyFileP::pending->getLength(); i++) {
+      if ((*SmLazyFileP::pending)[i]->distance < (*SmLazyFileP::pending)[best]->distance) {
+        best = i;
+      }
+    }
+    SmLazyFileLoad * load = (*SmLazyFileP::pending)[best];
+    SmLazyFileP::pending->remove(best);
+    SmLazyFileP::running->append(load);
+
+    if (SmLazyFileP::sched == NULL) {
+      SmLazyFileP::sched = cc_sched_construct(SmLazyFileP::maxloads);
+    }
+    cc_sched_schedule(SmLazyFileP::sched, SmLazyFileLoad::load_cb, load, 0.0f);
+  }
+
+  if (SmLazyFileP::running->getLength()) {
+    if (SmLazyFileP::sensor == NULL) {
+      SmLazyFileP::sensor = new SoTimerSensor(SmLazyFileP::sensor_cb, NULL);
+      SmLazyFileP::sensor->setInterval(SbTime(0.1));
+    }
+    if (!SmLazyFileP::sensor->isScheduled()) SmLazyFileP::sensor->schedule();
+  }
+}
+
+//
+// Polls the files being read, and hands the finished ones over to
+// their nodes.
+//
+void
+SmLazyFileP::sensor_cb(void * closure, SoSensor * sensor)
+{
+  SbList <SmLazyFileLoad *> & running = *SmLazyFileP::running;
+  for (int i = 0; i < running.getLength(); i++) {
+    SmLazyFileLoad * load = running[i];
+    load->mutex.lock();
+    const SbBool done = load->done;
+    load->mutex.unlock();
+    if (!done) continue;
+
+    running.remove(i--);
+    if (load->node) PRIVATE(load->node)->finishLoad(load);
+    if (load->root) load->root->unref();
+    delete load;
+  }
+  SmLazyFileP::dispatch();
+  if (running.getLength() == 0) sensor->unschedule();
+}
+
+void
+SmLazyFileP::loader_cleanup(void)
+{
+  int i;
+  for (i = 0; i < SmLazyFileP::pending->getLength(); i++) {
+    delete (*SmLazyFileP::pending)[i];
+  }
+  if (SmLazyFileP::sched) {
+    // waits for the files being read
+    cc_sched_destruct(SmLazyFileP::sched);
+    SmLazyFileP::sched = NULL;
+  }
+  for (i = 0; i < SmLazyFileP::running->getLength(); i++) {
+    SmLazyFileLoad * load = (*SmLazyFileP::running)[i];
+    if (load->root) load->root->unref();
+    delete load;
+  }
+  delete SmLazyFileP::sensor;
+  SmLazyFileP::sensor = NULL;
+  delete SmLazyFileP::pending;
+  SmLazyFileP::pending = NULL;
+  delete SmLazyFileP::running;
+  SmLazyFileP::running = NULL;
+}
+
 #undef PRIVATE
 #undef PUBLIC
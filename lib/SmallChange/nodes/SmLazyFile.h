@@ -2,6 +2,8 @@
 #define SMALLCHANGE_LAZYFILE_H
 
 #include <Inventor/nodes/SoFile.h>
+#include <Inventor/fields/SoSFBool.h>
+#include <Inventor/fields/SoSFVec3f.h>
 #include <SmallChange/basic.h>
 #include <Inventor/SbBox3f.h>
 
@@ -19,6 +21,13 @@ public:
   static void initClass(void);
   SmLazyFile(void);
 
+  SoSFBool asynchronous;
+  SoSFVec3f bboxCenter;
+  SoSFVec3f bboxSize;
+
+  static void setMaxConcurrentLoads(const int num);
+  static int getMaxConcurrentLoads(void);
+
   virtual void GLRender(SoGLRenderAction * action);
   virtual void getBoundingBox(SoGetBoundingBoxAction * action);
 
@@ -29,6 +38,7 @@ protected:
 private:
   virtual ~SmLazyFile(void);
 
+  friend class SmLazyFileP;
   SmLazyFileP * pimpl;
 };
 
@@ -41,6 +41,13 @@
   which specifies how many markers to render based on the distance to
   the camera.
 
+  The markers are not drawn with glBitmap(). The built-in marker
+  bitmaps are copied into a single texture atlas when the class is
+  initialized, and all visible markers are drawn as screen aligned,
+  textured quads in one vertex array call. Markers are therefore
+  clipped like any other geometry, and are drawn partly when they
+  overlap the viewport border.
+
 */
 
 #ifdef HAVE_CONFIG_H
@@ -60,8 +67,15 @@
 #include <Inventor/elements/SoProjectionMatrixElement.h>
 #include <Inventor/elements/SoViewportRegionElement.h>
 #include <Inventor/elements/SoCullElement.h>
+#include <Inventor/elements/SoGLCacheContextElement.h>
+#include <Inventor/elements/SoGLLazyElement.h>
 #include <Inventor/misc/SoState.h>
+#include <Inventor/misc/SoGLImage.h>
+#include <Inventor/lists/SbList.h>
+#include <Inventor/C/glue/gl.h>
+#include <Inventor/C/tidbits.h>
 #include <cstring>
+#include <cmath>
 
 #include <Inventor/system/gl.h>
 
@@ -116,6 +130,12 @@ public:
   smmarkerset_indexdistance * pointdistancelist;
   int pointdistancelistlen;
 
+  // quads for the visible markers, rebuilt every frame but kept
+  // around to avoid reallocating them
+  SbList <float> quadcoords;
+  SbList <float> quadtexcoords;
+  SbList <uint32_t> quadcolors;
+
 private:
   SmMarkerSet * master;
 };
@@ -160,6 +180,42 @@ typedef struct {
 static SbList <so_marker> * markerlist;
 static GLubyte * markerimages;
 static void convert_bitmaps(void);
+
+// The markers are packed into an atlas of ATLAS_CELL x ATLAS_CELL
+// cells, ATLAS_COLUMNS cells per row.
+#define ATLAS_CELL 16
+#define ATLAS_COLUMNS 16
+
+static SoGLImage * markeratlas;
+static unsigned char * markeratlasdata;
+static SbVec2s markeratlassize;
+static void create_atlas(void);
+
+static void
+free_marker_images(void)
+{
+  if (markeratlas) markeratlas->unref();
+  markeratlas = NULL;
+  delete [] markeratlasdata;
+  markeratlasdata = NULL;
+  delete [] markerimages;
+  markerimages = NULL;
+  delete markerlist;
+  markerlist = NULL;
+}
+
+static uint32_t
+smmarkerset_rgba(const float r, const float g, const float b, const float a)
+{
+  // stored so that the bytes are R, G, B, A in memory
+  uint32_t val;
+  unsigned char * bytes = (unsigned char *) &val;
+  bytes[0] = (unsigned char) (SbClamp(r, 0.0f, 1.0f) * 255.0f + 0.5f);
+  bytes[1] = (unsigned char) (SbClamp(g, 0.0f, 1.0f) * 255.0f + 0.5f);
+  bytes[2] = (unsigned char) (SbClamp(b, 0.0f, 1.0f) * 255.0f + 0.5f);
+  bytes[3] = (unsigned char) (SbClamp(a, 0.0f, 1.0f) * 255.0f + 0.5f);
+  return val;
+}
 // -----------------------------------------------------------------------
 
 // Internal method which translates the current material binding found
@@ -184,9 +240,7 @@ SmMarkerSet::initClass(void)
 
   markerimages = new GLubyte[NUM_MARKERS*9*4]; // hardcoded markers, 32x9 bitmaps (9x9 used), dword alignment
   markerlist = new SbList<so_marker>;
-
-  // FIXME: How should this be done as 'coin_atexit' is private? (20040209 handegar)
-  //coin_atexit((coin_atexit_f *)free_marker_images, 0);
+  cc_coin_atexit((coin_atexit_f *) free_marker_images);
 
   convert_bitmaps();
   so_marker temp;
@@ -198,7 +252,7 @@ SmMarkerSet::initClass(void)
     temp.deletedata = FALSE;
     markerlist->append(temp);
   }
-
+  create_atlas();
 }
 
 
@@ -206,11 +260,6 @@ SmMarkerSet::initClass(void)
 void
 SmMarkerSet::GLRender(SoGLRenderAction * action)
 {
-  // FIXME: the marker bitmaps are toggled off when the leftmost pixel
-  // is outside the left border, and ditto for the bottommost pixel
-  // versus the bottom border. They should be drawn partly until they
-  // are wholly outside the canvas instead. 20011218 mortene.
-
   SoState * state = action->getState();
   if (!this->shouldGLRender(action)) { return; }
 
@@ -237,7 +286,6 @@ SmMarkerSet::GLRender(SoGLRenderAction * action)
   SoMaterialBundle mb(action);
   mb.sendFirst();
 
-  int matnr = 0;
   int32_t idx = this->startIndex.getValue();
   int32_t numpts = this->numPoints.getValue();
   if (numpts < 0) numpts = coords->getNum() - idx;
@@ -249,14 +297,6 @@ SmMarkerSet::GLRender(SoGLRenderAction * action)
                                    SoProjectionMatrixElement::get(state));
   SbVec2s vpsize = vp.getViewportSizePixels();
 
-  glMatrixMode(GL_MODELVIEW);
-  glPushMatrix();
-  glLoadIdentity();
-  glMatrixMode(GL_PROJECTION);
-  glPushMatrix();
-  glLoadIdentity();
-  glOrtho(0, vpsize[0], 0, vpsize[1], -1.0f, 1.0f);
-
   // Find the number of closest markers to render
   if (numpts != PRIVATE(this)->pointdistancelistlen ||
       PRIVATE(this)->pointdistancelist == NULL) {
@@ -291,6 +331,23 @@ SmMarkerSet::GLRender(SoGLRenderAction * action)
     this->maxMarkersToRender.getValue() : numpts;
   if (counter > numpts) counter = numpts; // Failsafe
 
+  // per marker colors are read directly from the lazy element instead
+  // of being sent through the material bundle, so that all markers
+  // can be drawn with a single color array
+  const SoLazyElement * lazy = SoLazyElement::getInstance(state);
+  const int numdiffuse = lazy->getNumDiffuse();
+  const SbBool packed = lazy->isPacked();
+  const uint32_t * packedptr = lazy->getPackedPointer();
+  const SbColor * diffuseptr = lazy->getDiffusePointer();
+  const float alpha = 1.0f - SoLazyElement::getTransparency(state, 0);
+
+  SbList <float> & quadcoords = PRIVATE(this)->quadcoords;
+  SbList <float> & quadtexcoords = PRIVATE(this)->quadtexcoords;
+  SbList <uint32_t> & quadcolors = PRIVATE(this)->quadcolors;
+  quadcoords.truncate(0);
+  quadtexcoords.truncate(0);
+  quadcolors.truncate(0);
+
   for (int i = 0; i < counter; i++) {
 
     const int index = PRIVATE(this)->pointdistancelist[i].index;
@@ -311,18 +368,13 @@ SmMarkerSet::GLRender(SoGLRenderAction * action)
       }
 #endif // COIN_DEBUG
 
-    if (mbind == PER_VERTEX)
-      mb.send(index, TRUE);
-
     if (this->markerIndex[midx] == NONE)
       { continue; }
 
     SbVec3f point = coords->get3(idx + index);
 
-    // OpenGL's glBitmap() will not be clipped against anything but
-    // the near and far planes. We want markers to also be clipped
-    // against other clipping planes, to behave like the SoPointSet
-    // superclass.
+    // We want markers to be clipped against other clipping planes,
+    // to behave like the SoPointSet superclass.
     const SbBox3f bbox(point, point);
     // FIXME: if there are *heaps* of markers, this next line will
     // probably become a bottleneck. Should really partition marker
@@ -338,22 +390,100 @@ SmMarkerSet::GLRender(SoGLRenderAction * action)
     // projected 3D position.  (FIXME: I haven't actually checked that
     // this is what TGS' implementation of the SoMarkerSet node does
     // when rendering, but it seems likely. 20010823 mortene.)
-    so_marker * tmp = &(* markerlist)[this->markerIndex[midx]];
-    point[0] = point[0] - (tmp->width - 1) / 2;
-    point[1] = point[1] - (tmp->height - 1) / 2;
-
-    glPixelStorei(GL_UNPACK_ALIGNMENT, tmp->align);
-    glRasterPos3f(point[0], point[1], -point[2]);
-    glBitmap(tmp->width, tmp->height, 0, 0, 0, 0, tmp->data);
+    const int marker = this->markerIndex[midx];
+    so_marker * tmp = &(* markerlist)[marker];
+
+    // snap the quad to whole pixels, the same way glBitmap() would
+    // place the bitmap, so that each texel covers exactly one pixel
+    const float x0 = (float) floor(point[0] - (tmp->width - 1) / 2);
+    const float y0 = (float) floor(point[1] - (tmp->height - 1) / 2);
+    const float x1 = x0 + tmp->width;
+    const float y1 = y0 + tmp->height;
+    const float z = -point[2];
+
+    const float s0 = float((marker % ATLAS_COLUMNS) * ATLAS_CELL) / markeratlassize[0];
+    const float t0 = float((marker / ATLAS_COLUMNS) * ATLAS_CELL) / markeratlassize[1];
+    const float s1 = s0 + float(tmp->width) / markeratlassize[0];
+    const float t1 = t0 + float(tmp->height) / markeratlassize[1];
+
+    const float c[] = { x0, y0, z, x1, y0, z, x1, y1, z, x0, y1, z };
+    const float tc[] = { s0, t0, s1, t0, s1, t1, s0, t1 };
+    int j;
+    for (j = 0; j < 12; j++) quadcoords.append(c[j]);
+    for (j = 0; j < 8; j++) quadtexcoords.append(tc[j]);
+
+    if (mbind == PER_VERTEX) {
+      const int cidx = SbMin(index, numdiffuse - 1);
+      uint32_t rgba;
+      if (packed) {
+        const uint32_t col = packedptr[cidx];
+        rgba = smmarkerset_rgba(float(col >> 24) / 255.0f,
+                                float((col >> 16) & 0xff) / 255.0f,
+                                float((col >> 8) & 0xff) / 255.0f,
+                                float(col & 0xff) / 255.0f);
+      }
+      else {
+        const SbColor & col = diffuseptr[cidx];
+        rgba = smmarkerset_rgba(col[0], col[1], col[2], alpha);
+      }
+      for (j = 0; j < 4; j++) quadcolors.append(rgba);
+    }
   }
 
-  // FIXME: this looks wrong, shouldn't we rather reset the alignment
-  // value to what it was previously?  20010824 mortene.
-  glPixelStorei(GL_UNPACK_ALIGNMENT, 4); // restore default value
-  glMatrixMode(GL_PROJECTION);
-  glPopMatrix();
-  glMatrixMode(GL_MODELVIEW);
-  glPopMatrix();
+  const int numverts = quadcoords.getLength() / 3;
+  SoGLDisplayList * atlaslist =
+    numverts ? markeratlas->getGLDisplayList(state) : NULL;
+
+  if (atlaslist) {
+    const cc_glglue * glue =
+      cc_glglue_instance((int) SoGLCacheContextElement::get(state));
+
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, vpsize[0], 0, vpsize[1], -1.0f, 1.0f);
+
+    // the texture and alpha test are enabled behind the back of the
+    // elements, so the previous GL state is restored before returning
+    glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_TEXTURE_BIT);
+    atlaslist->call(state);
+    // SoGLImage picks the filter from SoTextureQualityElement, but
+    // the markers are drawn one texel per pixel
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glEnable(GL_TEXTURE_2D);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glEnable(GL_ALPHA_TEST);
+    glAlphaFunc(GL_GREATER, 0.0f);
+
+    cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0, quadcoords.getArrayPtr());
+    cc_glglue_glTexCoordPointer(glue, 2, GL_FLOAT, 0, quadtexcoords.getArrayPtr());
+    cc_glglue_glEnableClientState(glue, GL_VERTEX_ARRAY);
+    cc_glglue_glEnableClientState(glue, GL_TEXTURE_COORD_ARRAY);
+    if (mbind == PER_VERTEX) {
+      cc_glglue_glColorPointer(glue, 4, GL_UNSIGNED_BYTE, 0, quadcolors.getArrayPtr());
+      cc_glglue_glEnableClientState(glue, GL_COLOR_ARRAY);
+    }
+
+    cc_glglue_glDrawArrays(glue, GL_QUADS, 0, numverts);
+
+    cc_glglue_glDisableClientState(glue, GL_VERTEX_ARRAY);
+    cc_glglue_glDisableClientState(glue, GL_TEXTURE_COORD_ARRAY);
+    if (mbind == PER_VERTEX) {
+      cc_glglue_glDisableClientState(glue, GL_COLOR_ARRAY);
+      // the color array leaves the current GL color undefined
+      SoGLLazyElement::getInstance(state)->reset(state, SoLazyElement::DIFFUSE_MASK);
+    }
+    glPopAttrib();
+
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+  }
 
   state->pop(); // we pushed, remember
 }
@@ -1296,3 +1426,48 @@ convert_bitmaps(void)
 
 
 // ----------------------------------------------------------------------------------------------------
+
+// Copies the marker bitmaps into a luminance/alpha atlas. Luminance
+// is always white, so that GL_MODULATE gives the marker color, and
+// alpha is the bitmap coverage.
+static void
+create_atlas(void)
+{
+  const int num = markerlist->getLength();
+  const int rows = (num + ATLAS_COLUMNS - 1) / ATLAS_COLUMNS;
+  int height = 1;
+  while (height < rows * ATLAS_CELL) height <<= 1;
+  markeratlassize.setValue(ATLAS_COLUMNS * ATLAS_CELL, height);
+
+  const int width = markeratlassize[0];
+  markeratlasdata = new unsigned char[width * height * 2];
+  for (int i = 0; i < width * height; i++) {
+    markeratlasdata[i*2] = 255;
+    markeratlasdata[i*2+1] = 0;
+  }
+
+  for (int m = 0; m < num; m++) {
+    const so_marker & marker = (*markerlist)[m];
+    const int stride = (((marker.width + 7) / 8 + marker.align - 1) / marker.align) * marker.align;
+    const int cx = (m % ATLAS_COLUMNS) * ATLAS_CELL;
+    const int cy = (m / ATLAS_COLUMNS) * ATLAS_CELL;
+    // bitmap rows are stored bottom to top, like the texture rows
+    for (int y = 0; y < marker.height; y++) {
+      const unsigned char * src = marker.data + y * stride;
+      unsigned char * dst = markeratlasdata + ((cy + y) * width + cx) * 2;
+      for (int x = 0; x < marker.width; x++) {
+        if (src[x >> 3] & (0x80 >> (x & 7))) dst[x*2+1] = 255;
+      }
+    }
+  }
+
+  markeratlas = new SoGLImage;
+  // no mipmaps, markers are always drawn one texel per pixel. The
+  // filtering is set to GL_NEAREST when rendering.
+  markeratlas->setFlags(SoGLImage::NO_MIPMAP);
+  markeratlas->setData(markeratlasdata, markeratlassize, 2,
+                       SoGLImage::CLAMP, SoGLImage::CLAMP);
+}
+
+#undef ATLAS_CELL
+#undef ATLAS_COLUMNS
@@ -97,6 +97,13 @@ public:
 
   void setVertexArraysRendering(const SbBool onoff);
   SbBool getVertexArraysRendering(void) const;
+  void setVertexBufferCaching(const SbBool onoff);
+  SbBool getVertexBufferCaching(void) const;
+  void setVertexBufferCacheBudget(const unsigned int bytes);
+  unsigned int getVertexBufferCacheBudget(void) const;
+  void getVertexBufferCacheStats(int & hits, int & misses, unsigned int & bytes) const;
+  void setTessellationThreads(const int numthreads);
+  int getTessellationThreads(void) const;
 
   SbVec3f getRenderCoordinateOffset(void) const;
   SbVec2f getElevationRange(void) const;
@@ -106,6 +113,7 @@ public:
 
   // dynamic texture callbacks
   static uint32_t colortexture_cb(void * node, double * xypos, float elevation, double * spacing);
+  void getColorTextureRow(const float * elevations, const int num, uint32_t * abgr);
 
   // action callbacks
   static SoCallbackAction::Response evaluateS(void * userdata, SoCallbackAction * action, const SoNode * node);
@@ -48,6 +48,12 @@
   If the stringIndex field is not empty, it will be used to select
   strings to render. If the material binding != OVERALL, the index
   array will also be used to select the color.
+
+  The priority field is only used when rendering below an
+  SmTextureText2Collector with declutter enabled. Strings with higher
+  priority are kept when labels overlap. There is one value per
+  string, and the last value is used for the remaining strings. The
+  default is empty, which gives all strings priority 0.
 */
 
 #include "SmTextureText2.h"
@@ -109,6 +115,7 @@ SmTextureText2::SmTextureText2()
   SO_NODE_ADD_FIELD(rotation, (0.0f)); // TODO also make it work for SmTextureText2Collector
   SO_NODE_ADD_FIELD(pickOnPixel, (FALSE));
   SO_NODE_ADD_EMPTY_MFIELD(stringIndex);
+  SO_NODE_ADD_EMPTY_MFIELD(priority);
 
   SO_NODE_DEFINE_ENUM_VALUE(Justification, CENTER);
   SO_NODE_DEFINE_ENUM_VALUE(Justification, LEFT);
@@ -227,6 +234,8 @@ SmTextureText2::GLRender(SoGLRenderAction * action)
 
     SbColor4f col(SoLazyElement::getDiffuse(state, 0),
                   1.0f - SoLazyElement::getTransparency(state, 0));
+    const int numpriorities = this->priority.getNum();
+    const float * priorities = this->priority.getValues(0);
     
     for (int i = 0; i < num; i++) {
       const int idx = numindices > 0 ? indices[i] : i; 
@@ -243,7 +252,10 @@ SmTextureText2::GLRender(SoGLRenderAction * action)
                                           this->maxRange.getValue(),
                                           col,
                                           static_cast<Justification>(this->justification.getValue()),
-                                          static_cast<VerticalJustification>(this->verticalJustification.getValue()));
+                                          static_cast<VerticalJustification>(this->verticalJustification.getValue()),
+                                          numpriorities > 0 ?
+                                          priorities[SbMin(idx, numpriorities - 1)] : 0.0f,
+                                          this, idx);
     }
     
     // invalidate caches to make sure this node is traversed every frame.
@@ -81,6 +81,7 @@ public:
 
   SoMFInt32 stringIndex;
   SoSFBool pickOnPixel;
+  SoMFFloat priority;
 
 
   virtual void GLRender(SoGLRenderAction * action);
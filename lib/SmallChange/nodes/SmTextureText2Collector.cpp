@@ -64,6 +64,12 @@
 
   Please note that this node will only be able to optimize SmTextureText2 nodes
   where the number of positions equals the number of strings.
+
+  If the declutter field is TRUE, labels that overlap on screen are
+  not rendered. Labels are placed in order of the SmTextureText2
+  priority field, then labels that were visible in the previous frame,
+  to avoid flicker, and then the nearest labels. A label is skipped if
+  it overlaps a label that was placed before it.
 */
 
 #include "SmTextureText2Collector.h"
@@ -81,9 +87,11 @@
 #include <Inventor/elements/SoGLLazyElement.h>
 #include <Inventor/elements/SoCacheElement.h>
 #include <Inventor/elements/SoGLTextureCoordinateElement.h>
+#include <Inventor/elements/SoGLCacheContextElement.h>
 #include <Inventor/bundles/SoMaterialBundle.h>
 #include <Inventor/system/gl.h>
 #include <Inventor/SbPlane.h>
+#include <algorithm>
 #include <cassert>
 
 SO_NODE_SOURCE(SmTextureText2Collector);
@@ -92,6 +100,7 @@ SmTextureText2Collector::SmTextureText2Collector(void)
 {
   SO_NODE_CONSTRUCTOR(SmTextureText2Collector);
   SO_NODE_ADD_FIELD(depthMask, (false));
+  SO_NODE_ADD_FIELD(declutter, (false));
 }
 
 SmTextureText2Collector::~SmTextureText2Collector()
@@ -158,14 +167,142 @@ SmTextureText2Collector::GLRenderBelowPath(SoGLRenderAction * action)
   }
 }
 
+// a collected item placed on screen, in pixels
+typedef struct {
+  int item;
+  SbVec2s pos;
+  short width;
+  short height;
+  float z;
+  float dist;
+  uint32_t key;
+  bool wasvisible;
+  int font;
+} sm_label;
+
+// identifies an item between frames, by the node that added it and
+// the index of the string in that node, so that a label keeps its key
+// when it moves or its text changes. Items added without a node are
+// identified by their text.
+static uint32_t
+label_key(const SmTextureText2CollectorElement::TextItem & item)
+{
+  if (item.node == NULL) return SbString::hash(item.text.getString());
+  // FNV-1a over the bytes of the node pointer, then the index
+  const unsigned char * ptr = reinterpret_cast<const unsigned char *>(&item.node);
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < sizeof(item.node); i++) h = (h ^ ptr[i]) * 16777619U;
+  h = (h ^ uint32_t(item.index)) * 16777619U;
+  return h;
+}
+
+// decluttering order: highest priority first, then the labels that
+// were visible in the last frame, then the nearest
+class sm_label_priority_less {
+public:
+  sm_label_priority_less(const std::vector<SmTextureText2CollectorElement::TextItem> & items)
+    : items(items) { }
+  bool operator()(const sm_label & l0, const sm_label & l1) const {
+    const float p0 = this->items[l0.item].priority;
+    const float p1 = this->items[l1.item].priority;
+    if (p0 != p1) return p0 > p1;
+    if (l0.wasvisible != l1.wasvisible) return l0.wasvisible;
+    return l0.dist < l1.dist;
+  }
+private:
+  const std::vector<SmTextureText2CollectorElement::TextItem> & items;
+};
+
+static bool
+label_font_less(const sm_label & l0, const sm_label & l1)
+{
+  return l0.font < l1.font;
+}
+
+static bool
+labels_overlap(const sm_label & l0, const sm_label & l1)
+{
+  return
+    l0.pos[0] < l1.pos[0] + l1.width && l1.pos[0] < l0.pos[0] + l0.width &&
+    l0.pos[1] < l1.pos[1] + l1.height && l1.pos[1] < l0.pos[1] + l0.height;
+}
+
+// Removes labels that overlap a label with higher priority, or that
+// are outside the viewport. Placed labels are stored in a uniform
+// grid, so that each label is only tested against the placed labels
+// near it. The keys of the remaining labels are stored in visible.
+static void
+declutter_labels(std::vector<sm_label> & labels,
+                 const std::vector<SmTextureText2CollectorElement::TextItem> & items,
+                 const SbVec2s & vpsize,
+                 std::vector<uint32_t> & visible)
+{
+  const int cellsize = 32;
+  const int cols = (vpsize[0] + cellsize - 1) / cellsize;
+  const int rows = (vpsize[1] + cellsize - 1) / cellsize;
+  if (cols <= 0 || rows <= 0) {
+    labels.clear();
+    visible.clear();
+    return;
+  }
+
+  size_t i;
+  for (i = 0; i < labels.size(); i++) {
+    labels[i].wasvisible =
+      std::binary_search(visible.begin(), visible.end(), labels[i].key);
+  }
+  std::sort(labels.begin(), labels.end(), sm_label_priority_less(items));
+
+  std::vector<std::vector<int> > grid(cols * rows);
+  std::vector<sm_label> placed;
+  for (i = 0; i < labels.size(); i++) {
+    const sm_label & l = labels[i];
+    const int x0 = l.pos[0];
+    const int y0 = l.pos[1];
+    const int x1 = x0 + l.width;
+    const int y1 = y0 + l.height;
+    if (x1 <= 0 || y1 <= 0 || x0 >= vpsize[0] || y0 >= vpsize[1]) continue;
+
+    const int c0 = SbMax(x0, 0) / cellsize;
+    const int c1 = (SbMin(x1, int(vpsize[0])) - 1) / cellsize;
+    const int r0 = SbMax(y0, 0) / cellsize;
+    const int r1 = (SbMin(y1, int(vpsize[1])) - 1) / cellsize;
+
+    bool overlap = false;
+    int r, c;
+    for (r = r0; r <= r1 && !overlap; r++) {
+      for (c = c0; c <= c1 && !overlap; c++) {
+        const std::vector<int> & cell = grid[r * cols + c];
+        for (size_t j = 0; j < cell.size(); j++) {
+          if (labels_overlap(l, placed[cell[j]])) {
+            overlap = true;
+            break;
+          }
+        }
+      }
+    }
+    if (overlap) continue;
+
+    const int idx = int(placed.size());
+    placed.push_back(l);
+    for (r = r0; r <= r1; r++) {
+      for (c = c0; c <= c1; c++) {
+        grid[r * cols + c].push_back(idx);
+      }
+    }
+  }
+
+  labels.swap(placed);
+  visible.resize(labels.size());
+  for (i = 0; i < labels.size(); i++) visible[i] = labels[i].key;
+  std::sort(visible.begin(), visible.end());
+}
+
 void
 SmTextureText2Collector::renderText(SoGLRenderAction * action,
                                     const std::vector<SmTextureText2CollectorElement::TextItem> & items)
 {
-  // FIXME: sort items based on font
-
   SoState * state = action->getState();
-  state->push();
 
   SbMatrix normalize(0.5f, 0.0f, 0.0f, 0.0f,
     0.0f, 0.5f, 0.0f, 0.0f,
@@ -180,82 +317,41 @@ SmTextureText2Collector::renderText(SoGLRenderAction * action,
   const SbViewportRegion & vp = SoViewportRegionElement::get(state);
   const SbVec2s vpsize = vp.getViewportSizePixels();
 
-  // Set up new view volume
-  glMatrixMode(GL_MODELVIEW);
-  glPushMatrix();
-  glLoadIdentity();
-  glMatrixMode(GL_PROJECTION);
-  glPushMatrix();
-  glLoadIdentity();
-  glOrtho(0, vpsize[0], 0, vpsize[1], -1.0f, 1.0f);
-
-  // set up texture and rendering
-  const SmTextureFont::FontImage * currentfont = items[0].font;
-  SoLightModelElement::set(state, SoLightModelElement::BASE_COLOR);
-  SoTextureQualityElement::set(state, 0.3f);
-  SoGLTextureImageElement::set(state, this,
-    currentfont->getGLImage(),
-    SoTextureImageElement::MODULATE,
-    SbColor(1.0f, 1.0f, 1.0f));
-  SoLazyElement::setVertexOrdering(state, SoLazyElement::CCW);
-  SoGLTextureCoordinateElement::setTexGen(state, this, NULL);
-
-  SoGLTextureEnabledElement::set(state, this, TRUE);
-  SoLazyElement::enableBlending(state, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-  SoMaterialBundle mb(action);
-  mb.sendFirst();
-
-  glPushAttrib(GL_DEPTH_BUFFER_BIT|GL_COLOR_BUFFER_BIT);
-  // use an alpha test function to avoid that we write values into
-  // the depth buffer for fully transparent parts of the text
-  glAlphaFunc(GL_GREATER, 0.01f);
-  glEnable(GL_ALPHA_TEST);
-  glDepthMask(this->depthMask.getValue());
-  glBegin(GL_QUADS);
-
   const SbPlane & nearplane = vv.getPlane(0.0f);
 
+  // place the items on screen. Fonts are numbered in the order they
+  // are first used.
+  std::vector<const SmTextureFont::FontImage *> fonts;
+  std::vector<sm_label> labels;
+  labels.reserve(items.size());
   for (size_t i = 0; i < items.size(); i++) {
     float dist = -nearplane.getDistance(items[i].worldpos);
     if ((dist < 0.0f) ||
       ((items[i].maxdist > 0.0f) && (dist > items[i].maxdist))) continue;
 
-    glColor4fv(items[i].color.getValue());
     int len = items[i].text.getLength();
     if (len == 0) continue;
 
-    if (items[i].font != currentfont) {
-      glEnd();
-      currentfont = items[i].font;
-      SoGLTextureImageElement::set(state, this,
-        currentfont->getGLImage(),
-        SoTextureImageElement::MODULATE,
-        SbColor(1.0f, 1.0f, 1.0f));
-      SoGLLazyElement::getInstance(state)->send(state,
-        SoLazyElement::GLIMAGE_MASK);
-
-      glBegin(GL_QUADS);
-    }
+    const SmTextureFont::FontImage * font = items[i].font;
     SbVec3f screenpoint;
     projmatrix.multVecMatrix(items[i].worldpos, screenpoint);
 
-    short ymin = short(-currentfont->getDescent());
+    short ymin = short(-font->getDescent());
 
     switch (items[i].vjustification) {
       case SmTextureText2::BOTTOM:
         break;
       case SmTextureText2::TOP:
-        ymin -= currentfont->getAscent();
+        ymin -= font->getAscent();
         break;
       case SmTextureText2::VCENTER:
-        ymin -= currentfont->getAscent() / 2;
+        ymin -= font->getAscent() / 2;
         break;
       default:
         assert(0 && "unknown alignment");
         break;
     }
-    short w = static_cast<short>(currentfont->stringWidth(items[i].text));
+    short w = static_cast<short>(font->stringWidth(items[i].text));
 
     SbVec2s sp;
     if (!get_screenpoint_pixels(screenpoint, vpsize, sp)) continue;
@@ -276,7 +372,89 @@ SmTextureText2Collector::renderText(SoGLRenderAction * action,
         assert(0 && "unknown alignment");
         break;
     }
-    currentfont->renderString(items[i].text, SbVec3f(n0[0], n0[1], screenpoint[2]), false);
+
+    sm_label l;
+    l.item = int(i);
+    l.pos = n0;
+    l.width = w;
+    l.height = static_cast<short>(font->getAscent() + font->getDescent());
+    l.z = screenpoint[2];
+    l.dist = dist;
+    l.key = label_key(items[i]);
+    l.wasvisible = false;
+    l.font = int(std::find(fonts.begin(), fonts.end(), font) - fonts.begin());
+    if (l.font == int(fonts.size())) fonts.push_back(font);
+    labels.push_back(l);
+  }
+
+  if (this->declutter.getValue()) {
+    // the visible labels are kept per context, since each view has
+    // its own camera
+    const uint32_t contextid = SoGLCacheContextElement::get(state);
+    declutter_labels(labels, items, vpsize, this->prevvisible[contextid]);
+  }
+  else {
+    this->prevvisible.clear();
+  }
+  if (labels.empty()) return;
+
+  // render the items one font at a time, to avoid texture switches
+  std::stable_sort(labels.begin(), labels.end(), label_font_less);
+
+  state->push();
+
+  // Set up new view volume
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadIdentity();
+  glOrtho(0, vpsize[0], 0, vpsize[1], -1.0f, 1.0f);
+
+  // set up texture and rendering
+  int currentfont = labels[0].font;
+  SoLightModelElement::set(state, SoLightModelElement::BASE_COLOR);
+  SoTextureQualityElement::set(state, 0.3f);
+  SoGLTextureImageElement::set(state, this,
+    fonts[currentfont]->getGLImage(),
+    SoTextureImageElement::MODULATE,
+    SbColor(1.0f, 1.0f, 1.0f));
+  SoLazyElement::setVertexOrdering(state, SoLazyElement::CCW);
+  SoGLTextureCoordinateElement::setTexGen(state, this, NULL);
+
+  SoGLTextureEnabledElement::set(state, this, TRUE);
+  SoLazyElement::enableBlending(state, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  SoMaterialBundle mb(action);
+  mb.sendFirst();
+
+  glPushAttrib(GL_DEPTH_BUFFER_BIT|GL_COLOR_BUFFER_BIT);
+  // use an alpha test function to avoid that we write values into
+  // the depth buffer for fully transparent parts of the text
+  glAlphaFunc(GL_GREATER, 0.01f);
+  glEnable(GL_ALPHA_TEST);
+  glDepthMask(this->depthMask.getValue());
+  glBegin(GL_QUADS);
+
+  for (size_t i = 0; i < labels.size(); i++) {
+    const sm_label & l = labels[i];
+    const SmTextureText2CollectorElement::TextItem & item = items[l.item];
+
+    if (l.font != currentfont) {
+      glEnd();
+      currentfont = l.font;
+      SoGLTextureImageElement::set(state, this,
+        fonts[currentfont]->getGLImage(),
+        SoTextureImageElement::MODULATE,
+        SbColor(1.0f, 1.0f, 1.0f));
+      SoGLLazyElement::getInstance(state)->send(state,
+        SoLazyElement::GLIMAGE_MASK);
+
+      glBegin(GL_QUADS);
+    }
+    glColor4fv(item.color.getValue());
+    fonts[currentfont]->renderString(item.text, SbVec3f(l.pos[0], l.pos[1], l.z), false);
   }
   glEnd();
   glPopAttrib();
@@ -339,7 +517,10 @@ SmTextureText2CollectorElement::add(SoState * state,
                                     const float maxdist,
                                 const SbColor4f & color,
                                 SmTextureText2::Justification j,
-                                SmTextureText2::VerticalJustification vj)
+                                SmTextureText2::VerticalJustification vj,
+                                const float priority,
+                                const SoNode * node,
+                                const int index)
 {
   SmTextureText2CollectorElement * elem =
     static_cast<SmTextureText2CollectorElement*>
@@ -356,6 +537,9 @@ SmTextureText2CollectorElement::add(SoState * state,
   item.maxdist = maxdist;
   item.justification = j;
   item.vjustification = vj;
+  item.priority = priority;
+  item.node = node;
+  item.index = index;
 
   elem->items.push_back(item);
 }
@@ -3,6 +3,7 @@
 
 /**************************************************************************/
 
+#include <map>
 #include <vector>
 #include <Inventor/elements/SoSubElement.h>
 #include <Inventor/elements/SoElement.h>
@@ -30,6 +31,10 @@ public:
     SbColor4f color;
     SmTextureText2::Justification justification;
     SmTextureText2::VerticalJustification vjustification;
+    float priority;
+    // the node that added the item, and the index of the string in it
+    const SoNode * node;
+    int index;
   } TextItem;
 
 
@@ -43,7 +48,10 @@ public:
     const float maxdist,
     const SbColor4f & color,
     SmTextureText2::Justification j,
-    SmTextureText2::VerticalJustification vj);
+    SmTextureText2::VerticalJustification vj,
+    const float priority = 0.0f,
+    const SoNode * node = NULL,
+    const int index = 0);
 
   static const std::vector <TextItem> &  finishCollecting(SoState * state);
   static bool isCollecting(SoState * state);
@@ -72,6 +80,7 @@ class SMALLCHANGE_DLL_API SmTextureText2Collector : public SoSeparator {
 
  public:
   SoSFBool depthMask;
+  SoSFBool declutter;
 
   static void initClass(void);
   SmTextureText2Collector(void);
@@ -84,6 +93,11 @@ class SMALLCHANGE_DLL_API SmTextureText2Collector : public SoSeparator {
 
   virtual void renderText(SoGLRenderAction * action,
                           const std::vector<SmTextureText2CollectorElement::TextItem> &);
+
+ private:
+  // keys of the labels that survived decluttering in the last frame,
+  // for each GL context
+  std::map<uint32_t, std::vector<uint32_t> > prevvisible;
 };
 
 /**************************************************************************/
@@ -2,6 +2,29 @@
 #include <config.h>
 #endif // HAVE_CONFIG_H
 
+/*!
+  \class SmTrack SmTrack.h SmallChange/nodes/SmTrack.h
+  \brief The SmTrack class renders a track of time stamped positions.
+
+  Positions are added with append(). Only the positions within the
+  last \a trackLength seconds are rendered, as points, lines and/or
+  direction ticks.
+
+  The positions are kept in a float vertex array relative to the first
+  position, and uploaded to a vertex buffer object when supported.
+  When positions are appended, only the new ones are uploaded, and
+  points, lines and ticks are drawn with one call each.
+*/
+
+/*!
+  \var SoSFBool SmTrack::ringBuffer
+
+  When TRUE, positions older than \a trackLength are deleted from \a
+  track and \a timeStamps as new positions are appended, so that
+  memory use stays bounded for tracks that run for a long time. When
+  FALSE (the default), all positions are kept.
+*/
+
 #include <SmallChange/nodes/SmTrack.h>
 
 #ifdef __COIN__
@@ -17,20 +40,37 @@
 #include <Inventor/actions/SoGLRenderAction.h>
 #include <Inventor/bundles/SoMaterialBundle.h>
 #include <Inventor/elements/SoViewVolumeElement.h>
+#include <Inventor/elements/SoGLCacheContextElement.h>
 #include <Inventor/sensors/SoFieldSensor.h>
+#include <Inventor/lists/SbList.h>
+#include <Inventor/misc/SoNotification.h>
+#include <Inventor/C/glue/gl.h>
 
 #define PRIVATE(obj) (obj)->pimpl
 #define PUBLIC(obj) (obj)->master
 
+// positions before startix are only deleted when there are at least
+// this many of them, and they make up half the track
+#define SMTRACK_MIN_DISCARD 256
+
 class SmTrackP {
 public:
     SmTrackP(void)
-            : startix(0) {}
+            : startix(0),
+              inappend(FALSE),
+              numcached(0),
+              vbo(0),
+              vbocontext(0),
+              vbocapacity(0),
+              numuploaded(0),
+              ticknum(-1) {}
 
     void updateInterval(void)
     {
-        float t = PUBLIC(this)->trackLength.getValue();
         int n = PUBLIC(this)->timeStamps.getNum();
+        this->startix = 0;
+        if (n == 0) return;
+
         int i = n-1;
         SbTime starttime = PUBLIC(this)->timeStamps[i];
 
@@ -52,9 +92,58 @@ public:
         thisp->updateInterval();
     }
 
-    int startix, endix;
+    void discardOld(void);
+    void invalidateCache(void);
+    void updateCache(void);
+    void updateVBO(const cc_glglue * glue, const uint32_t contextid);
+    void updateTicks(const int tickinterval, const float ticksize);
+
+    static void deleteVBOCB(void * closure, uint32_t contextid);
+
+    int startix;
     SmTrack * master;
     SoFieldSensor * tracklengthsensor;
+    SbBool inappend;
+
+    // positions as floats relative to origin, for vertex arrays
+    SbVec3d origin;
+    SbList <float> vertices;
+    int numcached;
+
+    GLuint vbo;
+    uint32_t vbocontext;
+    int vbocapacity;
+    int numuploaded;
+
+    // indices for every n'th point or line, rebuilt when the track
+    // or the interval changes
+    class indexcache {
+    public:
+        indexcache(void) : num(-1), start(-1), interval(0) { }
+        void update(const int num, const int start, const int interval,
+                    const SbBool lines)
+        {
+            if (num == this->num && start == this->start && interval == this->interval) return;
+            this->num = num;
+            this->start = start;
+            this->interval = interval;
+            this->indices.truncate(0);
+            for (int i = lines ? start + 1 : start; i < num; i += interval) {
+                if (lines) this->indices.append((GLuint) (i - 1));
+                this->indices.append((GLuint) i);
+            }
+        }
+        void invalidate(void) { this->num = -1; }
+        SbList <GLuint> indices;
+    private:
+        int num, start, interval;
+    };
+    indexcache pointindices;
+    indexcache lineindices;
+
+    SbList <float> tickvertices;
+    int ticknum, tickstart, tickinterval;
+    float ticksize;
 };
 
 SO_NODE_SOURCE(SmTrack);
@@ -77,6 +166,7 @@ SmTrack::SmTrack(void)
     SO_NODE_ADD_FIELD(lineInterval, (0));
     SO_NODE_ADD_FIELD(tickInterval, (0));
     SO_NODE_ADD_FIELD(tickSize, (1.0f));
+    SO_NODE_ADD_FIELD(ringBuffer, (FALSE));
 
     PRIVATE(this) = new SmTrackP;
     PRIVATE(this)->master = this;
@@ -88,6 +178,11 @@ SmTrack::SmTrack(void)
 
 SmTrack::~SmTrack()
 {
+    if (PRIVATE(this)->vbo) {
+        SoGLCacheContextElement::scheduleDeleteCallback(PRIVATE(this)->vbocontext,
+                                                        SmTrackP::deleteVBOCB,
+                                                        (void *) ((uintptr_t) PRIVATE(this)->vbo));
+    }
     delete PRIVATE(this)->tracklengthsensor;
     delete PRIVATE(this);
 }
@@ -98,58 +193,74 @@ SmTrack::GLRender(SoGLRenderAction * action)
     if (!this->shouldGLRender(action)) return;
     if (this->trackLength.getValue() == 0.0) return;
 
+    PRIVATE(this)->updateCache();
+    const int num = PRIVATE(this)->numcached;
+    const int startix = PRIVATE(this)->startix;
+    if (startix >= num) return;
+
     SoMaterialBundle mb(action);
     mb.sendFirst();
 
     GLboolean lighting = glIsEnabled(GL_LIGHTING);
     if (lighting) glDisable(GL_LIGHTING);
 
+    const uint32_t contextid = action->getCacheContext();
+    const cc_glglue * glue = cc_glglue_instance((int) contextid);
+    const SbBool usevbo = cc_glglue_has_vertex_buffer_object(glue);
+
+    // draw relative to the origin of the float vertices
+    glPushMatrix();
+    glTranslated(PRIVATE(this)->origin[0], PRIVATE(this)->origin[1], PRIVATE(this)->origin[2]);
+    cc_glglue_glEnableClientState(glue, GL_VERTEX_ARRAY);
+
+    const float * vptr = PRIVATE(this)->vertices.getArrayPtr();
+    if (usevbo) {
+        PRIVATE(this)->updateVBO(glue, contextid);
+        // the point and line indices are in client memory
+        cc_glglue_glBindBuffer(glue, GL_ELEMENT_ARRAY_BUFFER, 0);
+        vptr = NULL;
+    }
+
+    cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0, vptr);
+
     unsigned short pointInterval = this->pointInterval.getValue();
-    if (pointInterval > 0) {
-        glBegin(GL_POINTS);
-        for (int i = PRIVATE(this)->startix; i < this->track.getNum(); i += pointInterval) {
-            glVertex3dv(this->track[i].getValue());
-        }
-        glEnd();
+    if (pointInterval == 1) {
+        cc_glglue_glDrawArrays(glue, GL_POINTS, startix, num - startix);
+    }
+    else if (pointInterval > 1) {
+        SmTrackP::indexcache & ic = PRIVATE(this)->pointindices;
+        ic.update(num, startix, pointInterval, FALSE);
+        cc_glglue_glDrawElements(glue, GL_POINTS, ic.indices.getLength(),
+                                 GL_UNSIGNED_INT, ic.indices.getArrayPtr());
     }
 
     unsigned short lineInterval = this->lineInterval.getValue();
-    if (lineInterval > 0) {
-        glBegin(GL_LINES);
-        for (int i = PRIVATE(this)->startix + 1; i < this->track.getNum(); i += lineInterval) {
-            glVertex3dv(this->track[i - 1].getValue());
-            glVertex3dv(this->track[i].getValue());
-        }
-        glEnd();
+    if (lineInterval == 1 && num - startix > 1) {
+        cc_glglue_glDrawArrays(glue, GL_LINE_STRIP, startix, num - startix);
+    }
+    else if (lineInterval > 1 && num - startix > 1) {
+        SmTrackP::indexcache & ic = PRIVATE(this)->lineindices;
+        ic.update(num, startix, lineInterval, TRUE);
+        cc_glglue_glDrawElements(glue, GL_LINES, ic.indices.getLength(),
+                                 GL_UNSIGNED_INT, ic.indices.getArrayPtr());
     }
 
+    if (usevbo) cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, 0);
+
     unsigned short tickInterval = this->tickInterval.getValue();
-    if (tickInterval > 0) {
-        float s = this->tickSize.getValue();
-        SbRotation r(SbVec3f(0, 0, 1), 0.125f * float(M_PI));
-        for (int i = PRIVATE(this)->startix + 1; i < this->track.getNum(); i += tickInterval) {
-            SbVec3f p = SbVec3f(this->track[i]);
-            SbVec3f v = SbVec3f(this->track[i - 1]) - p;
-
-#if 1
-            v *=  s / v.length();
-#else
-            v *= SoViewVolumeElement::get(action->getState()).getWorldToScreenScale(p, s) / v.length();
-#endif
-
-            SbVec3f left, right;
-            r.multVec(v, left);
-            r.inverse().multVec(v, right);
-            left += p;
-            right += p;
-            glBegin(GL_LINE_STRIP);
-            glVertex3fv(left.getValue());
-            glVertex3fv(p.getValue());
-            glVertex3fv(right.getValue());
-            glEnd();
+    if (tickInterval > 0 && num - startix > 1) {
+        PRIVATE(this)->updateTicks(tickInterval, this->tickSize.getValue());
+        if (PRIVATE(this)->tickvertices.getLength()) {
+            cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0,
+                                      PRIVATE(this)->tickvertices.getArrayPtr());
+            cc_glglue_glDrawArrays(glue, GL_LINES, 0,
+                                   PRIVATE(this)->tickvertices.getLength() / 3);
         }
     }
 
+    cc_glglue_glDisableClientState(glue, GL_VERTEX_ARRAY);
+    glPopMatrix();
+
     if (lighting) glEnable(GL_LIGHTING);
 }
 
@@ -159,10 +270,15 @@ SmTrack::append(const SbVec3d & pos,
 {
     int index = this->timeStamps.getNum();
     assert(index == this->track.getNum());
+
+    // the vertex cache is extended instead of rebuilt
+    PRIVATE(this)->inappend = TRUE;
     this->timeStamps.set1Value(index, timestamp);
     this->track.set1Value(index, pos);
+    PRIVATE(this)->inappend = FALSE;
 
     PRIVATE(this)->updateInterval();
+    if (this->ringBuffer.getValue()) PRIVATE(this)->discardOld();
 }
 
 
@@ -193,5 +309,159 @@ SmTrack::generatePrimitives(SoAction * action)
     // FIXME: implement! (20060602 frodo)
 }
 
+// Overridden to invalidate the vertex cache when the positions are
+// changed other than through append().
+void
+SmTrack::notify(SoNotList * list)
+{
+    SoField * f = list->getLastField();
+    if (f == &this->track && !PRIVATE(this)->inappend) {
+        PRIVATE(this)->invalidateCache();
+    }
+    else if (f == &this->timeStamps && !PRIVATE(this)->inappend) {
+        PRIVATE(this)->updateInterval();
+    }
+    else if (f == &this->ringBuffer && this->ringBuffer.getValue()) {
+        PRIVATE(this)->discardOld();
+    }
+    inherited::notify(list);
+}
+
+// *************************************************************************
+
+//
+// Deletes the positions before startix, once there are enough of
+// them to make it worthwhile.
+//
+void
+SmTrackP::discardOld(void)
+{
+    const int n = this->startix;
+    if (n < SMTRACK_MIN_DISCARD || n < PUBLIC(this)->track.getNum() / 2) return;
+
+    // notify() invalidates the vertex cache and updates startix
+    PUBLIC(this)->track.deleteValues(0, n);
+    PUBLIC(this)->timeStamps.deleteValues(0, n);
+}
+
+void
+SmTrackP::invalidateCache(void)
+{
+    this->vertices.truncate(0);
+    this->numcached = 0;
+    this->numuploaded = 0;
+    this->pointindices.invalidate();
+    this->lineindices.invalidate();
+    this->ticknum = -1;
+}
+
+//
+// Converts the positions that aren't in the vertex cache yet. After
+// an append, this is only the new position.
+//
+void
+SmTrackP::updateCache(void)
+{
+    const int num = PUBLIC(this)->track.getNum();
+    if (num < this->numcached) this->invalidateCache();
+    if (num == this->numcached) return;
+
+    const SbVec3d * pts = PUBLIC(this)->track.getValues(0);
+    if (this->numcached == 0) this->origin = pts[0];
+    for (int i = this->numcached; i < num; i++) {
+        const SbVec3d p = pts[i] - this->origin;
+        this->vertices.append((float) p[0]);
+        this->vertices.append((float) p[1]);
+        this->vertices.append((float) p[2]);
+    }
+    this->numcached = num;
+}
+
+//
+// Uploads the new tail of the vertex cache, and leaves the buffer
+// bound. The whole buffer is uploaded when it has to grow.
+//
+void
+SmTrackP::updateVBO(const cc_glglue * glue, const uint32_t contextid)
+{
+    if (this->vbo && this->vbocontext != contextid) {
+        SoGLCacheContextElement::scheduleDeleteCallback(this->vbocontext, deleteVBOCB,
+                                                        (void *) ((uintptr_t) this->vbo));
+        this->vbo = 0;
+    }
+    if (this->vbo == 0) {
+        cc_glglue_glGenBuffers(glue, 1, &this->vbo);
+        this->vbocontext = contextid;
+        this->vbocapacity = 0;
+        this->numuploaded = 0;
+    }
+    cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, this->vbo);
+
+    const int num = this->numcached;
+    if (num > this->vbocapacity) {
+        int capacity = this->vbocapacity ? this->vbocapacity : 64;
+        while (capacity < num) capacity *= 2;
+        cc_glglue_glBufferData(glue, GL_ARRAY_BUFFER, capacity * 3 * sizeof(float),
+                               NULL, GL_DYNAMIC_DRAW);
+        this->vbocapacity = capacity;
+        this->numuploaded = 0;
+    }
+    if (num > this->numuploaded) {
+        cc_glglue_glBufferSubData(glue, GL_ARRAY_BUFFER,
+                                  this->numuploaded * 3 * sizeof(float),
+                                  (num - this->numuploaded) * 3 * sizeof(float),
+                                  this->vertices.getArrayPtr() + this->numuploaded * 3);
+        this->numuploaded = num;
+    }
+}
+
+//
+// Builds the tick lines. Each tick is two lines, from the left side to
+// the position and from the position to the right side.
+//
+void
+SmTrackP::updateTicks(const int tickinterval, const float ticksize)
+{
+    if (this->numcached == this->ticknum && this->startix == this->tickstart &&
+        tickinterval == this->tickinterval && ticksize == this->ticksize) return;
+    this->ticknum = this->numcached;
+    this->tickstart = this->startix;
+    this->tickinterval = tickinterval;
+    this->ticksize = ticksize;
+
+    this->tickvertices.truncate(0);
+    SbRotation r(SbVec3f(0, 0, 1), 0.125f * float(M_PI));
+    SbRotation rinv = r.inverse();
+    const SbVec3f * pts = (const SbVec3f *) this->vertices.getArrayPtr();
+    for (int i = this->startix + 1; i < this->numcached; i += tickinterval) {
+        SbVec3f p = pts[i];
+        SbVec3f v = pts[i - 1] - p;
+        float len = v.length();
+        if (len == 0.0f) continue;
+        v *= ticksize / len;
+
+        SbVec3f left, right;
+        r.multVec(v, left);
+        rinv.multVec(v, right);
+        left += p;
+        right += p;
+        const SbVec3f * tick[4] = { &left, &p, &p, &right };
+        for (int j = 0; j < 4; j++) {
+            this->tickvertices.append((*tick[j])[0]);
+            this->tickvertices.append((*tick[j])[1]);
+            this->tickvertices.append((*tick[j])[2]);
+        }
+    }
+}
+
+void
+SmTrackP::deleteVBOCB(void * closure, uint32_t contextid)
+{
+    const cc_glglue * glue = cc_glglue_instance((int) contextid);
+    GLuint buffer = (GLuint) ((uintptr_t) closure);
+    cc_glglue_glDeleteBuffers(glue, 1, &buffer);
+}
+
+#undef SMTRACK_MIN_DISCARD
 #undef PRIVATE
 #undef PUBLIC
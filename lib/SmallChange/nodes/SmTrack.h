@@ -38,6 +38,7 @@
 #include <Inventor/fields/SoMFTime.h>
 #include <Inventor/fields/SoSFFloat.h>
 #include <Inventor/fields/SoSFUShort.h>
+#include <Inventor/fields/SoSFBool.h>
 #include <SmallChange/basic.h>
 
 class SoAction;
@@ -59,6 +60,7 @@ public:
   SoSFUShort lineInterval;
   SoSFUShort tickInterval;
   SoSFFloat tickSize;
+  SoSFBool ringBuffer;
 
   void append(const SbVec3d & pos,
               const SbTime & timestamp);
@@ -73,6 +75,7 @@ protected:
   virtual void computeBBox(SoAction * action, SbBox3f & box,
                            SbVec3f & center);
   virtual void generatePrimitives(SoAction * action);
+  virtual void notify(SoNotList * list);
 
 private:
   virtual ~SmTrack(void);
@@ -0,0 +1,1058 @@
+/**************************************************************************\
+ * Copyright (c) Kongsberg Oil & Gas Technologies AS
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+\**************************************************************************/
+
+/*!
+  \class SmTrackSet SmTrackSet.h SmallChange/nodes/SmTrackSet.h
+  \brief The SmTrackSet class renders many tracks of time stamped positions.
+
+  \ingroup nodes
+
+  This node is meant for scenes with thousands of tracked targets,
+  where one SmTrackPointKit or SmTrack per target would spend most of
+  the frame time traversing nodes and changing GL state. All tracks
+  are kept in one node, and all points are drawn with one call, and
+  all lines and ticks with another, if multi draw is supported. Each
+  track has its own region in the vertex buffers, so only the tracks
+  that have changed are rebuilt and uploaded.
+
+  Tracks are added with addTrack(), which returns an id used for the
+  other functions. Each track has its own color, track length and
+  point, line and tick intervals, with the same meaning as the fields
+  in SmTrack. The initial values are taken from the fields of this
+  node. Positions older than the track length are deleted as new
+  positions are appended, and tracks that haven't been updated for a
+  while can be deleted with removeExpiredTracks().
+
+  The tracks are not stored in fields, and are not written to file.
+
+  \sa SmTrack, SmTrackPointKit
+*/
+
+/*!
+  \var SoSFFloat SmTrackSet::trackLength
+
+  The track length, in seconds, for new tracks. Default value is 22.
+*/
+
+/*!
+  \var SoSFUShort SmTrackSet::pointInterval
+
+  The point interval for new tracks. Every pointInterval'th position
+  is drawn as a point, or none if 0. Default value is 1.
+*/
+
+/*!
+  \var SoSFUShort SmTrackSet::lineInterval
+
+  The line interval for new tracks. Default value is 0.
+*/
+
+/*!
+  \var SoSFUShort SmTrackSet::tickInterval
+
+  The tick interval for new tracks. Default value is 0.
+*/
+
+/*!
+  \var SoSFFloat SmTrackSet::tickSize
+
+  The length of the direction ticks, for all tracks. Default value is 1.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif // HAVE_CONFIG_H
+
+#include <SmallChange/nodes/SmTrackSet.h>
+#include <Inventor/system/gl.h>
+#include <Inventor/C/glue/gl.h>
+#include <Inventor/actions/SoGLRenderAction.h>
+#include <Inventor/bundles/SoMaterialBundle.h>
+#include <Inventor/elements/SoGLCacheContextElement.h>
+#include <Inventor/elements/SoGLLazyElement.h>
+#include <Inventor/SoPrimitiveVertex.h>
+#include <Inventor/lists/SbList.h>
+#include <SmallChange/misc/SbHash.h>
+#include <cstring>
+#include <cmath>
+
+#define PRIVATE(obj) (obj)->pimpl
+#define PUBLIC(obj) (obj)->master
+
+// The positions of one track, in a ring buffer with one array for
+// each coordinate and the time stamps.
+class sm_trackring {
+public:
+  sm_trackring(void)
+    : x(NULL), y(NULL), z(NULL), t(NULL), capacity(0), first(0), count(0) { }
+  ~sm_trackring() { this->clear(); }
+
+  void clear(void) {
+    delete[] this->x;
+    delete[] this->y;
+    delete[] this->z;
+    delete[] this->t;
+    this->x = this->y = this->z = this->t = NULL;
+    this->capacity = this->first = this->count = 0;
+  }
+
+  int index(const int i) const { return (this->first + i) & (this->capacity - 1); }
+  double getTime(const int i) const { return this->t[this->index(i)]; }
+  SbVec3d getPosition(const int i) const {
+    const int idx = this->index(i);
+    return SbVec3d(this->x[idx], this->y[idx], this->z[idx]);
+  }
+
+  void push(const SbVec3d & pos, const double time) {
+    if (this->count == this->capacity) this->grow();
+    const int idx = this->index(this->count++);
+    this->x[idx] = pos[0];
+    this->y[idx] = pos[1];
+    this->z[idx] = pos[2];
+    this->t[idx] = time;
+  }
+
+  void dropFirst(const int n) {
+    this->first = this->index(n);
+    this->count -= n;
+  }
+
+  // returns the first position to render, which is the last one that
+  // is at least tracklength older than the newest, like SmTrack
+  int getStart(const float tracklength) const {
+    int start = 0;
+    if (this->count == 0) return 0;
+    const double newest = this->getTime(this->count - 1);
+    while (start + 1 < this->count &&
+           newest - this->getTime(start + 1) >= tracklength) {
+      start++;
+    }
+    return start;
+  }
+
+  double * x, * y, * z, * t;
+  int capacity; // always a power of two
+  int first;
+  int count;
+
+private:
+  void grow(void) {
+    const int newcapacity = this->capacity ? this->capacity * 2 : 16;
+    double * arrays[4] = { this->x, this->y, this->z, this->t };
+    double * newarrays[4];
+    for (int a = 0; a < 4; a++) {
+      newarrays[a] = new double[newcapacity];
+      for (int i = 0; i < this->count; i++) {
+        newarrays[a][i] = arrays[a][this->index(i)];
+      }
+      delete[] arrays[a];
+    }
+    this->x = newarrays[0];
+    this->y = newarrays[1];
+    this->z = newarrays[2];
+    this->t = newarrays[3];
+    this->capacity = newcapacity;
+    this->first = 0;
+  }
+};
+
+// Where a track is stored in the render cache. Each track has room
+// for more vertices and indices than it uses, so that it can usually
+// be updated in place when positions are appended.
+struct sm_trackregion {
+  int vstart;
+  int vcapacity;
+  int numvertices;
+  int istart; // the point indices, followed by the line indices
+  int icapacity;
+  int numpoints;
+  int numlines;
+  SbBool dirty;
+};
+
+class SmTrackSetP {
+public:
+  SmTrackSetP(SmTrackSet * master)
+    : master(master),
+      nextid(0),
+      dirty(TRUE),
+      originset(FALSE),
+      cacheticksize(-1.0f),
+      vwasted(0),
+      iwasted(0),
+      totalpoints(0),
+      totallines(0),
+      vbo(0),
+      ibo(0),
+      vbocontext(0),
+      vbovertices(0),
+      vboindices(0),
+      needupload(TRUE) { }
+
+  int getSlot(const int id) const {
+    int slot;
+    if (!this->idmap.get(id, slot)) return -1;
+    return slot;
+  }
+  void changed(void) {
+    if (!this->dirty) {
+      this->dirty = TRUE;
+      PUBLIC(this)->touch();
+    }
+  }
+  void changed(const int slot) {
+    this->regions[slot].dirty = TRUE;
+    this->changed();
+  }
+  void removeSlot(const int slot);
+  void buildTrack(const int slot);
+  void storeTrack(const int slot);
+  void compact(void);
+  void updateCache(void);
+  void updateBuffers(const cc_glglue * glue, const uint32_t contextid);
+  void drawRanges(const cc_glglue * glue, const GLenum mode,
+                  const SbList <GLsizei> & counts, const SbList <GLuint> & starts,
+                  const char * indexptr);
+  static void deleteBufferCB(void * closure, uint32_t contextid);
+
+  SmTrackSet * master;
+  int nextid;
+  SbHash <int, int> idmap; // track id -> slot
+
+  // the tracks, as a structure of arrays indexed by slot
+  SbList <int> ids;
+  SbList <sm_trackring *> rings;
+  SbList <float> tracklength;
+  SbList <unsigned short> pointinterval;
+  SbList <unsigned short> lineinterval;
+  SbList <unsigned short> tickinterval;
+  SbList <uint32_t> color; // RGBA bytes in memory order, for glColorPointer()
+  SbList <sm_trackregion> regions;
+
+  // render cache for all tracks, with a region for each track. The
+  // tick vertices of a track are stored after its positions.
+  SbBool dirty;
+  SbBool originset;
+  SbVec3d origin;
+  float cacheticksize;
+  SbList <float> vertices;
+  SbList <uint32_t> colors;
+  SbList <GLuint> indices;
+  int vwasted; // space in the cache not used by any track
+  int iwasted;
+
+  // the index ranges to draw, one for each track
+  SbList <GLsizei> pointcounts;
+  SbList <GLuint> pointstarts;
+  SbList <GLsizei> linecounts;
+  SbList <GLuint> linestarts;
+  int totalpoints;
+  int totallines;
+  SbList <const GLvoid *> drawoffsets;
+
+  // a rebuilt track, before it is stored in the cache
+  SbList <float> trackvertices;
+  SbList <float> tickvertices;
+  SbList <GLuint> trackpoints;
+  SbList <GLuint> tracklines;
+
+  GLuint vbo;
+  GLuint ibo;
+  uint32_t vbocontext;
+  int vbovertices; // the number of vertices the buffer has room for
+  int vboindices;
+  SbBool needupload;
+  // the regions changed since the last upload, as vertex start,
+  // number of vertices, index start and number of indices
+  SbList <int> uploadranges;
+};
+
+SO_NODE_SOURCE(SmTrackSet);
+
+/*!
+  Constructor.
+*/
+SmTrackSet::SmTrackSet(void)
+{
+  SO_NODE_CONSTRUCTOR(SmTrackSet);
+
+  SO_NODE_ADD_FIELD(trackLength, (22.0f));
+  SO_NODE_ADD_FIELD(pointInterval, (1));
+  SO_NODE_ADD_FIELD(lineInterval, (0));
+  SO_NODE_ADD_FIELD(tickInterval, (0));
+  SO_NODE_ADD_FIELD(tickSize, (1.0f));
+
+  PRIVATE(this) = new SmTrackSetP(this);
+}
+
+/*!
+  Destructor.
+*/
+SmTrackSet::~SmTrackSet()
+{
+  for (int i = 0; i < PRIVATE(this)->rings.getLength(); i++) {
+    delete PRIVATE(this)->rings[i];
+  }
+  if (PRIVATE(this)->vbo) {
+    SoGLCacheContextElement::scheduleDeleteCallback(PRIVATE(this)->vbocontext,
+                                                    SmTrackSetP::deleteBufferCB,
+                                                    (void *) ((uintptr_t) PRIVATE(this)->vbo));
+    SoGLCacheContextElement::scheduleDeleteCallback(PRIVATE(this)->vbocontext,
+                                                    SmTrackSetP::deleteBufferCB,
+                                                    (void *) ((uintptr_t) PRIVATE(this)->ibo));
+  }
+  delete PRIVATE(this);
+}
+
+// Documented in superclass
+void
+SmTrackSet::initClass(void)
+{
+  static int first = 1;
+  if (first) {
+    first = 0;
+    SO_NODE_INIT_CLASS(SmTrackSet, SoShape, "Shape");
+  }
+}
+
+/*!
+  Adds a new, empty track with \a color, and returns its id.
+*/
+int
+SmTrackSet::addTrack(const SbColor & color)
+{
+  const int id = PRIVATE(this)->nextid++;
+  const int slot = PRIVATE(this)->ids.getLength();
+  PRIVATE(this)->idmap.put(id, slot);
+  PRIVATE(this)->ids.append(id);
+  PRIVATE(this)->rings.append(new sm_trackring);
+  PRIVATE(this)->tracklength.append(this->trackLength.getValue());
+  PRIVATE(this)->pointinterval.append(this->pointInterval.getValue());
+  PRIVATE(this)->lineinterval.append(this->lineInterval.getValue());
+  PRIVATE(this)->tickinterval.append(this->tickInterval.getValue());
+  PRIVATE(this)->color.append(0);
+  sm_trackregion region;
+  memset(&region, 0, sizeof(region));
+  PRIVATE(this)->regions.append(region);
+  this->setColor(id, color);
+  return id;
+}
+
+/*!
+  Removes \a track.
+*/
+void
+SmTrackSet::removeTrack(const int track)
+{
+  const int slot = PRIVATE(this)->getSlot(track);
+  if (slot < 0) return;
+  PRIVATE(this)->removeSlot(slot);
+  PRIVATE(this)->changed();
+}
+
+/*!
+  Returns TRUE if there is a track with id \a track.
+*/
+SbBool
+SmTrackSet::hasTrack(const int track) const
+{
+  return PRIVATE(this)->getSlot(track) >= 0;
+}
+
+/*!
+  Returns the number of tracks.
+*/
+int
+SmTrackSet::getNumTracks(void) const
+{
+  return PRIVATE(this)->ids.getLength();
+}
+
+/*!
+  Appends a position to \a track. Positions older than the track
+  length are deleted.
+*/
+void
+SmTrackSet::append(const int track, const SbVec3d & pos, const SbTime & timestamp)
+{
+  const int slot = PRIVATE(this)->getSlot(track);
+  if (slot < 0) return;
+
+  if (!PRIVATE(this)->originset) {
+    // vertices are stored as floats relative to the first position
+    PRIVATE(this)->origin = pos;
+    PRIVATE(this)->originset = TRUE;
+  }
+  sm_trackring * ring = PRIVATE(this)->rings[slot];
+  ring->push(pos, timestamp.getValue());
+  const int start = ring->getStart(PRIVATE(this)->tracklength[slot]);
+  if (start > 0) ring->dropFirst(start);
+  PRIVATE(this)->changed(slot);
+}
+
+/*!
+  Deletes all positions in \a track.
+*/
+void
+SmTrackSet::clearTrack(const int track)
+{
+  const int slot = PRIVATE(this)->getSlot(track);
+  if (slot < 0) return;
+  PRIVATE(this)->rings[slot]->clear();
+  PRIVATE(this)->changed(slot);
+}
+
+/*!
+  Returns the number of positions stored for \a track.
+*/
+int
+SmTrackSet::getNumPositions(const int track) const
+{
+  const int slot = PRIVATE(this)->getSlot(track);
+  return slot < 0 ? 0 : PRIVATE(this)->rings[slot]->count;
+}
+
+/*!
+  Removes all tracks with no positions newer than \a before, and
+  returns the number of tracks removed. Tracks with no positions are
+  not removed.
+*/
+int
+SmTrackSet::removeExpiredTracks(const SbTime & before)
+{
+  const double t = before.getValue();
+  int numremoved = 0;
+  int slot = 0;
+  while (slot < PRIVATE(this)->ids.getLength()) {
+    const sm_trackring * ring = PRIVATE(this)->rings[slot];
+    if (ring->count > 0 && ring->getTime(ring->count - 1) < t) {
+      // the last track is moved into this slot
+      PRIVATE(this)->removeSlot(slot);
+      numremoved++;
+    }
+    else {
+      slot++;
+    }
+  }
+  if (numremoved) PRIVATE(this)->changed();
+  return numremoved;
+}
+
+/*!
+  Sets the color of \a track.
+*/
+void
+SmTrackSet::setColor(const int track, const SbColor & color)
+{
+  const int slot = PRIVATE(this)->getSlot(track);
+  if (slot < 0) return;
+  unsigned char rgba[4];
+  for (int i = 0; i < 3; i++) {
+    rgba[i] = (unsigned char) (SbClamp(color[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+  }
+  rgba[3] = 255;
+  uint32_t c;
+  memcpy(&c, rgba, 4);
+  PRIVATE(this)->color[slot] = c;
+  PRIVATE(this)->changed(slot);
+}
+
+/*!
+  Sets the track length of \a track, in seconds.
+
+  \sa SmTrack::trackLength
+*/
+void
+SmTrackSet::setTrackLength(const int track, const float seconds)
+{
+  const int slot = PRIVATE(this)->getSlot(track);
+  if (slot < 0) return;
+  PRIVATE(this)->tracklength[slot] = seconds;
+  PRIVATE(this)->changed(slot);
+}
+
+/*!
+  Sets the point interval of \a track.
+
+  \sa SmTrack::pointInterval
+*/
+void
+SmTrackSet::setPointInterval(const int track, const unsigned short interval)
+{
+  const int slot = PRIVATE(this)->getSlot(track);
+  if (slot < 0) return;
+  PRIVATE(this)->pointinterval[slot] = interval;
+  PRIVATE(this)->changed(slot);
+}
+
+/*!
+  Sets the line interval of \a track.
+
+  \sa SmTrack::lineInterval
+*/
+void
+SmTrackSet::setLineInterval(const int track, const unsigned short interval)
+{
+  const int slot = PRIVATE(this)->getSlot(track);
+  if (slot < 0) return;
+  PRIVATE(this)->lineinterval[slot] = interval;
+  PRIVATE(this)->changed(slot);
+}
+
+/*!
+  Sets the tick interval of \a track.
+
+  \sa SmTrack::tickInterval
+*/
+void
+SmTrackSet::setTickInterval(const int track, const unsigned short interval)
+{
+  const int slot = PRIVATE(this)->getSlot(track);
+  if (slot < 0) return;
+  PRIVATE(this)->tickinterval[slot] = interval;
+  PRIVATE(this)->changed(slot);
+}
+
+// Documented in superclass
+void
+SmTrackSet::GLRender(SoGLRenderAction * action)
+{
+  if (!this->shouldGLRender(action)) return;
+
+  PRIVATE(this)->updateCache();
+  const int numpoints = PRIVATE(this)->totalpoints;
+  const int numlines = PRIVATE(this)->totallines;
+  if (numpoints == 0 && numlines == 0) return;
+
+  SoState * state = action->getState();
+  SoMaterialBundle mb(action);
+  mb.sendFirst();
+
+  GLboolean lighting = glIsEnabled(GL_LIGHTING);
+  if (lighting) glDisable(GL_LIGHTING);
+
+  const uint32_t contextid = action->getCacheContext();
+  const cc_glglue * glue = cc_glglue_instance((int) contextid);
+
+  const char * vptr = (const char *) PRIVATE(this)->vertices.getArrayPtr();
+  const char * cptr = (const char *) PRIVATE(this)->colors.getArrayPtr();
+  const char * iptr = (const char *) PRIVATE(this)->indices.getArrayPtr();
+  const SbBool usevbo = cc_glglue_has_vertex_buffer_object(glue);
+  if (usevbo) {
+    PRIVATE(this)->updateBuffers(glue, contextid);
+    // offsets into the buffers, see updateBuffers()
+    vptr = NULL;
+    cptr = vptr + PRIVATE(this)->vbovertices * 3 * sizeof(float);
+    iptr = NULL;
+  }
+
+  const SbVec3d & origin = PRIVATE(this)->origin;
+  glPushMatrix();
+  glTranslated(origin[0], origin[1], origin[2]);
+
+  cc_glglue_glEnableClientState(glue, GL_VERTEX_ARRAY);
+  cc_glglue_glEnableClientState(glue, GL_COLOR_ARRAY);
+  cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0, vptr);
+  cc_glglue_glColorPointer(glue, 4, GL_UNSIGNED_BYTE, 0, cptr);
+
+  if (numpoints) {
+    PRIVATE(this)->drawRanges(glue, GL_POINTS, PRIVATE(this)->pointcounts,
+                              PRIVATE(this)->pointstarts, iptr);
+  }
+  if (numlines) {
+    PRIVATE(this)->drawRanges(glue, GL_LINES, PRIVATE(this)->linecounts,
+                              PRIVATE(this)->linestarts, iptr);
+  }
+
+  cc_glglue_glDisableClientState(glue, GL_COLOR_ARRAY);
+  cc_glglue_glDisableClientState(glue, GL_VERTEX_ARRAY);
+  if (usevbo) {
+    cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, 0);
+    cc_glglue_glBindBuffer(glue, GL_ELEMENT_ARRAY_BUFFER, 0);
+  }
+  glPopMatrix();
+
+  if (lighting) glEnable(GL_LIGHTING);
+  // the color array changed the current color
+  SoGLLazyElement::getInstance(state)->reset(state, SoLazyElement::DIFFUSE_MASK);
+}
+
+// Documented in superclass
+void
+SmTrackSet::computeBBox(SoAction * action, SbBox3f & box, SbVec3f & center)
+{
+  box.makeEmpty();
+  for (int slot = 0; slot < PRIVATE(this)->rings.getLength(); slot++) {
+    if (PRIVATE(this)->tracklength[slot] == 0.0f) continue;
+    const sm_trackring * ring = PRIVATE(this)->rings[slot];
+    for (int i = ring->getStart(PRIVATE(this)->tracklength[slot]); i < ring->count; i++) {
+      const SbVec3d p = ring->getPosition(i);
+      box.extendBy(SbVec3f((float) p[0], (float) p[1], (float) p[2]));
+    }
+  }
+  if (!box.isEmpty()) center = box.getCenter();
+}
+
+// Documented in superclass. Generates the points and the lines,
+// including the ticks.
+void
+SmTrackSet::generatePrimitives(SoAction * action)
+{
+  PRIVATE(this)->updateCache();
+
+  const SbVec3f * vertices = (const SbVec3f *) PRIVATE(this)->vertices.getArrayPtr();
+  const GLuint * indices = PRIVATE(this)->indices.getArrayPtr();
+  const SbVec3d & o = PRIVATE(this)->origin;
+  const SbVec3f origin((float) o[0], (float) o[1], (float) o[2]);
+  SoPrimitiveVertex pv;
+  int i, j;
+
+  if (PRIVATE(this)->totalpoints) {
+    this->beginShape(action, SoShape::POINTS);
+    for (i = 0; i < PRIVATE(this)->pointcounts.getLength(); i++) {
+      const GLuint * idx = indices + PRIVATE(this)->pointstarts[i];
+      for (j = 0; j < PRIVATE(this)->pointcounts[i]; j++) {
+        pv.setPoint(vertices[idx[j]] + origin);
+        this->shapeVertex(&pv);
+      }
+    }
+    this->endShape();
+  }
+
+  if (PRIVATE(this)->totallines) {
+    this->beginShape(action, SoShape::LINES);
+    for (i = 0; i < PRIVATE(this)->linecounts.getLength(); i++) {
+      const GLuint * idx = indices + PRIVATE(this)->linestarts[i];
+      for (j = 0; j < PRIVATE(this)->linecounts[i]; j++) {
+        pv.setPoint(vertices[idx[j]] + origin);
+        this->shapeVertex(&pv);
+      }
+    }
+    this->endShape();
+  }
+}
+
+#undef PRIVATE
+
+// *************************************************************************
+
+//
+// Removes the track in slot, by moving the last track into it.
+//
+void
+SmTrackSetP::removeSlot(const int slot)
+{
+  const int last = this->ids.getLength() - 1;
+  this->idmap.remove(this->ids[slot]);
+  delete this->rings[slot];
+  // the region is left unused until the cache is compacted
+  this->vwasted += this->regions[slot].vcapacity;
+  this->iwasted += this->regions[slot].icapacity;
+  if (slot != last) {
+    this->ids[slot] = this->ids[last];
+    this->rings[slot] = this->rings[last];
+    this->tracklength[slot] = this->tracklength[last];
+    this->pointinterval[slot] = this->pointinterval[last];
+    this->lineinterval[slot] = this->lineinterval[last];
+    this->tickinterval[slot] = this->tickinterval[last];
+    this->color[slot] = this->color[last];
+    this->regions[slot] = this->regions[last];
+    this->idmap.put(this->ids[slot], slot);
+  }
+  this->ids.remove(last);
+  this->rings.remove(last);
+  this->tracklength.remove(last);
+  this->pointinterval.remove(last);
+  this->lineinterval.remove(last);
+  this->tickinterval.remove(last);
+  this->color.remove(last);
+  this->regions.remove(last);
+}
+
+//
+// Rebuilds the vertices and indices of the track in slot, with
+// indices relative to the first vertex of the track, into the track
+// lists.
+//
+void
+SmTrackSetP::buildTrack(const int slot)
+{
+  this->trackvertices.truncate(0);
+  this->tickvertices.truncate(0);
+  this->trackpoints.truncate(0);
+  this->tracklines.truncate(0);
+
+  const float tracklength = this->tracklength[slot];
+  if (tracklength == 0.0f) return;
+  const sm_trackring * ring = this->rings[slot];
+  const int start = ring->getStart(tracklength);
+  const int num = ring->count - start;
+  if (num <= 0) return;
+
+  int i;
+  for (i = start; i < ring->count; i++) {
+    const SbVec3d p = ring->getPosition(i) - this->origin;
+    this->trackvertices.append((float) p[0]);
+    this->trackvertices.append((float) p[1]);
+    this->trackvertices.append((float) p[2]);
+  }
+
+  const int pointinterval = this->pointinterval[slot];
+  if (pointinterval > 0) {
+    for (i = 0; i < num; i += pointinterval) {
+      this->trackpoints.append((GLuint) i);
+    }
+  }
+  const int lineinterval = this->lineinterval[slot];
+  if (lineinterval > 0) {
+    for (i = 1; i < num; i += lineinterval) {
+      this->tracklines.append((GLuint) (i - 1));
+      this->tracklines.append((GLuint) i);
+    }
+  }
+  const int tickinterval = this->tickinterval[slot];
+  if (tickinterval > 0) {
+    const float ticksize = this->cacheticksize;
+    // the ticks are rotated 22.5 degrees to each side
+    const float cs = (float) cos(0.125 * M_PI);
+    const float sn = (float) sin(0.125 * M_PI);
+    const SbVec3f * pts = (const SbVec3f *) this->trackvertices.getArrayPtr();
+    for (i = 1; i < num; i += tickinterval) {
+      const SbVec3f & p = pts[i];
+      SbVec3f v = pts[i - 1] - p;
+      const float len = v.length();
+      if (len == 0.0f) continue;
+      v *= ticksize / len;
+
+      const GLuint tickidx = (GLuint) (num + this->tickvertices.getLength() / 3);
+      const SbVec3f left(p[0] + v[0] * cs - v[1] * sn, p[1] + v[0] * sn + v[1] * cs, p[2] + v[2]);
+      const SbVec3f right(p[0] + v[0] * cs + v[1] * sn, p[1] - v[0] * sn + v[1] * cs, p[2] + v[2]);
+      for (int j = 0; j < 3; j++) this->tickvertices.append(left[j]);
+      for (int j = 0; j < 3; j++) this->tickvertices.append(right[j]);
+      this->tracklines.append(tickidx);
+      this->tracklines.append((GLuint) i);
+      this->tracklines.append((GLuint) i);
+      this->tracklines.append(tickidx + 1);
+    }
+    for (i = 0; i < this->tickvertices.getLength(); i++) {
+      this->trackvertices.append(this->tickvertices[i]);
+    }
+  }
+}
+
+// the room reserved for a track with num vertices or indices
+static int
+sm_trackset_capacity(const int num)
+{
+  if (num == 0) return 0;
+  int capacity = 16;
+  while (capacity < num) capacity *= 2;
+  return capacity;
+}
+
+//
+// Copies the track lists into the region of the track in slot. If
+// they don't fit, the track is moved to a new, larger region at the
+// end of the cache.
+//
+void
+SmTrackSetP::storeTrack(const int slot)
+{
+  sm_trackregion & region = this->regions[slot];
+  const int numvertices = this->trackvertices.getLength() / 3;
+  const int numpoints = this->trackpoints.getLength();
+  const int numlines = this->tracklines.getLength();
+  int i;
+
+  if (numvertices > region.vcapacity) {
+    this->vwasted += region.vcapacity;
+    region.vstart = this->colors.getLength();
+    region.vcapacity = sm_trackset_capacity(numvertices);
+    for (i = 0; i < region.vcapacity; i++) {
+      this->vertices.append(0.0f);
+      this->vertices.append(0.0f);
+      this->vertices.append(0.0f);
+      this->colors.append(0);
+    }
+  }
+  if (numpoints + numlines > region.icapacity) {
+    this->iwasted += region.icapacity;
+    region.istart = this->indices.getLength();
+    region.icapacity = sm_trackset_capacity(numpoints + numlines);
+    for (i = 0; i < region.icapacity; i++) this->indices.append(0);
+  }
+  region.numvertices = numvertices;
+  region.numpoints = numpoints;
+  region.numlines = numlines;
+  region.dirty = FALSE;
+
+  const uint32_t color = this->color[slot];
+  for (i = 0; i < numvertices; i++) {
+    this->vertices[(region.vstart + i) * 3] = this->trackvertices[i * 3];
+    this->vertices[(region.vstart + i) * 3 + 1] = this->trackvertices[i * 3 + 1];
+    this->vertices[(region.vstart + i) * 3 + 2] = this->trackvertices[i * 3 + 2];
+    this->colors[region.vstart + i] = color;
+  }
+  const GLuint base = (GLuint) region.vstart;
+  for (i = 0; i < numpoints; i++) {
+    this->indices[region.istart + i] = base + this->trackpoints[i];
+  }
+  for (i = 0; i < numlines; i++) {
+    this->indices[region.istart + numpoints + i] = base + this->tracklines[i];
+  }
+
+  this->uploadranges.append(region.vstart);
+  this->uploadranges.append(numvertices);
+  this->uploadranges.append(region.istart);
+  this->uploadranges.append(numpoints + numlines);
+}
+
+//
+// Moves all regions to new lists, without the unused space between
+// them. Everything is uploaded again after this.
+//
+void
+SmTrackSetP::compact(void)
+{
+  SbList <float> oldvertices(this->vertices);
+  SbList <GLuint> oldindices(this->indices);
+  this->vertices.truncate(0);
+  this->colors.truncate(0);
+  this->indices.truncate(0);
+
+  for (int slot = 0; slot < this->regions.getLength(); slot++) {
+    sm_trackregion & region = this->regions[slot];
+    const int vstart = this->colors.getLength();
+    const int istart = this->indices.getLength();
+    const uint32_t color = this->color[slot];
+    int i;
+    for (i = 0; i < region.vcapacity; i++) {
+      for (int j = 0; j < 3; j++) {
+        this->vertices.append(i < region.numvertices ?
+                              oldvertices[(region.vstart + i) * 3 + j] : 0.0f);
+      }
+      this->colors.append(color);
+    }
+    const int numindices = region.numpoints + region.numlines;
+    for (i = 0; i < region.icapacity; i++) {
+      this->indices.append(i < numindices ?
+                           oldindices[region.istart + i] - region.vstart + vstart : 0);
+    }
+    region.vstart = vstart;
+    region.istart = istart;
+  }
+  this->vwasted = 0;
+  this->iwasted = 0;
+  this->needupload = TRUE;
+}
+
+//
+// Rebuilds the tracks that have changed since the last time, and the
+// lists of index ranges to draw.
+//
+void
+SmTrackSetP::updateCache(void)
+{
+  const int numtracks = this->rings.getLength();
+  int slot;
+
+  const float ticksize = PUBLIC(this)->tickSize.getValue();
+  if (ticksize != this->cacheticksize) {
+    this->cacheticksize = ticksize;
+    for (slot = 0; slot < numtracks; slot++) {
+      if (this->tickinterval[slot] > 0) {
+        this->regions[slot].dirty = TRUE;
+        this->dirty = TRUE;
+      }
+    }
+  }
+
+  if (!this->dirty) return;
+  this->dirty = FALSE;
+
+  for (slot = 0; slot < numtracks; slot++) {
+    if (!this->regions[slot].dirty) continue;
+    this->buildTrack(slot);
+    this->storeTrack(slot);
+  }
+
+  // compact when more than half the cache is unused
+  if ((this->vwasted > 1024 && this->vwasted * 2 > this->colors.getLength()) ||
+      (this->iwasted > 1024 && this->iwasted * 2 > this->indices.getLength())) {
+    this->compact();
+  }
+  if (this->uploadranges.getLength() > numtracks * 4) {
+    // the cache hasn't been rendered for a while
+    this->needupload = TRUE;
+  }
+  if (this->needupload) this->uploadranges.truncate(0);
+
+  this->pointcounts.truncate(0);
+  this->pointstarts.truncate(0);
+  this->linecounts.truncate(0);
+  this->linestarts.truncate(0);
+  this->totalpoints = 0;
+  this->totallines = 0;
+  for (slot = 0; slot < numtracks; slot++) {
+    const sm_trackregion & region = this->regions[slot];
+    if (region.numpoints) {
+      this->pointcounts.append(region.numpoints);
+      this->pointstarts.append(region.istart);
+      this->totalpoints += region.numpoints;
+    }
+    if (region.numlines) {
+      this->linecounts.append(region.numlines);
+      this->linestarts.append(region.istart + region.numpoints);
+      this->totallines += region.numlines;
+    }
+  }
+}
+
+//
+// Uploads the render cache to a vertex buffer, with the colors after
+// room for vbovertices vertices, and an index buffer. Only the
+// regions that have changed are uploaded, unless the cache has grown
+// past the size of the buffers. Leaves both buffers bound.
+//
+void
+SmTrackSetP::updateBuffers(const cc_glglue * glue, const uint32_t contextid)
+{
+  if (this->vbo && this->vbocontext != contextid) {
+    SoGLCacheContextElement::scheduleDeleteCallback(this->vbocontext, deleteBufferCB,
+                                                    (void *) ((uintptr_t) this->vbo));
+    SoGLCacheContextElement::scheduleDeleteCallback(this->vbocontext, deleteBufferCB,
+                                                    (void *) ((uintptr_t) this->ibo));
+    this->vbo = 0;
+  }
+  if (this->vbo == 0) {
+    cc_glglue_glGenBuffers(glue, 1, &this->vbo);
+    cc_glglue_glGenBuffers(glue, 1, &this->ibo);
+    this->vbocontext = contextid;
+    this->needupload = TRUE;
+  }
+
+  cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, this->vbo);
+  cc_glglue_glBindBuffer(glue, GL_ELEMENT_ARRAY_BUFFER, this->ibo);
+
+  const int numvertices = this->colors.getLength();
+  const int numindices = this->indices.getLength();
+  if (numvertices > this->vbovertices || numindices > this->vboindices) {
+    this->needupload = TRUE;
+  }
+
+  if (this->needupload) {
+    this->needupload = FALSE;
+    this->uploadranges.truncate(0);
+    // leave room for the tracks to grow
+    this->vbovertices = SbMax(numvertices * 2, 1024);
+    this->vboindices = SbMax(numindices * 2, 1024);
+
+    cc_glglue_glBufferData(glue, GL_ARRAY_BUFFER,
+                           this->vbovertices * (3 * sizeof(float) + sizeof(uint32_t)),
+                           NULL, GL_DYNAMIC_DRAW);
+    if (numvertices) {
+      cc_glglue_glBufferSubData(glue, GL_ARRAY_BUFFER, 0, numvertices * 3 * sizeof(float),
+                                this->vertices.getArrayPtr());
+      cc_glglue_glBufferSubData(glue, GL_ARRAY_BUFFER,
+                                this->vbovertices * 3 * sizeof(float),
+                                numvertices * sizeof(uint32_t),
+                                this->colors.getArrayPtr());
+    }
+    cc_glglue_glBufferData(glue, GL_ELEMENT_ARRAY_BUFFER, this->vboindices * sizeof(GLuint),
+                           NULL, GL_DYNAMIC_DRAW);
+    if (numindices) {
+      cc_glglue_glBufferSubData(glue, GL_ELEMENT_ARRAY_BUFFER, 0,
+                                numindices * sizeof(GLuint),
+                                this->indices.getArrayPtr());
+    }
+    return;
+  }
+
+  for (int i = 0; i < this->uploadranges.getLength(); i += 4) {
+    const int vstart = this->uploadranges[i];
+    const int nv = this->uploadranges[i + 1];
+    const int istart = this->uploadranges[i + 2];
+    const int ni = this->uploadranges[i + 3];
+    if (nv) {
+      cc_glglue_glBufferSubData(glue, GL_ARRAY_BUFFER,
+                                vstart * 3 * sizeof(float), nv * 3 * sizeof(float),
+                                this->vertices.getArrayPtr(vstart * 3));
+      cc_glglue_glBufferSubData(glue, GL_ARRAY_BUFFER,
+                                this->vbovertices * 3 * sizeof(float) +
+                                vstart * sizeof(uint32_t),
+                                nv * sizeof(uint32_t),
+                                this->colors.getArrayPtr(vstart));
+    }
+    if (ni) {
+      cc_glglue_glBufferSubData(glue, GL_ELEMENT_ARRAY_BUFFER,
+                                istart * sizeof(GLuint), ni * sizeof(GLuint),
+                                this->indices.getArrayPtr(istart));
+    }
+  }
+  this->uploadranges.truncate(0);
+}
+
+//
+// Draws the index ranges given by counts and starts, with one call if
+// multi draw is supported.
+//
+void
+SmTrackSetP::drawRanges(const cc_glglue * glue, const GLenum mode,
+                        const SbList <GLsizei> & counts, const SbList <GLuint> & starts,
+                        const char * indexptr)
+{
+  const int numranges = counts.getLength();
+  this->drawoffsets.truncate(0);
+  for (int i = 0; i < numranges; i++) {
+    this->drawoffsets.append(indexptr + starts[i] * sizeof(GLuint));
+  }
+  if ((numranges > 1) && cc_glglue_has_multidraw_vertex_arrays(glue)) {
+    cc_glglue_glMultiDrawElements(glue, mode, counts.getArrayPtr(), GL_UNSIGNED_INT,
+                                  (const GLvoid **) this->drawoffsets.getArrayPtr(),
+                                  numranges);
+  }
+  else {
+    for (int i = 0; i < numranges; i++) {
+      cc_glglue_glDrawElements(glue, mode, counts[i], GL_UNSIGNED_INT, this->drawoffsets[i]);
+    }
+  }
+}
+
+void
+SmTrackSetP::deleteBufferCB(void * closure, uint32_t contextid)
+{
+  const cc_glglue * glue = cc_glglue_instance((int) contextid);
+  GLuint buffer = (GLuint) ((uintptr_t) closure);
+  cc_glglue_glDeleteBuffers(glue, 1, &buffer);
+}
+
+#undef PUBLIC
@@ -0,0 +1,90 @@
+#ifndef SMALLCHANGE_SMTRACKSET_H
+#define SMALLCHANGE_SMTRACKSET_H
+
+/**************************************************************************\
+ * Copyright (c) Kongsberg Oil & Gas Technologies AS
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+\**************************************************************************/
+
+#include <Inventor/nodes/SoShape.h>
+#include <Inventor/fields/SoSFFloat.h>
+#include <Inventor/fields/SoSFUShort.h>
+#include <Inventor/SbTime.h>
+#include <Inventor/SbColor.h>
+#include <Inventor/SbVec3d.h>
+#include <SmallChange/basic.h>
+
+class SMALLCHANGE_DLL_API SmTrackSet : public SoShape {
+  typedef SoShape inherited;
+  SO_NODE_HEADER(SmTrackSet);
+
+public:
+  static void initClass(void);
+  SmTrackSet(void);
+
+  // defaults for new tracks
+  SoSFFloat trackLength;
+  SoSFUShort pointInterval;
+  SoSFUShort lineInterval;
+  SoSFUShort tickInterval;
+
+  SoSFFloat tickSize;
+
+  int addTrack(const SbColor & color = SbColor(1.0f, 1.0f, 1.0f));
+  void removeTrack(const int track);
+  SbBool hasTrack(const int track) const;
+  int getNumTracks(void) const;
+
+  void append(const int track, const SbVec3d & pos,
+              const SbTime & timestamp = SbTime::getTimeOfDay());
+  void clearTrack(const int track);
+  int getNumPositions(const int track) const;
+  int removeExpiredTracks(const SbTime & before);
+
+  void setColor(const int track, const SbColor & color);
+  void setTrackLength(const int track, const float seconds);
+  void setPointInterval(const int track, const unsigned short interval);
+  void setLineInterval(const int track, const unsigned short interval);
+  void setTickInterval(const int track, const unsigned short interval);
+
+  virtual void GLRender(SoGLRenderAction * action);
+
+protected:
+  virtual ~SmTrackSet();
+
+  virtual void computeBBox(SoAction * action, SbBox3f & box, SbVec3f & center);
+  virtual void generatePrimitives(SoAction * action);
+
+private:
+  friend class SmTrackSetP;
+  class SmTrackSetP * pimpl;
+};
+
+#endif // !SMALLCHANGE_SMTRACKSET_H
@@ -69,6 +69,10 @@ public:
     OFF, ON, AUTO
   };
 
+  enum VertexArray {
+    COORD, NORMAL, TEXCOORD, COLOR
+  };
+
   SoSFEnum renderAsVertexBufferObject;
   SoMFInt32 vertexIndex;
   SoSFNode vertexCoord;
@@ -79,6 +83,8 @@ public:
   virtual void GLRender(SoGLRenderAction * action);
   virtual void getPrimitiveCount(SoGetPrimitiveCountAction * action);
 
+  void markDirtyRange(const VertexArray array, const int start, const int num);
+
 protected:
   virtual ~SmVertexArrayShape();
 
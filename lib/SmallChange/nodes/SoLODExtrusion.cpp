@@ -139,6 +139,8 @@
 #include <Inventor/elements/SoViewVolumeElement.h>
 #include <Inventor/elements/SoGLCacheContextElement.h>
 #include <Inventor/elements/SoGLLazyElement.h>
+#include <Inventor/misc/SoNotification.h>
+#include <Inventor/C/glue/gl.h>
 #include <Inventor/actions/SoGLRenderAction.h>
 #include <Inventor/actions/SoGetPrimitiveCountAction.h>
 #include <Inventor/actions/SoRayPickAction.h>
@@ -147,6 +149,7 @@
 #include <Inventor/SoPrimitiveVertex.h>
 #include <Inventor/SoPickedPoint.h>
 #include <Inventor/SbLine.h>
+#include <Inventor/SbBox3f.h>
 #include <Inventor/SbCylinder.h>
 #include <Inventor/details/SoPointDetail.h>
 #include <Inventor/details/SoLineDetail.h>
@@ -155,6 +158,7 @@
 #include <cmath>
 
 #include "../misc/SbList.h"
+#include <SmallChange/misc/SmVBO.h>
 
 #ifdef __COIN__
 #include <Inventor/system/gl.h>
@@ -178,6 +182,67 @@ my_normalize(SbVec3f & vec)
   return len;
 }
 
+// number of spine segments in each leaf of the segment hierarchy
+#define LODEXTRUSION_BVH_LEAFSIZE 8
+
+// LOD mode for a spine point at distance dist from the camera: 0 for
+// extrusion, 1 for line and 2 for nothing
+static int
+lod_mode(const float dist, const float lod1, const float lod2)
+{
+  if (dist < lod1) return 0;
+  if (lod2 > 0.0f && dist >= lod2) return 2;
+  return 1;
+}
+
+// slab test for an infinite line against an axis aligned box
+static SbBool
+line_intersects_box(const SbVec3f & pos, const SbVec3f & dir,
+                    const SbVec3f & bmin, const SbVec3f & bmax)
+{
+  float tmin = -FLT_MAX;
+  float tmax = FLT_MAX;
+  for (int i = 0; i < 3; i++) {
+    if (SbAbs(dir[i]) <= FLT_EPSILON) {
+      if (pos[i] < bmin[i] || pos[i] > bmax[i]) return FALSE;
+    }
+    else {
+      float t0 = (bmin[i] - pos[i]) / dir[i];
+      float t1 = (bmax[i] - pos[i]) / dir[i];
+      if (t0 > t1) SbSwap(t0, t1);
+      if (t0 > tmin) tmin = t0;
+      if (t1 < tmax) tmax = t1;
+      if (tmin > tmax) return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+// squared distance from p to the closest and the farthest point in a box
+static void
+box_distances(const SbVec3f & p, const SbVec3f & bmin, const SbVec3f & bmax,
+              float & mindist2, float & maxdist2)
+{
+  mindist2 = maxdist2 = 0.0f;
+  for (int i = 0; i < 3; i++) {
+    const float d0 = bmin[i] - p[i];
+    const float d1 = p[i] - bmax[i];
+    if (d0 > 0.0f) mindist2 += d0 * d0;
+    else if (d1 > 0.0f) mindist2 += d1 * d1;
+    const float dmax = SbMax(SbAbs(d0), SbAbs(d1));
+    maxdist2 += dmax * dmax;
+  }
+}
+
+
+// set item index in list, appending when index is at the end
+template <class Type>
+static void
+list_set(SbList <Type> & list, const int index, const Type & item)
+{
+  if (index < list.getLength()) list[index] = item;
+  else list.append(item);
+}
 
 #ifndef DOXYGEN_SKIP_THIS
 class SoLODExtrusionP {
@@ -187,27 +252,91 @@ public:
      coord(32),
      tcoord(32),
      idx(32),
-     color_idx(32),
-     segidx(32),
-     striplens(32),
-     dirty(TRUE)
+     numspine(0),
+     numcross(0),
+     ringsize(0),
+     connected(FALSE),
+     closed(FALSE),
+     dirty(TRUE),
+     spinedirty(FALSE),
+     colorsvalid(FALSE),
+     coordvbo(NULL),
+     normalvbo(NULL),
+     tcoordvbo(NULL),
+     colorvbo(NULL),
+     indexvbo(NULL)
   {
   }
+  ~SoLODExtrusionP() {
+    delete this->coordvbo;
+    delete this->normalvbo;
+    delete this->tcoordvbo;
+    delete this->colorvbo;
+    delete this->indexvbo;
+  }
 
   SoLODExtrusion * master;
+
+  // One ring of ringsize vertices per spine point. When the cross
+  // section is connected, the last vertex in each ring is a copy of
+  // the first, with texture coordinate s = 1.
   SbList <SbVec3f> coord;
   SbList <SbVec3f> normals;
   SbList <SbVec2f> tcoord;
-  SbList <int> idx;     // vertex index
-  SbList <int> color_idx;     // per coord color index (into master->color), matches coord list
-  SbList <int> segidx;  // index into idx, for each spine segment
-  SbList <int32_t> striplens;  // lengths of tri-strips
-  SbList <float> spinelens;    // geometric length of each spine segment, precalculated
+  SbList <SbColor> colors;     // per vertex colors from master->color
+  SbList <int32_t> idx;        // triangles, 6 * (ringsize-1) indices per segment
+  SbList <SbVec3f> frames;     // X, Y and Z axis of each ring
+  SbList <SbVec3f> spinecache; // the spine the rings were generated from
+  int numspine;                // number of rings
+  int numcross;                // cross section points, without the closing point
+  int ringsize;
+  SbBool connected;            // is cross section closed
+  SbBool closed;               // is spine closed
   SbBool dirty;
+  SbBool spinedirty;
+  SbBool colorsvalid;
+
+  SmVBO * coordvbo;
+  SmVBO * normalvbo;
+  SmVBO * tcoordvbo;
+  SmVBO * colorvbo;
+  SmVBO * indexvbo;
+
+  // Bounding volume hierarchy over the spine segments. The spine is
+  // split on segment index, so every node covers a contiguous range
+  // of segments and the leaves are in spine order. Boxes hold the
+  // spine points only, radius and antiSquish are applied when the
+  // hierarchy is used.
+  class BVHNode {
+  public:
+    SbBox3f box;
+    int first;   // first segment
+    int count;   // number of segments
+    int child;   // first of two consecutive children, -1 for leaves
+  };
+  SbList <BVHNode> bvh;
+  SbList <int> lodruns; // (lod mode, end segment) pairs from classifyLOD()
+
+  int getSegmentIndexCount(void) const {
+    return 6 * (this->ringsize - 1);
+  }
 
   void generateAntiSquish(SbMatrix & mat, const SbVec3f & spinept, const SbVec3f & scale);
   void generateCoords(void);
+  SbBool updateSpine(void);
+  void generateRings(const int start, const int stop);
+  void generateIndices(void);
+  void generateTexCoords(void);
+  void generateColors(void);
+  void updateVBOs(void);
+  void generateBVH(void);
+  void buildBVH(const int node, const SbVec3f * spine, const int first, const int count);
+  void classifyLOD(const int node, const SbVec3f & cameralocal,
+                   const float lod1, const float lod2);
+  void addLODRun(const int mode, const int end);
   void renderSegidx(SoState * state, const int, const SbBool, const SbBool, const SbBool, const SbVec3f &);
+  void renderSegments(const cc_glglue * glue, const int first, const int last,
+                      const SbBool usevbo);
   void makeCircleCrossSection( const float, const int);
   SbVec3f calcAntiSquish(SoState * state);
 };
@@ -309,9 +438,6 @@ SoLODExtrusion::GLRender(SoGLRenderAction * action)
   }
 
   const SbVec3f * colorv = this->color.getValues(0);
-  const float * lengths = this->pimpl->spinelens.getArrayPtr();
-  int lodmode, i = 0;
-  float dist, ld1dist, ld2dist, accdist;
 
   SbBool use_alternate_color = this->doAlternateColor.getValue();
 
@@ -320,35 +446,96 @@ SoLODExtrusion::GLRender(SoGLRenderAction * action)
 
   if (use_alternate_color) use_color = FALSE;
 
-  while (i < spinelength-1) {
-    int oldi = i;
-    accdist = 0.0;
-    dist = (cameralocal - sv[i]).length();
-    ld1dist = SbAbs(dist - this->lodDistance1.getValue());
-    ld2dist = SbAbs(dist - this->lodDistance2.getValue());
-    if (dist < this->lodDistance1.getValue()) {
-      lodmode = 0;
-    }
-    else if (this->lodDistance2.getValue() > 0.0) {
-      if (dist < this->lodDistance2.getValue()) {
-        lodmode = 1;
+  // find the ranges of segments to render as extrusion, as lines or
+  // not at all
+  THIS->lodruns.truncate(0);
+  if (THIS->bvh.getLength()) {
+    THIS->classifyLOD(0, cameralocal,
+                      this->lodDistance1.getValue(),
+                      this->lodDistance2.getValue());
+  }
+  const int * runs = THIS->lodruns.getArrayPtr();
+  const int numruns = THIS->lodruns.getLength() / 2;
+
+  SbBool hasextrusion = FALSE;
+  for (int run = 0; run < numruns; run++) {
+    if (runs[run*2] == 0) hasextrusion = TRUE;
+  }
+  if (THIS->numspine < 2) hasextrusion = FALSE; // nothing to extrude
+
+  // The extrusion is drawn from vertex arrays, with the geometry in
+  // buffer objects when possible. With antiSquish each ring is scaled
+  // around its own spine point, so it is rendered in immediate mode.
+  const uint32_t contextid = action->getCacheContext();
+  const cc_glglue * glue = cc_glglue_instance((int) contextid);
+  const SbBool varray = hasextrusion && !antisquish && cc_glglue_has_vertex_array(glue);
+  SbBool usevbo = FALSE;
+  if (varray) {
+    if (use_color && !THIS->colorsvalid) THIS->generateColors();
+
+    usevbo = cc_glglue_has_vertex_buffer_object(glue) &&
+      SmVBO::shouldCreateVBO(contextid, THIS->coord.getLength());
+    if (usevbo) {
+      if (THIS->coordvbo == NULL) {
+        THIS->coordvbo = new SmVBO(GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+        THIS->normalvbo = new SmVBO(GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+        THIS->tcoordvbo = new SmVBO(GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+        THIS->indexvbo = new SmVBO(GL_ELEMENT_ARRAY_BUFFER, GL_STATIC_DRAW);
+        THIS->updateVBOs();
       }
-      else {
-        lodmode = 2;
+      if (use_color && THIS->colorvbo == NULL) {
+        THIS->colorvbo = new SmVBO(GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+        THIS->colorvbo->setBufferData(THIS->colors.getArrayPtr(),
+                                      THIS->colors.getLength() * sizeof(SbColor));
       }
     }
-    else {
-      lodmode = 1;
+
+    if (usevbo) THIS->coordvbo->bindBuffer(contextid);
+    cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0,
+                              usevbo ? NULL : (GLvoid*) THIS->coord.getArrayPtr());
+    cc_glglue_glEnableClientState(glue, GL_VERTEX_ARRAY);
+    if (usevbo) THIS->normalvbo->bindBuffer(contextid);
+    cc_glglue_glNormalPointer(glue, GL_FLOAT, 0,
+                              usevbo ? NULL : (GLvoid*) THIS->normals.getArrayPtr());
+    cc_glglue_glEnableClientState(glue, GL_NORMAL_ARRAY);
+    if (usevbo) THIS->tcoordvbo->bindBuffer(contextid);
+    cc_glglue_glTexCoordPointer(glue, 2, GL_FLOAT, 0,
+                                usevbo ? NULL : (GLvoid*) THIS->tcoord.getArrayPtr());
+    cc_glglue_glEnableClientState(glue, GL_TEXTURE_COORD_ARRAY);
+    if (use_color) {
+      if (usevbo) THIS->colorvbo->bindBuffer(contextid);
+      cc_glglue_glColorPointer(glue, 3, GL_FLOAT, 0,
+                               usevbo ? NULL : (GLvoid*) THIS->colors.getArrayPtr());
+      cc_glglue_glEnableClientState(glue, GL_COLOR_ARRAY);
     }
-    switch (lodmode) {
-    case 0:    // render extrusion until above lodDistance1
-      while (accdist < ld1dist && i < spinelength-1) {
-        THIS->renderSegidx(state, i, use_color, use_alternate_color, antisquish, scale);
-        accdist += lengths[i];
-        i++;
+    if (usevbo) THIS->indexvbo->bindBuffer(contextid);
+  }
+
+  int i = 0;
+  for (int run = 0; run < numruns; run++) {
+    const int end = SbMin(runs[run*2+1], spinelength-1);
+    switch (runs[run*2]) {
+    case 0:    // render extrusion
+      if (!hasextrusion) {
+        i = end;
+      }
+      else if (varray && !use_alternate_color) {
+        THIS->renderSegments(glue, i, end, usevbo);
+        i = end;
+      }
+      else if (varray) {
+        for (; i < end; i++) {
+          glColor3fv(i & 1 ? main_color.getValue() : alt_color.getValue());
+          THIS->renderSegments(glue, i, i + 1, usevbo);
+        }
+      }
+      else {
+        for (; i < end; i++) {
+          THIS->renderSegidx(state, i, use_color, use_alternate_color, antisquish, scale);
+        }
       }
       break;
-    case 1:    // render line until crossing a lodDistance
+    case 1:    // render line
       {
         if (use_alternate_color) {
           glColor3fv(main_color.getValue());
@@ -357,35 +544,32 @@ SoLODExtrusion::GLRender(SoGLRenderAction * action)
         SbBool wasenabled = glIsEnabled(GL_LIGHTING);
         if (wasenabled) glDisable(GL_LIGHTING);
         glBegin(GL_LINE_STRIP);
-        while (accdist < ld1dist && accdist < ld2dist && i < spinelength-1) {
+        for (; i <= end; i++) {
           if (use_color) {
             glColor3fv((const GLfloat*)colorv[i].getValue());
           }
           glVertex3fv((const GLfloat*)sv[i].getValue());
-          accdist += lengths[i];
-          i++;
-        }
-        if (use_color) {
-          glColor3fv((const GLfloat*)colorv[i].getValue());
         }
-        glVertex3fv((const GLfloat*)sv[i].getValue());
         glEnd();
         if (wasenabled) glEnable(GL_LIGHTING);
+        i = end;
       }
       break;
-    case 2:    // render nothing until beneath lodDistance2
-      while (accdist < ld2dist && i < spinelength-1) {
-       accdist += lengths[i];
-       i++;
-      }
-      break;
-    default:
-      assert(0);
-      i = spinelength + 1;  // exit loop on error
+    default:   // render nothing
+      i = end;
       break;
     }
-    // to avoid hangs
-    if (i == oldi) i++;
+  }
+
+  if (varray) {
+    cc_glglue_glDisableClientState(glue, GL_VERTEX_ARRAY);
+    cc_glglue_glDisableClientState(glue, GL_NORMAL_ARRAY);
+    cc_glglue_glDisableClientState(glue, GL_TEXTURE_COORD_ARRAY);
+    if (use_color) cc_glglue_glDisableClientState(glue, GL_COLOR_ARRAY);
+    if (usevbo) {
+      cc_glglue_glBindBuffer(glue, GL_ELEMENT_ARRAY_BUFFER, 0);
+      cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, 0);
+    }
   }
   SoGLCacheContextElement::shouldAutoCache(action->getState(),
                                            SoGLCacheContextElement::DONT_AUTO_CACHE);
@@ -398,6 +582,8 @@ SoLODExtrusion::rayPick(SoRayPickAction * action)
 {
   if (!shouldRayPick(action)) return;
 
+  this->updateCache();
+
   SoState * state = action->getState();
   state->push();
 
@@ -449,41 +635,75 @@ SoLODExtrusion::rayPick(SoRayPickAction * action)
   SoPointDetail pd0;
   SoPointDetail pd1;
 
-  for (int i = 0; i < num-1; i++) {
-    SbVec3f v0 = sptr[i];
-    SbVec3f v1 = sptr[i+1];
+  const SbVec3f & raypos = ray.getPosition();
+  const SbVec3f & raydir = ray.getDirection();
+  const SbVec3f inflate(SbAbs(r), SbAbs(r), SbAbs(r));
+
+  // walk the segment hierarchy, and test only the segments in leaves
+  // that can be hit by the ray
+  const SoLODExtrusionP::BVHNode * nodes = THIS->bvh.getArrayPtr();
+  int stack[64];
+  int stacksize = 0;
+  if (THIS->bvh.getLength()) stack[stacksize++] = 0;
 
+  while (stacksize > 0) {
+    const SoLODExtrusionP::BVHNode & node = nodes[stack[--stacksize]];
+
+    SbVec3f bmin, bmax;
+    node.box.getBounds(bmin, bmax);
     for (int j = 0; j < 3; j++) {
-      v0[j] *= scale[j];
-      v1[j] *= scale[j];
+      bmin[j] *= scale[j];
+      bmax[j] *= scale[j];
+      if (bmin[j] > bmax[j]) SbSwap(bmin[j], bmax[j]);
+    }
+    float mindist2, maxdist2;
+    box_distances(cameralocal, bmin, bmax, mindist2, maxdist2);
+    if (mindist2 >= d2) continue;
+    if (!line_intersects_box(raypos, raydir, bmin - inflate, bmax + inflate)) continue;
+
+    if (node.child >= 0) {
+      stack[stacksize++] = node.child + 1;
+      stack[stacksize++] = node.child;
+      continue;
     }
 
-    if (v0 != v1) {
-      float l1 = (v0-cameralocal).sqrLength();
-      float l2 = (v1-cameralocal).sqrLength();
-
-      if (l1 < d2 || l2 < d2) {
-        SbLine line(v0, v1);
-        SbVec3f op0, op1; // object space
-        if (ray.getClosestPoints(line, op0, op1)) {
-          // clamp op1 between v0 and v1
-          if ((op1-v0).dot(line.getDirection()) < 0.0f) op1 = v0;
-          else if ((v1-op1).dot(line.getDirection()) < 0.0f) op1 = v1;
-
-          if ((op1-op0).sqrLength() <= r2 && action->isBetweenPlanes(op0)) {
-            // adjust picked point to account for radius of the extrusion
-            SbCylinder cyl(line, r);
-            (void) cyl.intersect(ray, op0);
-
-            SoPickedPoint * pp = action->addIntersection(op0);
-            if (pp) {
-              pd0.setCoordinateIndex(i);
-              pd1.setCoordinateIndex(i+1);
-              SoLineDetail * detail = new SoLineDetail;
-              detail->setPoint0(&pd0);
-              detail->setPoint1(&pd1);
-              detail->setLineIndex(i);
-              pp->setDetail(detail, this);
+    const int last = SbMin(node.first + node.count, num - 1);
+    for (int i = node.first; i < last; i++) {
+      SbVec3f v0 = sptr[i];
+      SbVec3f v1 = sptr[i+1];
+
+      for (int j = 0; j < 3; j++) {
+        v0[j] *= scale[j];
+        v1[j] *= scale[j];
+      }
+
+      if (v0 != v1) {
+        float l1 = (v0-cameralocal).sqrLength();
+        float l2 = (v1-cameralocal).sqrLength();
+
+        if (l1 < d2 || l2 < d2) {
+          SbLine line(v0, v1);
+          SbVec3f op0, op1; // object space
+          if (ray.getClosestPoints(line, op0, op1)) {
+            // clamp op1 between v0 and v1
+            if ((op1-v0).dot(line.getDirection()) < 0.0f) op1 = v0;
+            else if ((v1-op1).dot(line.getDirection()) < 0.0f) op1 = v1;
+
+            if ((op1-op0).sqrLength() <= r2 && action->isBetweenPlanes(op0)) {
+              // adjust picked point to account for radius of the extrusion
+              SbCylinder cyl(line, r);
+              (void) cyl.intersect(ray, op0);
+
+              SoPickedPoint * pp = action->addIntersection(op0);
+              if (pp) {
+                pd0.setCoordinateIndex(i);
+                pd1.setCoordinateIndex(i+1);
+                SoLineDetail * detail = new SoLineDetail;
+                detail->setPoint0(&pd0);
+                detail->setPoint1(&pd1);
+                detail->setLineIndex(i);
+                pp->setDetail(detail, this);
+              }
             }
           }
         }
@@ -497,7 +717,7 @@ void
 SoLODExtrusion::getPrimitiveCount(SoGetPrimitiveCountAction * action)
 {
   this->updateCache();
-  action->addNumTriangles(THIS->idx.getLength() / 4);
+  action->addNumTriangles(THIS->idx.getLength() / 3);
 }
 
 void
@@ -566,9 +786,14 @@ SoLODExtrusion::generatePrimitives(SoAction * action)
 void
 SoLODExtrusion::updateCache(void)
 {
-  if (THIS->dirty) {
-    THIS->generateCoords();
+  if (THIS->dirty || THIS->spinedirty) {
+    // only regenerate the rings affected by a changed spine
+    if (THIS->dirty || !THIS->updateSpine()) THIS->generateCoords();
+    THIS->generateBVH();
+    THIS->updateVBOs();
+    THIS->colorsvalid = FALSE;
     THIS->dirty = FALSE;
+    THIS->spinedirty = FALSE;
   }
 }
 
@@ -578,7 +803,17 @@ SoLODExtrusion::updateCache(void)
 void
 SoLODExtrusion::notify(SoNotList * list)
 {
-  THIS->dirty = TRUE;
+  SoField * f = list->getLastField();
+  if (f == &this->spine) {
+    THIS->spinedirty = TRUE;
+  }
+  else if (f == &this->color) {
+    THIS->colorsvalid = FALSE;
+  }
+  else if (f == NULL || f == &this->crossSection || f == &this->radius ||
+           f == &this->circleSegmentCount || f == &this->zAxis) {
+    THIS->dirty = TRUE;
+  }
   inherited::notify(list);
 }
 
@@ -601,13 +836,13 @@ void
 SoLODExtrusionP::generateCoords(void)
 {
   this->coord.truncate(0);
-  this->color_idx.truncate(0);
+  this->normals.truncate(0);
   this->tcoord.truncate(0);
   this->idx.truncate(0);
-  this->segidx.truncate(0);
-  this->striplens.truncate(0);
-  this->spinelens.truncate(0);
-  this->normals.truncate(0);
+  this->frames.truncate(0);
+  this->spinecache.truncate(0);
+  this->numspine = 0;
+  this->ringsize = 0;
 
   // Create circular cross section if radius > 0.0
   if (this->master->radius.getValue() > 0.0) {
@@ -617,25 +852,101 @@ SoLODExtrusionP::generateCoords(void)
   if (this->master->crossSection.getNum() == 0 ||
       this->master->spine.getNum() == 0) return;
 
-  SbMatrix matrix = SbMatrix::identity();
-
-  int i, j, numcross;
-  SbBool connected = FALSE;   // is cross section closed
-  SbBool closed = FALSE;      // is spine closed
-  numcross = this->master->crossSection.getNum();
+  this->numcross = this->master->crossSection.getNum();
   const SbVec2f * cross =  master->crossSection.getValues(0);
-  if (cross[0] == cross[numcross-1]) {
-    connected = TRUE;
-    numcross--;
+  this->connected = FALSE;
+  if (cross[0] == cross[this->numcross-1]) {
+    this->connected = TRUE;
+    this->numcross--;
   }
 
-  int numspine = master->spine.getNum();
+  const int num = master->spine.getNum();
   const SbVec3f * spine = master->spine.getValues(0);
-  if (spine[0] == spine[numspine-1]) {
-    closed = TRUE;
-    numspine--;
+  this->closed = FALSE;
+  this->numspine = num;
+  if (spine[0] == spine[num-1]) {
+    this->closed = TRUE;
+    this->numspine--;
+  }
+  this->ringsize = this->connected ? this->numcross + 1 : this->numcross;
+  // a single spine or cross section point can not be extruded
+  if (this->numspine < 2 || this->ringsize < 2) {
+    this->numspine = 0;
+    this->ringsize = 0;
+    return;
+  }
+
+  this->generateRings(0, -1);
+  this->generateIndices();
+  this->generateTexCoords();
+  for (int i = 0; i < num; i++) this->spinecache.append(spine[i]);
+}
+
+//
+// Regenerate only the rings affected by changes in the spine since
+// the last call to generateCoords() or updateSpine(). Returns FALSE
+// if everything needs to be regenerated.
+//
+SbBool
+SoLODExtrusionP::updateSpine(void)
+{
+  const int num = this->master->spine.getNum();
+  const SbVec3f * spine = this->master->spine.getValues(0);
+
+  // the rings at the ends of a closed spine depend on both ends, and
+  // very short spines use special cases for the ring orientation
+  if (this->numspine < 3 || this->closed ||
+      num < 3 || spine[0] == spine[num-1]) return FALSE;
+
+  const int oldnum = this->spinecache.getLength();
+  const SbVec3f * oldspine = this->spinecache.getArrayPtr();
+  const int minnum = SbMin(num, oldnum);
+
+  int first = 0; // first changed spine point
+  while (first < minnum && spine[first] == oldspine[first]) first++;
+  if (first == num && num == oldnum) return TRUE;
+
+  int last = num - 1; // last changed spine point
+  if (num == oldnum) {
+    while (last > first && spine[last] == oldspine[last]) last--;
   }
 
+  // A ring depends on the spine points before and after it, the end
+  // rings on the three points at the end, and every ring on the
+  // orientation of the ring before it. Regenerate from the first
+  // ring that changed, until a ring past the changes comes out as
+  // before.
+  const int start = first < 3 ? 0 : first - 1;
+  this->numspine = num;
+  if (num < oldnum) {
+    this->coord.truncate(num * this->ringsize);
+    this->normals.truncate(num * this->ringsize);
+    this->frames.truncate(num * 3);
+  }
+  this->generateRings(start, num == oldnum ? last + 2 : -1);
+  this->generateIndices();
+  this->generateTexCoords();
+
+  for (int i = first; i < num; i++) list_set(this->spinecache, i, spine[i]);
+  this->spinecache.truncate(num);
+  return TRUE;
+}
+
+//
+// Generate the rings from start to the end of the spine. If stop is
+// not negative, generation ends at the first ring from stop that
+// is unchanged.
+//
+void
+SoLODExtrusionP::generateRings(const int start, const int stop)
+{
+  SbMatrix matrix = SbMatrix::identity();
+
+  const SbVec2f * cross =  master->crossSection.getValues(0);
+  const SbVec3f * spine = master->spine.getValues(0);
+  const int numspine = this->numspine;
+  const SbBool closed = this->closed;
+
   SbVec3f zaxis = this->master->zAxis.getValue();
   SbBool dolockz = zaxis != SbVec3f(0.0f, 0.0f, 0.0f);
   if (dolockz) zaxis.normalize();
@@ -644,34 +955,14 @@ SoLODExtrusionP::generateCoords(void)
   SbVec3f prevX(1.0f, 0.0f, 0.0f);
   SbVec3f prevY(0.0f, 1.0f, 0.0f);
   SbVec3f prevZ(0.0f, 0.0f, 1.0f);
-
-  //  int numorient = this->master->orientation.getNum();
-  //  const SbRotation * orient = this->master->orientation.getValues(0);
-  int numorient = 0;
-  const SbRotation * orient = NULL;
-
-  //  int numscale = this->master->scale.getNum();
-  //  const SbVec2f * scale = this->master->scale.getValues(0);
-  int numscale = 0;
-  const SbVec2f * scale = NULL;
-
-  int reversecnt = 0;
-
-  float sumDepths = 0;
-  SbList <float> depths;
-  depths.append(0);
-  for (i = 1; i < master->spine.getNum(); i++) {
-    const SbVec3f cv = master->spine.getValues(0)[i];
-    const SbVec3f pv = master->spine.getValues(0)[i - 1];
-    sumDepths += (cv - pv).length();
-    depths.append(sumDepths);
+  if (start > 0) {
+    prevX = this->frames[3*(start-1)];
+    prevY = this->frames[3*(start-1)+1];
+    prevZ = this->frames[3*(start-1)+2];
   }
 
   // loop through all spines
-  for (i = 0; i < numspine; i++) {
-    if (i < numspine-1) {
-      this->spinelens.append( (spine[i+1]-spine[i]).length() );
-    }
+  for (int i = start; i < numspine; i++) {
     if (closed) {
       if (i > 0)
         Y = spine[i+1] - spine[i-1];
@@ -798,9 +1089,17 @@ SoLODExtrusionP::generateCoords(void)
       }
     }
 
+    // the rest of the rings are unchanged when this ring is
+    if (stop >= 0 && i >= stop && 3*i < this->frames.getLength() &&
+        this->frames[3*i] == X && this->frames[3*i+1] == Y &&
+        this->frames[3*i+2] == Z) return;
+
     prevX = X;
     prevY = Y;
     prevZ = Z;
+    list_set(this->frames, 3*i, X);
+    list_set(this->frames, 3*i+1, Y);
+    list_set(this->frames, 3*i+2, Z);
 
     matrix[0][0] = X[0];
     matrix[0][1] = X[1];
@@ -822,105 +1121,135 @@ SoLODExtrusionP::generateCoords(void)
     matrix[3][2] = spine[i][2];
     matrix[3][3] = 1.0f;
 
-    int cnt = 0;
-    if (X[0] < 0.0f) cnt++;
-    if (X[1] < 0.0f) cnt++;
-    if (X[2] < 0.0f) cnt++;
-    if (Y[0] < 0.0f) cnt++;
-    if (Y[1] < 0.0f) cnt++;
-    if (Y[2] < 0.0f) cnt++;
-    if (Z[0] < 0.0f) cnt++;
-    if (Z[1] < 0.0f) cnt++;
-    if (Z[2] < 0.0f) cnt++;
-
-    if (cnt & 1) reversecnt--;
-    else reversecnt++;
-
-    if (numorient) {
-      SbMatrix rmat;
-      orient[SbMin(i, numorient-1)].getValue(rmat);
-      matrix.multLeft(rmat);
-    }
-
-    if (numscale) {
-      SbMatrix smat = SbMatrix::identity();
-      SbVec2f s = scale[SbMin(i, numscale-1)];
-      smat[0][0] = s[0];
-      smat[2][2] = s[1];
-      matrix.multLeft(smat);
-    }
-
-    for (j = 0; j < numcross; j++) {
+    int v = i * this->ringsize;
+    for (int j = 0; j < this->ringsize; j++, v++) {
+      const int cj = j < this->numcross ? j : 0;
       SbVec3f c;
-      c[0] = cross[j][0];
+      c[0] = cross[cj][0];
       c[1] = 0.0f;
-      c[2] = cross[j][1];
+      c[2] = cross[cj][1];
 
       matrix.multVecMatrix(c, c);
 
       // calc vertex normal
       SbVec3f t(0.0f, 0.0f, 0.0f); // assumes cross section is centered in (0,0)
       matrix.multVecMatrix(t, t);
-      this->coord.append(c);
+      list_set(this->coord, v, c);
       c -= t;
       c.normalize();
-      this->normals.append(c);
-      this->tcoord.append(SbVec2f(float(j) / numcross, 1.0f - depths[i] / sumDepths));
-      this->color_idx.append(i);
+      list_set(this->normals, v, c);
     }
   }
+}
 
-  // this macro makes the code below more readable
-#define ADD_TRIANGLE(i0, j0, i1, j1, i2, j2) \
-  do { \
-    if (reversecnt < 0) { \
-      this->idx.append((i2)*numcross+(j2)); \
-      this->idx.append((i1)*numcross+(j1)); \
-      this->idx.append((i0)*numcross+(j0)); \
-      this->idx.append(-1); \
-    } \
-    else { \
-      this->idx.append((i0)*numcross+(j0)); \
-      this->idx.append((i1)*numcross+(j1)); \
-      this->idx.append((i2)*numcross+(j2)); \
-      this->idx.append(-1); \
-    } \
-  } while (0)
-
-#define ADD_VERTEX(i0, j0) \
-  do { \
-    this->idx.append((i0)*numcross+(j0)); \
-  } while (0)
-
-  int cursegidx = 0;
-  // create walls
-  for (i = 0; i < numspine-1; i++) {
-    // Create walls
-    assert(cursegidx == this->idx.getLength());
-    this->segidx.append( cursegidx );
-    for (j = 0; j < numcross; j++) {
-      ADD_VERTEX(i, j);
-      ADD_VERTEX(i+1, j);
-      cursegidx += 2;
+//
+// Generate triangle indices for all spine segments. The indices only
+// depend on the number of segments, so existing segments are kept.
+//
+void
+SoLODExtrusionP::generateIndices(void)
+{
+  const int segcount = this->getSegmentIndexCount();
+  const int numseg = this->numspine - 1;
+  const int oldseg = this->idx.getLength() / segcount;
+  if (numseg <= oldseg) {
+    this->idx.truncate(numseg * segcount);
+    return;
+  }
+  for (int i = oldseg; i < numseg; i++) {
+    const int v0 = i * this->ringsize;
+    const int v1 = v0 + this->ringsize;
+    // same triangles and winding as a strip v0, v1, v0+1, v1+1, ...
+    for (int j = 0; j < this->ringsize - 1; j++) {
+      this->idx.append(v0 + j);
+      this->idx.append(v1 + j);
+      this->idx.append(v0 + j + 1);
+      this->idx.append(v0 + j + 1);
+      this->idx.append(v1 + j);
+      this->idx.append(v1 + j + 1);
     }
-    if (connected) {
-      ADD_VERTEX(i, 0);
-      ADD_VERTEX(i+1, 0);
-      cursegidx += 2;
-      this->striplens.append( 2 + numcross * 2 );
+  }
+}
+
+void
+SoLODExtrusionP::generateTexCoords(void)
+{
+  const int num = this->master->spine.getNum();
+  const SbVec3f * spine = this->master->spine.getValues(0);
+
+  float sumDepths = 0;
+  SbList <float> depths;
+  depths.append(0);
+  for (int i = 1; i < num; i++) {
+    sumDepths += (spine[i] - spine[i-1]).length();
+    depths.append(sumDepths);
+  }
+  if (sumDepths <= 0.0f) sumDepths = 1.0f;
+
+  int v = 0;
+  for (int i = 0; i < this->numspine; i++) {
+    const float t = 1.0f - depths[i] / sumDepths;
+    for (int j = 0; j < this->ringsize; j++, v++) {
+      // the last vertex in each ring closes the texture
+      const float s = j < this->ringsize - 1 ? float(j) / this->numcross : 1.0f;
+      list_set(this->tcoord, v, SbVec2f(s, t));
     }
-    else {
-      this->striplens.append( numcross * 2 );
+  }
+  this->tcoord.truncate(v);
+}
+
+void
+SoLODExtrusionP::generateColors(void)
+{
+  this->colors.truncate(0);
+  const SbColor * colorv = this->master->color.getValues(0);
+  for (int i = 0; i < this->numspine; i++) {
+    for (int j = 0; j < this->ringsize; j++) {
+      this->colors.append(colorv[i]);
     }
   }
-  this->segidx.append(cursegidx);
-#undef ADD_TRIANGLE
-#undef ADD_VERTEX
-  //  printf("generateCoords: done, segidx length = %d \n", this->segidx.getLength() );
+  this->colorsvalid = TRUE;
+  if (this->colorvbo) {
+    this->colorvbo->setBufferData(this->colors.getArrayPtr(),
+                                  this->colors.getLength() * sizeof(SbColor));
+  }
+}
+
+//
+// Point the buffer objects at the regenerated lists. The buffers are
+// uploaded again the next time they are bound.
+//
+void
+SoLODExtrusionP::updateVBOs(void)
+{
+  if (this->coordvbo) {
+    this->coordvbo->setBufferData(this->coord.getArrayPtr(),
+                                  this->coord.getLength() * sizeof(SbVec3f));
+    this->normalvbo->setBufferData(this->normals.getArrayPtr(),
+                                   this->normals.getLength() * sizeof(SbVec3f));
+    this->tcoordvbo->setBufferData(this->tcoord.getArrayPtr(),
+                                   this->tcoord.getLength() * sizeof(SbVec2f));
+    this->indexvbo->setBufferData(this->idx.getArrayPtr(),
+                                  this->idx.getLength() * sizeof(int32_t));
+  }
 }
 
 //
-// Render triangles for segidx[index]
+// Render the extrusion for spine segments first to last (exclusive)
+// with the vertex arrays set up in GLRender()
+//
+void
+SoLODExtrusionP::renderSegments(const cc_glglue * glue, const int first, const int last,
+                                const SbBool usevbo)
+{
+  const int segcount = this->getSegmentIndexCount();
+  const int32_t * ptr = usevbo ? NULL : this->idx.getArrayPtr();
+  cc_glglue_glDrawElements(glue, GL_TRIANGLES, (last - first) * segcount,
+                           GL_UNSIGNED_INT, (const GLvoid *) (ptr + first * segcount));
+}
+
+//
+// Render triangles for spine segment index in immediate mode
 // Assumes per vertex normals, no materials or texture coords
 //
 void
@@ -931,91 +1260,144 @@ SoLODExtrusionP::renderSegidx(SoState * state,
                               const SbBool antisquish,
                               const SbVec3f & antisquishscale)
 {
-  assert( index >=0 && index < this->segidx.getLength() );
+  assert( index >= 0 && index < this->numspine-1 );
 
   SbColor alt_color = this->master->alternateColor.getValue();
   SbColor main_color = SoLazyElement::getDiffuse(state, 0);
 
-  const int * siv = this->segidx.getArrayPtr();
-  const int * iv = this->idx.getArrayPtr();
+  const int32_t * iv = this->idx.getArrayPtr();
   const SbVec3f * cv = this->coord.getArrayPtr();
   const SbVec3f * nv = this->normals.getArrayPtr();
   const SbVec2f * tcv = this->tcoord.getArrayPtr();
   const SbColor * colorv = this->master->color.getValues(0);
-  const int * coloridx = this->color_idx.getArrayPtr();
-  int vcnt = this->coord.getLength();
-  int startindex = siv[index];
-  int stopindex;
-  int nextindex;
-  if (index < segidx.getLength()-1) {
-    stopindex = siv[index+1];
-    nextindex = index + 1;
-  }
-  else {
-    stopindex = idx.getLength();
-    nextindex = index;
-  }
-  assert(stopindex > startindex);
-
-  int curidx = startindex;
-  int32_t v1;
+  const int segcount = this->getSegmentIndexCount();
+  const int startindex = index * segcount;
+  const int stopindex = startindex + segcount;
+  const int firstvertex = index * this->ringsize;
 
   if (use_alternate_color) {
     glColor3fv(index & 1 ? main_color.getValue() : alt_color.getValue());
   }
 
+  SbMatrix transform[2];
   if (antisquish) {
-    SbMatrix transform[2];
-    this->generateAntiSquish(transform[0], this->master->spine.getValues(0)[index], antisquishscale);
-    this->generateAntiSquish(transform[1], this->master->spine.getValues(0)[nextindex], antisquishscale);
-    
-    glBegin(GL_TRIANGLE_STRIP);
-    int cnt = 0;
-    while( curidx < stopindex ) {
-      assert(curidx < this->idx.getLength());
-      v1 = iv[curidx];
-      assert(v1 >= 0 && v1 < vcnt);
-      if (use_color) {
-        glColor3fv((const GLfloat*)colorv[coloridx[v1]].getValue());
-      }
+    const SbVec3f * spine = this->master->spine.getValues(0);
+    this->generateAntiSquish(transform[0], spine[index], antisquishscale);
+    this->generateAntiSquish(transform[1], spine[index+1], antisquishscale);
+  }
+
+  glBegin(GL_TRIANGLES);
+  for (int curidx = startindex; curidx < stopindex; curidx++) {
+    const int32_t v1 = iv[curidx];
+    // 0 for the first ring of the segment, 1 for the second
+    const int ring = (v1 - firstvertex) / this->ringsize;
+    if (use_color) {
+      glColor3fv((const GLfloat*)colorv[index + ring].getValue());
+    }
+    glTexCoord2fv((const GLfloat*)tcv[v1].getValue());
+    if (antisquish) {
       SbVec3f n = nv[v1];
       n[0] /= antisquishscale[0];
       n[1] /= antisquishscale[1];
       n[2] /= antisquishscale[2];
-      
       glNormal3fv((const GLfloat*)n.getValue());
 
-      SbVec2f t = tcv[v1];
-      if (curidx > stopindex - 3) t[0] = 1.0f;
-      glTexCoord2fv((const GLfloat*)t.getValue());
-      
-      SbVec3f tmp = cv[v1];
-      transform[cnt++ & 1].multVecMatrix(tmp, tmp);
-      
+      SbVec3f tmp;
+      transform[ring].multVecMatrix(cv[v1], tmp);
       glVertex3fv((const GLfloat*)tmp.getValue());
-      curidx++;
     }
-    glEnd(); /* draw tristrip*/
-  }
-  else {
-    glBegin(GL_TRIANGLE_STRIP);
-    while( curidx < stopindex ) {
-      assert(curidx < this->idx.getLength());
-      v1 = iv[curidx];
-      assert(v1 >= 0 && v1 < vcnt);
-      if (use_color) {
-        glColor3fv((const GLfloat*)colorv[coloridx[v1]].getValue());
-      }
+    else {
       glNormal3fv((const GLfloat*)nv[v1].getValue());
+      glVertex3fv((const GLfloat*)cv[v1].getValue());
+    }
+  }
+  glEnd();
+}
 
-      SbVec2f t = tcv[v1];
-      if (curidx > stopindex - 3) t[0] = 1.0f;
-      glTexCoord2fv((const GLfloat*)t.getValue());
+void
+SoLODExtrusionP::generateBVH(void)
+{
+  this->bvh.truncate(0);
 
-      glVertex3fv((const GLfloat*)cv[v1].getValue());
-      curidx++;
+  int num = this->master->spine.getNum();
+  if (num < 2) return;
+  const SbVec3f * spine = this->master->spine.getValues(0);
+  if (spine[0] == spine[num-1]) num--;
+  if (num < 2) return;
+
+  this->bvh.append(BVHNode());
+  this->buildBVH(0, spine, 0, num-1);
+}
+
+void
+SoLODExtrusionP::buildBVH(const int node, const SbVec3f * spine,
+                          const int first, const int count)
+{
+  SbBox3f box;
+  int child = -1;
+  if (count <= LODEXTRUSION_BVH_LEAFSIZE) {
+    for (int i = first; i <= first + count; i++) box.extendBy(spine[i]);
+  }
+  else {
+    // append both children before recursing to keep them consecutive
+    child = this->bvh.getLength();
+    this->bvh.append(BVHNode());
+    this->bvh.append(BVHNode());
+    const int half = count / 2;
+    this->buildBVH(child, spine, first, half);
+    this->buildBVH(child + 1, spine, first + half, count - half);
+    box = this->bvh[child].box;
+    box.extendBy(this->bvh[child + 1].box);
+  }
+  BVHNode & n = this->bvh[node];
+  n.box = box;
+  n.first = first;
+  n.count = count;
+  n.child = child;
+}
+
+//
+// Find the LOD mode for each segment below node, and store them as
+// runs in lodruns. A whole subtree gets the same mode when both the
+// closest and the farthest point of its box do, otherwise the
+// children are classified. In leaves the segments get the mode of
+// their first spine point.
+//
+void
+SoLODExtrusionP::classifyLOD(const int node, const SbVec3f & cameralocal,
+                             const float lod1, const float lod2)
+{
+  const BVHNode & n = this->bvh[node];
+  SbVec3f bmin, bmax;
+  n.box.getBounds(bmin, bmax);
+  float mindist2, maxdist2;
+  box_distances(cameralocal, bmin, bmax, mindist2, maxdist2);
+  const int mode = lod_mode(float(sqrt(mindist2)), lod1, lod2);
+  if (mode == lod_mode(float(sqrt(maxdist2)), lod1, lod2)) {
+    this->addLODRun(mode, n.first + n.count);
+  }
+  else if (n.child >= 0) {
+    this->classifyLOD(n.child, cameralocal, lod1, lod2);
+    this->classifyLOD(n.child + 1, cameralocal, lod1, lod2);
+  }
+  else {
+    const SbVec3f * spine = this->master->spine.getValues(0);
+    for (int i = n.first; i < n.first + n.count; i++) {
+      this->addLODRun(lod_mode((cameralocal - spine[i]).length(), lod1, lod2), i + 1);
     }
-    glEnd(); /* draw tristrip*/
+  }
+}
+
+void
+SoLODExtrusionP::addLODRun(const int mode, const int end)
+{
+  const int len = this->lodruns.getLength();
+  if (len && this->lodruns[len-2] == mode) {
+    this->lodruns[len-1] = end;
+  }
+  else {
+    this->lodruns.append(mode);
+    this->lodruns.append(end);
   }
 }
 
@@ -48,6 +48,14 @@
   The SoPointCloud::numPoints field specifies the number of points in
   the coordinate set which should be rendered (or otherwise handled by
   traversal actions).
+
+  When vertex buffer objects are supported, the points are sorted into
+  a grid of cells and kept in a vertex buffer. Points are only tested
+  against the detail distance in cells that cross it, the far points
+  are drawn with a few glDrawArrays() calls straight from the buffer,
+  and near spheres reuse one sphere mesh in buffer objects. Set the
+  environment variable COIN_DISABLE_VBO to 1 to always use the
+  immediate mode path.
 */
 
 #ifdef HAVE_CONFIG_H
@@ -55,7 +63,6 @@
 #endif // HAVE_CONFIG_H
 
 #include "SoPointCloud.h"
-#include "SmHQSphere.h"
 
 #include <Inventor/misc/SoState.h>
 #include <Inventor/bundles/SoTextureCoordinateBundle.h>
@@ -89,13 +96,42 @@
 #include <Inventor/elements/SoModelMatrixElement.h>
 #include <Inventor/elements/SoViewVolumeElement.h>
 #include <Inventor/elements/SoCacheElement.h>
+#include <Inventor/elements/SoGLLazyElement.h>
+#include <Inventor/elements/SoViewportRegionElement.h>
+#include <Inventor/sensors/SoTimerSensor.h>
+#include <Inventor/misc/SoContextHandler.h>
+#include <Inventor/threads/SbMutex.h>
+#include <Inventor/C/threads/sched.h>
+#include <Inventor/C/tidbits.h>
 #include <Inventor/SbPlane.h>
-#include <Inventor/SbBSPTree.h>
+#include <Inventor/SbBox3f.h>
+#include <SmallChange/misc/SmVBO.h>
+#include <SmallChange/misc/SmSphereMesh.h>
+#include <SmallChange/misc/SbHash.h>
+
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 #if COIN_DEBUG
 #include <Inventor/errors/SoDebugError.h>
 #endif // COIN_DEBUG
 
+#ifndef APIENTRY
+#define APIENTRY
+#endif // !APIENTRY
+
+#ifndef GL_VERTEX_SHADER
+#define GL_VERTEX_SHADER 0x8B31
+#endif // !GL_VERTEX_SHADER
+#ifndef GL_COMPILE_STATUS
+#define GL_COMPILE_STATUS 0x8B81
+#endif // !GL_COMPILE_STATUS
+#ifndef GL_LINK_STATUS
+#define GL_LINK_STATUS 0x8B82
+#endif // !GL_LINK_STATUS
+
 /*!
   \var SoSFInt32 SoPointCloud::numPoints
 
@@ -127,20 +163,222 @@
   The radius of the points when rendered as quads.
 */
 
+/*!
+  \var SoSFInt32 SoPointCloud::pointBudget
+
+  The maximum number of points to render. When the point cloud has
+  more points than this, an octree is built in a background thread,
+  where each node keeps a spatially even subsample of the points
+  below it. The visible nodes are then refined, coarse to fine by
+  projected point spacing, until the budget is used. The root node is
+  always rendered, so the budget can be exceeded if it is smaller than
+  the root subsample. Until the octree is ready, an evenly strided
+  subset of the points is rendered.
+
+  Only used when vertex buffer objects are available. The default
+  value is 0, which disables the budget.
+*/
+
 SO_NODE_SOURCE(SoPointCloud);
 
 
+// a cell in the spatial sort of the points
+struct SoPointCloudCell {
+  SbVec3f center;
+  SbVec3f extent; // half size
+  int32_t start;
+  int32_t num;
+};
+
+// an octree node. The points owned by the node are a subsample of
+// all the points below it.
+struct SoPointCloudNode {
+  SoPointCloudCell cell;
+  float spacing;
+  int32_t child[8];
+};
+
+// an octree node waiting to be refined, see SoPointCloudP::selectNodes()
+struct SoPointCloudHeapEntry {
+  float priority;
+  int32_t node;
+};
+
+typedef GLuint (APIENTRY * sm_glCreateShader_f)(GLenum type);
+typedef void (APIENTRY * sm_glShaderSource_f)(GLuint shader, GLsizei count, const char ** string, const GLint * length);
+typedef void (APIENTRY * sm_glCompileShader_f)(GLuint shader);
+typedef void (APIENTRY * sm_glGetShaderiv_f)(GLuint shader, GLenum pname, GLint * params);
+typedef void (APIENTRY * sm_glDeleteShader_f)(GLuint shader);
+typedef GLuint (APIENTRY * sm_glCreateProgram_f)(void);
+typedef void (APIENTRY * sm_glAttachShader_f)(GLuint program, GLuint shader);
+typedef void (APIENTRY * sm_glBindAttribLocation_f)(GLuint program, GLuint index, const char * name);
+typedef void (APIENTRY * sm_glLinkProgram_f)(GLuint program);
+typedef void (APIENTRY * sm_glGetProgramiv_f)(GLuint program, GLenum pname, GLint * params);
+typedef void (APIENTRY * sm_glUseProgram_f)(GLuint program);
+typedef GLint (APIENTRY * sm_glGetUniformLocation_f)(GLuint program, const char * name);
+typedef void (APIENTRY * sm_glUniform1f_f)(GLint location, GLfloat v0);
+typedef void (APIENTRY * sm_glVertexAttribPointer_f)(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const GLvoid * pointer);
+typedef void (APIENTRY * sm_glEnableVertexAttribArray_f)(GLuint index);
+typedef void (APIENTRY * sm_glDisableVertexAttribArray_f)(GLuint index);
+typedef void (APIENTRY * sm_glVertexAttribDivisor_f)(GLuint index, GLuint divisor);
+typedef void (APIENTRY * sm_glDrawElementsInstanced_f)(GLenum mode, GLsizei count, GLenum type, const GLvoid * indices, GLsizei primcount);
+
+// the entry points and the sphere program for instanced spheres in
+// one context, see SoPointCloudP::getInstancing()
+struct SoPointCloudInstancing {
+  SbBool ok;
+  GLuint program;
+  GLint usecolor;
+
+  sm_glUseProgram_f glUseProgram;
+  sm_glUniform1f_f glUniform1f;
+  sm_glVertexAttribPointer_f glVertexAttribPointer;
+  sm_glEnableVertexAttribArray_f glEnableVertexAttribArray;
+  sm_glDisableVertexAttribArray_f glDisableVertexAttribArray;
+  sm_glVertexAttribDivisor_f glVertexAttribDivisor;
+  sm_glDrawElementsInstanced_f glDrawElementsInstanced;
+};
+
+// an octree, built in a background thread, see SoPointCloudP::updateLOD()
+class SoPointCloudLOD {
+public:
+  SoPointCloudLOD(const uint32_t nodeid, const int32_t start, const int32_t num)
+    : done(FALSE), cancelled(FALSE), nodeid(nodeid), start(start), num(num),
+      coords(NULL), index(NULL), vbo(NULL)
+  { }
+  ~SoPointCloudLOD() {
+    free(this->coords);
+    free(this->index);
+    delete this->vbo;
+  }
+
+  SbMutex mutex;
+  SbBool done;
+  SbBool cancelled;
+
+  uint32_t nodeid;
+  int32_t start;
+  int32_t num;
+  SbVec3f * coords;
+  int32_t * index;
+  SbList <SoPointCloudNode> nodes;
+  SmVBO * vbo;
+
+  static void build_cb(void * closure);
+  static void cancel(SoPointCloudLOD * lod);
+  int buildNode(const int32_t start, const int32_t end, const SbVec3f & center,
+                const float halfsize, const int depth, unsigned char * gridused);
+  int32_t partition(const int32_t start, const int32_t end, const int axis, const float value);
+  void swap(const int32_t i, const int32_t j) {
+    const SbVec3f tmpcoord = this->coords[i];
+    this->coords[i] = this->coords[j];
+    this->coords[j] = tmpcoord;
+    const int32_t tmpindex = this->index[i];
+    this->index[i] = this->index[j];
+    this->index[j] = tmpindex;
+  }
+};
+
 class SoPointCloudP {
 public:
-  HQSphereGenerator spheregenerator;
-  SbBSPTree spherebsp;
-  SbList <int32_t> sphereidx;
+  SoPointCloudP(SoPointCloud * master)
+    : master(master), coordnodeid(0), colornodeid(0), sortedstart(-1), sortednum(-1),
+      ordercoords(NULL), orderindex(NULL), ordernum(0), ordervbo(NULL), orderislod(FALSE),
+      lod(NULL), lodbuild(NULL), lodsensor(NULL),
+      coordvbo(NULL), colorvbo(NULL), spheremesh(NULL)
+  { }
+  ~SoPointCloudP() {
+    delete this->lodsensor;
+    if (this->lodbuild) SoPointCloudLOD::cancel(this->lodbuild);
+    delete this->lod;
+    delete this->coordvbo;
+    delete this->colorvbo;
+    if (this->spheremesh) this->spheremesh->unref();
+  }
 
-  void genSphereGeom(const int level) {
-    this->spheregenerator.generate(SbClamp(level, 1, 12), this->spherebsp, this->sphereidx);
+  SoPointCloud * master;
+  // shared with the other point clouds and SmHQSphere nodes
+  SmSphereMesh * spheremesh;
+
+  SmSphereMesh * getSphereMesh(void) {
+    if (this->spheremesh == NULL) this->spheremesh = SmSphereMesh::ref(3);
+    return this->spheremesh;
   }
+
+  static int disable_vbo;
+  static cc_sched * lodsched;
+  static void lodsched_cleanup(void);
+
+  // the points sorted into cells, see sortPoints()
+  uint32_t coordnodeid;
+  uint32_t colornodeid;
+  int32_t sortedstart;
+  int32_t sortednum;
+  SbList <SbVec3f> sortedcoords;
+  SbList <int32_t> sortedindex; // offset into the state coordinates
+  SbList <SoPointCloudCell> cells;
+
+  // the point order used for rendering, from sortPoints() or the octree
+  const SbVec3f * ordercoords;
+  const int32_t * orderindex;
+  int32_t ordernum;
+  SmVBO * ordervbo;
+  SbBool orderislod;
+  SbList <uint32_t> ordercolors;
+
+  SoPointCloudLOD * lod;
+  SoPointCloudLOD * lodbuild;
+  SoTimerSensor * lodsensor;
+  SbList <SoPointCloudCell> lodcells;
+  SbList <SoPointCloudHeapEntry> lodheap;
+
+  SmVBO * coordvbo;
+  SmVBO * colorvbo;
+
+  // per frame lists
+  SbList <GLint> farfirst;
+  SbList <GLsizei> farcount;
+  SbList <GLuint> farindices;
+  SbList <int32_t> nearpoints;
+  SbList <SbVec3f> quadcoords;
+  SbList <SbVec3f> quadnormals;
+  SbList <uint32_t> quadcolors;
+
+  void setOrder(const SbVec3f * coords, const int32_t * index, const int32_t num,
+                SmVBO * vbo, const SbBool islod);
+  void sortPoints(const SoCoordinateElement * coords, const int32_t start, const int32_t num);
+  SbBool updateLOD(const SoCoordinateElement * coords, const int32_t start, const int32_t num);
+  void selectNodes(const SbViewVolume & vv, const SbMatrix & inversemm,
+                   const float vpheight, const int32_t budget);
+  void updateColors(SoState * state);
+  void classifyCells(const SbList <SoPointCloudCell> & celllist,
+                     const SbPlane & nearplane, const float distlimit);
+  void renderNear(SoState * state, const uint32_t contextid, SoMaterialBundle & mb,
+                  const SbBool pervertex, const int shape,
+                  const SbVec3f & xaxis, const SbVec3f & yaxis, const float r);
+  void renderFar(SoState * state, const uint32_t contextid, SoMaterialBundle & mb,
+                 const SbBool pervertex);
+
+  static void lodsensor_cb(void * closure, SoSensor * sensor);
+
+  // instanced spheres, see renderSpheres()
+  SbList <SbVec3f> instcoords;
+  SbList <uint32_t> instcolors;
+
+  static SbHash <SoPointCloudInstancing *, uint32_t> * instancing;
+  static SoPointCloudInstancing * getInstancing(const uint32_t contextid);
+  static void instancing_destruction_cb(uint32_t contextid, void * closure);
+  static void instancing_cleanup(void);
+
+  SbBool canInstance(const uint32_t contextid, const float r);
+  void renderSpheres(const uint32_t contextid, SmSphereMesh * mesh,
+                     const SbBool usevbo, const SbBool pervertex, const float r);
 };
 
+int SoPointCloudP::disable_vbo = -1;
+cc_sched * SoPointCloudP::lodsched = NULL;
+SbHash <SoPointCloudInstancing *, uint32_t> * SoPointCloudP::instancing = NULL;
+
 #define PRIVATE(obj) obj->pimpl
 
 /*!
@@ -148,7 +386,7 @@ public:
 */
 SoPointCloud::SoPointCloud()
 {
-  PRIVATE(this) = new SoPointCloudP;
+  PRIVATE(this) = new SoPointCloudP(this);
 
   SO_NODE_CONSTRUCTOR(SoPointCloud);
 
@@ -157,6 +395,7 @@ SoPointCloud::SoPointCloud()
   SO_NODE_ADD_FIELD(itemSize, (1.0f));
   SO_NODE_ADD_FIELD(mode, (DISTANCE_BASED));
   SO_NODE_ADD_FIELD(shape, (CUBE));
+  SO_NODE_ADD_FIELD(pointBudget, (0));
 
   SO_NODE_DEFINE_ENUM_VALUE(Shape, BILLBOARD_DIAMOND);
   SO_NODE_DEFINE_ENUM_VALUE(Shape, CUBE);
@@ -169,6 +408,13 @@ SoPointCloud::SoPointCloud()
   SO_NODE_SET_SF_ENUM_TYPE(mode, Mode);
   SO_NODE_SET_SF_ENUM_TYPE(shape, Shape);
 
+  if (SoPointCloudP::disable_vbo < 0) {
+    SoPointCloudP::disable_vbo = 0;
+    const char * env = coin_getenv("COIN_DISABLE_VBO");
+    if (env) {
+      SoPointCloudP::disable_vbo = atoi(env);
+    }
+  }
 }
 
 /*!
@@ -286,6 +532,958 @@ render_cube(const SbVec3f & center,
 }
 
 
+// *************************************************************************
+
+// the number of points to aim for in each cell of the spatial sort
+#define SORT_CELL_POINTS 512
+
+// octree nodes with more points than this are split, and keep one
+// point from each cell of a LOD_GRID^3 grid as their subsample
+#define LOD_NODE_POINTS 4096
+#define LOD_GRID 16
+#define LOD_MAX_DEPTH 20
+
+static uint32_t
+sm_rgba_bytes(const float r, const float g, const float b, const float a)
+{
+  // stored so that the bytes are R, G, B, A in memory
+  uint32_t val;
+  unsigned char * bytes = (unsigned char *) &val;
+  bytes[0] = (unsigned char) (SbClamp(r, 0.0f, 1.0f) * 255.0f + 0.5f);
+  bytes[1] = (unsigned char) (SbClamp(g, 0.0f, 1.0f) * 255.0f + 0.5f);
+  bytes[2] = (unsigned char) (SbClamp(b, 0.0f, 1.0f) * 255.0f + 0.5f);
+  bytes[3] = (unsigned char) (SbClamp(a, 0.0f, 1.0f) * 255.0f + 0.5f);
+  return val;
+}
+
+// the diffuse color at idx as RGBA bytes, see sm_rgba_bytes()
+static uint32_t
+sm_diffuse_rgba(const SoLazyElement * lazy, const int idx, const float alpha)
+{
+  const int i = SbMin(idx, lazy->getNumDiffuse() - 1);
+  if (lazy->isPacked()) {
+    const uint32_t col = lazy->getPackedPointer()[i];
+    return sm_rgba_bytes(float(col >> 24) / 255.0f,
+                         float((col >> 16) & 0xff) / 255.0f,
+                         float((col >> 8) & 0xff) / 255.0f,
+                         float(col & 0xff) / 255.0f);
+  }
+  const SbColor & col = lazy->getDiffusePointer()[i];
+  return sm_rgba_bytes(col[0], col[1], col[2], alpha);
+}
+
+//
+// Sorts the points into a regular grid of cells, so that the points
+// in each cell are consecutive in the vertex buffer, and only the
+// cells crossing the detail distance need to be tested point by
+// point.
+//
+void
+SoPointCloudP::sortPoints(const SoCoordinateElement * coords,
+                          const int32_t start, const int32_t num)
+{
+  this->coordnodeid = coords->getNodeId();
+  this->sortedstart = start;
+  this->sortednum = num;
+  this->sortedcoords.truncate(0);
+  this->sortedindex.truncate(0);
+  this->cells.truncate(0);
+  this->setOrder(NULL, NULL, 0, NULL, FALSE);
+  if (num <= 0) return;
+
+  int i;
+  SbBox3f box;
+  for (i = 0; i < num; i++) box.extendBy(coords->get3(start + i));
+  const SbVec3f bmin = box.getMin();
+  const SbVec3f size = box.getMax() - bmin;
+
+  // cells as close to cubes as the point set allows. Flat axes (like
+  // the depth of a sonar survey) get a single layer of cells.
+  int dim[3] = { 1, 1, 1 };
+  const float maxsize = SbMax(size[0], SbMax(size[1], size[2]));
+  if (maxsize > 0.0f) {
+    const int numcells = SbMax(1, num / SORT_CELL_POINTS);
+    double volume = 1.0;
+    int naxes = 0;
+    for (i = 0; i < 3; i++) {
+      if (size[i] > maxsize * 1.0e-3f) {
+        volume *= size[i];
+        naxes++;
+      }
+    }
+    const double cellsize = pow(volume / numcells, 1.0 / naxes);
+    for (i = 0; i < 3; i++) {
+      dim[i] = SbClamp((int) ceil(size[i] / cellsize), 1, 256);
+    }
+  }
+  float scale[3];
+  for (i = 0; i < 3; i++) {
+    scale[i] = size[i] > 0.0f ? float(dim[i]) / size[i] : 0.0f;
+  }
+
+  // counting sort on the cell index
+  const int numcells = dim[0] * dim[1] * dim[2];
+  SbList <int32_t> cellstart(numcells + 1);
+  for (i = 0; i <= numcells; i++) cellstart.append(0);
+  SbList <int32_t> cellof(num);
+  for (i = 0; i < num; i++) {
+    const SbVec3f v = coords->get3(start + i) - bmin;
+    const int x = SbMin(int(v[0] * scale[0]), dim[0] - 1);
+    const int y = SbMin(int(v[1] * scale[1]), dim[1] - 1);
+    const int z = SbMin(int(v[2] * scale[2]), dim[2] - 1);
+    const int cell = (z * dim[1] + y) * dim[0] + x;
+    cellof.append(cell);
+    cellstart[cell + 1]++;
+  }
+  for (i = 0; i < numcells; i++) cellstart[i + 1] += cellstart[i];
+
+  for (i = 0; i < num; i++) {
+    this->sortedcoords.append(SbVec3f(0.0f, 0.0f, 0.0f));
+    this->sortedindex.append(0);
+  }
+  for (i = 0; i < num; i++) {
+    const int pos = cellstart[cellof[i]]++;
+    this->sortedcoords[pos] = coords->get3(start + i);
+    this->sortedindex[pos] = i;
+  }
+
+  // cellstart[i] is now the end of cell i
+  int32_t first = 0;
+  for (i = 0; i < numcells; i++) {
+    const int32_t end = cellstart[i];
+    if (end > first) {
+      SbBox3f cellbox;
+      for (int j = first; j < end; j++) cellbox.extendBy(this->sortedcoords[j]);
+      SoPointCloudCell cell;
+      cell.center = cellbox.getCenter();
+      cell.extent = (cellbox.getMax() - cellbox.getMin()) * 0.5f;
+      cell.start = first;
+      cell.num = end - first;
+      this->cells.append(cell);
+    }
+    first = end;
+  }
+
+  if (!this->coordvbo) {
+    this->coordvbo = new SmVBO(GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+  }
+  this->coordvbo->setBufferData(this->sortedcoords.getArrayPtr(),
+                                num * sizeof(SbVec3f), this->coordnodeid);
+  this->setOrder(this->sortedcoords.getArrayPtr(), this->sortedindex.getArrayPtr(),
+                 num, this->coordvbo, FALSE);
+}
+
+void
+SoPointCloudP::setOrder(const SbVec3f * coords, const int32_t * index, const int32_t num,
+                        SmVBO * vbo, const SbBool islod)
+{
+  this->ordercoords = coords;
+  this->orderindex = index;
+  this->ordernum = num;
+  this->ordervbo = vbo;
+  this->orderislod = islod;
+  // colors must be sorted again
+  this->colornodeid = 0;
+  this->ordercolors.truncate(0);
+}
+
+// *************************************************************************
+
+void
+SoPointCloudP::lodsched_cleanup(void)
+{
+  cc_sched_destruct(SoPointCloudP::lodsched);
+  SoPointCloudP::lodsched = NULL;
+}
+
+//
+// Returns TRUE if an octree for the current coordinates is ready,
+// and makes it the point order. Otherwise starts building one in the
+// background, if it's not already being built.
+//
+SbBool
+SoPointCloudP::updateLOD(const SoCoordinateElement * coords,
+                         const int32_t start, const int32_t num)
+{
+  const uint32_t nodeid = coords->getNodeId();
+  if (this->lod && (this->lod->nodeid == nodeid) &&
+      (this->lod->start == start) && (this->lod->num == num)) {
+    if (!this->orderislod) {
+      if (!this->lod->vbo) {
+        this->lod->vbo = new SmVBO(GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+        this->lod->vbo->setBufferData(this->lod->coords, num * sizeof(SbVec3f), nodeid);
+      }
+      this->setOrder(this->lod->coords, this->lod->index, num, this->lod->vbo, TRUE);
+    }
+    return TRUE;
+  }
+  if (this->orderislod) {
+    this->setOrder(NULL, NULL, 0, NULL, FALSE);
+  }
+
+  SoPointCloudLOD * build = this->lodbuild;
+  if (build && (build->nodeid == nodeid) && (build->start == start) && (build->num == num)) {
+    return FALSE; // still building
+  }
+  if (build) SoPointCloudLOD::cancel(build);
+
+  // the coordinates are copied, since they can change on the state
+  // while the octree is built
+  build = new SoPointCloudLOD(nodeid, start, num);
+  build->coords = (SbVec3f *) malloc(num * sizeof(SbVec3f));
+  build->index = (int32_t *) malloc(num * sizeof(int32_t));
+  if (!build->coords || !build->index) {
+    delete build;
+    this->lodbuild = NULL;
+    return FALSE;
+  }
+  for (int32_t i = 0; i < num; i++) {
+    build->coords[i] = coords->get3(start + i);
+    build->index[i] = i;
+  }
+  this->lodbuild = build;
+
+  if (SoPointCloudP::lodsched == NULL) {
+    SoPointCloudP::lodsched = cc_sched_construct(1);
+    cc_coin_atexit((coin_atexit_f *) SoPointCloudP::lodsched_cleanup);
+  }
+  cc_sched_schedule(SoPointCloudP::lodsched, SoPointCloudLOD::build_cb, build, 0.0f);
+
+  if (!this->lodsensor) {
+    this->lodsensor = new SoTimerSensor(SoPointCloudP::lodsensor_cb, this);
+    this->lodsensor->setInterval(SbTime(0.1));
+  }
+  if (!this->lodsensor->isScheduled()) this->lodsensor->schedule();
+  return FALSE;
+}
+
+//
+// Polls the octree being built, and triggers a redraw when it's done.
+//
+void
+SoPointCloudP::lodsensor_cb(void * closure, SoSensor * sensor)
+{
+  SoPointCloudP * thisp = (SoPointCloudP *) closure;
+  SoPointCloudLOD * build = thisp->lodbuild;
+  if (build) {
+    build->mutex.lock();
+    const SbBool done = build->done;
+    build->mutex.unlock();
+    if (!done) return;
+
+    if (thisp->orderislod) {
+      thisp->setOrder(NULL, NULL, 0, NULL, FALSE);
+    }
+    delete thisp->lod;
+    thisp->lod = build;
+    thisp->lodbuild = NULL;
+  }
+  thisp->lodsensor->unschedule();
+  thisp->master->touch();
+}
+
+//
+// Stops a build. The octree is deleted here if the build is done,
+// and by the build thread otherwise.
+//
+void
+SoPointCloudLOD::cancel(SoPointCloudLOD * lod)
+{
+  lod->mutex.lock();
+  const SbBool done = lod->done;
+  lod->cancelled = TRUE;
+  lod->mutex.unlock();
+  if (done) delete lod;
+}
+
+void
+SoPointCloudLOD::build_cb(void * closure)
+{
+  SoPointCloudLOD * thisp = (SoPointCloudLOD *) closure;
+
+  if (thisp->num > 0) {
+    SbBox3f box;
+    for (int32_t i = 0; i < thisp->num; i++) box.extendBy(thisp->coords[i]);
+    float dx, dy, dz;
+    box.getSize(dx, dy, dz);
+    const float halfsize = SbMax(SbMax(dx, dy), SbMax(dz, FLT_EPSILON)) * 0.5f;
+    unsigned char * gridused = (unsigned char *) malloc(LOD_GRID * LOD_GRID * LOD_GRID);
+    (void) thisp->buildNode(0, thisp->num, box.getCenter(), halfsize, 0, gridused);
+    free(gridused);
+  }
+
+  thisp->mutex.lock();
+  thisp->done = TRUE;
+  const SbBool cancelled = thisp->cancelled;
+  thisp->mutex.unlock();
+  if (cancelled) delete thisp;
+}
+
+// moves the points in [start, end) with coordinate below value on axis
+// to the front of the range, and returns the end of those points
+int32_t
+SoPointCloudLOD::partition(int32_t start, int32_t end, const int axis, const float value)
+{
+  while (start < end) {
+    if (this->coords[start][axis] < value) start++;
+    else this->swap(start, --end);
+  }
+  return start;
+}
+
+//
+// Builds the node for the points in [start, end). A subsample with
+// one point per grid cell is moved to the front of the range and
+// owned by the node, and the rest is split into the eight octants.
+// Returns the node index.
+//
+int
+SoPointCloudLOD::buildNode(const int32_t start, const int32_t end, const SbVec3f & center,
+                           const float halfsize, const int depth, unsigned char * gridused)
+{
+  SoPointCloudNode node;
+  node.cell.center = center;
+  node.cell.extent.setValue(halfsize, halfsize, halfsize);
+  node.cell.start = start;
+  node.cell.num = end - start;
+  node.spacing = halfsize * 2.0f / LOD_GRID;
+  for (int c = 0; c < 8; c++) node.child[c] = -1;
+  const int nodeidx = this->nodes.getLength();
+  this->nodes.append(node);
+
+  this->mutex.lock();
+  const SbBool cancelled = this->cancelled;
+  this->mutex.unlock();
+  if (cancelled || (end - start <= LOD_NODE_POINTS) || (depth >= LOD_MAX_DEPTH)) {
+    return nodeidx;
+  }
+
+  memset(gridused, 0, LOD_GRID * LOD_GRID * LOD_GRID);
+  const SbVec3f bmin = center - node.cell.extent;
+  const float scale = LOD_GRID / (halfsize * 2.0f);
+  int32_t own = start;
+  int32_t i;
+  for (i = start; i < end; i++) {
+    const SbVec3f v = (this->coords[i] - bmin) * scale;
+    const int x = SbClamp((int) v[0], 0, LOD_GRID - 1);
+    const int y = SbClamp((int) v[1], 0, LOD_GRID - 1);
+    const int z = SbClamp((int) v[2], 0, LOD_GRID - 1);
+    unsigned char & used = gridused[(z * LOD_GRID + y) * LOD_GRID + x];
+    if (!used) {
+      used = 1;
+      this->swap(i, own++);
+    }
+  }
+  this->nodes[nodeidx].cell.num = own - start;
+
+  // split into octants, ordered as (z, y, x) bits
+  int32_t bounds[9];
+  bounds[0] = own;
+  bounds[8] = end;
+  bounds[4] = this->partition(bounds[0], bounds[8], 2, center[2]);
+  bounds[2] = this->partition(bounds[0], bounds[4], 1, center[1]);
+  bounds[6] = this->partition(bounds[4], bounds[8], 1, center[1]);
+  for (i = 0; i < 8; i += 2) {
+    bounds[i+1] = this->partition(bounds[i], bounds[i+2], 0, center[0]);
+  }
+
+  const float childsize = halfsize * 0.5f;
+  for (int octant = 0; octant < 8; octant++) {
+    if (bounds[octant+1] > bounds[octant]) {
+      const SbVec3f childcenter(center[0] + ((octant & 1) ? childsize : -childsize),
+                                center[1] + ((octant & 2) ? childsize : -childsize),
+                                center[2] + ((octant & 4) ? childsize : -childsize));
+      const int child = this->buildNode(bounds[octant], bounds[octant+1], childcenter,
+                                        childsize, depth + 1, gridused);
+      this->nodes[nodeidx].child[octant] = child;
+    }
+  }
+  return nodeidx;
+}
+
+// *************************************************************************
+
+static SbBool
+sopointcloud_is_visible(const SbPlane * planes, const SoPointCloudCell & cell)
+{
+  for (int i = 0; i < 6; i++) {
+    const SbVec3f & n = planes[i].getNormal();
+    const float r =
+      fabs(n[0]) * cell.extent[0] + fabs(n[1]) * cell.extent[1] + fabs(n[2]) * cell.extent[2];
+    if (planes[i].getDistance(cell.center) < -r) return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+sopointcloud_heap_push(SbList <SoPointCloudHeapEntry> & heap, const float priority,
+                       const int32_t node)
+{
+  SoPointCloudHeapEntry entry;
+  entry.priority = priority;
+  entry.node = node;
+  heap.append(entry);
+  int i = heap.getLength() - 1;
+  while (i > 0) {
+    const int parent = (i - 1) / 2;
+    if (heap[parent].priority >= heap[i].priority) break;
+    const SoPointCloudHeapEntry tmp = heap[parent];
+    heap[parent] = heap[i];
+    heap[i] = tmp;
+    i = parent;
+  }
+}
+
+static int32_t
+sopointcloud_heap_pop(SbList <SoPointCloudHeapEntry> & heap, float & priority)
+{
+  priority = heap[0].priority;
+  const int32_t node = heap[0].node;
+  const int num = heap.getLength() - 1;
+  heap[0] = heap[num];
+  heap.truncate(num);
+  int i = 0;
+  for (;;) {
+    int largest = i;
+    const int left = i * 2 + 1;
+    const int right = left + 1;
+    if ((left < num) && (heap[left].priority > heap[largest].priority)) largest = left;
+    if ((right < num) && (heap[right].priority > heap[largest].priority)) largest = right;
+    if (largest == i) break;
+    const SoPointCloudHeapEntry tmp = heap[largest];
+    heap[largest] = heap[i];
+    heap[i] = tmp;
+    i = largest;
+  }
+  return node;
+}
+
+//
+// Picks the octree nodes to render. Visible nodes are refined in
+// order of the projected size of their point spacing, until the point
+// budget is used up or the spacing is below a pixel. The root is
+// always selected when visible, even if it alone exceeds the budget.
+//
+void
+SoPointCloudP::selectNodes(const SbViewVolume & vv, const SbMatrix & inversemm,
+                           const float vpheight, const int32_t budget)
+{
+  this->lodcells.truncate(0);
+  this->lodheap.truncate(0);
+  const SoPointCloudNode * nodes = this->lod->nodes.getArrayPtr();
+  if (this->lod->nodes.getLength() == 0) return;
+
+  SbPlane planes[6];
+  vv.getViewVolumePlanes(planes);
+  int i;
+  for (i = 0; i < 6; i++) planes[i].transform(inversemm);
+
+  const SbBool ortho = vv.getProjectionType() == SbViewVolume::ORTHOGRAPHIC;
+  SbVec3f eye = vv.getProjectionPoint();
+  inversemm.multVecMatrix(eye, eye);
+  // pixels per unit at unit distance (perspective), or per unit (orthographic)
+  float pixelscale = vpheight / vv.getHeight();
+  if (ortho) {
+    SbVec3f unit(1.0f, 0.0f, 0.0f);
+    inversemm.multDirMatrix(unit, unit);
+    pixelscale /= unit.length();
+  }
+  else {
+    pixelscale *= vv.getNearDist();
+  }
+  const float mindist = vv.getNearDist() * 0.5f;
+
+  if (sopointcloud_is_visible(planes, nodes[0].cell)) {
+    sopointcloud_heap_push(this->lodheap, FLT_MAX, 0);
+  }
+  int32_t total = 0;
+  while (this->lodheap.getLength()) {
+    float priority;
+    const SoPointCloudNode & node = nodes[sopointcloud_heap_pop(this->lodheap, priority)];
+    if ((total > 0) && (total + node.cell.num > budget)) break;
+    total += node.cell.num;
+    this->lodcells.append(node.cell);
+
+    for (i = 0; i < 8; i++) {
+      if (node.child[i] < 0) continue;
+      const SoPointCloudNode & child = nodes[node.child[i]];
+      if (!sopointcloud_is_visible(planes, child.cell)) continue;
+      float size = child.spacing * pixelscale;
+      if (!ortho) {
+        const float dist = (child.cell.center - eye).length() - child.cell.extent.length();
+        size /= SbMax(dist, mindist);
+      }
+      // skip children that only add detail below a pixel
+      if (size * 2.0f >= 1.0f) {
+        sopointcloud_heap_push(this->lodheap, size, node.child[i]);
+      }
+    }
+  }
+}
+
+//
+// Updates the color buffer, in sorted order, when the diffuse colors
+// on the state change.
+//
+void
+SoPointCloudP::updateColors(SoState * state)
+{
+  const int32_t num = this->ordernum;
+  const SoLazyElement * lazy = SoLazyElement::getInstance(state);
+  if ((this->colornodeid == lazy->getDiffuseNodeId()) &&
+      (this->ordercolors.getLength() == num)) return;
+  this->colornodeid = lazy->getDiffuseNodeId();
+  this->ordercolors.truncate(0);
+
+  const float alpha = 1.0f - SoLazyElement::getTransparency(state, 0);
+  for (int i = 0; i < num; i++) {
+    this->ordercolors.append(sm_diffuse_rgba(lazy, this->orderindex[i], alpha));
+  }
+
+  if (!this->colorvbo) {
+    this->colorvbo = new SmVBO(GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+  }
+  this->colorvbo->setBufferData(this->ordercolors.getArrayPtr(),
+                                num * sizeof(uint32_t), this->colornodeid);
+}
+
+//
+// Splits the sorted points in near and far points. Whole cells
+// are classified from their bounding box, and the far cells are
+// merged into ranges for glDrawArrays().
+//
+void
+SoPointCloudP::classifyCells(const SbList <SoPointCloudCell> & celllist,
+                             const SbPlane & nearplane, const float distlimit)
+{
+  this->farfirst.truncate(0);
+  this->farcount.truncate(0);
+  this->farindices.truncate(0);
+  this->nearpoints.truncate(0);
+
+  const SbVec3f & n = nearplane.getNormal();
+  const float d = nearplane.getDistanceFromOrigin();
+  const SbVec3f absn(fabs(n[0]), fabs(n[1]), fabs(n[2]));
+
+  const SoPointCloudCell * cell = celllist.getArrayPtr();
+  const int numcells = celllist.getLength();
+  for (int i = 0; i < numcells; i++, cell++) {
+    // distance in front of the near plane, as -nearplane.getDistance(v)
+    const float mid = d - n.dot(cell->center);
+    const float r = absn.dot(cell->extent);
+    const int32_t end = cell->start + cell->num;
+
+    if (mid - r > distlimit) {
+      const int last = this->farfirst.getLength() - 1;
+      if ((last >= 0) && (this->farfirst[last] + this->farcount[last] == cell->start)) {
+        this->farcount[last] += cell->num;
+      }
+      else {
+        this->farfirst.append(cell->start);
+        this->farcount.append(cell->num);
+      }
+    }
+    else if (mid + r <= distlimit) {
+      for (int32_t j = cell->start; j < end; j++) this->nearpoints.append(j);
+    }
+    else {
+      for (int32_t j = cell->start; j < end; j++) {
+        if (d - n.dot(this->ordercoords[j]) <= distlimit) this->nearpoints.append(j);
+        else this->farindices.append(j);
+      }
+    }
+  }
+}
+
+// the per instance attributes of the sphere program. Locations 6 and
+// 7 are not aliased by any of the conventional vertex attributes.
+#define SM_INSTANCE_OFFSET 6
+#define SM_INSTANCE_COLOR 7
+
+// Moves the unit sphere to the instance offset, and lights it like
+// the fixed function pipeline does, with the first light source only.
+// The diffuse color is the instance color if usecolor is 1, and the
+// current color otherwise.
+static const char sopointcloud_sphere_vs[] =
+  "attribute vec3 offset;\n"
+  "attribute vec4 color;\n"
+  "uniform float usecolor;\n"
+  "void main(void)\n"
+  "{\n"
+  "  vec4 v = gl_ModelViewMatrix * vec4(gl_Vertex.xyz + offset, 1.0);\n"
+  "  vec3 n = normalize(gl_NormalMatrix * gl_Normal);\n"
+  "  vec4 diffuse = mix(gl_Color, color, usecolor);\n"
+  "  vec4 lpos = gl_LightSource[0].position;\n"
+  "  vec3 l = normalize(lpos.xyz - v.xyz * lpos.w);\n"
+  "  vec3 h = normalize(l + vec3(0.0, 0.0, 1.0));\n"
+  "  float nl = max(dot(n, l), 0.0);\n"
+  "  float nh = nl > 0.0 ? pow(max(dot(n, h), 0.0), gl_FrontMaterial.shininess) : 0.0;\n"
+  "  vec3 rgb = gl_FrontMaterial.emission.rgb +\n"
+  "    gl_FrontMaterial.ambient.rgb * (gl_LightModel.ambient.rgb + gl_LightSource[0].ambient.rgb) +\n"
+  "    diffuse.rgb * gl_LightSource[0].diffuse.rgb * nl +\n"
+  "    gl_FrontMaterial.specular.rgb * gl_LightSource[0].specular.rgb * nh;\n"
+  "  gl_FrontColor = vec4(rgb, diffuse.a);\n"
+  "  gl_FogFragCoord = abs(v.z);\n"
+  "  gl_Position = gl_ProjectionMatrix * v;\n"
+  "}\n";
+
+//
+// Returns the entry points and the sphere program for instanced
+// spheres in the given context. The ok flag is FALSE if instancing or
+// shaders are not supported, or if the program could not be built.
+//
+SoPointCloudInstancing *
+SoPointCloudP::getInstancing(const uint32_t contextid)
+{
+  if (SoPointCloudP::instancing == NULL) {
+    SoPointCloudP::instancing = new SbHash <SoPointCloudInstancing *, uint32_t>;
+    SoContextHandler::addContextDestructionCallback(SoPointCloudP::instancing_destruction_cb, NULL);
+    cc_coin_atexit((coin_atexit_f *) SoPointCloudP::instancing_cleanup);
+  }
+  SoPointCloudInstancing * inst = NULL;
+  if (SoPointCloudP::instancing->get(contextid, inst)) return inst;
+
+  inst = new SoPointCloudInstancing;
+  memset(inst, 0, sizeof(SoPointCloudInstancing));
+  SoPointCloudP::instancing->put(contextid, inst);
+
+  const cc_glglue * glue = cc_glglue_instance((int) contextid);
+  if (!cc_glglue_glversion_matches_at_least(glue, 2, 0, 0)) return inst;
+
+#define SM_GETPROC(type, name) (type) cc_glglue_getprocaddress(glue, name)
+  sm_glCreateShader_f glCreateShader = SM_GETPROC(sm_glCreateShader_f, "glCreateShader");
+  sm_glShaderSource_f glShaderSource = SM_GETPROC(sm_glShaderSource_f, "glShaderSource");
+  sm_glCompileShader_f glCompileShader = SM_GETPROC(sm_glCompileShader_f, "glCompileShader");
+  sm_glGetShaderiv_f glGetShaderiv = SM_GETPROC(sm_glGetShaderiv_f, "glGetShaderiv");
+  sm_glDeleteShader_f glDeleteShader = SM_GETPROC(sm_glDeleteShader_f, "glDeleteShader");
+  sm_glCreateProgram_f glCreateProgram = SM_GETPROC(sm_glCreateProgram_f, "glCreateProgram");
+  sm_glAttachShader_f glAttachShader = SM_GETPROC(sm_glAttachShader_f, "glAttachShader");
+  sm_glBindAttribLocation_f glBindAttribLocation =
+    SM_GETPROC(sm_glBindAttribLocation_f, "glBindAttribLocation");
+  sm_glLinkProgram_f glLinkProgram = SM_GETPROC(sm_glLinkProgram_f, "glLinkProgram");
+  sm_glGetProgramiv_f glGetProgramiv = SM_GETPROC(sm_glGetProgramiv_f, "glGetProgramiv");
+  sm_glGetUniformLocation_f glGetUniformLocation =
+    SM_GETPROC(sm_glGetUniformLocation_f, "glGetUniformLocation");
+
+  inst->glUseProgram = SM_GETPROC(sm_glUseProgram_f, "glUseProgram");
+  inst->glUniform1f = SM_GETPROC(sm_glUniform1f_f, "glUniform1f");
+  inst->glVertexAttribPointer = SM_GETPROC(sm_glVertexAttribPointer_f, "glVertexAttribPointer");
+  inst->glEnableVertexAttribArray =
+    SM_GETPROC(sm_glEnableVertexAttribArray_f, "glEnableVertexAttribArray");
+  inst->glDisableVertexAttribArray =
+    SM_GETPROC(sm_glDisableVertexAttribArray_f, "glDisableVertexAttribArray");
+
+  // core in OpenGL 3.1 and 3.3, or the ARB extensions
+  if (cc_glglue_glversion_matches_at_least(glue, 3, 3, 0)) {
+    inst->glVertexAttribDivisor = SM_GETPROC(sm_glVertexAttribDivisor_f, "glVertexAttribDivisor");
+    inst->glDrawElementsInstanced =
+      SM_GETPROC(sm_glDrawElementsInstanced_f, "glDrawElementsInstanced");
+  }
+  else if (cc_glglue_glext_supported(glue, "GL_ARB_instanced_arrays") &&
+           cc_glglue_glext_supported(glue, "GL_ARB_draw_instanced")) {
+    inst->glVertexAttribDivisor =
+      SM_GETPROC(sm_glVertexAttribDivisor_f, "glVertexAttribDivisorARB");
+    inst->glDrawElementsInstanced =
+      SM_GETPROC(sm_glDrawElementsInstanced_f, "glDrawElementsInstancedARB");
+  }
+#undef SM_GETPROC
+
+  if (!glCreateShader || !glShaderSource || !glCompileShader || !glGetShaderiv ||
+      !glDeleteShader || !glCreateProgram || !glAttachShader || !glBindAttribLocation ||
+      !glLinkProgram || !glGetProgramiv || !glGetUniformLocation ||
+      !inst->glUseProgram || !inst->glUniform1f || !inst->glVertexAttribPointer ||
+      !inst->glEnableVertexAttribArray || !inst->glDisableVertexAttribArray ||
+      !inst->glVertexAttribDivisor || !inst->glDrawElementsInstanced) {
+    return inst;
+  }
+
+  const char * src = sopointcloud_sphere_vs;
+  GLint status = 0;
+  GLuint shader = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(shader, 1, &src, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+  if (status) {
+    inst->program = glCreateProgram();
+    glAttachShader(inst->program, shader);
+    glBindAttribLocation(inst->program, SM_INSTANCE_OFFSET, "offset");
+    glBindAttribLocation(inst->program, SM_INSTANCE_COLOR, "color");
+    glLinkProgram(inst->program);
+    glGetProgramiv(inst->program, GL_LINK_STATUS, &status);
+  }
+  // the program keeps the shader alive
+  glDeleteShader(shader);
+
+  if (status) {
+    inst->usecolor = glGetUniformLocation(inst->program, "usecolor");
+    inst->ok = TRUE;
+  }
+#if COIN_DEBUG
+  else {
+    SoDebugError::postWarning("SoPointCloudP::getInstancing",
+                              "could not build the sphere program, "
+                              "spheres will be drawn one at a time");
+  }
+#endif // COIN_DEBUG
+  return inst;
+}
+
+// the program is deleted with the context
+void
+SoPointCloudP::instancing_destruction_cb(uint32_t contextid, void * closure)
+{
+  SoPointCloudInstancing * inst = NULL;
+  if (SoPointCloudP::instancing->get(contextid, inst)) {
+    SoPointCloudP::instancing->remove(contextid);
+    delete inst;
+  }
+}
+
+static void
+sopointcloud_delete_instancing(const uint32_t & key, SoPointCloudInstancing * const & inst,
+                               void * closure)
+{
+  delete inst;
+}
+
+void
+SoPointCloudP::instancing_cleanup(void)
+{
+  SoContextHandler::removeContextDestructionCallback(SoPointCloudP::instancing_destruction_cb, NULL);
+  SoPointCloudP::instancing->apply(sopointcloud_delete_instancing, NULL);
+  delete SoPointCloudP::instancing;
+  SoPointCloudP::instancing = NULL;
+}
+
+// TRUE if the spheres can be drawn with renderSpheres()
+SbBool
+SoPointCloudP::canInstance(const uint32_t contextid, const float r)
+{
+  // the offsets are divided by r
+  if (r <= 0.0f) return FALSE;
+  return SoPointCloudP::getInstancing(contextid)->ok;
+}
+
+//
+// Draws the spheres in instcoords with one instanced call. The
+// offsets are the sphere centers divided by r, so that the radius can
+// be applied to the modelview matrix. instcolors has the colors when
+// pervertex is TRUE.
+//
+void
+SoPointCloudP::renderSpheres(const uint32_t contextid, SmSphereMesh * mesh,
+                             const SbBool usevbo, const SbBool pervertex, const float r)
+{
+  const int num = this->instcoords.getLength();
+  if (num == 0) return;
+  const SoPointCloudInstancing * inst = SoPointCloudP::getInstancing(contextid);
+  const cc_glglue * glue = cc_glglue_instance((int) contextid);
+  const int numidx = mesh->getNumIndices();
+
+  // the unit sphere vertices are also the normals
+  const GLvoid * spherecoords = NULL;
+  if (usevbo) mesh->getCoordVBO()->bindBuffer(contextid);
+  else spherecoords = mesh->getCoords();
+  cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0, spherecoords);
+  cc_glglue_glNormalPointer(glue, GL_FLOAT, 0, spherecoords);
+  cc_glglue_glEnableClientState(glue, GL_VERTEX_ARRAY);
+  cc_glglue_glEnableClientState(glue, GL_NORMAL_ARRAY);
+  if (usevbo) cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, 0);
+
+  // the instance attributes are client side arrays, rebuilt every frame
+  inst->glVertexAttribPointer(SM_INSTANCE_OFFSET, 3, GL_FLOAT, GL_FALSE, 0,
+                              this->instcoords.getArrayPtr());
+  inst->glEnableVertexAttribArray(SM_INSTANCE_OFFSET);
+  inst->glVertexAttribDivisor(SM_INSTANCE_OFFSET, 1);
+  if (pervertex) {
+    inst->glVertexAttribPointer(SM_INSTANCE_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0,
+                                this->instcolors.getArrayPtr());
+    inst->glEnableVertexAttribArray(SM_INSTANCE_COLOR);
+    inst->glVertexAttribDivisor(SM_INSTANCE_COLOR, 1);
+  }
+
+  inst->glUseProgram(inst->program);
+  inst->glUniform1f(inst->usecolor, pervertex ? 1.0f : 0.0f);
+
+  glPushMatrix();
+  glScalef(r, r, r);
+  if (usevbo) {
+    mesh->getIndexVBO()->bindBuffer(contextid);
+    inst->glDrawElementsInstanced(GL_TRIANGLES, numidx, GL_UNSIGNED_INT, NULL, num);
+    cc_glglue_glBindBuffer(glue, GL_ELEMENT_ARRAY_BUFFER, 0);
+  }
+  else {
+    inst->glDrawElementsInstanced(GL_TRIANGLES, numidx, GL_UNSIGNED_INT,
+                                  mesh->getIndices(), num);
+  }
+  glPopMatrix();
+
+  inst->glUseProgram(0);
+  inst->glVertexAttribDivisor(SM_INSTANCE_OFFSET, 0);
+  inst->glDisableVertexAttribArray(SM_INSTANCE_OFFSET);
+  if (pervertex) {
+    inst->glVertexAttribDivisor(SM_INSTANCE_COLOR, 0);
+    inst->glDisableVertexAttribArray(SM_INSTANCE_COLOR);
+  }
+  cc_glglue_glDisableClientState(glue, GL_NORMAL_ARRAY);
+  cc_glglue_glDisableClientState(glue, GL_VERTEX_ARRAY);
+}
+
+//
+// Renders the near points as shapes. Spheres share one mesh in
+// buffer objects, and are drawn with one instanced call when
+// possible. Cubes and diamonds are collected into a single vertex
+// array.
+//
+void
+SoPointCloudP::renderNear(SoState * state, const uint32_t contextid, SoMaterialBundle & mb,
+                          const SbBool pervertex, const int shape,
+                          const SbVec3f & xaxis, const SbVec3f & yaxis, const float r)
+{
+  const int numnear = this->nearpoints.getLength();
+  if (numnear == 0) return;
+  const int32_t * nearptr = this->nearpoints.getArrayPtr();
+  const cc_glglue * glue = cc_glglue_instance((int) contextid);
+  int i;
+
+  if (shape == SoPointCloud::SPHERE) {
+    SmSphereMesh * mesh = this->getSphereMesh();
+    if (this->canInstance(contextid, r)) {
+      const float invr = 1.0f / r;
+      this->instcoords.truncate(0);
+      this->instcolors.truncate(0);
+      for (i = 0; i < numnear; i++) {
+        this->instcoords.append(this->ordercoords[nearptr[i]] * invr);
+        if (pervertex) this->instcolors.append(this->ordercolors[nearptr[i]]);
+      }
+      this->renderSpheres(contextid, mesh, TRUE, pervertex, r);
+      return;
+    }
+
+    const int numidx = mesh->getNumIndices();
+
+    // the unit sphere vertices are also the normals
+    mesh->getCoordVBO()->bindBuffer(contextid);
+    cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0, NULL);
+    cc_glglue_glNormalPointer(glue, GL_FLOAT, 0, NULL);
+    cc_glglue_glEnableClientState(glue, GL_VERTEX_ARRAY);
+    cc_glglue_glEnableClientState(glue, GL_NORMAL_ARRAY);
+    mesh->getIndexVBO()->bindBuffer(contextid);
+
+    for (i = 0; i < numnear; i++) {
+      const SbVec3f & v = this->ordercoords[nearptr[i]];
+      if (pervertex) mb.send(this->orderindex[nearptr[i]], TRUE);
+      glPushMatrix();
+      glTranslatef(v[0], v[1], v[2]);
+      glScalef(r, r, r);
+      cc_glglue_glDrawElements(glue, GL_TRIANGLES, numidx, GL_UNSIGNED_INT, NULL);
+      glPopMatrix();
+    }
+
+    cc_glglue_glDisableClientState(glue, GL_NORMAL_ARRAY);
+    cc_glglue_glDisableClientState(glue, GL_VERTEX_ARRAY);
+    cc_glglue_glBindBuffer(glue, GL_ELEMENT_ARRAY_BUFFER, 0);
+    cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, 0);
+    return;
+  }
+
+  const SbBool cube = shape == SoPointCloud::CUBE;
+  const int numvertices = cube ? 24 : 4;
+  this->quadcoords.truncate(0);
+  this->quadnormals.truncate(0);
+  this->quadcolors.truncate(0);
+
+  for (i = 0; i < numnear; i++) {
+    const SbVec3f & v = this->ordercoords[nearptr[i]];
+    if (cube) {
+      SbVec3f varray[8];
+      generate_cube_vertices(varray, v, r, r, r);
+      for (int j = 0; j < 24; j++) {
+        this->quadcoords.append(varray[cube_vindices[j]]);
+        this->quadnormals.append(SbVec3f(&cube_normals[(j/4)*3]));
+      }
+    }
+    else {
+      this->quadcoords.append(v - yaxis);
+      this->quadcoords.append(v + xaxis);
+      this->quadcoords.append(v + yaxis);
+      this->quadcoords.append(v - xaxis);
+    }
+    if (pervertex) {
+      const uint32_t col = this->ordercolors[nearptr[i]];
+      for (int j = 0; j < numvertices; j++) this->quadcolors.append(col);
+    }
+  }
+
+  cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0, this->quadcoords.getArrayPtr());
+  cc_glglue_glEnableClientState(glue, GL_VERTEX_ARRAY);
+  if (cube) {
+    cc_glglue_glNormalPointer(glue, GL_FLOAT, 0, this->quadnormals.getArrayPtr());
+    cc_glglue_glEnableClientState(glue, GL_NORMAL_ARRAY);
+  }
+  if (pervertex) {
+    mb.send(this->orderindex[nearptr[0]], TRUE);
+    cc_glglue_glColorPointer(glue, 4, GL_UNSIGNED_BYTE, 0, this->quadcolors.getArrayPtr());
+    cc_glglue_glEnableClientState(glue, GL_COLOR_ARRAY);
+  }
+
+  cc_glglue_glDrawArrays(glue, GL_QUADS, 0, this->quadcoords.getLength());
+
+  cc_glglue_glDisableClientState(glue, GL_VERTEX_ARRAY);
+  if (cube) cc_glglue_glDisableClientState(glue, GL_NORMAL_ARRAY);
+  if (pervertex) {
+    cc_glglue_glDisableClientState(glue, GL_COLOR_ARRAY);
+    // the current color is undefined after using a color array
+    SoGLLazyElement::getInstance(state)->reset(state, SoLazyElement::DIFFUSE_MASK);
+  }
+}
+
+//
+// Renders the far points as GL_POINTS straight from the vertex
+// buffer.
+//
+void
+SoPointCloudP::renderFar(SoState * state, const uint32_t contextid, SoMaterialBundle & mb,
+                         const SbBool pervertex)
+{
+  const int numranges = this->farfirst.getLength();
+  const int numindices = this->farindices.getLength();
+  if ((numranges == 0) && (numindices == 0)) return;
+  const cc_glglue * glue = cc_glglue_instance((int) contextid);
+
+  this->ordervbo->bindBuffer(contextid);
+  cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0, NULL);
+  cc_glglue_glEnableClientState(glue, GL_VERTEX_ARRAY);
+  if (pervertex) {
+    mb.send(0, TRUE);
+    this->colorvbo->bindBuffer(contextid);
+    cc_glglue_glColorPointer(glue, 4, GL_UNSIGNED_BYTE, 0, NULL);
+    cc_glglue_glEnableClientState(glue, GL_COLOR_ARRAY);
+  }
+
+  if ((numranges > 1) && cc_glglue_has_multidraw_vertex_arrays(glue)) {
+    cc_glglue_glMultiDrawArrays(glue, GL_POINTS, this->farfirst.getArrayPtr(),
+                                this->farcount.getArrayPtr(), numranges);
+  }
+  else {
+    for (int i = 0; i < numranges; i++) {
+      cc_glglue_glDrawArrays(glue, GL_POINTS, this->farfirst[i], this->farcount[i]);
+    }
+  }
+  if (numindices) {
+    // points from cells crossing the detail distance
+    cc_glglue_glDrawElements(glue, GL_POINTS, numindices, GL_UNSIGNED_INT,
+                             this->farindices.getArrayPtr());
+  }
+
+  cc_glglue_glDisableClientState(glue, GL_VERTEX_ARRAY);
+  if (pervertex) {
+    cc_glglue_glDisableClientState(glue, GL_COLOR_ARRAY);
+    SoGLLazyElement::getInstance(state)->reset(state, SoLazyElement::DIFFUSE_MASK);
+  }
+  cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, 0);
+}
+
 // doc from parent
 void
 SoPointCloud::GLRender(SoGLRenderAction * action)
@@ -347,6 +1545,11 @@ SoPointCloud::GLRender(SoGLRenderAction * action)
   if (numpts < 0) numpts = coords->getNum() - idx;
 
   float distlimit = this->detailDistance.getValue();
+  switch (this->mode.getValue()) {
+  case ALWAYS_POINTS: distlimit = -FLT_MAX; break;
+  case ALWAYS_SHAPE: distlimit = FLT_MAX; break;
+  default: break;
+  }
 
   float r = this->itemSize.getValue() * 0.5f;
   xaxis *= r;
@@ -377,16 +1580,70 @@ SoPointCloud::GLRender(SoGLRenderAction * action)
   int i;
   SbVec3f v;
 
-  if (rendershape == SPHERE) {
-    const cc_glglue * glue = cc_glglue_instance(SoGLCacheContextElement::get(state));
+  const uint32_t contextid = SoGLCacheContextElement::get(state);
+  const cc_glglue * glue = cc_glglue_instance((int) contextid);
+  SbBool usebuffers = !SoPointCloudP::disable_vbo &&
+    cc_glglue_has_vertex_buffer_object(glue) &&
+    SmVBO::shouldCreateVBO(contextid, numpts);
+
+  const int32_t budget = this->pointBudget.getValue();
+  SbBool strided = FALSE;
+  if (usebuffers && (budget > 0) && (numpts > budget)) {
+    if (PRIVATE(this)->updateLOD(coords, idx, numpts)) {
+      const float vpheight = (float)
+        SoViewportRegionElement::get(state).getViewportSizePixels()[1];
+      PRIVATE(this)->selectNodes(vv, inversemm, vpheight, budget);
+      PRIVATE(this)->classifyCells(PRIVATE(this)->lodcells, nearplane, distlimit);
+    }
+    else {
+      // the octree is being built, draw a subset of the points meanwhile
+      usebuffers = FALSE;
+      strided = TRUE;
+    }
+  }
+  else if (usebuffers) {
+    if (PRIVATE(this)->orderislod ||
+        (coords->getNodeId() != PRIVATE(this)->coordnodeid) ||
+        (idx != PRIVATE(this)->sortedstart) ||
+        (numpts != PRIVATE(this)->sortednum)) {
+      PRIVATE(this)->sortPoints(coords, idx, numpts);
+    }
+    PRIVATE(this)->classifyCells(PRIVATE(this)->cells, nearplane, distlimit);
+  }
 
-    if (PRIVATE(this)->sphereidx.getLength() == 0) {
-      PRIVATE(this)->genSphereGeom(3);
+  if (usebuffers) {
+    if (mbind == PER_VERTEX) PRIVATE(this)->updateColors(state);
+    PRIVATE(this)->renderNear(state, contextid, mb, mbind == PER_VERTEX,
+                              rendershape, xaxis, yaxis, r);
+  }
+  else if (strided) {
+    // no shapes until the octree is ready
+  }
+  else if ((rendershape == SPHERE) && PRIVATE(this)->canInstance(contextid, r)) {
+    const SoLazyElement * lazy = SoLazyElement::getInstance(state);
+    const float alpha = 1.0f - SoLazyElement::getTransparency(state, 0);
+    const float invr = 1.0f / r;
+    PRIVATE(this)->instcoords.truncate(0);
+    PRIVATE(this)->instcolors.truncate(0);
+    for (i = 0; i < numpts; i++) {
+      v = coords->get3(idx+i);
+      float dist = - nearplane.getDistance(v);
+      if (dist <= distlimit) {
+        PRIVATE(this)->instcoords.append(v * invr);
+        if (mbind == PER_VERTEX) {
+          PRIVATE(this)->instcolors.append(sm_diffuse_rgba(lazy, idx+i, alpha));
+        }
+      }
     }
-    const SbVec3f * pts = PRIVATE(this)->spherebsp.getPointsArrayPtr();
+    PRIVATE(this)->renderSpheres(contextid, PRIVATE(this)->getSphereMesh(), FALSE,
+                                 mbind == PER_VERTEX, r);
+  }
+  else if (rendershape == SPHERE) {
+    SmSphereMesh * mesh = PRIVATE(this)->getSphereMesh();
+    const SbVec3f * pts = mesh->getCoords();
     const SbVec3f * nptr = pts;
-    const int32_t * iptr = PRIVATE(this)->sphereidx.getArrayPtr();
-    const int numidx = PRIVATE(this)->sphereidx.getLength();
+    const int32_t * iptr = mesh->getIndices();
+    const int numidx = mesh->getNumIndices();
 
     cc_glglue_glNormalPointer(glue, GL_FLOAT, 0, (GLvoid*) nptr);
     cc_glglue_glEnableClientState(glue, GL_NORMAL_ARRAY);
@@ -444,16 +1701,31 @@ SoPointCloud::GLRender(SoGLRenderAction * action)
   }
 
 
-  glBegin(GL_POINTS);
-  for (i = 0; i < numpts; i++) {
-    v = coords->get3(idx+i);
-    float dist = - nearplane.getDistance(v);
-    if (dist > distlimit) {
+  if (usebuffers) {
+    PRIVATE(this)->renderFar(state, contextid, mb, mbind == PER_VERTEX);
+  }
+  else if (strided) {
+    const int32_t step = (numpts + budget - 1) / budget;
+    glBegin(GL_POINTS);
+    for (i = 0; i < numpts; i += step) {
+      v = coords->get3(idx+i);
       if (mbind == PER_VERTEX) mb.send(i, TRUE);
       glVertex3f(v[0], v[1], v[2]);
     }
+    glEnd();
+  }
+  else {
+    glBegin(GL_POINTS);
+    for (i = 0; i < numpts; i++) {
+      v = coords->get3(idx+i);
+      float dist = - nearplane.getDistance(v);
+      if (dist > distlimit) {
+        if (mbind == PER_VERTEX) mb.send(i, TRUE);
+        glVertex3f(v[0], v[1], v[2]);
+      }
+    }
+    glEnd();
   }
-  glEnd();
 
   if (waslightingenabled && !islightingenabled) {
     glEnable(GL_LIGHTING);
@@ -57,6 +57,7 @@ public:
   SoSFInt32 numPoints;
   SoSFFloat detailDistance;
   SoSFFloat itemSize;
+  SoSFInt32 pointBudget;
 
   enum Mode {
     ALWAYS_POINTS,
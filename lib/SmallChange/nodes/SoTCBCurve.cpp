@@ -108,8 +108,17 @@
 
 #include <Inventor/actions/SoGLRenderAction.h>
 #include <Inventor/elements/SoGLCoordinateElement.h>
+#include <Inventor/elements/SoGLCacheContextElement.h>
+#include <Inventor/elements/SoViewportRegionElement.h>
+#include <Inventor/elements/SoViewVolumeElement.h>
+#include <Inventor/elements/SoModelMatrixElement.h>
+#include <Inventor/misc/SoState.h>
 #include <Inventor/SoPrimitiveVertex.h>
+#include <Inventor/SbBox3f.h>
 #include <Inventor/details/SoLineDetail.h>
+#include <Inventor/C/glue/gl.h>
+#include <SmallChange/misc/SbList.h>
+#include <SmallChange/misc/SmVBO.h>
 
 #ifdef __COIN__
 #include <Inventor/system/gl.h>
@@ -120,6 +129,8 @@
 #include <GL/gl.h>
 #endif // SGI/TGS Inventor
 
+#include <math.h>
+
 
 /*!
   \var SoSFInt32 SoTCBCurve::numControlpoints
@@ -131,7 +142,8 @@
 
   The timestamps for the curve. This table must contain either 0
   elements or exactly numControlpoints elements. Nothing in
-  between. This list \e must be sorted in increasing order.
+  between. This list \e must be sorted in increasing order. With no
+  timestamps, the control points are spread uniformly in time.
 */
 
 
@@ -147,11 +159,37 @@ public:
   {
     this->master = master;
     this->linesPerSegment = 0;
+    this->dirty = TRUE;
+    this->coordnodeid = 0;
+    this->vbo = NULL;
+  }
+  ~SoTCBCurveP() {
+    delete this->vbo;
   }
 
   int linesPerSegment;
 
-  int getLinesPerSegment(SoAction * action);
+  // set when the fields change, see SoTCBCurve::notify()
+  SbBool dirty;
+  uint32_t coordnodeid;
+
+  // the control points, and the cubic coefficients of each segment
+  // (a, b, c, d), so that p(t) = ((a * t + b) * t + c) * t + d
+  SbList <SbVec3f> points;
+  SbList <SbVec3f> coefficients;
+  SbList <float> hulllength;
+  SbBox3f bbox;
+
+  // the tessellation, with the number of lines in each segment
+  SbList <int> segmentlines;
+  SbList <SbVec3f> vertices;
+  SmVBO * vbo;
+
+  SbBool update(SoAction * action);
+  SbBool updateSegments(SoState * state);
+  void updateLines(SoAction * action);
+  void computeLines(SoAction * action, SbList <int> & lines);
+  SbVec3f evaluate(const int segment, const float t) const;
 
 private:
   SoTCBCurve * master;
@@ -196,11 +234,11 @@ SoTCBCurve::GLRender(SoGLRenderAction *action)
   SoState * state = action->getState();
   if (!this->shouldGLRender(action)) return;
 
-  if (this->numControlpoints.getValue() < 2) return;
-
-  const SoCoordinateElement *coordElement= SoCoordinateElement::getInstance(state);
-  const SbVec3f * coords = coordElement->getArrayPtr3();
-
+  // The curve is tessellated into a line strip which is kept until
+  // the control points, the timestamps or the number of lines
+  // change. Mark that this baby guarantees the curve always touches
+  // perfectly all controlpoints (avoiding floating point errors)
+  if (!PRIVATE(this)->update(action)) return;
 
   //---- Rendering...
 
@@ -209,39 +247,40 @@ SoTCBCurve::GLRender(SoGLRenderAction *action)
   // any examples or reasonable text in that stupid book. This is
   // probably trivial for the other guys here. 20020612 torbjorv
 
-  // Renders each curvesegment as [complexity*100] lines, using a
-  // for-loop. Mark that this baby guarantees the curve always touches
-  // perfectly all controlpoints (avoiding floating point errors)
-  PRIVATE(this)->linesPerSegment = PRIVATE(this)->getLinesPerSegment(action);
-  if (PRIVATE(this)->linesPerSegment == 0) { return; }
+  const int num = PRIVATE(this)->vertices.getLength();
+  const SbVec3f * ptr = PRIVATE(this)->vertices.getArrayPtr();
+  const uint32_t contextid = action->getCacheContext();
+  const cc_glglue * glue = cc_glglue_instance((int) contextid);
 
   glColor3f(1.0, 1.0, 1.0);
   glDisable(GL_LIGHTING);
-  glBegin(GL_LINE_STRIP);
-
-  glVertex3f(coords[0][0], coords[0][1], coords[0][2]);
-  for (int segment = 0; segment < this->numControlpoints.getValue() - 1; segment++) {
-
-    // FIXME: should handle timestamp.getNum()==0 as a special case,
-    // and just distribute timevalues uniformly. 20030108 mortene.
-    assert(segment + 1 < this->timestamp.getNum());
-
-    float timestep = (float) (this->timestamp[segment + 1] - this->timestamp[segment]).getValue()/PRIVATE(this)->linesPerSegment;
-    float time = (float) this->timestamp[segment].getValue() + timestep;
-    SbVec3f vec;
 
-    // FIXME: investigate what happens if linesPerSegment==1. 20030109 mortene.
-    for (int i = 0; i < PRIVATE(this)->linesPerSegment - 1; i++) {
-      SoTCBCurve::TCB(coords, this->timestamp, this->numControlpoints.getValue(), time, vec);
-      glVertex3f(vec[0], vec[1], vec[2]);
-
-      time += timestep;
+  if (cc_glglue_has_vertex_array(glue)) {
+    const SbBool usevbo = cc_glglue_has_vertex_buffer_object(glue) &&
+      SmVBO::shouldCreateVBO(contextid, num);
+    if (usevbo) {
+      if (PRIVATE(this)->vbo == NULL) {
+        PRIVATE(this)->vbo = new SmVBO(GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+        PRIVATE(this)->vbo->setBufferData(ptr, num * sizeof(SbVec3f));
+      }
+      PRIVATE(this)->vbo->bindBuffer(contextid);
+      ptr = NULL;
     }
-
-    glVertex3f(coords[segment + 1][0], coords[segment + 1][1], coords[segment + 1][2]);
+    cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0, (GLvoid*) ptr);
+    cc_glglue_glEnableClientState(glue, GL_VERTEX_ARRAY);
+    cc_glglue_glDrawArrays(glue, GL_LINE_STRIP, 0, num);
+    cc_glglue_glDisableClientState(glue, GL_VERTEX_ARRAY);
+    if (usevbo) cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, 0);
+    SoGLCacheContextElement::shouldAutoCache(state, SoGLCacheContextElement::DONT_AUTO_CACHE);
+  }
+  else {
+    glBegin(GL_LINE_STRIP);
+    for (int i = 0; i < num; i++) {
+      glVertex3f(ptr[i][0], ptr[i][1], ptr[i][2]);
+    }
+    glEnd();
   }
 
-  glEnd();
   glEnable(GL_LIGHTING);
 }
 
@@ -249,11 +288,7 @@ SoTCBCurve::GLRender(SoGLRenderAction *action)
 void
 SoTCBCurve::generatePrimitives(SoAction * action)
 {
-  SoState * state = action->getState();
-
-  const SoCoordinateElement *coordElement= SoCoordinateElement::getInstance(state);
-  const SbVec3f * coords = coordElement->getArrayPtr3();
-
+  if (!PRIVATE(this)->update(action)) return;
 
   //---- Generating...
 
@@ -267,46 +302,30 @@ SoTCBCurve::generatePrimitives(SoAction * action)
 
   this->beginShape(action, SoShape::LINE_STRIP, &lineDetail);
 
-  // Generates each curvesegment as [resolution] lines using a for-loop. Mark
-  // that this baby guarantees the curve always touches perfectly all controlpoints
-  // (avoiding floating point errors)
+  // Generates the same line strip as GLRender(), with the line index
+  // set to the segment and the part index to the line in the segment
 
   SoPrimitiveVertex pv;
-  SbVec3f point;
-  point.setValue(coords[0][0], coords[0][1], coords[0][2]);
-  pv.setPoint(point);
+  const SbVec3f * vertices = PRIVATE(this)->vertices.getArrayPtr();
+  pv.setPoint(*vertices++);
   pv.setDetail(&pointDetail);
   this->shapeVertex(&pv);
 
-  if (this->numControlpoints.getValue() > 1)
-    for (int segment = 0; segment < this->numControlpoints.getValue() - 1; segment++) {
-
-      // FIXME: should handle timestamp.getNum()==0 as a special
-      // case. 20030108 mortene.
-      assert(segment + 1 < this->timestamp.getNum());
-
-      float timestep = (float) (this->timestamp[segment + 1] - this->timestamp[segment]).getValue()/PRIVATE(this)->linesPerSegment;
-      float time = (float) this->timestamp[segment].getValue() + timestep;
-      SbVec3f vec;
-
-      for (int i = 0; i < PRIVATE(this)->linesPerSegment - 1; i++) {
-        SoTCBCurve::TCB(coords, this->timestamp, this->numControlpoints.getValue(), time, vec);
-        point.setValue(vec[0], vec[1], vec[2]);
-
-        pv.setPoint(point);
-        this->shapeVertex(&pv);
-        lineDetail.incPartIndex();
-
-        time += timestep;
-      }
-
-      point.setValue(coords[segment + 1][0], coords[segment + 1][1], coords[segment + 1][2]);
-      pv.setPoint(point);
+  const int numsegments = PRIVATE(this)->segmentlines.getLength();
+  for (int segment = 0; segment < numsegments; segment++) {
+    const int lines = PRIVATE(this)->segmentlines[segment];
+    for (int i = 0; i < lines - 1; i++) {
+      pv.setPoint(*vertices++);
       this->shapeVertex(&pv);
-      lineDetail.incLineIndex();
-      lineDetail.setPartIndex(0);
+      lineDetail.incPartIndex();
     }
 
+    pv.setPoint(*vertices++);
+    this->shapeVertex(&pv);
+    lineDetail.incLineIndex();
+    lineDetail.setPartIndex(0);
+  }
+
   this->endShape();
 }
 
@@ -314,47 +333,20 @@ SoTCBCurve::generatePrimitives(SoAction * action)
 void
 SoTCBCurve::computeBBox(SoAction *action, SbBox3f &box, SbVec3f &center)
 {
-  /*
-    I'm not sure how accurate such a boundingbox must be, as this
-    could be implemented very fast by using the controlpoints. But the
-    curve will most likely run outside this box. 20020613 torbjorv
-  */
-
-  // FIXME: the checks for when to _not_ compute a bbox below should
-  // be copied to generatePrimitives() and GLRender(). 20030109 mortene.
-
-  if (this->numControlpoints.getValue() == 0) return;
-
-  SoState * state = action->getState();
-  const SoCoordinateElement * coordElement = SoCoordinateElement::getInstance(state);
-  if ((coordElement == NULL) || (coordElement->getNum() == 0)) return;
-  assert(this->numControlpoints.getValue() <= coordElement->getNum());
-
-  // FIXME: should handle timestamp.getNum()==0 as a special
-  // case. 20030108 mortene.
-  assert(this->timestamp.getNum() == this->numControlpoints.getValue());
-
-  const SbVec3f * coords = coordElement->getArrayPtr3();
-
-  box.extendBy(coords[0]);
-
-  for (int segment = 0; segment < this->numControlpoints.getValue() - 1; segment++) {
-    float timestep = (float) (this->timestamp[segment + 1] - this->timestamp[segment]).getValue()/PRIVATE(this)->linesPerSegment;
-    float time = (float) this->timestamp[segment].getValue() + timestep;
-    SbVec3f vec;
-
-    for (int i = 0; i < PRIVATE(this)->linesPerSegment - 1; i++) {
-      SoTCBCurve::TCB(coords, this->timestamp, this->numControlpoints.getValue(), time, vec);
-      box.extendBy(vec);
-      time += timestep;
-    }
-
-    box.extendBy(coords[segment + 1]);
-  }
+  // The box is computed exactly from the extremal points of each
+  // cubic segment, so it does not depend on the tessellation.
+  if (!PRIVATE(this)->updateSegments(action->getState())) return;
 
+  box.extendBy(PRIVATE(this)->bbox);
   center = box.getCenter();
+}
 
-  return;
+// Doc from parent class.
+void
+SoTCBCurve::notify(SoNotList * list)
+{
+  PRIVATE(this)->dirty = TRUE;
+  inherited::notify(list);
 }
 
 /*!
@@ -381,14 +373,18 @@ SoTCBCurve::TCB(const SbVec3f * vec, const SoMFTime &timestamp,
     return;
   }
 
-  //---- Find segment...
-  int k = -1;
-  for (int i = 0; i < numControlpoints - 1; i++) {
-    if (timestamp[i] <= time) k++;
+  //---- Find segment, the last one starting at or before time...
+  int k = 0;
+  int hi = numControlpoints - 2;
+  while (k < hi) {
+    const int mid = (k + hi + 1) / 2;
+    if (timestamp[mid] <= time) k = mid;
+    else hi = mid - 1;
   }
 
   //---- Calculating t = (T - T0)/(T1 - T0)
   float t = (float) ((time - timestamp[k])/(timestamp[k + 1] - timestamp[k]));
+  t = SbClamp(t, 0.0f, 1.0f);
 
   //---- Calculating curve-location.
 
@@ -427,8 +423,10 @@ SoTCBCurve::TCB(const SbVec3f * vec, const SoMFTime &timestamp,
 }
 
 /*!
-  Returns an integer with the number of lines per segment rendered at
-  the previous pass.
+  Returns the largest number of lines used for a segment at the
+  previous pass.
+
+  \sa getLinesPerSegment(const int)
 */
 int
 SoTCBCurve::getLinesPerSegment(void)
@@ -439,13 +437,215 @@ SoTCBCurve::getLinesPerSegment(void)
 }
 
 /*!
-  Returns an integer with the number of lines per segment to render.
+  Returns the number of lines used for \a segment at the previous
+  pass. The number of lines varies between segments, depending on
+  their size on screen.
 */
 int
-SoTCBCurveP::getLinesPerSegment(SoAction * action)
+SoTCBCurve::getLinesPerSegment(const int segment)
+{
+  if (segment < 0 || segment >= PRIVATE(this)->segmentlines.getLength()) {
+    return PRIVATE(this)->linesPerSegment;
+  }
+  return PRIVATE(this)->segmentlines[segment];
+}
+
+#undef PRIVATE
+
+// *************************************************************************
+
+//
+// Updates the segments and the tessellation. Returns FALSE if there
+// is nothing to draw.
+//
+SbBool
+SoTCBCurveP::update(SoAction * action)
+{
+  if (!this->updateSegments(action->getState())) return FALSE;
+  this->updateLines(action);
+  return this->vertices.getLength() > 0;
+}
+
+//
+// Computes the coefficients and the bounding box of each segment, if
+// the control points or the fields have changed since the last
+// time. Returns FALSE if there are fewer than two control points.
+//
+SbBool
+SoTCBCurveP::updateSegments(SoState * state)
+{
+  const SoCoordinateElement * coordElement = SoCoordinateElement::getInstance(state);
+  if (coordElement == NULL) return FALSE;
+
+  const int num = SbMin((int) PUBLIC(this)->numControlpoints.getValue(),
+                        coordElement->getNum());
+  if (!this->dirty &&
+      (coordElement->getNodeId() == this->coordnodeid) &&
+      (num == this->points.getLength())) {
+    return num >= 2;
+  }
+  this->dirty = FALSE;
+  this->coordnodeid = coordElement->getNodeId();
+
+  this->points.truncate(0);
+  this->coefficients.truncate(0);
+  this->hulllength.truncate(0);
+  this->segmentlines.truncate(0);
+  this->vertices.truncate(0);
+  this->bbox.makeEmpty();
+  this->linesPerSegment = 0;
+
+  int i;
+  for (i = 0; i < num; i++) this->points.append(coordElement->get3(i));
+  if (num < 2) return FALSE;
+
+  // with too few timestamps, the control points are spread uniformly
+  const SoMFTime & timestamp = PUBLIC(this)->timestamp;
+  const SbBool uniform = timestamp.getNum() < num;
+#define TCB_TIME(idx) (uniform ? double(idx) : timestamp[idx].getValue())
+
+  const SbVec3f * p = this->points.getArrayPtr();
+  for (i = 0; i < num - 1; i++) {
+    // the tangents are the same as in SoTCBCurve::TCB()
+    const SbVec3f d10 = p[i + 1] - p[i];
+    const double dt = TCB_TIME(i + 1) - TCB_TIME(i);
+    SbVec3f dd0 = d10, ds1 = d10;
+    if (i > 0) {
+      const float adj = (float) (dt / (TCB_TIME(i + 1) - TCB_TIME(i - 1)));
+      dd0 = adj * (p[i] - p[i - 1] + d10);
+    }
+    if (i + 2 < num) {
+      const float adj = (float) (dt / (TCB_TIME(i + 2) - TCB_TIME(i)));
+      ds1 = adj * (p[i + 2] - p[i + 1] + d10);
+    }
+
+    // the Hermite basis functions expanded into a cubic polynomial
+    const SbVec3f a = 2.0f * p[i] - 2.0f * p[i + 1] + dd0 + ds1;
+    const SbVec3f b = 3.0f * p[i + 1] - 3.0f * p[i] - 2.0f * dd0 - ds1;
+    this->coefficients.append(a);
+    this->coefficients.append(b);
+    this->coefficients.append(dd0);
+    this->coefficients.append(p[i]);
+
+    // the length of the Bezier control polygon bounds the length of
+    // the segment, and is used to distribute the lines
+    const SbVec3f c1 = p[i] + dd0 / 3.0f;
+    const SbVec3f c2 = p[i + 1] - ds1 / 3.0f;
+    this->hulllength.append((c1 - p[i]).length() + (c2 - c1).length() +
+                            (p[i + 1] - c2).length());
+
+    // extend the box by the end points and the points where the
+    // derivative 3at^2 + 2bt + c is zero
+    this->bbox.extendBy(p[i]);
+    for (int j = 0; j < 3; j++) {
+      const float qa = 3.0f * a[j];
+      const float qb = 2.0f * b[j];
+      const float qc = dd0[j];
+      float roots[2];
+      int numroots = 0;
+      if (fabs(qa) < 1.0e-12f) {
+        if (fabs(qb) > 1.0e-12f) roots[numroots++] = -qc / qb;
+      }
+      else {
+        const float disc = qb * qb - 4.0f * qa * qc;
+        if (disc >= 0.0f) {
+          const float sq = (float) sqrt(disc);
+          roots[numroots++] = (-qb + sq) / (2.0f * qa);
+          roots[numroots++] = (-qb - sq) / (2.0f * qa);
+        }
+      }
+      for (int r = 0; r < numroots; r++) {
+        if (roots[r] > 0.0f && roots[r] < 1.0f) {
+          this->bbox.extendBy(this->evaluate(i, roots[r]));
+        }
+      }
+    }
+  }
+  this->bbox.extendBy(p[num - 1]);
+#undef TCB_TIME
+  return TRUE;
+}
+
+//
+// Regenerates the tessellation if the number of lines in any segment
+// has changed.
+//
+void
+SoTCBCurveP::updateLines(SoAction * action)
+{
+  SbList <int> lines(this->coefficients.getLength() / 4);
+  this->computeLines(action, lines);
+  if ((lines == this->segmentlines) && (this->vertices.getLength() > 0)) return;
+
+  this->segmentlines = lines;
+  this->vertices.truncate(0);
+  this->linesPerSegment = 0;
+  const int numsegments = lines.getLength();
+  if (numsegments == 0) return;
+
+  this->vertices.append(this->points[0]);
+  for (int segment = 0; segment < numsegments; segment++) {
+    const int n = lines[segment];
+    const float step = 1.0f / float(n);
+    for (int i = 1; i < n; i++) {
+      this->vertices.append(this->evaluate(segment, float(i) * step));
+    }
+    this->vertices.append(this->points[segment + 1]);
+    if (n > this->linesPerSegment) this->linesPerSegment = n;
+  }
+  if (this->vbo) {
+    this->vbo->setBufferData(this->vertices.getArrayPtr(),
+                             this->vertices.getLength() * sizeof(SbVec3f));
+  }
+}
+
+//
+// Finds the number of lines to use for each segment. When the view
+// is known, the segments are given lines based on their size on
+// screen, about one line per 2 / complexity pixels. The screen size
+// is rounded up to a power of two so that the tessellation only
+// changes when the curve is zoomed in or out by a factor of two. The
+// old complexity * 100 lines per segment is the upper limit.
+//
+void
+SoTCBCurveP::computeLines(SoAction * action, SbList <int> & lines)
 {
-  // FIXME: the magic number (100.0f) should really be replaced with
-  // something based on the screen space the curve occupies
-  // instead. 20030109 mortene.
-  return (int)(PUBLIC(this)->getComplexityValue(action) * 100.0f);
+  const float complexity = PUBLIC(this)->getComplexityValue(action);
+  const int maxlines = (int) (complexity * 100.0f);
+  if (maxlines <= 0) return;
+
+  const int numsegments = this->hulllength.getLength();
+  SoState * state = action->getState();
+  if (!state->isElementEnabled(SoViewportRegionElement::getClassStackIndex()) ||
+      !state->isElementEnabled(SoViewVolumeElement::getClassStackIndex()) ||
+      !state->isElementEnabled(SoModelMatrixElement::getClassStackIndex())) {
+    for (int i = 0; i < numsegments; i++) lines.append(maxlines);
+    return;
+  }
+
+  SbVec2s rectsize;
+  SoTCBCurve::getScreenSize(state, this->bbox, rectsize);
+  const int pixels = SbMax((int) rectsize[0], (int) rectsize[1]);
+  int quantized = 1;
+  while (quantized < pixels) quantized <<= 1;
+
+  float size = this->bbox.getMax()[0] - this->bbox.getMin()[0];
+  size = SbMax(size, this->bbox.getMax()[1] - this->bbox.getMin()[1]);
+  size = SbMax(size, this->bbox.getMax()[2] - this->bbox.getMin()[2]);
+  const float linesperunit = (size > 0.0f) ?
+    float(quantized) / size * complexity * 0.5f : 0.0f;
+
+  for (int i = 0; i < numsegments; i++) {
+    const int n = (int) ceil(this->hulllength[i] * linesperunit);
+    lines.append(SbClamp(n, 1, maxlines));
+  }
 }
+
+SbVec3f
+SoTCBCurveP::evaluate(const int segment, const float t) const
+{
+  const SbVec3f * c = this->coefficients.getArrayPtr() + segment * 4;
+  return ((c[0] * t + c[1]) * t + c[2]) * t + c[3];
+}
+
+#undef PUBLIC
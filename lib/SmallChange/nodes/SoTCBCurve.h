@@ -55,6 +55,7 @@ public:
   SoTCBCurve(void);
 
   int getLinesPerSegment(void);
+  int getLinesPerSegment(const int segment);
 
   static void TCB(const SbVec3f * vec, const SoMFTime & timestamp,
                   const int numControlpoints, const SbTime time, SbVec3f &res);
@@ -65,6 +66,7 @@ protected:
   virtual void GLRender(SoGLRenderAction * action);
   virtual void generatePrimitives(SoAction * action);
   virtual void computeBBox(SoAction * action, SbBox3f & box, SbVec3f & center);
+  virtual void notify(SoNotList * list);
 
 private:
   friend class SoTCBCurveP;
@@ -34,6 +34,11 @@
   \class SmVertexArrayShape
   \brief The SmVertexArrayShape class us used to render using OpenGL vertex arrays (and soon vertex buffer objects).
 
+  When rendering with vertex buffer objects, an array is uploaded
+  again whenever its node changes. Use markDirtyRange() before
+  editing a node to upload only the edited range. The buffer usage
+  hint for each array is picked from how often it has been updated
+  recently.
 */
 
 #include <SmallChange/nodes/SmVertexArrayShape.h>
@@ -65,6 +70,7 @@
 #include <Inventor/SbDict.h>
 #include <Inventor/details/SoFaceDetail.h>
 #include <Inventor/C/tidbits.h>
+#include <SmallChange/misc/SmVBO.h>
 #include <cstdlib>
 
 #include <cassert>
@@ -97,11 +103,15 @@ public:
   // needed when vertex buffer objects are used
   SbBool indexlistdirty;
   SbBool onlyoneindexlist;
+  SbBool shortindices;        // index VBO holds 16 bit indices
   SbBool indexvbodirty;
-  SbBool coordarraydirty;
-  SbBool normalarraydirty;
-  SbBool texcoordarraydirty;
-  SbBool colorarraydirty;
+  // the rest are indexed by SmVertexArrayShape::VertexArray
+  SbBool arraydirty[4];       // the whole array must be uploaded
+  int dirtystart[4];          // element range from markDirtyRange()
+  int dirtyend[4];
+  int vbosize[4];             // size and usage of the uploaded data
+  GLenum vbousage[4];
+  uint32_t updatehistory[4];  // see SmVBO::getUsageHint()
   SbList <uint32_t> littleendiancolor;
   SbList <int32_t> indexlist;
 
@@ -120,6 +130,10 @@ public:
 
   void updateIndexList(void);
   SbBool updateVBOs(const cc_glglue * glue);
+  SbBool uploadArray(const cc_glglue * glue, const int array, const GLuint vbo,
+                     const GLvoid * data, const int num, const int elemsize);
+  void markArrayDirty(const int array);
+  void clearDirtyRanges(void);
   void initializeVBO(const cc_glglue * glue);
   void setupCurrentContextVBOs(SoState * state);
   void updateLittleEndianList(SoPackedColor * pc);
@@ -143,11 +157,16 @@ SmVertexArrayShape::SmVertexArrayShape()
   PRIVATE(this) = new SmVertexArrayShapeP(this);
   PRIVATE(this)->indexlistdirty = TRUE;
   PRIVATE(this)->onlyoneindexlist = FALSE;
+  PRIVATE(this)->shortindices = FALSE;
   PRIVATE(this)->indexvbodirty = TRUE;
-  PRIVATE(this)->coordarraydirty = TRUE;
-  PRIVATE(this)->normalarraydirty = TRUE;
-  PRIVATE(this)->texcoordarraydirty = TRUE;
-  PRIVATE(this)->colorarraydirty = TRUE;
+  for (int i = 0; i < 4; i++) {
+    PRIVATE(this)->arraydirty[i] = TRUE;
+    PRIVATE(this)->dirtystart[i] = 0x7fffffff;
+    PRIVATE(this)->dirtyend[i] = 0;
+    PRIVATE(this)->vbosize[i] = 0;
+    PRIVATE(this)->vbousage[i] = GL_STATIC_DRAW;
+    PRIVATE(this)->updatehistory[i] = 0;
+  }
   PRIVATE(this)->numtriangles = 0;
   PRIVATE(this)->prevcontextid = 0;
 
@@ -300,98 +319,119 @@ SmVertexArrayShapeP::setupCurrentContextVBOs(SoState * state)
 
 }
 
+//
+// Upload array to vbo if it has changed. Only the range from
+// markDirtyRange() is uploaded, unless the whole array is dirty or
+// the buffer must be reallocated.
+//
 SbBool
-SmVertexArrayShapeP::updateVBOs(const cc_glglue * glue)
+SmVertexArrayShapeP::uploadArray(const cc_glglue * glue, const int array, const GLuint vbo,
+                                 const GLvoid * data, const int num, const int elemsize)
 {
-  SbBool changed = FALSE;
-
-  if (this->coordarraydirty) {
-    SoNode * node = PUBLIC(this)->vertexCoord.getValue();
-    if (node && node->isOfType(SoCoordinate3::getClassTypeId())) {
-      SoCoordinate3 * coord3 = (SoCoordinate3 *) node;
-      cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, this->vertex3vbo);
-      cc_glglue_glBufferData(glue, GL_ARRAY_BUFFER,
-                             coord3->point.getNum() * 3 * sizeof(float),
-                             coord3->point.getValues(0), GL_STATIC_DRAW);
-      changed = TRUE;
-    }
-    else if (node && node->isOfType(SoCoordinate4::getClassTypeId())) {
-      SoCoordinate4 * coord4 = (SoCoordinate4 *) node;
-      cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, this->vertex4vbo);
-      cc_glglue_glBufferData(glue, GL_ARRAY_BUFFER,
-                             coord4->point.getNum() * 4 * sizeof(float),
-                             coord4->point.getValues(0), GL_STATIC_DRAW);
-      changed = TRUE;
+  const SbBool partial = this->dirtyend[array] > this->dirtystart[array];
+  this->updatehistory[array] <<= 1;
+  if (!this->arraydirty[array] && !partial) return FALSE;
+  this->updatehistory[array] |= 1;
+
+  const GLenum usage = SmVBO::getUsageHint(this->updatehistory[array]);
+  const int size = num * elemsize;
+  cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, vbo);
+  if (this->arraydirty[array] || size != this->vbosize[array] ||
+      usage != this->vbousage[array]) {
+    cc_glglue_glBufferData(glue, GL_ARRAY_BUFFER, size, data, usage);
+    this->vbosize[array] = size;
+    this->vbousage[array] = usage;
+  }
+  else {
+    const int start = SbMin(this->dirtystart[array], num);
+    const int end = SbMin(this->dirtyend[array], num);
+    if (end > start) {
+      cc_glglue_glBufferSubData(glue, GL_ARRAY_BUFFER,
+                                start * elemsize, (end - start) * elemsize,
+                                (const char *) data + start * elemsize);
     }
-    this->coordarraydirty = FALSE;
   }
+  this->arraydirty[array] = FALSE;
+  this->dirtystart[array] = 0x7fffffff;
+  this->dirtyend[array] = 0;
+  return TRUE;
+}
 
+SbBool
+SmVertexArrayShapeP::updateVBOs(const cc_glglue * glue)
+{
+  SbBool changed = FALSE;
 
-  if (this->normalarraydirty) {
-    SoNormal * normal = (SoNormal *) PUBLIC(this)->vertexNormal.getValue();
-    cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, this->normalvbo);
-    cc_glglue_glBufferData(glue, GL_ARRAY_BUFFER, normal->vector.getNum() * 3 * sizeof(float),
-                           normal->vector.getValues(0), GL_STATIC_DRAW);
-    changed = TRUE;
-    this->normalarraydirty = FALSE;
+  SoNode * node = PUBLIC(this)->vertexCoord.getValue();
+  if (node && node->isOfType(SoCoordinate3::getClassTypeId())) {
+    SoCoordinate3 * coord3 = (SoCoordinate3 *) node;
+    if (this->uploadArray(glue, SmVertexArrayShape::COORD, this->vertex3vbo,
+                          coord3->point.getValues(0), coord3->point.getNum(),
+                          3 * sizeof(float))) changed = TRUE;
   }
-
-
-  if(this->texcoordarraydirty) {
-    SoNode * node = PUBLIC(this)->vertexTexCoord.getValue();
-    if (node && node->isOfType(SoTextureCoordinate2::getClassTypeId())) {
-      SoTextureCoordinate2 * texcoord2 = (SoTextureCoordinate2 *) node;
-      cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, this->texcoord2vbo);
-      cc_glglue_glBufferData(glue, GL_ARRAY_BUFFER, texcoord2->point.getNum() * 2 * sizeof(float),
-                             texcoord2->point.getValues(0), GL_STATIC_DRAW);
-      changed = TRUE;
-    }
-    else if (node && node->isOfType(SoTextureCoordinate3::getClassTypeId())) {
-      SoTextureCoordinate3 * texcoord3 = (SoTextureCoordinate3 *) node;
-      cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, this->texcoord3vbo);
-      cc_glglue_glBufferData(glue, GL_ARRAY_BUFFER, texcoord3->point.getNum() * 3 * sizeof(float),
-                             texcoord3->point.getValues(0), GL_STATIC_DRAW);
-      changed = TRUE;
-    }
-    this->texcoordarraydirty = FALSE;
+  else if (node && node->isOfType(SoCoordinate4::getClassTypeId())) {
+    SoCoordinate4 * coord4 = (SoCoordinate4 *) node;
+    if (this->uploadArray(glue, SmVertexArrayShape::COORD, this->vertex4vbo,
+                          coord4->point.getValues(0), coord4->point.getNum(),
+                          4 * sizeof(float))) changed = TRUE;
   }
 
-  if (this->colorarraydirty) {
-    SoNode * node = PUBLIC(this)->vertexColor.getValue();
-    if (node && node->isOfType(SoBaseColor::getClassTypeId())) {
-      SoBaseColor * basecolor = (SoBaseColor*) node;
-      cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, this->basecolorvbo);
-      cc_glglue_glVertexPointer(glue, 3, GL_FLOAT, 0, NULL);
-      cc_glglue_glBufferData(glue, GL_ARRAY_BUFFER, basecolor->rgb.getNum() * sizeof(float) * 3,
-                      basecolor->rgb.getValues(0), GL_STATIC_DRAW);
-    }
-    else if (node && node->isOfType(SoPackedColor::getClassTypeId())) {
-      SoPackedColor * packedcolor = (SoPackedColor*) node;
-      cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, this->packedcolorvbo);
-
-      const uint32_t * pcptr = packedcolor->orderedRGBA.getValues(0);
-      if (SmVertexArrayShapeP::is_little_endian) {
-        if (this->littleendiancolor.getLength() == 0) {
-          this->updateLittleEndianList(packedcolor);
-        }
-        pcptr = this->littleendiancolor.getArrayPtr();
-      }
+  node = PUBLIC(this)->vertexNormal.getValue();
+  if (node && node->isOfType(SoNormal::getClassTypeId())) {
+    SoNormal * normal = (SoNormal *) node;
+    if (this->uploadArray(glue, SmVertexArrayShape::NORMAL, this->normalvbo,
+                          normal->vector.getValues(0), normal->vector.getNum(),
+                          3 * sizeof(float))) changed = TRUE;
+  }
 
-      cc_glglue_glBufferData(glue, GL_ARRAY_BUFFER,
-                             packedcolor->orderedRGBA.getNum() * sizeof(uint32_t),
-                             pcptr, GL_STATIC_DRAW);
-      changed = TRUE;
+  node = PUBLIC(this)->vertexTexCoord.getValue();
+  if (node && node->isOfType(SoTextureCoordinate2::getClassTypeId())) {
+    SoTextureCoordinate2 * texcoord2 = (SoTextureCoordinate2 *) node;
+    if (this->uploadArray(glue, SmVertexArrayShape::TEXCOORD, this->texcoord2vbo,
+                          texcoord2->point.getValues(0), texcoord2->point.getNum(),
+                          2 * sizeof(float))) changed = TRUE;
+  }
+  else if (node && node->isOfType(SoTextureCoordinate3::getClassTypeId())) {
+    SoTextureCoordinate3 * texcoord3 = (SoTextureCoordinate3 *) node;
+    if (this->uploadArray(glue, SmVertexArrayShape::TEXCOORD, this->texcoord3vbo,
+                          texcoord3->point.getValues(0), texcoord3->point.getNum(),
+                          3 * sizeof(float))) changed = TRUE;
+  }
 
-    }
-    this->colorarraydirty = FALSE;
+  node = PUBLIC(this)->vertexColor.getValue();
+  if (node && node->isOfType(SoBaseColor::getClassTypeId())) {
+    SoBaseColor * basecolor = (SoBaseColor*) node;
+    if (this->uploadArray(glue, SmVertexArrayShape::COLOR, this->basecolorvbo,
+                          basecolor->rgb.getValues(0), basecolor->rgb.getNum(),
+                          3 * sizeof(float))) changed = TRUE;
+  }
+  else if (node && node->isOfType(SoPackedColor::getClassTypeId())) {
+    SoPackedColor * packedcolor = (SoPackedColor*) node;
+    // littleendiancolor is updated in GLRender()
+    const uint32_t * pcptr = SmVertexArrayShapeP::is_little_endian ?
+      this->littleendiancolor.getArrayPtr() : packedcolor->orderedRGBA.getValues(0);
+    if (this->uploadArray(glue, SmVertexArrayShape::COLOR, this->packedcolorvbo,
+                          pcptr, packedcolor->orderedRGBA.getNum(),
+                          sizeof(uint32_t))) changed = TRUE;
   }
 
   if (this->onlyoneindexlist && this->indexvbodirty) {
+    const int len = this->indexlist[1];
+    const int32_t * src = this->indexlist.getArrayPtr() + 4;
     cc_glglue_glBindBuffer(glue, GL_ELEMENT_ARRAY_BUFFER, this->indexvbo);
-    cc_glglue_glBufferData(glue, GL_ELEMENT_ARRAY_BUFFER,
-                           this->indexlist[1] * sizeof(int32_t),
-                           this->indexlist.getArrayPtr() + 4,
-                           GL_STATIC_DRAW);
+    if (this->shortindices) {
+      SbList <uint16_t> shortlist(len);
+      for (int i = 0; i < len; i++) shortlist.append((uint16_t) src[i]);
+      cc_glglue_glBufferData(glue, GL_ELEMENT_ARRAY_BUFFER,
+                             len * sizeof(uint16_t),
+                             shortlist.getArrayPtr(),
+                             GL_STATIC_DRAW);
+    }
+    else {
+      cc_glglue_glBufferData(glue, GL_ELEMENT_ARRAY_BUFFER,
+                             len * sizeof(int32_t), src,
+                             GL_STATIC_DRAW);
+    }
     this->indexvbodirty = FALSE;
     changed = TRUE;
   }
@@ -457,6 +497,9 @@ SmVertexArrayShape::GLRender(SoGLRenderAction * action)
   if (PRIVATE(this)->indexlistdirty) {
     PRIVATE(this)->updateIndexList();
   }
+  if (packedcolor && SmVertexArrayShapeP::is_little_endian) {
+    PRIVATE(this)->updateLittleEndianList(packedcolor);
+  }
 
   SoMaterialBundle mb(action);
   mb.sendFirst();
@@ -504,9 +547,6 @@ SmVertexArrayShape::GLRender(SoGLRenderAction * action)
       else { // packedcolor
         const uint32_t * pcptr = packedcolor->orderedRGBA.getValues(0);
         if (SmVertexArrayShapeP::is_little_endian) {
-          if (PRIVATE(this)->littleendiancolor.getLength() == 0) {
-            PRIVATE(this)->updateLittleEndianList(packedcolor);
-          }
           pcptr = PRIVATE(this)->littleendiancolor.getArrayPtr();
         }
         cc_glglue_glColorPointer(glue, 4, GL_UNSIGNED_BYTE, 0,
@@ -582,7 +622,9 @@ SmVertexArrayShape::GLRender(SoGLRenderAction * action)
     const int32_t type = *ptr++;
     const int32_t len = *ptr++;
 
-    cc_glglue_glDrawElements(glue, (GLenum) (-type-1), len, GL_UNSIGNED_INT, NULL);
+    cc_glglue_glDrawElements(glue, (GLenum) (-type-1), len,
+                             PRIVATE(this)->shortindices ?
+                             GL_UNSIGNED_SHORT : GL_UNSIGNED_INT, NULL);
     cc_glglue_glBindBuffer(glue, GL_ARRAY_BUFFER, 0); // Reset VBO binding
     cc_glglue_glBindBuffer(glue, GL_ELEMENT_ARRAY_BUFFER, 0); // Reset VBO binding
   }
@@ -618,6 +660,8 @@ SmVertexArrayShape::GLRender(SoGLRenderAction * action)
     SoGLLazyElement::getInstance(state)->reset(state, SoLazyElement::DIFFUSE_MASK);
   }
 
+  PRIVATE(this)->clearDirtyRanges();
+
   SoGLCacheContextElement::shouldAutoCache(state, SoGLCacheContextElement::DONT_AUTO_CACHE);
 
 }
@@ -790,21 +834,66 @@ SmVertexArrayShape::notify(SoNotList * l)
     PRIVATE(this)->indexvbodirty = TRUE;
   }
   else if (f == &this->vertexCoord) {
-    PRIVATE(this)->coordarraydirty = TRUE;
+    PRIVATE(this)->markArrayDirty(COORD);
   }
   else if (f == &this->vertexNormal) {
-    PRIVATE(this)->normalarraydirty = TRUE;
+    PRIVATE(this)->markArrayDirty(NORMAL);
   }
   else if (f == &this->vertexTexCoord) {
-    PRIVATE(this)->texcoordarraydirty = TRUE;
+    PRIVATE(this)->markArrayDirty(TEXCOORD);
   }
   else if (f == &this->vertexColor) {
-    PRIVATE(this)->colorarraydirty = TRUE;
-    PRIVATE(this)->littleendiancolor.truncate(0);
+    PRIVATE(this)->markArrayDirty(COLOR);
   }
   inherited::notify(l);
 }
 
+/*!
+  Tells the node that the next edits of the node in the field for \a
+  array only change the elements from \a start to \a start + \a num
+  - 1. Call this before editing the node. When rendering with vertex
+  buffer objects, only the marked elements are then uploaded, instead
+  of the whole array. Ranges marked between two renders are merged.
+
+  The whole array is uploaded anyway if its number of elements
+  changes.
+*/
+void
+SmVertexArrayShape::markDirtyRange(const VertexArray array, const int start, const int num)
+{
+  if (num <= 0) return;
+  PRIVATE(this)->dirtystart[array] = SbMin(PRIVATE(this)->dirtystart[array], start);
+  PRIVATE(this)->dirtyend[array] = SbMax(PRIVATE(this)->dirtyend[array], start + num);
+}
+
+//
+// Called when the node in the field for array changes. Changes
+// without a range from markDirtyRange() make the whole array dirty.
+//
+void
+SmVertexArrayShapeP::markArrayDirty(const int array)
+{
+  if (this->dirtyend[array] <= this->dirtystart[array]) {
+    this->arraydirty[array] = TRUE;
+    if (array == SmVertexArrayShape::COLOR) this->littleendiancolor.truncate(0);
+  }
+}
+
+//
+// Called after each render. Ranges that were not uploaded, because
+// the node rendered without vertex buffer objects, make the whole
+// array dirty.
+//
+void
+SmVertexArrayShapeP::clearDirtyRanges(void)
+{
+  for (int i = 0; i < 4; i++) {
+    if (this->dirtyend[i] > this->dirtystart[i]) this->arraydirty[i] = TRUE;
+    this->dirtystart[i] = 0x7fffffff;
+    this->dirtyend[i] = 0;
+  }
+}
+
 void
 SmVertexArrayShapeP::updateIndexList(void)
 {
@@ -852,18 +941,32 @@ SmVertexArrayShapeP::updateIndexList(void)
   } while (src < end);
 
   this->onlyoneindexlist = numlists == 1;
+  // the index VBO is only used with a single list, and 16 bit indices
+  // halve its size when the list addresses few enough vertices
+  this->shortindices = this->onlyoneindexlist && this->indexlist[3] < 65536;
 }
 
 void
 SmVertexArrayShapeP::updateLittleEndianList(SoPackedColor * pc)
 {
-  this->littleendiancolor.truncate(0);
-  int n = pc->orderedRGBA.getNum();
+  const int n = pc->orderedRGBA.getNum();
   const uint32_t * src = pc->orderedRGBA.getValues(0);
 
-  for (int i = 0; i < n; i++) {
-    uint32_t t = *src++;
-    this->littleendiancolor.append((t&0xff<<24) | ((t&0xff00)<<8) | ((t&0xff0000)>>8) | (t>>24));
+  int start = 0;
+  int end = n;
+  if (this->littleendiancolor.getLength() == n) {
+    // only the range from markDirtyRange() has changed, if any
+    start = SbMin(this->dirtystart[SmVertexArrayShape::COLOR], n);
+    end = SbMin(this->dirtyend[SmVertexArrayShape::COLOR], n);
+  }
+  else {
+    this->littleendiancolor.truncate(0);
+    for (int i = 0; i < n; i++) this->littleendiancolor.append(0);
+  }
+
+  for (int i = start; i < end; i++) {
+    uint32_t t = src[i];
+    this->littleendiancolor[i] = ((t&0xff)<<24) | ((t&0xff00)<<8) | ((t&0xff0000)>>8) | (t>>24);
   }
 }
 
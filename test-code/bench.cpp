@@ -0,0 +1,700 @@
+/*
+ * Headless micro-benchmark suite for the SmallChange hot paths. Every
+ * benchmark builds a deterministic synthetic scene, runs a fixed
+ * number of iterations (rendered frames or calls), and the results
+ * are written as JSON so that runs can be compared for regressions.
+ *
+ * Usage: smallchange-bench [-o file] [-f filter] [-n iterations]
+ *                          [-s scale] [-w width] [-h height]
+ *
+ *   -o  write the JSON to file instead of stdout
+ *   -f  only run benchmarks whose name contains filter
+ *   -n  iterations per benchmark (default 50)
+ *   -s  scale factor for the scene sizes (default 1.0)
+ *   -w  viewport width (default 1024)
+ *   -h  viewport height (default 768)
+ *
+ * Rendering is done with SoOffscreenRenderer, so the suite runs
+ * without a window system when Coin is built with an OSMesa or EGL
+ * offscreen backend. Otherwise it needs a display, e.g. from
+ * xvfb-run. Render benchmarks are reported as skipped if no GL
+ * context can be created, and the scenery benchmarks if the scenery
+ * library is not available.
+ *
+ * For each benchmark the output has the time per iteration (mean,
+ * min and max), the triangles per second where it makes sense, and
+ * the process peak RSS after the benchmark. The peak RSS only grows,
+ * so run one benchmark per process with -f to get exact numbers.
+ */
+
+#include <Inventor/SoDB.h>
+#include <Inventor/SoOffscreenRenderer.h>
+#include <Inventor/SbTime.h>
+#include <Inventor/SbPlane.h>
+#include <Inventor/actions/SoCallbackAction.h>
+#include <Inventor/actions/SoGLRenderAction.h>
+#include <Inventor/actions/SoGetBoundingBoxAction.h>
+#include <Inventor/actions/SoGetPrimitiveCountAction.h>
+#include <Inventor/nodes/SoSeparator.h>
+#include <Inventor/nodes/SoCoordinate3.h>
+#include <Inventor/nodes/SoPackedColor.h>
+#include <Inventor/nodes/SoMaterialBinding.h>
+#include <Inventor/nodes/SoShapeHints.h>
+#include <Inventor/nodes/SoIndexedFaceSet.h>
+#include <Inventor/nodes/SoPerspectiveCamera.h>
+#include <Inventor/nodes/SoDirectionalLight.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <SmallChange/misc/Init.h>
+#include <SmallChange/misc/SmEnvelope.h>
+#include <SmallChange/actions/SmToVertexArrayShapeAction.h>
+#include <SmallChange/nodekits/SoFEMKit.h>
+#include <SmallChange/nodes/SmScenery.h>
+#include <SmallChange/nodes/SoPointCloud.h>
+#include <SmallChange/nodes/SmMarkerSet.h>
+#include <SmallChange/nodes/SoText2Set.h>
+#include <SmallChange/nodes/SmTextureText2.h>
+#include <SmallChange/nodes/SmTextureText2Collector.h>
+#include <SmallChange/nodes/SoLODExtrusion.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif // !_WIN32
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif // !M_PI
+
+// *************************************************************************
+
+class Bench {
+public:
+  Bench(void) : out(stdout), filter(NULL), iterations(50), scale(1.0f),
+                renderer(NULL), hasgl(FALSE), numresults(0) { }
+
+  FILE * out;
+  const char * filter;
+  int iterations;
+  float scale;
+  SoOffscreenRenderer * renderer;
+  SbBool hasgl;
+  int numresults;
+
+  // timing of the current benchmark
+  double total, mintime, maxtime;
+  int count;
+
+  SbBool wants(const char * name) const {
+    return (this->filter == NULL) || (strstr(name, this->filter) != NULL);
+  }
+  int scaled(const int num) const {
+    const int n = (int) (num * this->scale);
+    return n > 1 ? n : 1;
+  }
+
+  void start(void) {
+    this->total = 0.0;
+    this->mintime = 1.0e30;
+    this->maxtime = 0.0;
+    this->count = 0;
+  }
+  void add(const double t) {
+    this->total += t;
+    if (t < this->mintime) this->mintime = t;
+    if (t > this->maxtime) this->maxtime = t;
+    this->count++;
+  }
+
+  void report(const char * name, const double items, const double triangles);
+  void skip(const char * name, const char * reason);
+};
+
+static long
+peak_rss_kb(void)
+{
+#ifdef _WIN32
+  return -1;
+#else // !_WIN32
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0) return -1;
+#ifdef __APPLE__
+  return (long) (ru.ru_maxrss / 1024); // bytes on macOS
+#else // !__APPLE__
+  return (long) ru.ru_maxrss;
+#endif // !__APPLE__
+#endif // !_WIN32
+}
+
+// items is the number of objects in the scene, and triangles the
+// number of triangles per iteration, or 0 if not relevant
+void
+Bench::report(const char * name, const double items, const double triangles)
+{
+  const double mean = this->count ? this->total / this->count : 0.0;
+  fprintf(this->out,
+          "%s    { \"name\": \"%s\", \"iterations\": %d, \"items\": %.0f,\n"
+          "      \"time_ms\": %.4f, \"time_ms_min\": %.4f, \"time_ms_max\": %.4f,\n"
+          "      \"triangles_per_second\": %.0f, \"peak_rss_kb\": %ld }",
+          this->numresults ? ",\n" : "", name, this->count, items,
+          mean * 1000.0, this->count ? this->mintime * 1000.0 : 0.0,
+          this->maxtime * 1000.0,
+          mean > 0.0 ? triangles / mean : 0.0, peak_rss_kb());
+  this->numresults++;
+  fprintf(stderr, "%-22s %10.3f ms\n", name, mean * 1000.0);
+}
+
+void
+Bench::skip(const char * name, const char * reason)
+{
+  fprintf(this->out, "%s    { \"name\": \"%s\", \"skipped\": \"%s\" }",
+          this->numresults ? ",\n" : "", name, reason);
+  this->numresults++;
+  fprintf(stderr, "%-22s skipped, %s\n", name, reason);
+}
+
+// *************************************************************************
+
+// a small LCG, so that the scenes are the same on all platforms
+static uint32_t bench_seed = 1;
+
+static float
+bench_random(void)
+{
+  bench_seed = bench_seed * 1664525u + 1013904223u;
+  return float(bench_seed >> 8) * (1.0f / 16777216.0f);
+}
+
+static float
+terrain_height(const float x, const float y)
+{
+  return 50.0f * sinf(x * 0.01f) * cosf(y * 0.013f) + 10.0f * sinf(x * 0.07f + y * 0.05f);
+}
+
+static SoSeparator *
+make_root(SoPerspectiveCamera *& camera)
+{
+  SoSeparator * root = new SoSeparator;
+  root->ref();
+  camera = new SoPerspectiveCamera;
+  root->addChild(camera);
+  root->addChild(new SoDirectionalLight);
+  return root;
+}
+
+// moves the camera around the scene bounding box, one step per frame
+static void
+orbit_camera(SoPerspectiveCamera * camera, const SbBox3f & box,
+             const int frame, const int frames)
+{
+  const SbVec3f center = box.getCenter();
+  float dx, dy, dz;
+  box.getSize(dx, dy, dz);
+  const float radius = SbMax(SbMax(dx, dy), dz) * 0.8f + 1.0f;
+  const float angle = float(frame) / float(frames) * 2.0f * float(M_PI);
+  camera->position = center + SbVec3f(cosf(angle) * radius, sinf(angle) * radius, radius * 0.6f);
+  camera->pointAt(center, SbVec3f(0.0f, 0.0f, 1.0f));
+  camera->nearDistance = radius * 0.01f;
+  camera->farDistance = radius * 4.0f;
+}
+
+static SbBox3f
+scene_box(SoNode * root)
+{
+  SoGetBoundingBoxAction bba(SbViewportRegion(100, 100));
+  bba.apply(root);
+  return bba.getBoundingBox();
+}
+
+static double
+count_triangles(SoNode * root)
+{
+  SoGetPrimitiveCountAction pca;
+  pca.apply(root);
+  return (double) pca.getTriangleCount();
+}
+
+// renders frames while orbiting the camera, after one frame for
+// uploads and caches
+static void
+render_orbit(Bench & b, SoSeparator * root, SoPerspectiveCamera * camera)
+{
+  const SbBox3f box = scene_box(root);
+  orbit_camera(camera, box, 0, b.iterations);
+  b.renderer->render(root);
+
+  b.start();
+  for (int i = 0; i < b.iterations; i++) {
+    orbit_camera(camera, box, i, b.iterations);
+    SbTime start = SbTime::getTimeOfDay();
+    b.renderer->render(root); // reads back the pixels, so GL is done
+    b.add((SbTime::getTimeOfDay() - start).getValue());
+  }
+}
+
+// a grid of quads as an indexed face set, with each quad as a polygon
+static SoSeparator *
+make_grid(const int n, const float x0, const float y0)
+{
+  SoSeparator * sep = new SoSeparator;
+  SoShapeHints * sh = new SoShapeHints;
+  sh->vertexOrdering = SoShapeHints::COUNTERCLOCKWISE;
+  sh->creaseAngle = 0.5f;
+  sep->addChild(sh);
+
+  const int stride = n + 1;
+  SoCoordinate3 * coords = new SoCoordinate3;
+  coords->point.setNum(stride * stride);
+  SbVec3f * pts = coords->point.startEditing();
+  for (int y = 0; y <= n; y++) {
+    for (int x = 0; x <= n; x++) {
+      const float px = x0 + float(x);
+      const float py = y0 + float(y);
+      pts[y * stride + x].setValue(px, py, terrain_height(px, py));
+    }
+  }
+  coords->point.finishEditing();
+
+  SoIndexedFaceSet * ifs = new SoIndexedFaceSet;
+  ifs->coordIndex.setNum(n * n * 5);
+  int32_t * idx = ifs->coordIndex.startEditing();
+  for (int y = 0; y < n; y++) {
+    for (int x = 0; x < n; x++) {
+      *idx++ = y * stride + x;
+      *idx++ = y * stride + x + 1;
+      *idx++ = (y + 1) * stride + x + 1;
+      *idx++ = (y + 1) * stride + x;
+      *idx++ = -1;
+    }
+  }
+  ifs->coordIndex.finishEditing();
+  sep->addChild(coords);
+  sep->addChild(ifs);
+  return sep;
+}
+
+// *************************************************************************
+
+static void
+bench_scenery(Bench & b)
+{
+  const SbBool evaluate = b.wants("scenery_evaluate");
+  const SbBool render = b.wants("scenery_render");
+  if (!evaluate && !render) return;
+
+  const int n = b.scaled(2048) + 1;
+  double origo[2] = { 0.0, 0.0 };
+  double spacing[2] = { 5.0, 5.0 };
+  int elements[2] = { n, n };
+  std::vector<float> values(n * n);
+  for (int y = 0; y < n; y++) {
+    for (int x = 0; x < n; x++) {
+      values[y * n + x] = terrain_height(float(x * spacing[0]), float(y * spacing[1]));
+    }
+  }
+  SmScenery * scenery = SmScenery::createInstance(origo, spacing, elements, &values[0]);
+  if (scenery == NULL) {
+    if (evaluate) b.skip("scenery_evaluate", "scenery library not available");
+    if (render) b.skip("scenery_render", "scenery library not available");
+    return;
+  }
+
+  SoPerspectiveCamera * camera;
+  SoSeparator * root = make_root(camera);
+  root->addChild(scenery);
+
+  // a low fly-over, as in a navigation application
+  const float size = float(n * spacing[0]);
+  SoCallbackAction cba(b.renderer->getViewportRegion());
+  cba.addPreCallback(SmScenery::getClassTypeId(), SmScenery::evaluateS, NULL);
+  const uint32_t contextid = b.renderer->getGLRenderAction()->getCacheContext();
+
+  std::vector<double> evaltimes;
+  std::vector<double> rendertimes;
+  for (int i = -1; i < b.iterations; i++) {
+    const float t = float(SbMax(i, 0)) / float(b.iterations);
+    const SbVec3f pos(size * (0.1f + 0.8f * t), size * 0.5f, 300.0f);
+    camera->position = pos;
+    camera->pointAt(pos + SbVec3f(size * 0.1f, 0.0f, -150.0f), SbVec3f(0.0f, 0.0f, 1.0f));
+    camera->nearDistance = 1.0f;
+    camera->farDistance = size;
+
+    SbTime start = SbTime::getTimeOfDay();
+    cba.apply(root);
+    const double evaltime = (SbTime::getTimeOfDay() - start).getValue();
+
+    start = SbTime::getTimeOfDay();
+    if (render) {
+      scenery->preFrame(contextid);
+      b.renderer->render(root);
+      (void) scenery->postFrame(contextid);
+    }
+    const double rendertime = (SbTime::getTimeOfDay() - start).getValue();
+    if (i >= 0) { // the first frame loads the blocks
+      evaltimes.push_back(evaltime);
+      rendertimes.push_back(rendertime);
+    }
+  }
+
+  size_t i;
+  if (evaluate) {
+    b.start();
+    for (i = 0; i < evaltimes.size(); i++) b.add(evaltimes[i]);
+    b.report("scenery_evaluate", double(n) * double(n), 0.0);
+  }
+  if (render) {
+    const double triangles = count_triangles(root);
+    b.start();
+    for (i = 0; i < rendertimes.size(); i++) b.add(rendertimes[i]);
+    b.report("scenery_render", double(n) * double(n), triangles);
+  }
+  root->unref();
+}
+
+static void
+bench_pointcloud(Bench & b)
+{
+  if (!b.wants("pointcloud_render")) return;
+  const int num = b.scaled(2000000);
+  const int cols = (int) sqrt((double) num);
+
+  SoPerspectiveCamera * camera;
+  SoSeparator * root = make_root(camera);
+  SoCoordinate3 * coords = new SoCoordinate3;
+  coords->point.setNum(num);
+  SbVec3f * pts = coords->point.startEditing();
+  for (int i = 0; i < num; i++) {
+    const float x = float(i % cols) + (bench_random() - 0.5f) * 0.5f;
+    const float y = float(i / cols) + (bench_random() - 0.5f) * 0.5f;
+    pts[i].setValue(x, y, terrain_height(x, y) * 0.2f);
+  }
+  coords->point.finishEditing();
+  root->addChild(coords);
+  SoPointCloud * cloud = new SoPointCloud;
+  cloud->detailDistance = 20.0f;
+  cloud->pointBudget = 0;
+  root->addChild(cloud);
+
+  render_orbit(b, root, camera);
+  b.report("pointcloud_render", num, 0.0);
+  root->unref();
+}
+
+static void
+bench_markerset(Bench & b)
+{
+  if (!b.wants("markerset_render")) return;
+  const int num = b.scaled(200000);
+
+  SoPerspectiveCamera * camera;
+  SoSeparator * root = make_root(camera);
+  SoCoordinate3 * coords = new SoCoordinate3;
+  SoPackedColor * colors = new SoPackedColor;
+  SmMarkerSet * markers = new SmMarkerSet;
+  coords->point.setNum(num);
+  colors->orderedRGBA.setNum(num);
+  markers->markerIndex.setNum(num);
+  SbVec3f * pts = coords->point.startEditing();
+  uint32_t * col = colors->orderedRGBA.startEditing();
+  int32_t * idx = markers->markerIndex.startEditing();
+  for (int i = 0; i < num; i++) {
+    const float x = bench_random() * 1000.0f;
+    const float y = bench_random() * 1000.0f;
+    pts[i].setValue(x, y, terrain_height(x, y));
+    col[i] = (uint32_t(bench_random() * 16777215.0f) << 8) | 0xff;
+    idx[i] = SoMarkerSet::CIRCLE_FILLED_7_7 + (i % 3);
+  }
+  coords->point.finishEditing();
+  colors->orderedRGBA.finishEditing();
+  markers->markerIndex.finishEditing();
+  SoMaterialBinding * mb = new SoMaterialBinding;
+  mb->value = SoMaterialBinding::PER_VERTEX;
+  root->addChild(coords);
+  root->addChild(colors);
+  root->addChild(mb);
+  root->addChild(markers);
+
+  render_orbit(b, root, camera);
+  b.report("markerset_render", num, 0.0);
+  root->unref();
+}
+
+static void
+make_labels(const int num, SoMFVec3f & position, SoMFString & string)
+{
+  char buf[32];
+  position.setNum(num);
+  string.setNum(num);
+  SbVec3f * pts = position.startEditing();
+  SbString * str = string.startEditing();
+  for (int i = 0; i < num; i++) {
+    const float x = bench_random() * 1000.0f;
+    const float y = bench_random() * 1000.0f;
+    pts[i].setValue(x, y, terrain_height(x, y));
+    sprintf(buf, "label %d", i);
+    str[i] = buf;
+  }
+  position.finishEditing();
+  string.finishEditing();
+}
+
+static void
+bench_text(Bench & b)
+{
+  const int num = b.scaled(20000);
+  if (b.wants("text2set_render")) {
+    SoPerspectiveCamera * camera;
+    SoSeparator * root = make_root(camera);
+    SoText2Set * text = new SoText2Set;
+    make_labels(num, text->position, text->string);
+    root->addChild(text);
+    render_orbit(b, root, camera);
+    b.report("text2set_render", num, 0.0);
+    root->unref();
+  }
+  if (b.wants("texturetext2_render")) {
+    SoPerspectiveCamera * camera;
+    SoSeparator * root = make_root(camera);
+    SmTextureText2 * text = new SmTextureText2;
+    make_labels(num, text->position, text->string);
+    root->addChild(text);
+    render_orbit(b, root, camera);
+    b.report("texturetext2_render", num, 0.0);
+    root->unref();
+  }
+  if (b.wants("texturetext2_declutter")) {
+    SoPerspectiveCamera * camera;
+    SoSeparator * root = make_root(camera);
+    SmTextureText2Collector * collector = new SmTextureText2Collector;
+    collector->declutter = TRUE;
+    SmTextureText2 * text = new SmTextureText2;
+    make_labels(num, text->position, text->string);
+    collector->addChild(text);
+    root->addChild(collector);
+    render_orbit(b, root, camera);
+    b.report("texturetext2_declutter", num, 0.0);
+    root->unref();
+  }
+}
+
+static void
+bench_lodextrusion(Bench & b)
+{
+  if (!b.wants("lodextrusion_render")) return;
+  const int num = b.scaled(20000);
+
+  SoPerspectiveCamera * camera;
+  SoSeparator * root = make_root(camera);
+  SoLODExtrusion * ext = new SoLODExtrusion;
+  ext->radius = 1.0f;
+  ext->circleSegmentCount = 12;
+  ext->spine.setNum(num);
+  ext->color.setNum(num);
+  SbVec3f * spine = ext->spine.startEditing();
+  SbColor * col = ext->color.startEditing();
+  for (int i = 0; i < num; i++) {
+    // a helix, like a well path
+    const float a = float(i) * 0.01f;
+    spine[i].setValue(cosf(a) * 200.0f, sinf(a) * 200.0f, -float(i) * 0.2f);
+    col[i].setValue(bench_random(), bench_random(), bench_random());
+  }
+  ext->spine.finishEditing();
+  ext->color.finishEditing();
+  root->addChild(ext);
+
+  const SbBox3f box = scene_box(root);
+  float dx, dy, dz;
+  box.getSize(dx, dy, dz);
+  ext->lodDistance1 = SbMax(SbMax(dx, dy), dz) * 0.8f;
+
+  render_orbit(b, root, camera);
+  b.report("lodextrusion_render", num, count_triangles(root));
+  root->unref();
+}
+
+static void
+bench_tovertexarray(Bench & b, const SbBool optimize)
+{
+  const char * name = optimize ? "tovertexarray_optimize" : "tovertexarray";
+  if (!b.wants(name)) return;
+  const int n = b.scaled(512);
+  const double triangles = 2.0 * n * n;
+
+  b.start();
+  for (int i = 0; i < b.iterations; i++) {
+    SoSeparator * root = new SoSeparator;
+    root->ref();
+    root->addChild(make_grid(n, 0.0f, 0.0f));
+    SmToVertexArrayShapeAction tova;
+    tova.setOptimizeVertexCache(optimize);
+    SbTime start = SbTime::getTimeOfDay();
+    tova.apply(root);
+    b.add((SbTime::getTimeOfDay() - start).getValue());
+    root->unref();
+  }
+  b.report(name, triangles, triangles);
+}
+
+static void
+bench_envelope(Bench & b)
+{
+  if (!b.wants("envelope_export")) return;
+  const int grids = 8;
+  const int n = b.scaled(128);
+  const double triangles = 2.0 * n * n * grids * grids;
+
+  SoSeparator * root = new SoSeparator;
+  root->ref();
+  for (int y = 0; y < grids; y++) {
+    for (int x = 0; x < grids; x++) {
+      root->addChild(make_grid(n, float(x * n), float(y * n)));
+    }
+  }
+
+  SmEnvelope envelope;
+  envelope.importScene(root);
+  b.start();
+  for (int i = 0; i < b.iterations; i++) {
+    SbTime start = SbTime::getTimeOfDay();
+    SoNode * result = envelope.getConvertedScene(3);
+    b.add((SbTime::getTimeOfDay() - start).getValue());
+    if (result) {
+      result->ref();
+      result->unref();
+    }
+  }
+  b.report("envelope_export", triangles, triangles);
+  root->unref();
+}
+
+static void
+bench_femkit(Bench & b)
+{
+  if (!b.wants("femkit_update")) return;
+  const int n = b.scaled(40);
+  const int stride = n + 1;
+#define NODEIDX(x, y, z) (((z) * stride + (y)) * stride + (x))
+
+  SoFEMKit * fem = new SoFEMKit;
+  fem->ref();
+  int x, y, z;
+  for (z = 0; z <= n; z++) {
+    for (y = 0; y <= n; y++) {
+      for (x = 0; x <= n; x++) {
+        fem->addNode(NODEIDX(x, y, z), SbVec3f(float(x), float(y), float(z)));
+      }
+    }
+  }
+  int32_t nodes[8];
+  for (z = 0; z < n; z++) {
+    for (y = 0; y < n; y++) {
+      for (x = 0; x < n; x++) {
+        nodes[0] = NODEIDX(x, y, z);
+        nodes[1] = NODEIDX(x, y + 1, z);
+        nodes[2] = NODEIDX(x + 1, y + 1, z);
+        nodes[3] = NODEIDX(x + 1, y, z);
+        nodes[4] = NODEIDX(x, y, z + 1);
+        nodes[5] = NODEIDX(x, y + 1, z + 1);
+        nodes[6] = NODEIDX(x + 1, y + 1, z + 1);
+        nodes[7] = NODEIDX(x + 1, y, z + 1);
+        const int element = (z * n + y) * n + x;
+        fem->add3DElement(element, nodes);
+        fem->setElementColor(element, SbColor(float(x) / n, float(y) / n, float(z) / n));
+      }
+    }
+  }
+#undef NODEIDX
+
+  // sweep a cutting plane through the model. The bounding box action
+  // makes the kit update its scene right away.
+  SoGetBoundingBoxAction bba(SbViewportRegion(100, 100));
+  bba.apply(fem);
+  b.start();
+  for (int i = 0; i < b.iterations; i++) {
+    const float d = float(n) * float(i + 1) / float(b.iterations + 1);
+    SbTime start = SbTime::getTimeOfDay();
+    fem->enableAllElements(TRUE);
+    fem->enableElements(SbPlane(SbVec3f(1.0f, 1.0f, 0.0f), d), FALSE);
+    bba.apply(fem);
+    b.add((SbTime::getTimeOfDay() - start).getValue());
+  }
+  b.report("femkit_update", double(n) * n * n, 0.0);
+  fem->unref();
+}
+
+// *************************************************************************
+
+int
+main(int argc, char ** argv)
+{
+  Bench b;
+  const char * outfile = NULL;
+  int width = 1024, height = 768;
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 < argc && !strcmp(argv[i], "-o")) outfile = argv[++i];
+    else if (i + 1 < argc && !strcmp(argv[i], "-f")) b.filter = argv[++i];
+    else if (i + 1 < argc && !strcmp(argv[i], "-n")) b.iterations = atoi(argv[++i]);
+    else if (i + 1 < argc && !strcmp(argv[i], "-s")) b.scale = (float) atof(argv[++i]);
+    else if (i + 1 < argc && !strcmp(argv[i], "-w")) width = atoi(argv[++i]);
+    else if (i + 1 < argc && !strcmp(argv[i], "-h")) height = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "Usage: smallchange-bench [-o file] [-f filter] [-n iterations] "
+              "[-s scale] [-w width] [-h height]\n");
+      return -1;
+    }
+  }
+  if (b.iterations <= 0 || b.scale <= 0.0f || width <= 0 || height <= 0) {
+    fprintf(stderr, "smallchange-bench: invalid argument\n");
+    return -1;
+  }
+  if (outfile) {
+    b.out = fopen(outfile, "w");
+    if (b.out == NULL) {
+      fprintf(stderr, "smallchange-bench: could not open %s\n", outfile);
+      return -1;
+    }
+  }
+
+  SoDB::init();
+  smallchange_init();
+
+  SoOffscreenRenderer renderer(SbViewportRegion(width, height));
+  b.renderer = &renderer;
+  SoSeparator * empty = new SoSeparator;
+  empty->ref();
+  b.hasgl = renderer.render(empty);
+  empty->unref();
+
+  fprintf(b.out,
+          "{\n  \"benchmark\": \"smallchange-bench\",\n"
+          "  \"viewport\": [ %d, %d ], \"iterations\": %d, \"scale\": %g,\n"
+          "  \"results\": [\n", width, height, b.iterations, b.scale);
+
+  static const char * rendernames[] = {
+    "scenery_evaluate", "scenery_render", "pointcloud_render", "markerset_render",
+    "text2set_render", "texturetext2_render", "texturetext2_declutter",
+    "lodextrusion_render"
+  };
+  if (b.hasgl) {
+    bench_scenery(b);
+    bench_pointcloud(b);
+    bench_markerset(b);
+    bench_text(b);
+    bench_lodextrusion(b);
+  }
+  else {
+    for (unsigned int i = 0; i < sizeof(rendernames) / sizeof(rendernames[0]); i++) {
+      if (b.wants(rendernames[i])) b.skip(rendernames[i], "no offscreen GL context");
+    }
+  }
+  bench_tovertexarray(b, FALSE);
+  bench_tovertexarray(b, TRUE);
+  bench_envelope(b);
+  bench_femkit(b);
+
+  fprintf(b.out, "\n  ]\n}\n");
+  if (outfile) fclose(b.out);
+  return 0;
+}
@@ -0,0 +1,29 @@
+#include <Inventor/SoDB.h>
+#include <SmallChange/misc/SmHeightfield.h>
+#include <cstdio>
+#include <cstdlib>
+
+int main(int argc, char ** argv)
+{
+  if (argc < 3) {
+    (void)fprintf(stderr, "\nUsage: heightfield <xyzfile> <outfile> [tilesize] [undefval]\n");
+    return 1;
+  }
+  const int tilesize = argc > 3 ? atoi(argv[3]) : 256;
+  const float undefval = argc > 4 ? (float) atof(argv[4]) : 999999.0f;
+  SoDB::init();
+
+  if (!SmHeightfield::convertXYZ(argv[1], argv[2], tilesize, undefval)) {
+    return 1;
+  }
+
+  SmHeightfield hf;
+  if (!hf.open(argv[2])) return 1;
+  double origin[2], spacing[2];
+  hf.getOrigin(origin);
+  hf.getSpacing(spacing);
+  (void)fprintf(stdout, "%d x %d elevations, origin (%g, %g), spacing (%g, %g), %d x %d tiles\n",
+                hf.getColumns(), hf.getRows(), origin[0], origin[1],
+                spacing[0], spacing[1], hf.getNumTilesX(), hf.getNumTilesY());
+  return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Benchmark for SoPointCloud rendering. Renders a synthetic sonar
+ * survey of increasing size offscreen, with and without a point
+ * budget, and reports the time per frame.
+ *
+ * Usage: pointcloud [maxpoints] [budget] [frames]
+ *
+ * The cloud sizes are 1M, 2M, 5M, 10M, 20M and 50M points, up to
+ * maxpoints (default 50M). The default budget is 2M points.
+ */
+
+#include <Inventor/SoDB.h>
+#include <Inventor/SoOffscreenRenderer.h>
+#include <Inventor/SbTime.h>
+#include <Inventor/nodes/SoSeparator.h>
+#include <Inventor/nodes/SoCoordinate3.h>
+#include <Inventor/nodes/SoPerspectiveCamera.h>
+#include <Inventor/nodes/SoDirectionalLight.h>
+#include <Inventor/sensors/SoNodeSensor.h>
+#include <Inventor/sensors/SoSensorManager.h>
+#include <Inventor/C/threads/thread.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <SmallChange/misc/Init.h>
+#include <SmallChange/nodes/SoPointCloud.h>
+
+static SbBool lodready = FALSE;
+
+// seconds to wait for an octree before giving up
+static const double lodtimeout = 300.0;
+
+static void
+cloud_touched(void * closure, SoSensor * sensor)
+{
+  lodready = TRUE;
+}
+
+static void
+make_survey(SoCoordinate3 * coords, const int num)
+{
+  const int cols = (int) sqrt((double) num);
+  coords->point.setNum(num);
+  SbVec3f * pts = coords->point.startEditing();
+  for (int i = 0; i < num; i++) {
+    const float x = float(i % cols) + (rand() / float(RAND_MAX) - 0.5f) * 0.5f;
+    const float y = float(i / cols) + (rand() / float(RAND_MAX) - 0.5f) * 0.5f;
+    pts[i].setValue(x, y, -50.0f + 10.0f * sinf(x * 0.01f) * cosf(y * 0.013f));
+  }
+  coords->point.finishEditing();
+}
+
+// renders frames along a fly-over, returns seconds per frame
+static double
+render_frames(SoOffscreenRenderer & renderer, SoSeparator * root,
+              SoPerspectiveCamera * camera, const float size, const int frames)
+{
+  SbTime start = SbTime::getTimeOfDay();
+  for (int i = 0; i < frames; i++) {
+    const float t = float(i) / float(frames);
+    camera->position.setValue(size * t, size * 0.5f, size * 0.05f);
+    camera->pointAt(SbVec3f(size * t + size * 0.2f, size * 0.5f, -50.0f), SbVec3f(0.0f, 0.0f, 1.0f));
+    renderer.render(root);
+  }
+  return (SbTime::getTimeOfDay() - start).getValue() / frames;
+}
+
+int
+main(int argc, char ** argv)
+{
+  const int maxpoints = argc > 1 ? atoi(argv[1]) : 50000000;
+  const int budget = argc > 2 ? atoi(argv[2]) : 2000000;
+  const int frames = argc > 3 ? atoi(argv[3]) : 50;
+
+  SoDB::init();
+  smallchange_init();
+
+  SoOffscreenRenderer renderer(SbViewportRegion(1024, 768));
+  static const int sizes[] = { 1000000, 2000000, 5000000, 10000000, 20000000, 50000000 };
+
+  fprintf(stdout, "%10s %12s %12s %12s %10s\n",
+          "points", "first (ms)", "full (ms)", "budget (ms)", "build (s)");
+  for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] <= maxpoints; s++) {
+    SoSeparator * root = new SoSeparator;
+    root->ref();
+    SoPerspectiveCamera * camera = new SoPerspectiveCamera;
+    camera->nearDistance = 1.0f;
+    camera->farDistance = 20000.0f;
+    root->addChild(camera);
+    root->addChild(new SoDirectionalLight);
+    SoCoordinate3 * coords = new SoCoordinate3;
+    make_survey(coords, sizes[s]);
+    root->addChild(coords);
+    SoPointCloud * cloud = new SoPointCloud;
+    cloud->detailDistance = 20.0f;
+    root->addChild(cloud);
+    const float size = (float) sqrt((double) sizes[s]);
+
+    // all points
+    cloud->pointBudget = 0;
+    (void) render_frames(renderer, root, camera, size, 1); // sort and upload
+    const double full = render_frames(renderer, root, camera, size, frames);
+
+    // with a budget. The node is touched when the octree is ready.
+    lodready = FALSE;
+    SoNodeSensor sensor(cloud_touched, NULL);
+    cloud->pointBudget = budget;
+    SbTime start = SbTime::getTimeOfDay();
+    const double first = render_frames(renderer, root, camera, size, 1);
+    sensor.attach(cloud);
+    while (!lodready && ((SbTime::getTimeOfDay() - start).getValue() < lodtimeout)) {
+      cc_sleep(0.01f);
+      SoDB::getSensorManager()->processTimerQueue();
+      SoDB::getSensorManager()->processDelayQueue(TRUE);
+    }
+    const double build = (SbTime::getTimeOfDay() - start).getValue();
+    sensor.detach();
+    if (!lodready) {
+      fprintf(stderr, "no octree for %d points after %.0f seconds, giving up\n",
+              sizes[s], lodtimeout);
+      root->unref();
+      return 1;
+    }
+    (void) render_frames(renderer, root, camera, size, 1); // upload
+    const double lod = render_frames(renderer, root, camera, size, frames);
+
+    fprintf(stdout, "%10d %12.2f %12.2f %12.2f %10.2f\n",
+            sizes[s], first * 1000.0, full * 1000.0, lod * 1000.0, build);
+    root->unref();
+  }
+  return 0;
+}
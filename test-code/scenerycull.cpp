@@ -0,0 +1,166 @@
+/*
+ * Micro-benchmark for the scenery quadtree culling test. Compares the
+ * original eight-corner test (sc_cull_box_corners) with the
+ * centre/extent test used by sc_plane_culling_pre_cb (sc_cull_box) on
+ * a recorded set of boxes, and checks that they agree.
+ *
+ * Usage: scenerycull [boxfile] [iterations]
+ *
+ * If boxfile exists, the boxes and view planes are read from it.
+ * Otherwise a fly-over traversal of a synthetic terrain is recorded,
+ * and written to boxfile if one was given.
+ */
+
+#include <Inventor/SbTime.h>
+#include <Inventor/SbViewVolume.h>
+#include <Inventor/SbPlane.h>
+#include <Inventor/SbRotation.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <SmallChange/nodes/SceneryGL.h>
+
+struct CullBox {
+  double bmin[3];
+  double bmax[3];
+  int mask;
+};
+
+static float planes[6*4];
+static std::vector<CullBox> boxes;
+
+static void
+setup_planes(void)
+{
+  SbViewVolume vv;
+  vv.perspective(0.8f, 1.33f, 10.0f, 50000.0f);
+  SbRotation tilt(SbVec3f(1.0f, 0.0f, 0.0f), 1.2f);
+  vv.rotateCamera(tilt);
+  vv.translateCamera(SbVec3f(20000.0f, 10000.0f, 1500.0f));
+
+  SbPlane sbplanes[6];
+  vv.getViewVolumePlanes(sbplanes);
+  for (int i = 0; i < 6; i++) {
+    const SbVec3f & n = sbplanes[i].getNormal();
+    planes[i*4+0] = n[0];
+    planes[i*4+1] = n[1];
+    planes[i*4+2] = n[2];
+    planes[i*4+3] = sbplanes[i].getDistanceFromOrigin();
+  }
+}
+
+// descends a quadtree the same way the scenery library does
+static void
+record_boxes(const double * bmin, const double * bmax, int mask, int depth)
+{
+  CullBox box;
+  for (int i = 0; i < 3; i++) {
+    box.bmin[i] = bmin[i];
+    box.bmax[i] = bmax[i];
+  }
+  box.mask = mask;
+  boxes.push_back(box);
+
+  int bits = 0;
+  if (sc_cull_box_corners(planes, 6, bmin, bmax, mask, &bits)) return;
+  if (depth == 0) return;
+
+  const double mid[2] = { (bmin[0] + bmax[0]) * 0.5, (bmin[1] + bmax[1]) * 0.5 };
+  for (int q = 0; q < 4; q++) {
+    double cmin[3] = { (q & 1) ? mid[0] : bmin[0], (q & 2) ? mid[1] : bmin[1], bmin[2] };
+    double cmax[3] = { (q & 1) ? bmax[0] : mid[0], (q & 2) ? bmax[1] : mid[1], bmax[2] };
+    record_boxes(cmin, cmax, mask | bits, depth - 1);
+  }
+}
+
+static bool
+read_boxes(const char * filename)
+{
+  FILE * fp = fopen(filename, "rb");
+  if (!fp) return false;
+  int num = 0;
+  bool ok = (fread(planes, sizeof(float), 24, fp) == 24) &&
+    (fread(&num, sizeof(int), 1, fp) == 1) && (num >= 0);
+  if (ok) {
+    boxes.resize(num);
+    ok = num == 0 || fread(&boxes[0], sizeof(CullBox), num, fp) == (size_t) num;
+  }
+  fclose(fp);
+  return ok;
+}
+
+static void
+write_boxes(const char * filename)
+{
+  FILE * fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "unable to write '%s'\n", filename);
+    return;
+  }
+  const int num = (int) boxes.size();
+  fwrite(planes, sizeof(float), 24, fp);
+  fwrite(&num, sizeof(int), 1, fp);
+  if (num) fwrite(&boxes[0], sizeof(CullBox), num, fp);
+  fclose(fp);
+}
+
+int
+main(int argc, char ** argv)
+{
+  const char * filename = argc > 1 ? argv[1] : NULL;
+  const int iterations = argc > 2 ? atoi(argv[2]) : 200;
+
+  if (!filename || !read_boxes(filename)) {
+    setup_planes();
+    const double bmin[3] = { 0.0, 0.0, -500.0 };
+    const double bmax[3] = { 131072.0, 131072.0, 2500.0 };
+    record_boxes(bmin, bmax, 0, 10);
+    if (filename) write_boxes(filename);
+  }
+  const int num = (int) boxes.size();
+  if (num == 0) {
+    fprintf(stderr, "no boxes\n");
+    return -1;
+  }
+
+  float soaplanes[4 * SC_CULL_PLANES_STRIDE(6)];
+  sc_prepare_cull_planes(planes, 6, soaplanes);
+
+  int i, j, mismatches = 0, culled = 0;
+  for (i = 0; i < num; i++) {
+    const CullBox & b = boxes[i];
+    int bits0 = 0, bits1 = 0;
+    const int c0 = sc_cull_box_corners(planes, 6, b.bmin, b.bmax, b.mask, &bits0);
+    const int c1 = sc_cull_box(soaplanes, 6, b.bmin, b.bmax, b.mask, &bits1);
+    if (c0) culled++;
+    if ((c0 != c1) || (!c0 && (bits0 != bits1))) mismatches++;
+  }
+
+  int sink = 0;
+  SbTime start = SbTime::getTimeOfDay();
+  for (j = 0; j < iterations; j++) {
+    for (i = 0; i < num; i++) {
+      int bits = 0;
+      sink += sc_cull_box_corners(planes, 6, boxes[i].bmin, boxes[i].bmax, boxes[i].mask, &bits) + bits;
+    }
+  }
+  const double corners = (SbTime::getTimeOfDay() - start).getValue();
+
+  start = SbTime::getTimeOfDay();
+  for (j = 0; j < iterations; j++) {
+    for (i = 0; i < num; i++) {
+      int bits = 0;
+      sink += sc_cull_box(soaplanes, 6, boxes[i].bmin, boxes[i].bmax, boxes[i].mask, &bits) + bits;
+    }
+  }
+  const double extent = (SbTime::getTimeOfDay() - start).getValue();
+
+  const double tests = (double) num * iterations;
+  fprintf(stdout, "boxes: %d (%d culled), iterations: %d\n", num, culled, iterations);
+  fprintf(stdout, "corners:       %8.2f ns/box\n", corners * 1.0e9 / tests);
+  fprintf(stdout, "centre/extent: %8.2f ns/box (%.2fx)\n", extent * 1.0e9 / tests,
+          extent > 0.0 ? corners / extent : 0.0);
+  fprintf(stdout, "mismatches:    %d%s\n", mismatches,
+          mismatches ? " (boxes touching a plane within float precision)" : "");
+  return sink == -1 ? 1 : 0;
+}
@@ -41,15 +41,17 @@ int
 main(int argc, char ** argv )
 {
   if (argc < 3) {
-    fprintf(stderr,"Usage: tovertexarray <infile> <outfile> [nostrip]\n");
+    fprintf(stderr,"Usage: tovertexarray <infile> <outfile> [nostrip] [optimize]\n");
     return -1;
   }
 
   SbBool strip = TRUE;
-  if (argc > 3) {
-    if (strcmp(argv[3], "nostrip") == 0) strip = FALSE;
+  SbBool optimize = FALSE;
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "nostrip") == 0) strip = FALSE;
+    else if (strcmp(argv[i], "optimize") == 0) optimize = TRUE;
     else {
-      fprintf(stderr,"Usage: tovertexarray <infile> <outfile> [nostrip]\n");
+      fprintf(stderr,"Usage: tovertexarray <infile> <outfile> [nostrip] [optimize]\n");
       return -1;
     }
   }
@@ -83,9 +85,14 @@ main(int argc, char ** argv )
 
   fprintf(stderr,"Applying SmToVertexArrayShapeAction...");
   SmToVertexArrayShapeAction tova;
+  tova.setOptimizeVertexCache(optimize);
   tova.apply(root);
   fprintf(stderr,"done\n");
 
+  float acmrbefore, acmrafter;
+  tova.getACMR(acmrbefore, acmrafter);
+  fprintf(stderr,"ACMR: %.3f before, %.3f after\n", acmrbefore, acmrafter);
+
   SbBool binary = FALSE;
 
   SoOutput out;
@@ -0,0 +1,157 @@
+/*
+ * Benchmark for SmTrackSet. Renders the tracks of a fleet of targets
+ * offscreen, once with one SmTrackPointKit per target and once with a
+ * single SmTrackSet, and reports the time per frame. Every target gets
+ * a new position each frame.
+ *
+ * Usage: trackset [targets] [frames]
+ *
+ * The default is 5000 targets and 100 frames. Each track starts with
+ * 30 positions one second apart, and shows the last 22 seconds as
+ * points, lines and ticks.
+ */
+
+#include <Inventor/SoDB.h>
+#include <Inventor/SoOffscreenRenderer.h>
+#include <Inventor/SbTime.h>
+#include <Inventor/nodes/SoSeparator.h>
+#include <Inventor/nodes/SoOrthographicCamera.h>
+#include <Inventor/nodes/SoBaseColor.h>
+#include <Inventor/nodes/SoDrawStyle.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <SmallChange/misc/Init.h>
+#include <SmallChange/nodes/SmTrack.h>
+#include <SmallChange/nodes/SmTrackSet.h>
+#include <SmallChange/nodekits/SmTrackPointKit.h>
+
+static const int HISTORY = 30;
+static const float AREA = 20000.0f;
+
+struct Target {
+  double x, y, heading, speed;
+};
+
+static void
+init_targets(Target * targets, const int num)
+{
+  srand(1);
+  for (int i = 0; i < num; i++) {
+    targets[i].x = rand() / double(RAND_MAX) * AREA;
+    targets[i].y = rand() / double(RAND_MAX) * AREA;
+    targets[i].heading = rand() / double(RAND_MAX) * 2.0 * M_PI;
+    targets[i].speed = 2.0 + rand() / double(RAND_MAX) * 8.0;
+  }
+}
+
+static SbVec3d
+move_target(Target & t, const double dt)
+{
+  t.heading += (rand() / double(RAND_MAX) - 0.5) * 0.1;
+  t.x += cos(t.heading) * t.speed * dt;
+  t.y += sin(t.heading) * t.speed * dt;
+  return SbVec3d(t.x, t.y, 0.0);
+}
+
+static SoSeparator *
+make_root(void)
+{
+  SoSeparator * root = new SoSeparator;
+  SoOrthographicCamera * camera = new SoOrthographicCamera;
+  camera->position.setValue(AREA * 0.5f, AREA * 0.5f, 100.0f);
+  camera->height = AREA;
+  camera->nearDistance = 1.0f;
+  camera->farDistance = 1000.0f;
+  root->addChild(camera);
+  SoDrawStyle * ds = new SoDrawStyle;
+  ds->pointSize = 3.0f;
+  root->addChild(ds);
+  return root;
+}
+
+int
+main(int argc, char ** argv)
+{
+  const int num = argc > 1 ? atoi(argv[1]) : 5000;
+  const int frames = argc > 2 ? atoi(argv[2]) : 100;
+  if (num <= 0 || frames <= 0) {
+    fprintf(stderr, "Usage: trackset [targets] [frames]\n");
+    return -1;
+  }
+
+  SoDB::init();
+  smallchange_init();
+
+  SoOffscreenRenderer renderer(SbViewportRegion(1024, 1024));
+  Target * targets = new Target[num];
+  SbTime now(1000000.0);
+  int i, f, h;
+
+  // one SmTrackPointKit per target
+  init_targets(targets, num);
+  SoSeparator * root = make_root();
+  root->ref();
+  SmTrack ** tracks = new SmTrack*[num];
+  for (i = 0; i < num; i++) {
+    SoSeparator * sep = new SoSeparator;
+    SoBaseColor * color = new SoBaseColor;
+    color->rgb.setValue(SbColor(float(i % 7) / 6.0f, 1.0f, 0.5f));
+    sep->addChild(color);
+    SmTrackPointKit * kit = new SmTrackPointKit;
+    kit->lineInterval = 1;
+    kit->tickInterval = 5;
+    kit->tickSize = 20.0f;
+    sep->addChild(kit);
+    root->addChild(sep);
+    tracks[i] = kit->getTrack();
+    tracks[i]->deleteValues();
+    for (h = 0; h < HISTORY; h++) {
+      tracks[i]->append(move_target(targets[i], 1.0), now + SbTime(double(h)));
+    }
+  }
+  renderer.render(root);
+  SbTime start = SbTime::getTimeOfDay();
+  for (f = 0; f < frames; f++) {
+    const SbTime t = now + SbTime(HISTORY + f * 0.1);
+    for (i = 0; i < num; i++) tracks[i]->append(move_target(targets[i], 0.1), t);
+    renderer.render(root);
+  }
+  const double kits = (SbTime::getTimeOfDay() - start).getValue() / frames;
+  root->unref();
+  delete[] tracks;
+
+  // one SmTrackSet
+  init_targets(targets, num);
+  root = make_root();
+  root->ref();
+  SmTrackSet * set = new SmTrackSet;
+  set->lineInterval = 1;
+  set->tickInterval = 5;
+  set->tickSize = 20.0f;
+  root->addChild(set);
+  int * ids = new int[num];
+  for (i = 0; i < num; i++) {
+    ids[i] = set->addTrack(SbColor(float(i % 7) / 6.0f, 1.0f, 0.5f));
+    for (h = 0; h < HISTORY; h++) {
+      set->append(ids[i], move_target(targets[i], 1.0), now + SbTime(double(h)));
+    }
+  }
+  renderer.render(root);
+  start = SbTime::getTimeOfDay();
+  for (f = 0; f < frames; f++) {
+    const SbTime t = now + SbTime(HISTORY + f * 0.1);
+    for (i = 0; i < num; i++) set->append(ids[i], move_target(targets[i], 0.1), t);
+    renderer.render(root);
+  }
+  const double trackset = (SbTime::getTimeOfDay() - start).getValue() / frames;
+  root->unref();
+  delete[] ids;
+  delete[] targets;
+
+  fprintf(stdout, "targets: %d, frames: %d\n", num, frames);
+  fprintf(stdout, "SmTrackPointKit: %8.2f ms/frame\n", kits * 1000.0);
+  fprintf(stdout, "SmTrackSet:      %8.2f ms/frame (%.1fx)\n", trackset * 1000.0,
+          trackset > 0.0 ? kits / trackset : 0.0);
+  return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Benchmark for the vertex welding in SmToVertexArrayShapeAction.
+ * Converts a synthetic corpus of indexed face sets, with exact welding
+ * and with a weld tolerance, and reports the conversion time and the
+ * number of vertices in the result.
+ *
+ * Usage: vertexweld [gridsize] [tolerance]
+ *
+ * Each mesh is a gridsize x gridsize quad grid (default 1000, which
+ * gives 2M triangles per mesh). The default tolerance is 0.001.
+ */
+
+#include <Inventor/SoDB.h>
+#include <Inventor/SbTime.h>
+#include <Inventor/actions/SoSearchAction.h>
+#include <Inventor/nodes/SoSeparator.h>
+#include <Inventor/nodes/SoCoordinate3.h>
+#include <Inventor/nodes/SoPackedColor.h>
+#include <Inventor/nodes/SoMaterialBinding.h>
+#include <Inventor/nodes/SoShapeHints.h>
+#include <Inventor/nodes/SoIndexedFaceSet.h>
+#include <Inventor/nodes/SoVertexProperty.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <SmallChange/misc/Init.h>
+#include <SmallChange/actions/SmToVertexArrayShapeAction.h>
+
+enum MeshType {
+  SMOOTH,     // shared vertices, smooth normals
+  FACETED,    // flat shaded, every triangle has its own normal
+  COLORED,    // smooth, with one color per quad
+  JITTERED    // flat, with coordinates that differ below the tolerance
+};
+
+static const char * meshnames[] = { "smooth", "faceted", "colored", "jittered" };
+
+static SoSeparator *
+make_mesh(const MeshType type, const int n)
+{
+  SoSeparator * root = new SoSeparator;
+  SoShapeHints * sh = new SoShapeHints;
+  sh->creaseAngle = (type == FACETED) ? 0.0f : 3.14f;
+  root->addChild(sh);
+
+  if (type == COLORED) {
+    SoPackedColor * pc = new SoPackedColor;
+    pc->orderedRGBA.setNum(n * n);
+    uint32_t * col = pc->orderedRGBA.startEditing();
+    for (int i = 0; i < n * n; i++) col[i] = ((rand() & 0xffffff) << 8) | 0xff;
+    pc->orderedRGBA.finishEditing();
+    root->addChild(pc);
+    SoMaterialBinding * mb = new SoMaterialBinding;
+    mb->value = SoMaterialBinding::PER_FACE;
+    root->addChild(mb);
+  }
+
+  // a grid of quads, with each quad as a separate polygon. For the
+  // jittered mesh every quad has its own copy of its corners, in a
+  // plane so that all normals are equal.
+  SoCoordinate3 * coords = new SoCoordinate3;
+  SoIndexedFaceSet * ifs = new SoIndexedFaceSet;
+  const int stride = n + 1;
+  if (type == JITTERED) {
+    coords->point.setNum(n * n * 4);
+    ifs->coordIndex.setNum(n * n * 5);
+    SbVec3f * pts = coords->point.startEditing();
+    int32_t * idx = ifs->coordIndex.startEditing();
+    static const int corners[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+    for (int y = 0; y < n; y++) {
+      for (int x = 0; x < n; x++) {
+        for (int c = 0; c < 4; c++) {
+          const float px = float(x + corners[c][0]);
+          const float py = float(y + corners[c][1]);
+          const float jitter = (rand() / float(RAND_MAX) - 0.5f) * 1.0e-4f;
+          *pts++ = SbVec3f(px * 0.1f + jitter, py * 0.1f, 0.0f);
+          *idx++ = (y * n + x) * 4 + c;
+        }
+        *idx++ = -1;
+      }
+    }
+  }
+  else {
+    coords->point.setNum(stride * stride);
+    SbVec3f * pts = coords->point.startEditing();
+    for (int y = 0; y <= n; y++) {
+      for (int x = 0; x <= n; x++) {
+        pts[y * stride + x].setValue(x * 0.1f, y * 0.1f,
+                                     sinf(x * 0.05f) * cosf(y * 0.05f));
+      }
+    }
+    ifs->coordIndex.setNum(n * n * 5);
+    int32_t * idx = ifs->coordIndex.startEditing();
+    for (int y = 0; y < n; y++) {
+      for (int x = 0; x < n; x++) {
+        *idx++ = y * stride + x;
+        *idx++ = y * stride + x + 1;
+        *idx++ = (y + 1) * stride + x + 1;
+        *idx++ = (y + 1) * stride + x;
+        *idx++ = -1;
+      }
+    }
+  }
+  coords->point.finishEditing();
+  ifs->coordIndex.finishEditing();
+  root->addChild(coords);
+  root->addChild(ifs);
+  return root;
+}
+
+static int
+count_vertices(SoNode * root)
+{
+  SoSearchAction sa;
+  sa.setType(SoVertexProperty::getClassTypeId());
+  sa.setInterest(SoSearchAction::FIRST);
+  sa.apply(root);
+  SoPath * path = sa.getPath();
+  if (!path) return 0;
+  return ((SoVertexProperty *) path->getTail())->vertex.getNum();
+}
+
+int
+main(int argc, char ** argv)
+{
+  const int n = argc > 1 ? atoi(argv[1]) : 1000;
+  const float tolerance = argc > 2 ? (float) atof(argv[2]) : 0.001f;
+  if (n <= 0 || tolerance <= 0.0f) {
+    fprintf(stderr, "Usage: vertexweld [gridsize] [tolerance]\n");
+    return -1;
+  }
+
+  SoDB::init();
+  smallchange_init();
+
+  const double triangles = 2.0 * n * n;
+  fprintf(stdout, "%d x %d grid, %.0f triangles per mesh\n", n, n, triangles);
+  fprintf(stdout, "%-10s %-10s %10s %12s %12s\n",
+          "mesh", "weld", "seconds", "Mtris/s", "vertices");
+
+  for (int type = SMOOTH; type <= JITTERED; type++) {
+    for (int pass = 0; pass < 2; pass++) {
+      srand(1);
+      SoSeparator * root = make_mesh((MeshType) type, n);
+      root->ref();
+
+      SmToVertexArrayShapeAction tova;
+      tova.setWeldTolerance(pass ? tolerance : 0.0f);
+      SbTime start = SbTime::getTimeOfDay();
+      tova.apply(root);
+      const double t = (SbTime::getTimeOfDay() - start).getValue();
+
+      fprintf(stdout, "%-10s %-10s %10.3f %12.2f %12d\n",
+              meshnames[type], pass ? "tolerance" : "exact", t,
+              t > 0.0 ? triangles / t * 1.0e-6 : 0.0, count_vertices(root));
+      root->unref();
+    }
+  }
+  return 0;
+}